@@ -72,16 +72,22 @@ for renderpass in content[0]["renderpass"]:
 		if not filepath.startswith('/media'):
 			print("skipping")
 			continue
-		outfile = outputPath + '/..' + filepath
-		os.makedirs(os.path.dirname(outfile), exist_ok = True)
-		url = "http://shadertoy.com" + filepath
-		if not os.path.exists(outfile):
-			response = requests.get(url, headers = headers)
-			if response:
-				with open(outfile, 'wb') as f:
-					f.write(response.content)
-			else:
-				print(response)
+		# Cubemaps are stored as 6 files, the other faces have _1 to _5 suffixes
+		filepaths = [filepath]
+		if input["type"] == "cubemap":
+			base, ext = os.path.splitext(filepath)
+			filepaths += [base + '_' + str(face) + ext for face in range(1, 6)]
+		for filepath in filepaths:
+			outfile = outputPath + '/..' + filepath
+			os.makedirs(os.path.dirname(outfile), exist_ok = True)
+			url = "http://shadertoy.com" + filepath
+			if not os.path.exists(outfile):
+				response = requests.get(url, headers = headers)
+				if response:
+					with open(outfile, 'wb') as f:
+						f.write(response.content)
+				else:
+					print(response)
 	
 	code = renderpass["code"] + '\n'
 	passname = renderpass["name"].replace(' ', '') + ".glsl"
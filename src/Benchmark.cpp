@@ -0,0 +1,124 @@
+/*
+* Copyright (c) 2022, NVIDIA CORPORATION. All rights reserved.
+*
+* Permission is hereby granted, free of charge, to any person obtaining a
+* copy of this software and associated documentation files (the "Software"),
+* to deal in the Software without restriction, including without limitation
+* the rights to use, copy, modify, merge, publish, distribute, sublicense,
+* and/or sell copies of the Software, and to permit persons to whom the
+* Software is furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+* THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+* DEALINGS IN THE SOFTWARE.
+*/
+
+
+#include "ShaderProj.h"
+
+#include <algorithm>
+#include <chrono>
+
+using namespace std;
+
+template<typename F>
+static double MeasureNanoseconds(int iterations, F&& func)
+{
+    iterations = std::max(iterations, 1);
+
+    const auto start = chrono::steady_clock::now();
+    for (int iteration = 0; iteration < iterations; iteration++)
+        func();
+    const auto end = chrono::steady_clock::now();
+
+    return chrono::duration<double, nano>(end - start).count() / double(iterations);
+}
+
+void ShaderProj::RunCpuBenchmark(const CpuBenchmarkParams& params)
+{
+    Json::Value results;
+    results["type"] = "cpu_benchmark";
+    results["programs"] = Json::UInt(m_Programs.size());
+
+    if (!params.scriptPath.empty() && fs::exists(params.scriptPath))
+    {
+        results["load_script_ns"] = MeasureNanoseconds(params.iterations, [&]()
+        {
+            vector<ScriptEntry> script;
+            LoadScript(params.scriptPath, script);
+        });
+    }
+
+    // Reported per program, so that results from different scripts are comparable.
+    results["program_load_ns"] = MeasureNanoseconds(params.iterations, [&]()
+    {
+        for (const auto& program : m_Programs)
+        {
+            ShProgram copy(program->GetName());
+            copy.Load(params.projectPath / program->GetName() / "description.json", params.projectPath);
+        }
+    }) / double(std::max<size_t>(m_Programs.size(), 1));
+
+    uint32_t width, height;
+    GetWindowDimensions(width, height);
+
+    results["width"] = width;
+    results["height"] = height;
+
+    results["resize_ns"] = MeasureNanoseconds(params.resizes, [&]()
+    {
+        BackBufferResizing();
+        CreateBuffersAndBindings(width, height);
+    });
+
+    const CommonResources common = GetCommonResources(width, height);
+    results["create_binding_sets_ns"] = MeasureNanoseconds(params.iterations, [&]()
+    {
+        for (auto& program : m_Programs)
+        {
+            int index = 0;
+            for (auto& pass : program->GetPasses())
+            {
+                pass->CreateBindingSets(common, program->GetPasses(), index);
+                ++index;
+            }
+        }
+    });
+
+    // Measure the frames with all programs renderable, not the placeholder.
+    WaitForPipelines();
+
+    // Go through the whole script during the measured frames, regardless of the program durations.
+    const double frameTime = 1.0 / 60.0;
+    const int framesPerProgram = std::max(params.frames / std::max(int(m_Script.size()), 1), 1);
+    int frame = 0;
+
+    results["frame_ns"] = MeasureNanoseconds(params.frames, [&]()
+    {
+        if (frame > 0 && frame % framesPerProgram == 0)
+            NextProgram();
+
+        Animate(frameTime);
+        BeginFrame();
+        Render();
+        Present();
+        ++frame;
+    });
+    results["frames"] = params.frames;
+
+    LOG("CPU benchmark results (%ux%u, %d programs):\n", width, height, int(m_Programs.size()));
+    for (const auto& name : results.getMemberNames())
+    {
+        if (name.size() > 3 && name.compare(name.size() - 3, 3, "_ns") == 0)
+            LOG("    %-24s %12.0f ns\n", name.c_str(), results[name].asDouble());
+    }
+
+    WriteStats(results);
+}
@@ -0,0 +1,392 @@
+/*
+* Copyright (c) 2022, NVIDIA CORPORATION. All rights reserved.
+*
+* Permission is hereby granted, free of charge, to any person obtaining a
+* copy of this software and associated documentation files (the "Software"),
+* to deal in the Software without restriction, including without limitation
+* the rights to use, copy, modify, merge, publish, distribute, sublicense,
+* and/or sell copies of the Software, and to permit persons to whom the
+* Software is furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+* THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+* DEALINGS IN THE SOFTWARE.
+*/
+
+
+// Runs shader compilation jobs in a pool of worker processes. The workers are forked from the
+// player after the job list is built, so they inherit the jobs and the initialized compiler,
+// and only job indices travel over the command pipes. Each worker copies the SPIR-V code into
+// its own shared memory region, and the status byte sent back over the result pipe tells the
+// player that the region is ready; the player then copies the code into the job output, which
+// outlives the region. Both copies are tiny next to the compilation itself. A worker that
+// crashes, exceeds its memory limit or doesn't finish a job in time is killed and replaced, and
+// only that job fails.
+//
+// On Windows, the jobs are compiled in-process.
+
+#include "ShaderProj.h"
+#include "Log.h"
+
+#include <chrono>
+#include <deque>
+#include <thread>
+
+#ifndef _WIN32
+#include <csignal>
+#include <cstring>
+#include <fstream>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+static bool RunCompileJobsInProcess(vector<CompileJob>& jobs)
+{
+    bool allSucceeded = true;
+    for (auto& job : jobs)
+    {
+        job.success = CompileShader(job.shaderFile, job.preambles, *job.output, job.macroOverrides, job.cacheVariant);
+        allSucceeded = allSucceeded && job.success;
+    }
+    return allSucceeded;
+}
+
+#ifdef _WIN32
+
+bool RunCompileJobs(vector<CompileJob>& jobs, const CompileWorkerParams& params)
+{
+    return RunCompileJobsInProcess(jobs);
+}
+
+#else
+
+// Maximum size of the SPIR-V code produced by one job. The shared regions are mapped with
+// MAP_NORESERVE, so only the pages that are actually written consume memory.
+constexpr size_t c_MaxSpirvSize = 64 << 20;
+
+struct CompileResultHeader
+{
+    uint64_t size;
+    CompilerStats stats;
+};
+
+struct CompileWorker
+{
+    pid_t pid = -1;
+    int commandFd = -1;
+    int resultFd = -1;
+    int jobIndex = -1;
+    chrono::steady_clock::time_point jobStart;
+    uint8_t* sharedMemory = nullptr;
+};
+
+static CompilerStats SubtractStats(const CompilerStats& a, const CompilerStats& b)
+{
+    CompilerStats result = a;
+    result.compilations -= b.compilations;
+    result.cacheHits -= b.cacheHits;
+    result.failures -= b.failures;
+    return result;
+}
+
+static uint64_t GetProcessVirtualBytes()
+{
+    std::ifstream statm("/proc/self/statm");
+    uint64_t totalPages = 0;
+    if (!(statm >> totalPages))
+        return 0;
+
+    return totalPages * uint64_t(sysconf(_SC_PAGESIZE));
+}
+
+[[noreturn]] static void WorkerMain(const vector<CompileJob>& jobs, const CompileWorker& worker, const CompileWorkerParams& params)
+{
+    if (params.memoryLimitBytes)
+    {
+        // The limit is on top of what the worker inherits from the player.
+        rlimit limit;
+        limit.rlim_cur = limit.rlim_max = rlim_t(GetProcessVirtualBytes() + params.memoryLimitBytes);
+        setrlimit(RLIMIT_AS, &limit);
+    }
+
+    auto header = reinterpret_cast<CompileResultHeader*>(worker.sharedMemory);
+    uint8_t* spirv = worker.sharedMemory + sizeof(CompileResultHeader);
+
+    int jobIndex;
+    while (read(worker.commandFd, &jobIndex, sizeof(jobIndex)) == sizeof(jobIndex))
+    {
+        const auto& job = jobs[jobIndex];
+
+        const CompilerStats statsBefore = GetCompilerStats();
+
+        blob output;
+        uint8_t status = CompileShader(job.shaderFile, job.preambles, output, job.macroOverrides, job.cacheVariant) ? 1 : 0;
+
+        if (output.size() > c_MaxSpirvSize - sizeof(CompileResultHeader))
+        {
+            LOG("ERROR: SPIR-V code for '%s' is too large\n", job.shaderFile.generic_string().c_str());
+            status = 0;
+        }
+
+        header->stats = SubtractStats(GetCompilerStats(), statsBefore);
+        header->size = status ? output.size() : 0;
+        if (status)
+            memcpy(spirv, output.data(), output.size());
+
+        fflush(stdout);
+
+        if (write(worker.resultFd, &status, sizeof(status)) != sizeof(status))
+            break;
+    }
+
+    fflush(stdout);
+    _exit(0);
+}
+
+static bool StartWorker(vector<CompileWorker>& workers, size_t workerIndex, const vector<CompileJob>& jobs, const CompileWorkerParams& params)
+{
+    auto& worker = workers[workerIndex];
+
+    int commandPipe[2];
+    int resultPipe[2];
+    if (pipe(commandPipe) != 0)
+        return false;
+    if (pipe(resultPipe) != 0)
+    {
+        close(commandPipe[0]);
+        close(commandPipe[1]);
+        return false;
+    }
+
+    // Make sure that buffered output is not duplicated in the child.
+    fflush(stdout);
+
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        close(commandPipe[0]);
+        close(commandPipe[1]);
+        close(resultPipe[0]);
+        close(resultPipe[1]);
+        return false;
+    }
+
+    if (pid == 0)
+    {
+        // Close the pipes of the other workers, otherwise they won't see the end of their command streams.
+        for (const auto& other : workers)
+        {
+            if (other.commandFd >= 0) close(other.commandFd);
+            if (other.resultFd >= 0) close(other.resultFd);
+        }
+        close(commandPipe[1]);
+        close(resultPipe[0]);
+
+        CompileWorker self = worker;
+        self.commandFd = commandPipe[0];
+        self.resultFd = resultPipe[1];
+        WorkerMain(jobs, self, params);
+    }
+
+    close(commandPipe[0]);
+    close(resultPipe[1]);
+
+    worker.pid = pid;
+    worker.commandFd = commandPipe[1];
+    worker.resultFd = resultPipe[0];
+    worker.jobIndex = -1;
+    return true;
+}
+
+// Closes the pipes and waits for the worker to exit, returns the wait status.
+static int StopWorker(CompileWorker& worker, bool kill)
+{
+    if (worker.pid < 0)
+        return 0;
+
+    if (kill)
+        ::kill(worker.pid, SIGKILL);
+
+    close(worker.commandFd);
+    close(worker.resultFd);
+
+    int status = 0;
+    waitpid(worker.pid, &status, 0);
+
+    worker.pid = -1;
+    worker.commandFd = -1;
+    worker.resultFd = -1;
+    worker.jobIndex = -1;
+
+    return status;
+}
+
+bool RunCompileJobs(vector<CompileJob>& jobs, const CompileWorkerParams& params)
+{
+    if (params.workerCount <= 0 || jobs.empty())
+        return RunCompileJobsInProcess(jobs);
+
+    const size_t workerCount = std::min(size_t(params.workerCount), jobs.size());
+
+    vector<CompileWorker> workers(workerCount);
+    for (auto& worker : workers)
+    {
+        void* memory = mmap(nullptr, c_MaxSpirvSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (memory == MAP_FAILED)
+        {
+            LOG("WARNING: cannot create shared memory for the compile workers, compiling in-process.\n");
+            for (auto& mapped : workers)
+            {
+                if (mapped.sharedMemory)
+                    munmap(mapped.sharedMemory, c_MaxSpirvSize);
+            }
+            return RunCompileJobsInProcess(jobs);
+        }
+        worker.sharedMemory = static_cast<uint8_t*>(memory);
+    }
+
+    // A worker that dies makes the command pipe broken, which must not terminate the player.
+    auto previousSigpipe = signal(SIGPIPE, SIG_IGN);
+
+    deque<int> pendingJobs;
+    for (int index = 0; index < int(jobs.size()); index++)
+    {
+        jobs[index].success = false;
+        pendingJobs.push_back(index);
+    }
+
+    size_t finishedJobs = 0;
+    bool canStartWorkers = true;
+
+    while (finishedJobs < jobs.size())
+    {
+        // Hand out the pending jobs to idle workers, starting new workers as needed.
+        for (size_t workerIndex = 0; workerIndex < workers.size() && !pendingJobs.empty(); workerIndex++)
+        {
+            auto& worker = workers[workerIndex];
+            if (worker.jobIndex >= 0)
+                continue;
+
+            if (worker.pid < 0)
+            {
+                if (!canStartWorkers || !StartWorker(workers, workerIndex, jobs, params))
+                {
+                    canStartWorkers = false;
+                    continue;
+                }
+            }
+
+            int jobIndex = pendingJobs.front();
+            if (write(worker.commandFd, &jobIndex, sizeof(jobIndex)) != sizeof(jobIndex))
+            {
+                StopWorker(worker, true);
+                continue;
+            }
+
+            pendingJobs.pop_front();
+            worker.jobIndex = jobIndex;
+            worker.jobStart = chrono::steady_clock::now();
+        }
+
+        vector<pollfd> pollFds;
+        vector<size_t> pollWorkers;
+        for (size_t workerIndex = 0; workerIndex < workers.size(); workerIndex++)
+        {
+            if (workers[workerIndex].jobIndex >= 0)
+            {
+                pollFds.push_back({ workers[workerIndex].resultFd, POLLIN, 0 });
+                pollWorkers.push_back(workerIndex);
+            }
+        }
+
+        if (pollFds.empty())
+        {
+            // No workers could be started: compile the rest in-process.
+            LOG("WARNING: cannot start the compile workers, compiling in-process.\n");
+            for (int jobIndex : pendingJobs)
+            {
+                auto& job = jobs[jobIndex];
+                job.success = CompileShader(job.shaderFile, job.preambles, *job.output, job.macroOverrides, job.cacheVariant);
+                ++finishedJobs;
+            }
+            pendingJobs.clear();
+            break;
+        }
+
+        poll(pollFds.data(), nfds_t(pollFds.size()), 100);
+
+        for (size_t index = 0; index < pollFds.size(); index++)
+        {
+            auto& worker = workers[pollWorkers[index]];
+            auto& job = jobs[worker.jobIndex];
+
+            if (pollFds[index].revents == 0)
+            {
+                const double elapsed = chrono::duration<double>(chrono::steady_clock::now() - worker.jobStart).count();
+                if (params.timeoutSeconds > 0 && elapsed > params.timeoutSeconds)
+                {
+                    LOG("ERROR: compiling shader '%s' took more than %.0f seconds, aborted\n",
+                        job.shaderFile.generic_string().c_str(), params.timeoutSeconds);
+                    StopWorker(worker, true);
+                    ++finishedJobs;
+                }
+                continue;
+            }
+
+            uint8_t status = 0;
+            if (read(worker.resultFd, &status, sizeof(status)) != sizeof(status))
+            {
+                // The worker has closed the result pipe, which means that it has exited.
+                const int waitStatus = StopWorker(worker, false);
+                if (WIFSIGNALED(waitStatus))
+                    LOG("ERROR: the compiler crashed with signal %d on shader '%s'\n",
+                        WTERMSIG(waitStatus), job.shaderFile.generic_string().c_str());
+                else
+                    LOG("ERROR: the compiler exited unexpectedly on shader '%s'\n", job.shaderFile.generic_string().c_str());
+                ++finishedJobs;
+                continue;
+            }
+
+            const auto header = reinterpret_cast<const CompileResultHeader*>(worker.sharedMemory);
+            AccumulateCompilerStats(header->stats);
+
+            if (status)
+            {
+                const uint8_t* spirv = worker.sharedMemory + sizeof(CompileResultHeader);
+                job.output->assign(spirv, spirv + header->size);
+                job.success = true;
+            }
+
+            worker.jobIndex = -1;
+            ++finishedJobs;
+        }
+    }
+
+    for (auto& worker : workers)
+    {
+        StopWorker(worker, false);
+        munmap(worker.sharedMemory, c_MaxSpirvSize);
+    }
+
+    signal(SIGPIPE, previousSigpipe);
+
+    bool allSucceeded = true;
+    for (const auto& job : jobs)
+        allSucceeded = allSucceeded && job.success;
+
+    return allSucceeded;
+}
+
+#endif
@@ -20,9 +20,14 @@
 * DEALINGS IN THE SOFTWARE.
 */
 
+
 #include "ShaderProj.h"
 #include "Log.h"
 
+#include <cctype>
+#include <cstring>
+#include <fstream>
+
 #include <glslang/Include/ShHandle.h>
 #include <glslang/Public/ShaderLang.h>
 #include <SPIRV/GlslangToSpv.h>
@@ -30,16 +35,144 @@
 
 using namespace std;
 
+// The compiler session owns all state that is used across compilations. The glslang objects
+// are created per compilation and destroyed at the end of it, while the scratch buffers for the
+// shader source and the SPIR-V code keep their capacity, so that repeated reloads don't
+// allocate and free the same amount of memory again and again.
+class CompilerSession
+{
+private:
+    blob m_SourceScratch;
+    vector<blob> m_PatchedScratch;
+    vector<unsigned int> m_SpirvScratch;
+    CompilerStats m_Stats;
+    bool m_CacheEnabled = true;
+
+    bool ReadSource(const fs::path& shaderFile);
+    void UpdateScratchStats();
+
+public:
+    bool Compile(const fs::path& shaderFile, const vector<blob*>& preambles, blob& output, const blob* macroOverrides,
+        const string& cacheVariant);
+
+    void AccumulateStats(const CompilerStats& stats);
+    void SetCacheEnabled(bool enabled) { m_CacheEnabled = enabled; }
+    [[nodiscard]] const CompilerStats& GetStats() const { return m_Stats; }
+};
+
+static CompilerSession* g_CompilerSession = nullptr;
+
 void InitCompiler()
 {
     glslang::InitializeProcess();
+
+    g_CompilerSession = new CompilerSession();
 }
 
 void ShutdownCompiler()
 {
+    delete g_CompilerSession;
+    g_CompilerSession = nullptr;
+
     glslang::FinalizeProcess();
 }
 
+void SetShaderCacheEnabled(bool enabled)
+{
+    assert(g_CompilerSession);
+    g_CompilerSession->SetCacheEnabled(enabled);
+}
+
+CompilerStats GetCompilerStats()
+{
+    assert(g_CompilerSession);
+    return g_CompilerSession->GetStats();
+}
+
+void AccumulateCompilerStats(const CompilerStats& stats)
+{
+    assert(g_CompilerSession);
+    g_CompilerSession->AccumulateStats(stats);
+}
+
+bool CompileShader(const fs::path& shaderFile, const vector<blob*>& preambles, blob& output, const blob* macroOverrides,
+    const string& cacheVariant)
+{
+    assert(g_CompilerSession);
+    return g_CompilerSession->Compile(shaderFile, preambles, output, macroOverrides, cacheVariant);
+}
+
+// The cache files start with this header, followed by the SPIR-V code
+struct ShaderCacheHeader
+{
+    uint32_t magic;
+    uint32_t preambleHash;
+};
+
+constexpr uint32_t c_ShaderCacheMagic = 0x43565053; // "SPVC"
+
+// Calls the function for every '#define NAME ...' line in the source, with the name and the
+// offsets of the beginning and the end of the line, including the continuation lines.
+template<typename F>
+static void ForEachMacroDefinition(const blob& source, F&& function)
+{
+    const size_t size = source.size();
+    size_t lineStart = 0;
+    while (lineStart < size)
+    {
+        size_t lineEnd = lineStart;
+        while (lineEnd < size && (source[lineEnd] != '\n' || (lineEnd > lineStart && source[lineEnd - 1] == '\\')))
+            ++lineEnd;
+
+        size_t pos = lineStart;
+        auto skipSpaces = [&]() { while (pos < lineEnd && (source[pos] == ' ' || source[pos] == '\t')) ++pos; };
+
+        skipSpaces();
+        if (pos < lineEnd && source[pos] == '#')
+        {
+            ++pos;
+            skipSpaces();
+            if (lineEnd - pos > 6 && strncmp(&source[pos], "define", 6) == 0 && (source[pos + 6] == ' ' || source[pos + 6] == '\t'))
+            {
+                pos += 6;
+                skipSpaces();
+                const size_t nameStart = pos;
+                while (pos < lineEnd && (isalnum(uint8_t(source[pos])) || source[pos] == '_'))
+                    ++pos;
+
+                if (pos > nameStart)
+                    function(string(&source[nameStart], pos - nameStart), lineStart, lineEnd);
+            }
+        }
+
+        lineStart = lineEnd + 1;
+    }
+}
+
+// Replaces the definitions of the given macros with spaces, keeping the line numbers intact.
+// Returns false if the source doesn't define any of the macros.
+static bool RemoveMacroDefinitions(const blob& source, const vector<string>& names, blob& output)
+{
+    bool found = false;
+    ForEachMacroDefinition(source, [&](const string& name, size_t lineStart, size_t lineEnd)
+    {
+        if (std::find(names.begin(), names.end(), name) == names.end())
+            return;
+
+        if (!found)
+            output = source;
+        found = true;
+
+        for (size_t pos = lineStart; pos < lineEnd; pos++)
+        {
+            if (output[pos] != '\n')
+                output[pos] = ' ';
+        }
+    });
+
+    return found;
+}
+
 static EShLanguage GetShaderStage(const string& fileName)
 {
     if (fileName.find(".vert") != string::npos)
@@ -52,91 +185,176 @@ static EShLanguage GetShaderStage(const string& fileName)
     return EShLangFragment;
 }
 
-bool CompileShader(const fs::path& shaderFile, const vector<blob*>& preambles, blob& output)
+bool CompilerSession::ReadSource(const fs::path& shaderFile)
+{
+    std::ifstream file(shaderFile, std::ios::binary);
+
+    if (!file.is_open())
+        return false;
+
+    file.seekg(0, std::ios::end);
+    uint64_t size = file.tellg();
+    file.seekg(0, std::ios::beg);
+
+    // resize() never shrinks the capacity, so the buffer only grows to the largest shader seen
+    m_SourceScratch.resize(size);
+    file.read(m_SourceScratch.data(), m_SourceScratch.size());
+
+    return true;
+}
+
+void CompilerSession::UpdateScratchStats()
+{
+    m_Stats.scratchBytes = m_SourceScratch.capacity() + m_SpirvScratch.capacity() * sizeof(unsigned int);
+    for (const auto& patched : m_PatchedScratch)
+        m_Stats.scratchBytes += patched.capacity();
+    m_Stats.peakScratchBytes = std::max(m_Stats.peakScratchBytes, m_Stats.scratchBytes);
+}
+
+void CompilerSession::AccumulateStats(const CompilerStats& stats)
+{
+    // Only the counters are accumulated, the scratch buffers of other processes don't matter here.
+    m_Stats.compilations += stats.compilations;
+    m_Stats.cacheHits += stats.cacheHits;
+    m_Stats.failures += stats.failures;
+}
+
+bool CompilerSession::Compile(const fs::path& shaderFile, const vector<blob*>& preambles, blob& output, const blob* macroOverrides,
+    const string& cacheVariant)
 {
     if (!fs::exists(shaderFile))
     {
         LOG("ERROR: shader file '%s' does not exist\n", shaderFile.generic_string().c_str());
+        ++m_Stats.failures;
         return false;
     }
 
+    // The cache file of the variant is only used if it was compiled with the same preambles, e.g. with
+    // the same common source, which the hash stored in the file stands for
+    uint32_t preambleHash = 2166136261u;
+    for (auto preamble : preambles)
+    {
+        for (char c : *preamble)
+            preambleHash = (preambleHash ^ uint8_t(c)) * 16777619u;
+    }
+
     fs::path outputFile = shaderFile;
-    outputFile.replace_extension(".spv");
+    outputFile.replace_extension(cacheVariant.empty() ? ".spv" : "." + cacheVariant + ".spv");
 
-    if (fs::exists(outputFile))
+    if (m_CacheEnabled && fs::exists(outputFile))
     {
         auto inputTime = fs::last_write_time(shaderFile);
         auto outputTime = fs::last_write_time(outputFile);
-        if (outputTime > inputTime)
+        if (outputTime > inputTime && ReadFile(outputFile, output) && output.size() > sizeof(ShaderCacheHeader))
         {
-            if (ReadFile(outputFile, output))
+            ShaderCacheHeader header;
+            memcpy(&header, output.data(), sizeof(header));
+            if (header.magic == c_ShaderCacheMagic && header.preambleHash == preambleHash)
             {
+                output.erase(output.begin(), output.begin() + sizeof(header));
                 LOG("Using cached shader file '%s'\n", outputFile.generic_string().c_str());
+                ++m_Stats.cacheHits;
                 return true;
             }
-
-            output.clear();
         }
+
+        output.clear();
     }
 
-    blob contents;
-    if (ReadFile(shaderFile, contents))
+    if (!ReadSource(shaderFile))
     {
-        LOG("Compiling shader '%s'... ", shaderFile.generic_string().c_str());
+        LOG("ERROR: couldn't read shader file '%s'\n", shaderFile.generic_string().c_str());
+        ++m_Stats.failures;
+        return false;
+    }
 
-        auto shaderStage = GetShaderStage(shaderFile.generic_string());
-        glslang::TShader* shader = new glslang::TShader(shaderStage);
-        glslang::TProgram* program = new glslang::TProgram;
+    LOG("Compiling shader '%s'... ", shaderFile.generic_string().c_str());
 
-        blob mergedSource;
-        for (auto preamble : preambles)
-            mergedSource.insert(mergedSource.end(), preamble->begin(), preamble->end());
-        mergedSource.insert(mergedSource.end(), contents.begin(), contents.end());
+    ++m_Stats.compilations;
 
-        const char* shaderText = mergedSource.data();
-        const int shaderTextLen = (int)mergedSource.size();
-        shader->setStringsWithLengths(&shaderText, &shaderTextLen, 1);
+    auto shaderStage = GetShaderStage(shaderFile.generic_string());
 
-        shader->setEnvClient(glslang::EShClientVulkan, glslang::EShTargetVulkan_1_2);
-        shader->setEnvTarget(glslang::EShTargetSpv, glslang::EShTargetSpv_1_5);
+    // The program refers to the shader, so it must be destroyed first - hence the declaration order.
+    auto shader = make_unique<glslang::TShader>(shaderStage);
+    auto program = make_unique<glslang::TProgram>();
 
-        int defaultVersion = 400;
-        EShMessages messages = EShMsgDefault;
+    // Pass the preambles and the shader as separate strings instead of merging them into one
+    // buffer. glslang treats them as a single compilation unit, and the messages refer to lines
+    // in the original shader file, prefixed with the string index.
+    vector<const blob*> sources(preambles.begin(), preambles.end());
+    sources.push_back(&m_SourceScratch);
 
-        static TBuiltInResource Resources = glslang::DefaultTBuiltInResource;
+    // The overridden macros would be redefined by the shader, so their definitions are removed
+    // from all other strings. The patched copies keep their capacity, like the source scratch.
+    if (macroOverrides)
+    {
+        vector<string> names;
+        ForEachMacroDefinition(*macroOverrides, [&names](const string& name, size_t, size_t) { names.push_back(name); });
 
-        if (!shader->parse(&Resources, defaultVersion, false, messages))
+        m_PatchedScratch.resize(sources.size());
+        for (size_t index = 0; index < sources.size(); index++)
         {
-            const char* infoLog = shader->getInfoLog();
-            LOG("ERROR\n%s\n", infoLog);
-            return false;
+            if (sources[index] != macroOverrides && RemoveMacroDefinitions(*sources[index], names, m_PatchedScratch[index]))
+                sources[index] = &m_PatchedScratch[index];
         }
+    }
 
-        program->addShader(shader);
-        if (!program->link(messages))
-        {
-            const char* infoLog = program->getInfoLog();
-            LOG("ERROR\n%s\n", infoLog);
-            return false;
-        }
+    vector<const char*> strings;
+    vector<int> lengths;
+    for (auto source : sources)
+    {
+        strings.push_back(source->data());
+        lengths.push_back(int(source->size()));
+    }
 
-        LOG("OK\n");
+    shader->setStringsWithLengths(strings.data(), lengths.data(), int(strings.size()));
 
-        glslang::TIntermediate* intermediate = program->getIntermediate(shaderStage);
-        assert(intermediate);
+    shader->setEnvClient(glslang::EShClientVulkan, glslang::EShTargetVulkan_1_2);
+    shader->setEnvTarget(glslang::EShTargetSpv, glslang::EShTargetSpv_1_5);
 
-        glslang::SpvOptions spvOptions;
-        vector<unsigned int> spirv;
-        glslang::GlslangToSpv(*intermediate, spirv, &spvOptions);
+    int defaultVersion = 400;
+    EShMessages messages = EShMsgDefault;
 
-        glslang::OutputSpvBin(spirv, outputFile.generic_string().c_str());
+    static TBuiltInResource Resources = glslang::DefaultTBuiltInResource;
 
-        output.resize(spirv.size() * sizeof(spirv[0]));
-        memcpy(output.data(), spirv.data(), output.size());
+    if (!shader->parse(&Resources, defaultVersion, false, messages))
+    {
+        const char* infoLog = shader->getInfoLog();
+        LOG("ERROR\n%s\n", infoLog);
+        ++m_Stats.failures;
+        return false;
+    }
 
-        return true;
+    program->addShader(shader.get());
+    if (!program->link(messages))
+    {
+        const char* infoLog = program->getInfoLog();
+        LOG("ERROR\n%s\n", infoLog);
+        ++m_Stats.failures;
+        return false;
     }
 
-    LOG("ERROR: couldn't read shader file '%s'\n", shaderFile.generic_string().c_str());
-    return false;
+    LOG("OK\n");
+
+    glslang::TIntermediate* intermediate = program->getIntermediate(shaderStage);
+    assert(intermediate);
+
+    glslang::SpvOptions spvOptions;
+    m_SpirvScratch.clear();
+    glslang::GlslangToSpv(*intermediate, m_SpirvScratch, &spvOptions);
+
+    // The file replaces the previous compilation of the variant at once, so that a worker that is
+    // killed while writing it doesn't leave a partial file
+    const ShaderCacheHeader header = { c_ShaderCacheMagic, preambleHash };
+    output.resize(sizeof(header) + m_SpirvScratch.size() * sizeof(m_SpirvScratch[0]));
+    memcpy(output.data(), &header, sizeof(header));
+    memcpy(output.data() + sizeof(header), m_SpirvScratch.data(), output.size() - sizeof(header));
+    if (!WriteFile(outputFile, output))
+        LOG("WARNING: couldn't write the shader cache file '%s'\n", outputFile.generic_string().c_str());
+
+    output.erase(output.begin(), output.begin() + sizeof(header));
+
+    UpdateScratchStats();
+
+    return true;
 }
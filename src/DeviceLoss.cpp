@@ -0,0 +1,93 @@
+/*
+* Copyright (c) 2022, NVIDIA CORPORATION. All rights reserved.
+*
+* Permission is hereby granted, free of charge, to any person obtaining a
+* copy of this software and associated documentation files (the "Software"),
+* to deal in the Software without restriction, including without limitation
+* the rights to use, copy, modify, merge, publish, distribute, sublicense,
+* and/or sell copies of the Software, and to permit persons to whom the
+* Software is furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+* THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+* DEALINGS IN THE SOFTWARE.
+*/
+
+
+
+
+#include "ShaderProj.h"
+
+#include <chrono>
+
+// When the device is lost, all the objects on the device are destroyed and created again on a new
+// device from what is kept on the CPU: the SPIR-V of the passes, the decoded textures, and the
+// contents of the pipeline cache. The program that was playing is quarantined, because it's the
+// most likely cause of the loss, and playback continues with the next program in the script.
+
+void ShaderProj::DeviceLost()
+{
+    m_DeviceLostTime = std::chrono::steady_clock::now();
+    m_DeviceLostProgram = m_ActiveProgram;
+
+    // Save the pipelines that were compiled so far, if the driver still returns them
+    const auto vkDevice = GetDevice();
+    size_t cacheSize = 0;
+    if (m_PipelineCache && vkDevice.getPipelineCacheData(m_PipelineCache, &cacheSize, nullptr) == vk::Result::eSuccess)
+    {
+        m_PipelineCacheData.resize(cacheSize);
+        if (vkDevice.getPipelineCacheData(m_PipelineCache, &cacheSize, m_PipelineCacheData.data()) != vk::Result::eSuccess)
+            cacheSize = 0;
+        m_PipelineCacheData.resize(cacheSize);
+    }
+
+    DestroyDeviceObjects();
+    ReleaseImageCache(vkDevice);
+}
+
+bool ShaderProj::DeviceRecreated()
+{
+    if (!CreateDeviceObjects())
+        return false;
+
+    const double recreateMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - m_DeviceLostTime).count();
+    const std::string& programName = m_Programs[m_DeviceLostProgram]->GetName();
+    LOG("Re-created the device in %.1f ms after it was lost while playing '%s'.\n", recreateMs, programName.c_str());
+
+    Json::Value record;
+    record["type"] = "device_lost";
+    record["program"] = programName;
+    record["recreate_ms"] = recreateMs;
+    record["pipeline_cache_size"] = Json::UInt64(m_PipelineCacheData.size());
+    WriteStats(record);
+
+    Json::Value details;
+    details["reason"] = "device_lost";
+    QuarantineProgram(m_DeviceLostProgram, details);
+
+    m_ResetRequired = true;
+    m_RecoveryPending = true;
+
+    return true;
+}
+
+void ShaderProj::FinishDeviceRecovery()
+{
+    m_RecoveryPending = false;
+
+    const double recoveryMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - m_DeviceLostTime).count();
+    LOG("Recovered from the device loss in %.1f ms.\n", recoveryMs);
+
+    Json::Value record;
+    record["type"] = "device_recovered";
+    record["program"] = m_Programs[m_ActiveProgram]->GetName();
+    record["recovery_ms"] = recoveryMs;
+    WriteStats(record);
+}
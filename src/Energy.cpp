@@ -0,0 +1,136 @@
+/*
+* Copyright (c) 2022, NVIDIA CORPORATION. All rights reserved.
+*
+* Permission is hereby granted, free of charge, to any person obtaining a
+* copy of this software and associated documentation files (the "Software"),
+* to deal in the Software without restriction, including without limitation
+* the rights to use, copy, modify, merge, publish, distribute, sublicense,
+* and/or sell copies of the Software, and to permit persons to whom the
+* Software is furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+* THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+* DEALINGS IN THE SOFTWARE.
+*/
+
+
+
+#include "ShaderProj.h"
+
+#include <algorithm>
+
+// The energy counters are sampled once per second and whenever the program changes, and
+// the energy used in between is attributed to the program that was playing. Time spent
+// paused is not attributed to any program.
+static constexpr double c_EnergySampleInterval = 1.0;
+// The totals are written to the stats file every 10 minutes as well, so that they aren't lost
+// when the player is killed or the machine is switched off instead of exiting
+static constexpr double c_EnergyReportInterval = 600.0;
+
+bool ShaderProj::EnableEnergyAccounting(const fs::path& sysfsRoot)
+{
+    auto sensors = std::make_unique<PowerSensors>();
+    if (!sensors->Init(sysfsRoot) || !sensors->HasEnergy())
+    {
+        LOG("ERROR: no powercap energy counters found in '%s'\n", sysfsRoot.generic_string().c_str());
+        return false;
+    }
+
+    sensors->ReadEnergy(m_LastEnergy);
+    m_EnergySensors = std::move(sensors);
+    m_EnergySampleTime = std::chrono::steady_clock::now();
+    m_EnergyReportTime = m_EnergySampleTime;
+    m_EnergyProgram = -1;
+
+    return true;
+}
+
+void ShaderProj::SampleEnergy(bool force)
+{
+    if (!m_EnergySensors)
+        return;
+
+    const int program = m_Paused ? -1 : m_ActiveProgram;
+    const auto now = std::chrono::steady_clock::now();
+    const double seconds = std::chrono::duration<double>(now - m_EnergySampleTime).count();
+
+    if (!force && program == m_EnergyProgram && seconds < c_EnergySampleInterval)
+        return;
+
+    double energy = 0;
+    if (!m_EnergySensors->ReadEnergy(energy))
+        return;
+
+    if (m_EnergyProgram >= 0)
+    {
+        ProgramEnergy& programEnergy = m_ProgramEnergy[m_EnergyProgram];
+        programEnergy.joules += energy - m_LastEnergy;
+        programEnergy.seconds += seconds;
+    }
+
+    m_LastEnergy = energy;
+    m_EnergySampleTime = now;
+    m_EnergyProgram = program;
+
+    if (!force && std::chrono::duration<double>(now - m_EnergyReportTime).count() >= c_EnergyReportInterval)
+        WriteEnergyReport(false);
+}
+
+void ShaderProj::WriteEnergyReport(bool print)
+{
+    if (!m_EnergySensors)
+        return;
+
+    SampleEnergy(true);
+    m_EnergyReportTime = m_EnergySampleTime;
+
+    std::vector<int> order;
+    for (int index = 0; index < int(m_Programs.size()); index++)
+    {
+        if (m_ProgramEnergy[index].seconds > 0)
+            order.push_back(index);
+    }
+
+    // Most expensive first
+    auto joulesPerMinute = [this](int index)
+    {
+        return m_ProgramEnergy[index].joules * 60.0 / m_ProgramEnergy[index].seconds;
+    };
+    std::sort(order.begin(), order.end(), [&](int a, int b) { return joulesPerMinute(a) > joulesPerMinute(b); });
+
+    Json::Value record;
+    record["type"] = "energy_report";
+    // The periodic records are running totals, the one written when exiting is final
+    record["final"] = print;
+    Json::Value& programs = record["programs"];
+    programs = Json::Value(Json::objectValue);
+
+    for (int index : order)
+    {
+        const ProgramEnergy& energy = m_ProgramEnergy[index];
+        const double gpuBusy = energy.gpuBusyNs * 1e-9 / energy.seconds;
+
+        if (print)
+        {
+            LOG("%s: %.1f J/min (%.1f W average) over %.0f seconds, GPU busy %.0f%%\n",
+                m_Programs[index]->GetName().c_str(), joulesPerMinute(index), energy.joules / energy.seconds,
+                energy.seconds, gpuBusy * 100.0);
+        }
+
+        Json::Value& program = programs[m_Programs[index]->GetName()];
+        program["joules"] = energy.joules;
+        program["seconds"] = energy.seconds;
+        program["joules_per_minute"] = joulesPerMinute(index);
+        program["average_watts"] = energy.joules / energy.seconds;
+        program["gpu_busy"] = gpuBusy;
+    }
+
+    WriteStats(record);
+}
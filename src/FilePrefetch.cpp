@@ -0,0 +1,618 @@
+/*
+* Copyright (c) 2022, NVIDIA CORPORATION. All rights reserved.
+*
+* Permission is hereby granted, free of charge, to any person obtaining a
+* copy of this software and associated documentation files (the "Software"),
+* to deal in the Software without restriction, including without limitation
+* the rights to use, copy, modify, merge, publish, distribute, sublicense,
+* and/or sell copies of the Software, and to permit persons to whom the
+* Software is furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+* THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+* DEALINGS IN THE SOFTWARE.
+*/
+
+#include "ShaderProj.h"
+
+#include <cerrno>
+#include <cstring>
+#include <unordered_map>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+// Files are read in batches: all the reads of a batch are in flight at once, which hides
+// the latency of slow storage such as SD cards and network shares. The reads run on a
+// background thread, and the readers only wait for the files that they need.
+
+constexpr unsigned c_PrefetchQueueDepth = 32;
+constexpr int c_PrefetchThreads = 8;
+
+#ifdef __linux__
+
+// A minimal io_uring wrapper over the raw system calls, so that liburing is not needed
+class IoRing
+{
+private:
+    int m_Fd = -1;
+    void* m_SqRing = MAP_FAILED;
+    void* m_CqRing = MAP_FAILED;
+    size_t m_SqRingSize = 0;
+    size_t m_CqRingSize = 0;
+    size_t m_SqesSize = 0;
+    io_uring_sqe* m_Sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+
+    unsigned* m_SqHead = nullptr;
+    unsigned* m_SqTail = nullptr;
+    unsigned* m_SqMask = nullptr;
+    unsigned* m_SqArray = nullptr;
+    unsigned* m_CqHead = nullptr;
+    unsigned* m_CqTail = nullptr;
+    unsigned* m_CqMask = nullptr;
+    io_uring_cqe* m_Cqes = nullptr;
+    unsigned m_PendingSubmissions = 0;
+
+public:
+    ~IoRing() { Shutdown(); }
+
+    bool Init(unsigned entries);
+    void Shutdown();
+    [[nodiscard]] bool IsValid() const { return m_Fd >= 0; }
+
+    // Queues a read into the buffer, returns false if the submission queue is full
+    bool PrepareRead(int fd, void* buffer, size_t size, uint64_t offset, uint64_t userData);
+    // Submits the queued reads and waits for at least one completion
+    bool SubmitAndWait();
+    bool PopCompletion(io_uring_cqe& cqe);
+    // Takes back the reads that were not submitted and waits for the others to complete, discarding
+    // the results. Returns false if the wait fails, then the kernel may still write into the buffers.
+    bool Drain(unsigned inFlight);
+};
+
+bool IoRing::Init(unsigned entries)
+{
+    io_uring_params params{};
+    m_Fd = int(syscall(__NR_io_uring_setup, entries, &params));
+    if (m_Fd < 0)
+        return false;
+
+    m_SqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    m_CqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        m_SqRingSize = m_CqRingSize = std::max(m_SqRingSize, m_CqRingSize);
+
+    m_SqRing = mmap(nullptr, m_SqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_Fd, IORING_OFF_SQ_RING);
+    if (m_SqRing == MAP_FAILED)
+    {
+        Shutdown();
+        return false;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        m_CqRing = m_SqRing;
+    }
+    else
+    {
+        m_CqRing = mmap(nullptr, m_CqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_Fd, IORING_OFF_CQ_RING);
+        if (m_CqRing == MAP_FAILED)
+        {
+            Shutdown();
+            return false;
+        }
+    }
+
+    m_SqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    m_Sqes = static_cast<io_uring_sqe*>(mmap(nullptr, m_SqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_Fd, IORING_OFF_SQES));
+    if (m_Sqes == MAP_FAILED)
+    {
+        Shutdown();
+        return false;
+    }
+
+    auto sq = static_cast<char*>(m_SqRing);
+    m_SqHead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    m_SqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    m_SqMask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    m_SqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+
+    auto cq = static_cast<char*>(m_CqRing);
+    m_CqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    m_CqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    m_CqMask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    m_Cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+    return true;
+}
+
+void IoRing::Shutdown()
+{
+    if (m_Sqes != MAP_FAILED)
+        munmap(m_Sqes, m_SqesSize);
+    if (m_CqRing != MAP_FAILED && m_CqRing != m_SqRing)
+        munmap(m_CqRing, m_CqRingSize);
+    if (m_SqRing != MAP_FAILED)
+        munmap(m_SqRing, m_SqRingSize);
+    if (m_Fd >= 0)
+        close(m_Fd);
+
+    m_Sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+    m_CqRing = MAP_FAILED;
+    m_SqRing = MAP_FAILED;
+    m_Fd = -1;
+}
+
+bool IoRing::PrepareRead(int fd, void* buffer, size_t size, uint64_t offset, uint64_t userData)
+{
+    const unsigned head = __atomic_load_n(m_SqHead, __ATOMIC_ACQUIRE);
+    const unsigned tail = *m_SqTail;
+    if (tail - head > *m_SqMask)
+        return false;
+
+    const unsigned index = tail & *m_SqMask;
+    io_uring_sqe& sqe = m_Sqes[index];
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_READ;
+    sqe.fd = fd;
+    sqe.addr = reinterpret_cast<uint64_t>(buffer);
+    sqe.len = unsigned(std::min(size, size_t(1) << 30));
+    sqe.off = offset;
+    sqe.user_data = userData;
+
+    m_SqArray[index] = index;
+    __atomic_store_n(m_SqTail, tail + 1, __ATOMIC_RELEASE);
+    ++m_PendingSubmissions;
+    return true;
+}
+
+bool IoRing::SubmitAndWait()
+{
+    const int result = int(syscall(__NR_io_uring_enter, m_Fd, m_PendingSubmissions, 1, IORING_ENTER_GETEVENTS, nullptr, 0));
+    if (result < 0 && errno != EINTR)
+        return false;
+
+    if (result > 0)
+        m_PendingSubmissions -= std::min(unsigned(result), m_PendingSubmissions);
+    return true;
+}
+
+bool IoRing::PopCompletion(io_uring_cqe& cqe)
+{
+    const unsigned head = *m_CqHead;
+    if (head == __atomic_load_n(m_CqTail, __ATOMIC_ACQUIRE))
+        return false;
+
+    cqe = m_Cqes[head & *m_CqMask];
+    __atomic_store_n(m_CqHead, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+bool IoRing::Drain(unsigned inFlight)
+{
+    // Without SQPOLL, the kernel only reads the submission queue in io_uring_enter
+    __atomic_store_n(m_SqTail, *m_SqTail - m_PendingSubmissions, __ATOMIC_RELEASE);
+    inFlight -= std::min(inFlight, m_PendingSubmissions);
+    m_PendingSubmissions = 0;
+
+    io_uring_cqe cqe;
+    while (inFlight > 0)
+    {
+        if (PopCompletion(cqe))
+        {
+            --inFlight;
+            continue;
+        }
+
+        const int result = int(syscall(__NR_io_uring_enter, m_Fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0));
+        if (result < 0 && errno != EINTR)
+            return false;
+    }
+    return true;
+}
+
+#endif // __linux__
+
+struct PrefetchEntry
+{
+    blob data;
+    bool keepData = true;
+    bool done = false;
+    bool success = false;
+};
+
+struct PrefetchStats
+{
+    chrono::steady_clock::time_point start;
+    uint64_t bytes = 0;
+    int files = 0;
+    int failures = 0;
+    double totalLatency = 0;
+    double maxLatency = 0;
+};
+
+class FilePrefetcher
+{
+private:
+    std::mutex m_Mutex;
+    std::condition_variable m_FileDone;
+    std::condition_variable m_BatchAvailable;
+    std::unordered_map<string, PrefetchEntry> m_Files;
+    std::deque<vector<string>> m_Batches;
+    std::thread m_Thread;
+    bool m_Terminate = false;
+    unique_ptr<ThreadPool> m_ThreadPool;
+#ifdef __linux__
+    IoRing m_Ring;
+    bool ReadBatchWithRing(const vector<string>& batch, PrefetchStats& stats);
+#endif
+
+    void ThreadProc();
+    void ReadBatchWithThreads(const vector<string>& batch, PrefetchStats& stats);
+    void CompleteFile(const string& name, blob& data, bool success, PrefetchStats& stats);
+
+public:
+    explicit FilePrefetcher(bool useIoUring);
+    ~FilePrefetcher();
+
+    void Prefetch(const vector<PrefetchFile>& files);
+    bool Take(const string& name, blob& result);
+    void Discard();
+};
+
+FilePrefetcher::FilePrefetcher(bool useIoUring)
+{
+#ifdef __linux__
+    if (useIoUring && !m_Ring.Init(c_PrefetchQueueDepth))
+        LOG("INFO: io_uring is not available, reading the files with a thread pool.\n");
+#endif
+
+    m_Thread = thread([this]() { ThreadProc(); });
+}
+
+FilePrefetcher::~FilePrefetcher()
+{
+    {
+        lock_guard<mutex> lock(m_Mutex);
+        m_Terminate = true;
+    }
+    m_BatchAvailable.notify_all();
+    m_Thread.join();
+}
+
+void FilePrefetcher::Prefetch(const vector<PrefetchFile>& files)
+{
+    vector<string> batch;
+    {
+        lock_guard<mutex> lock(m_Mutex);
+        for (const auto& file : files)
+        {
+            const string name = file.name.generic_string();
+            if (m_Files.find(name) != m_Files.end())
+                continue;
+
+            m_Files[name].keepData = file.keepData;
+            batch.push_back(name);
+        }
+
+        if (batch.empty())
+            return;
+
+        m_Batches.push_back(std::move(batch));
+    }
+    m_BatchAvailable.notify_one();
+}
+
+bool FilePrefetcher::Take(const string& name, blob& result)
+{
+    unique_lock<mutex> lock(m_Mutex);
+
+    if (m_Files.find(name) == m_Files.end())
+        return false;
+
+    // The entry is looked up by name after the wait, because Prefetch can rehash the map
+    // and Discard can erase the entry once it's done
+    m_FileDone.wait(lock, [this, &name]()
+    {
+        auto found = m_Files.find(name);
+        return found == m_Files.end() || found->second.done;
+    });
+
+    auto it = m_Files.find(name);
+    if (it == m_Files.end())
+        return false;
+
+    const bool success = it->second.success && it->second.keepData;
+    if (success)
+        result = std::move(it->second.data);
+    m_Files.erase(it);
+
+    // The file is read again by the caller if only its cache was warmed, or if the read failed
+    return success;
+}
+
+void FilePrefetcher::Discard()
+{
+    lock_guard<mutex> lock(m_Mutex);
+
+    for (auto it = m_Files.begin(); it != m_Files.end(); )
+    {
+        if (it->second.done)
+            it = m_Files.erase(it);
+        else
+            ++it;
+    }
+}
+
+void FilePrefetcher::CompleteFile(const string& name, blob& data, bool success, PrefetchStats& stats)
+{
+    const double latency = chrono::duration<double>(chrono::steady_clock::now() - stats.start).count();
+    const uint64_t size = data.size();
+
+    {
+        lock_guard<mutex> lock(m_Mutex);
+
+        PrefetchEntry& entry = m_Files[name];
+        entry.done = true;
+        entry.success = success;
+        if (success && entry.keepData)
+            entry.data = std::move(data);
+
+        stats.files++;
+        stats.bytes += success ? size : 0;
+        stats.failures += success ? 0 : 1;
+        stats.totalLatency += latency;
+        stats.maxLatency = std::max(stats.maxLatency, latency);
+    }
+    m_FileDone.notify_all();
+}
+
+void FilePrefetcher::ThreadProc()
+{
+    while (true)
+    {
+        vector<string> batch;
+        {
+            unique_lock<mutex> lock(m_Mutex);
+            m_BatchAvailable.wait(lock, [this]() { return m_Terminate || !m_Batches.empty(); });
+
+            if (m_Terminate)
+                return;
+
+            batch = std::move(m_Batches.front());
+            m_Batches.pop_front();
+        }
+
+        PrefetchStats stats;
+        stats.start = chrono::steady_clock::now();
+
+        const char* backend = "threads";
+#ifdef __linux__
+        if (m_Ring.IsValid())
+        {
+            backend = "io_uring";
+            if (!ReadBatchWithRing(batch, stats))
+            {
+                LOG("WARNING: io_uring failed, reading the files with a thread pool.\n");
+                m_Ring.Shutdown();
+            }
+        }
+#endif
+        // Also finishes the files that the ring couldn't read
+        ReadBatchWithThreads(batch, stats);
+
+        const double seconds = chrono::duration<double>(chrono::steady_clock::now() - stats.start).count();
+        const double throughput = seconds > 0 ? double(stats.bytes) / (1024.0 * 1024.0) / seconds : 0;
+
+        LOG("INFO: prefetched %d file(s), %.1f MB in %.1f ms (%.1f MB/s) with %s, latency %.1f ms average, %.1f ms max\n",
+            stats.files, double(stats.bytes) / (1024.0 * 1024.0), seconds * 1000.0, throughput, backend,
+            stats.files ? stats.totalLatency * 1000.0 / stats.files : 0.0, stats.maxLatency * 1000.0);
+
+        Json::Value record;
+        record["type"] = "file_prefetch";
+        record["backend"] = backend;
+        record["files"] = stats.files;
+        record["failures"] = stats.failures;
+        record["bytes"] = Json::UInt64(stats.bytes);
+        record["seconds"] = seconds;
+        record["throughput_mbps"] = throughput;
+        record["mean_latency_ms"] = stats.files ? stats.totalLatency * 1000.0 / stats.files : 0.0;
+        record["max_latency_ms"] = stats.maxLatency * 1000.0;
+        WriteStats(record);
+    }
+}
+
+void FilePrefetcher::ReadBatchWithThreads(const vector<string>& batch, PrefetchStats& stats)
+{
+    if (!m_ThreadPool)
+        m_ThreadPool = make_unique<ThreadPool>(c_PrefetchThreads);
+
+    for (const auto& name : batch)
+    {
+        {
+            lock_guard<mutex> lock(m_Mutex);
+            auto it = m_Files.find(name);
+            if (it == m_Files.end() || it->second.done)
+                continue;
+        }
+
+        m_ThreadPool->AddTask([this, &name, &stats]()
+        {
+            blob data;
+            const bool success = ReadFile(name, data);
+            CompleteFile(name, data, success, stats);
+        });
+    }
+
+    m_ThreadPool->WaitForAll();
+}
+
+#ifdef __linux__
+
+// Reads the whole batch through the ring, with up to c_PrefetchQueueDepth reads in flight.
+// Returns false if the ring stops working, the files that are not done then are read by the threads.
+bool FilePrefetcher::ReadBatchWithRing(const vector<string>& batch, PrefetchStats& stats)
+{
+    struct PendingRead
+    {
+        int fd = -1;
+        blob data;
+        size_t offset = 0;
+    };
+
+    vector<PendingRead> reads(batch.size());
+    deque<size_t> queued;
+    size_t nextFile = 0;
+    unsigned inFlight = 0;
+
+    auto finish = [&](size_t index, bool success)
+    {
+        close(reads[index].fd);
+        reads[index].fd = -1;
+        CompleteFile(batch[index], reads[index].data, success, stats);
+        reads[index].data = blob();
+    };
+
+    while (nextFile < batch.size() || !queued.empty() || inFlight > 0)
+    {
+        // Open the next files while there is room in the ring
+        while (nextFile < batch.size() && queued.size() + inFlight < c_PrefetchQueueDepth)
+        {
+            const size_t index = nextFile++;
+            PendingRead& read = reads[index];
+
+            read.fd = open(batch[index].c_str(), O_RDONLY | O_CLOEXEC);
+            struct stat fileStat;
+            if (read.fd < 0 || fstat(read.fd, &fileStat) != 0)
+            {
+                if (read.fd >= 0)
+                    close(read.fd);
+                blob empty;
+                CompleteFile(batch[index], empty, false, stats);
+                continue;
+            }
+
+            read.data.resize(size_t(fileStat.st_size));
+            if (read.data.empty())
+                finish(index, true);
+            else
+                queued.push_back(index);
+        }
+
+        while (!queued.empty())
+        {
+            PendingRead& read = reads[queued.front()];
+            if (!m_Ring.PrepareRead(read.fd, read.data.data() + read.offset, read.data.size() - read.offset, read.offset, queued.front()))
+                break;
+
+            queued.pop_front();
+            ++inFlight;
+        }
+
+        if (inFlight == 0)
+            continue;
+
+        if (!m_Ring.SubmitAndWait())
+        {
+            // The buffers and files of the reads in flight are only released once the kernel is done with them
+            if (!m_Ring.Drain(inFlight))
+            {
+                LOG("WARNING: couldn't wait for the io_uring reads in flight, leaking their buffers.\n");
+                new vector<PendingRead>(std::move(reads));
+                return false;
+            }
+
+            for (size_t index = 0; index < reads.size(); index++)
+            {
+                if (reads[index].fd >= 0)
+                    close(reads[index].fd);
+            }
+            return false;
+        }
+
+        io_uring_cqe cqe;
+        while (m_Ring.PopCompletion(cqe))
+        {
+            --inFlight;
+            const size_t index = size_t(cqe.user_data);
+            PendingRead& read = reads[index];
+
+            if (cqe.res == -EINTR || cqe.res == -EAGAIN)
+            {
+                queued.push_back(index);
+            }
+            else if (cqe.res < 0)
+            {
+                finish(index, false);
+            }
+            else if (cqe.res == 0)
+            {
+                // The file has been truncated since it was opened
+                read.data.resize(read.offset);
+                finish(index, true);
+            }
+            else
+            {
+                // Short reads are continued from where they stopped
+                read.offset += size_t(cqe.res);
+                if (read.offset < read.data.size())
+                    queued.push_back(index);
+                else
+                    finish(index, true);
+            }
+        }
+    }
+
+    return true;
+}
+
+#endif // __linux__
+
+static FilePrefetcher* g_FilePrefetcher = nullptr;
+
+void InitFilePrefetch(bool useIoUring)
+{
+    g_FilePrefetcher = new FilePrefetcher(useIoUring);
+}
+
+void ShutdownFilePrefetch()
+{
+    delete g_FilePrefetcher;
+    g_FilePrefetcher = nullptr;
+}
+
+void PrefetchFiles(const vector<PrefetchFile>& files)
+{
+    if (g_FilePrefetcher)
+        g_FilePrefetcher->Prefetch(files);
+}
+
+bool ReadPrefetchedFile(const fs::path& name, blob& result)
+{
+    if (g_FilePrefetcher && g_FilePrefetcher->Take(name.generic_string(), result))
+        return true;
+
+    return ReadFile(name, result);
+}
+
+void DiscardPrefetchedFiles()
+{
+    if (g_FilePrefetcher)
+        g_FilePrefetcher->Discard();
+}
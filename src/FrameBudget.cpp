@@ -0,0 +1,123 @@
+/*
+* Copyright (c) 2022, NVIDIA CORPORATION. All rights reserved.
+*
+* Permission is hereby granted, free of charge, to any person obtaining a
+* copy of this software and associated documentation files (the "Software"),
+* to deal in the Software without restriction, including without limitation
+* the rights to use, copy, modify, merge, publish, distribute, sublicense,
+* and/or sell copies of the Software, and to permit persons to whom the
+* Software is furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+* THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+* DEALINGS IN THE SOFTWARE.
+*/
+
+
+
+#include "ShaderProj.h"
+
+#include <chrono>
+
+// The GPU time of the first frames of every program is checked against the frame budget.
+// A program that is over the budget is restarted at a reduced render scale, and if it's still
+// over the budget, it's quarantined: skipped for the rest of the session and on the next runs.
+
+void ShaderProj::StartFrameBudgetCheck()
+{
+    // Quarantined programs only play when there is nothing else left, don't check them again
+    m_BudgetProgram = m_Programs[m_ActiveProgram]->IsQuarantined() ? -1 : m_ActiveProgram;
+    m_BudgetTimeNs = 0;
+
+    // Skip the frames that may still be in flight from before the restart, they could be
+    // from the same program at a different scale.
+    m_BudgetFrames = -int(GetFrameSlotCount());
+}
+
+void ShaderProj::CheckFrameBudget(int programIndex, double gpuTimeNs)
+{
+    if (programIndex != m_BudgetProgram || m_BudgetFrames >= m_FrameBudget.frames)
+        return;
+
+    if (m_BudgetFrames++ < 0)
+        return;
+
+    ShProgram& program = *m_Programs[programIndex];
+    const double budgetMs = program.GetFrameBudget() > 0 ? program.GetFrameBudget() : m_FrameBudget.budget;
+    if (budgetMs <= 0)
+    {
+        m_BudgetFrames = m_FrameBudget.frames;
+        return;
+    }
+
+    // Fail as soon as the total time is over the budget for all checked frames, so that
+    // a program that takes seconds per frame doesn't stay on the screen for long
+    m_BudgetTimeNs += gpuTimeNs;
+    if (m_BudgetTimeNs <= budgetMs * 1e6 * double(m_FrameBudget.frames))
+        return;
+
+    const double averageMs = m_BudgetTimeNs * 1e-6 / double(m_BudgetFrames);
+    const bool reduceScale = program.GetRenderScale() > m_FrameBudget.reducedRenderScale;
+    m_BudgetFrames = m_FrameBudget.frames;
+
+    LOG("%s: %.1f ms per frame is over the budget of %.1f ms at %.0f%% render scale, %s\n",
+        program.GetName().c_str(), averageMs, budgetMs, program.GetRenderScale() * 100.0,
+        reduceScale ? "reducing the render scale" : "quarantining");
+
+    Json::Value record;
+    record["type"] = "frame_budget";
+    record["program"] = program.GetName();
+    record["gpu_ms"] = averageMs;
+    record["budget_ms"] = budgetMs;
+    record["render_scale"] = program.GetRenderScale();
+    record["action"] = reduceScale ? "reduce_scale" : "quarantine";
+    WriteStats(record);
+
+    if (reduceScale)
+    {
+        // Restart the program, which also starts a new check
+        program.SetRenderScale(m_FrameBudget.reducedRenderScale);
+        m_ResetRequired = true;
+        return;
+    }
+
+    Json::Value details;
+    details["reason"] = "frame_budget";
+    details["gpu_ms"] = averageMs;
+    details["budget_ms"] = budgetMs;
+    QuarantineProgram(programIndex, details);
+}
+
+void ShaderProj::QuarantineProgram(int programIndex, const Json::Value& details)
+{
+    ShProgram& program = *m_Programs[programIndex];
+    program.SetQuarantined(true);
+
+    Json::Value entry = details;
+    entry["time"] = Json::Int64(std::chrono::duration_cast<std::chrono::seconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count());
+    m_Quarantine.Add(program.GetName(), entry);
+    m_Quarantine.Save();
+
+    LOG("Program '%s' is quarantined and will be skipped from now on.\n", program.GetName().c_str());
+
+    Json::Value record = entry;
+    record["type"] = "quarantine";
+    record["program"] = program.GetName();
+    WriteStats(record);
+
+    if (programIndex == m_ActiveProgram)
+        NextProgram();
+}
+
+bool ShaderProj::IsProgramSkipped(int programIndex) const
+{
+    return m_Programs[programIndex]->IsQuarantined() || IsProgramThrottled(programIndex);
+}
@@ -0,0 +1,193 @@
+/*
+* Copyright (c) 2022, NVIDIA CORPORATION. All rights reserved.
+*
+* Permission is hereby granted, free of charge, to any person obtaining a
+* copy of this software and associated documentation files (the "Software"),
+* to deal in the Software without restriction, including without limitation
+* the rights to use, copy, modify, merge, publish, distribute, sublicense,
+* and/or sell copies of the Software, and to permit persons to whom the
+* Software is furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+* THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+* DEALINGS IN THE SOFTWARE.
+*/
+
+
+
+#include "ShaderProj.h"
+
+// The throttle levels, from the least to the most aggressive. Reducing the render scale
+// keeps all programs in the rotation, so it's tried first; the frame rate cap affects
+// the animation smoothness; and skipping programs changes what is being shown.
+static const ThrottleSettings c_ThrottleLevels[] = {
+    // renderScale, fpsCap, skipExpensivePrograms
+    { 1.f,   0,  false },
+    { 0.75f, 0,  false },
+    { 0.5f,  0,  false },
+    { 0.5f,  30, false },
+    { 0.5f,  30, true },
+    { 0.5f,  20, true },
+};
+
+static constexpr int c_MaxThrottleLevel = int(std::size(c_ThrottleLevels)) - 1;
+
+bool PowerGovernor::Init(const GovernorParams& params)
+{
+    m_Params = params;
+
+    if (!m_Sensors.Init(params.sysfsRoot))
+    {
+        LOG("ERROR: no thermal zones or powercap domains found in '%s'\n", params.sysfsRoot.generic_string().c_str());
+        return false;
+    }
+
+    if (params.maxPower > 0 && !m_Sensors.HasEnergy())
+        LOG("WARNING: no powercap domains found, the power limit will be ignored.\n");
+
+    m_Sensors.ReadEnergy(m_LastEnergy);
+    m_Sensors.ReadTemperature(m_Temperature);
+
+    return true;
+}
+
+bool PowerGovernor::Update(double elapsedSeconds)
+{
+    m_Time += elapsedSeconds;
+
+    const double interval = m_Time - m_LastUpdate;
+    if (interval < m_Params.updateInterval)
+        return false;
+
+    m_LastUpdate = m_Time;
+
+    const bool hasTemperature = m_Sensors.ReadTemperature(m_Temperature);
+
+    double energy = 0;
+    const bool hasPower = m_Params.maxPower > 0 && m_Sensors.ReadEnergy(energy);
+    if (hasPower)
+    {
+        m_Power = (energy - m_LastEnergy) / interval;
+        m_LastEnergy = energy;
+    }
+
+    const bool overTemperature = hasTemperature && m_Temperature > m_Params.maxTemperature;
+    const bool overPower = hasPower && m_Power > m_Params.maxPower;
+    const bool cool = (!hasTemperature || m_Temperature < m_Params.maxTemperature - m_Params.temperatureHysteresis)
+        && (!hasPower || m_Power < m_Params.maxPower * 0.9);
+
+    // Give the temperature time to respond to the previous change
+    if (m_Time - m_LastChange < m_Params.holdTime)
+        return false;
+
+    if ((overTemperature || overPower) && m_Level < c_MaxThrottleLevel)
+    {
+        ++m_Level;
+        m_Reason = overTemperature ? "temperature" : "power";
+    }
+    else if (cool && m_Level > 0)
+    {
+        --m_Level;
+        m_Reason = "recovered";
+    }
+    else
+        return false;
+
+    m_LastChange = m_Time;
+    return true;
+}
+
+ThrottleSettings PowerGovernor::GetSettings() const
+{
+    return c_ThrottleLevels[m_Level];
+}
+
+bool ShaderProj::EnableGovernor(const GovernorParams& params)
+{
+    auto governor = std::make_unique<PowerGovernor>();
+    if (!governor->Init(params))
+        return false;
+
+    m_Governor = std::move(governor);
+    return true;
+}
+
+void ShaderProj::RecordProgramCost(int programIndex, double gpuTimeNs)
+{
+    // Scale the cost to full resolution, assuming that it's proportional to the pixel count
+    const double scale = double(m_Throttle.renderScale) * double(m_Programs[programIndex]->GetRenderScale());
+    const double fullResolutionNs = gpuTimeNs / (scale * scale);
+
+    m_ProgramEnergy[programIndex].gpuBusyNs += gpuTimeNs;
+
+    ProgramCost& cost = m_ProgramCosts[programIndex];
+    cost.gpuTimeNs = cost.samples == 0 ? fullResolutionNs : cost.gpuTimeNs + (fullResolutionNs - cost.gpuTimeNs) * 0.05;
+    ++cost.samples;
+}
+
+bool ShaderProj::IsProgramThrottled(int programIndex) const
+{
+    if (!m_Throttle.skipExpensivePrograms)
+        return false;
+
+    const ProgramCost& cost = m_ProgramCosts[programIndex];
+    if (cost.samples == 0)
+        return false;
+
+    // Expensive means more than the median cost of the programs that have been measured
+    std::vector<double> costs;
+    for (const auto& other : m_ProgramCosts)
+    {
+        if (other.samples != 0)
+            costs.push_back(other.gpuTimeNs);
+    }
+
+    std::sort(costs.begin(), costs.end());
+    return cost.gpuTimeNs > costs[costs.size() / 2];
+}
+
+void ShaderProj::UpdateGovernor(double elapsedSeconds)
+{
+    if (!m_Governor || !m_Governor->Update(elapsedSeconds))
+        return;
+
+    m_Throttle = m_Governor->GetSettings();
+
+    LOG("Governor: %s, %.1f C, %.1f W -> level %d, render scale %.2f, fps cap %d%s\n",
+        m_Governor->GetReason().c_str(), m_Governor->GetTemperature(), m_Governor->GetPower(),
+        m_Governor->GetLevel(), m_Throttle.renderScale, m_Throttle.fpsCap,
+        m_Throttle.skipExpensivePrograms ? ", skipping expensive programs" : "");
+
+    Json::Value record;
+    record["type"] = "governor";
+    record["reason"] = m_Governor->GetReason();
+    record["temperature"] = m_Governor->GetTemperature();
+    record["power"] = m_Governor->GetPower();
+    record["level"] = m_Governor->GetLevel();
+    record["render_scale"] = m_Throttle.renderScale;
+    record["fps_cap"] = m_Throttle.fpsCap;
+    record["skip_expensive_programs"] = m_Throttle.skipExpensivePrograms;
+
+    Json::Value& programs = record["programs"];
+    programs = Json::Value(Json::objectValue);
+    for (size_t index = 0; index < m_Programs.size(); index++)
+    {
+        if (m_ProgramCosts[index].samples == 0)
+            continue;
+
+        Json::Value& program = programs[m_Programs[index]->GetName()];
+        program["gpu_ns"] = m_ProgramCosts[index].gpuTimeNs;
+        program["skipped"] = IsProgramThrottled(int(index));
+    }
+    WriteStats(record);
+
+    if (IsProgramThrottled(m_ActiveProgram))
+        NextProgram();
+}
@@ -0,0 +1,104 @@
+/*
+* Copyright (c) 2022, NVIDIA CORPORATION. All rights reserved.
+*
+* Permission is hereby granted, free of charge, to any person obtaining a
+* copy of this software and associated documentation files (the "Software"),
+* to deal in the Software without restriction, including without limitation
+* the rights to use, copy, modify, merge, publish, distribute, sublicense,
+* and/or sell copies of the Software, and to permit persons to whom the
+* Software is furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+* THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+* DEALINGS IN THE SOFTWARE.
+*/
+
+
+#include "ShaderProj.h"
+
+bool GpuTimer::Init(vk::PhysicalDevice physicalDevice, vk::Device device, uint32_t queryCount)
+{
+    Shutdown();
+
+    const auto limits = physicalDevice.getProperties().limits;
+    if (!limits.timestampComputeAndGraphics)
+    {
+        LOG("WARNING: the device doesn't support timestamp queries on graphics queues.\n");
+        return false;
+    }
+
+    m_QueryPool = device.createQueryPool(vk::QueryPoolCreateInfo()
+        .setQueryType(vk::QueryType::eTimestamp)
+        .setQueryCount(queryCount));
+
+    if (!m_QueryPool)
+        return false;
+
+    m_Device = device;
+    m_QueryCount = queryCount;
+    m_TimestampPeriodNs = double(limits.timestampPeriod);
+
+    return true;
+}
+
+void GpuTimer::Shutdown()
+{
+    if (!m_Device)
+        return;
+
+    m_Device.destroyQueryPool(m_QueryPool);
+    m_QueryPool = nullptr;
+    m_Device = nullptr;
+    m_QueryCount = 0;
+}
+
+void GpuTimer::Reset(vk::CommandBuffer cmdBuf, uint32_t firstQuery, uint32_t queryCount)
+{
+    if (!m_QueryPool)
+        return;
+
+    assert(firstQuery + queryCount <= m_QueryCount);
+    cmdBuf.resetQueryPool(m_QueryPool, firstQuery, queryCount);
+}
+
+void GpuTimer::WriteTimestamp(vk::CommandBuffer cmdBuf, uint32_t query)
+{
+    if (!m_QueryPool)
+        return;
+
+    assert(query < m_QueryCount);
+    cmdBuf.writeTimestamp(vk::PipelineStageFlagBits::eBottomOfPipe, m_QueryPool, query);
+}
+
+bool GpuTimer::GetElapsedNanoseconds(uint32_t beginQuery, uint32_t endQuery, double& nanoseconds, bool wait)
+{
+    if (!m_QueryPool)
+        return false;
+
+    uint64_t timestamps[2] = {};
+    const uint32_t queries[2] = { beginQuery, endQuery };
+
+    for (int index = 0; index < 2; index++)
+    {
+        auto flags = vk::QueryResultFlagBits::e64;
+        if (wait)
+            flags |= vk::QueryResultFlagBits::eWait;
+
+        const vk::Result res = m_Device.getQueryPoolResults(m_QueryPool, queries[index], 1,
+            sizeof(uint64_t), &timestamps[index], sizeof(uint64_t), flags);
+
+        // eNotReady means that the GPU hasn't reached the query yet
+        if (res != vk::Result::eSuccess)
+            return false;
+    }
+
+    nanoseconds = double(timestamps[1] - timestamps[0]) * m_TimestampPeriodNs;
+    return true;
+}
@@ -25,24 +25,127 @@
 #include "stb_image.h"
 
 #include <cinttypes>
+#include <cmath>
+#include <cstring>
 
 using namespace std;
 
-static std::unordered_map<string, Image>* g_ImageCache = nullptr;
+// Decoded image files, kept on the CPU so that the images can be re-created without
+// reading and decoding the files again when the device is lost.
+struct DecodedImage
+{
+    blob data;
+    int width = 0;
+    int height = 0;
+    int mipLevels = 1;
+};
+
+// The passes that use the same file share the image, which is destroyed when the last one releases it
+struct CachedImage
+{
+    Image image;
+    int references = 0;
+};
+
+static std::unordered_map<string, CachedImage>* g_ImageCache = nullptr;
+static std::unordered_map<string, DecodedImage>* g_DecodedImageCache = nullptr;
+static int g_TextureSizeLimit = 0;
+
+// Textures are uploaded from the smallest mip level, and the finer levels are added over
+// the next frames. The levels above the tail size are uploaded before the first use.
+constexpr int c_StreamingTailSize = 64;
+
+struct StreamingTexture
+{
+    DecodedImage* decoded = nullptr;
+    vk::Image image;
+    int residentLevel = 0;
+    std::atomic<bool> chainReady { false }; // decoded->data has all the levels or is empty
+};
+
+static ThreadPool* g_TextureLoader = nullptr;
+static std::vector<std::shared_ptr<StreamingTexture>> g_StreamingTextures;
+static std::vector<std::vector<Buffer>> g_StagingBuffers;
 
 void InitImageCache()
 {
-    g_ImageCache = new unordered_map<string, Image>();
+    g_ImageCache = new unordered_map<string, CachedImage>();
+    g_DecodedImageCache = new unordered_map<string, DecodedImage>();
+    g_TextureLoader = new ThreadPool(1);
 }
 
-void ShutdownImageCache(vk::Device device)
+void ReleaseImageCache(vk::Device device)
 {
-    for (auto& [name, image] : *g_ImageCache)
+    g_TextureLoader->WaitForAll();
+    g_StreamingTextures.clear();
+
+    for (auto& buffers : g_StagingBuffers)
     {
-        DestroyCommittedImage(device, image);
+        for (auto& buffer : buffers)
+            DestroyCommittedBuffer(device, buffer);
+    }
+    g_StagingBuffers.clear();
+
+    for (auto& [name, cached] : *g_ImageCache)
+    {
+        DestroyCommittedImage(device, cached.image);
+    }
+
+    g_ImageCache->clear();
+}
+
+void ReleaseImage(vk::Device device, const fs::path& fileName)
+{
+    const string fileNameStr = fileName.generic_string();
+
+    auto found = g_ImageCache->find(fileNameStr);
+    if (found == g_ImageCache->end() || --found->second.references > 0)
+        return;
+
+    // The loader tasks write into the decoded data, and the streaming uploads into the image
+    g_TextureLoader->WaitForAll();
+    const vk::Image image = found->second.image.image;
+    g_StreamingTextures.erase(std::remove_if(g_StreamingTextures.begin(), g_StreamingTextures.end(),
+        [image](const std::shared_ptr<StreamingTexture>& texture) { return texture->image == image; }),
+        g_StreamingTextures.end());
+
+    DestroyCommittedImage(device, found->second.image);
+    g_ImageCache->erase(found);
+    g_DecodedImageCache->erase(fileNameStr);
+}
+
+uint64_t GetDecodedImageSize(const Image& image)
+{
+    for (const auto& [name, cached] : *g_ImageCache)
+    {
+        if (cached.image.image != image.image)
+            continue;
+
+        auto decoded = g_DecodedImageCache->find(name);
+        return decoded != g_DecodedImageCache->end() ? uint64_t(decoded->second.data.size()) : 0;
     }
+    return 0;
+}
+
+void SetTextureSizeLimit(int maxSize)
+{
+    g_TextureSizeLimit = maxSize;
+}
+
+void ShutdownImageCache(vk::Device device)
+{
+    ReleaseImageCache(device);
+
+    delete g_TextureLoader;
+    g_TextureLoader = nullptr;
 
     delete g_ImageCache;
+    g_ImageCache = nullptr;
+
+    delete g_DecodedImageCache;
+    g_DecodedImageCache = nullptr;
+
+    DiscardPreparedTextures();
 }
 
 struct VolumeHeader
@@ -54,6 +157,35 @@ struct VolumeHeader
     uint32_t channels;
 };
 
+// Size of a 2D RGBA8 image with the mip chain that LoadTexture creates
+static uint64_t GetTextureMemorySize(int width, int height)
+{
+    uint64_t result = uint64_t(width) * height * 4;
+    while (width > 1 && height > 1)
+    {
+        width = std::max(width >> 1, 1);
+        height = std::max(height >> 1, 1);
+        result += uint64_t(width) * height * 4;
+    }
+    return result;
+}
+
+static void ReportTextureImport(const string& fileName, int sourceWidth, int sourceHeight, int width, int height, uint64_t savedBytes)
+{
+    LOG("INFO: imported %dx%d as %dx%d to fit the texture size limit of %d, saved %.1f MB: %s\n",
+        sourceWidth, sourceHeight, width, height, g_TextureSizeLimit, double(savedBytes) / (1024.0 * 1024.0), fileName.c_str());
+
+    Json::Value record;
+    record["type"] = "texture_import";
+    record["file"] = fileName;
+    record["source_width"] = sourceWidth;
+    record["source_height"] = sourceHeight;
+    record["width"] = width;
+    record["height"] = height;
+    record["saved_bytes"] = Json::UInt64(savedBytes);
+    WriteStats(record);
+}
+
 static Buffer UploadImage(vk::PhysicalDevice physicalDevice, vk::Device device, vk::Image image, vk::CommandBuffer cmdBuf,
         const void* data, int width, int height, int depth, int channels)
 {
@@ -105,6 +237,62 @@ static Buffer UploadImage(vk::PhysicalDevice physicalDevice, vk::Device device,
     return buffer;
 }
 
+static float SrgbToLinear(uint8_t value)
+{
+    static const auto table = []() {
+        array<float, 256> result;
+        for (int index = 0; index < 256; index++)
+        {
+            const float c = float(index) / 255.f;
+            result[index] = c <= 0.04045f ? c / 12.92f : powf((c + 0.055f) / 1.055f, 2.4f);
+        }
+        return result;
+    }();
+
+    return table[value];
+}
+
+static uint8_t LinearToSrgb(float value)
+{
+    const float c = value <= 0.0031308f ? value * 12.92f : 1.055f * powf(value, 1.f / 2.4f) - 0.055f;
+    return uint8_t(std::clamp(c * 255.f + 0.5f, 0.f, 255.f));
+}
+
+// Halves an RGBA8 sRGB image with a box filter, averaging the colors in linear space like the blits do
+static void DownsampleSrgb(const uint8_t* src, int srcWidth, int srcHeight, uint8_t* dst)
+{
+    const int dstWidth = std::max(srcWidth >> 1, 1);
+    const int dstHeight = std::max(srcHeight >> 1, 1);
+    for (int y = 0; y < dstHeight; y++)
+    {
+        for (int x = 0; x < dstWidth; x++)
+        {
+            const int x0 = std::min(x * 2, srcWidth - 1);
+            const int x1 = std::min(x * 2 + 1, srcWidth - 1);
+            const int y0 = std::min(y * 2, srcHeight - 1);
+            const int y1 = std::min(y * 2 + 1, srcHeight - 1);
+            const uint8_t* texels[4] = {
+                src + (size_t(y0) * srcWidth + x0) * 4,
+                src + (size_t(y0) * srcWidth + x1) * 4,
+                src + (size_t(y1) * srcWidth + x0) * 4,
+                src + (size_t(y1) * srcWidth + x1) * 4
+            };
+
+            uint8_t* out = dst + (size_t(y) * dstWidth + x) * 4;
+            for (int channel = 0; channel < 3; channel++)
+            {
+                float sum = 0.f;
+                for (const uint8_t* texel : texels)
+                    sum += SrgbToLinear(texel[channel]);
+                out[channel] = LinearToSrgb(sum * 0.25f);
+            }
+
+            const int alpha = texels[0][3] + texels[1][3] + texels[2][3] + texels[3][3];
+            out[3] = uint8_t((alpha + 2) / 4);
+        }
+    }
+}
+
 Image LoadVolume(const fs::path& fileName, vk::PhysicalDevice physicalDevice, vk::Device device, vk::Queue queue, vk::CommandBuffer cmdBuf)
 {
     string fileNameStr = fileName.generic_string();
@@ -113,10 +301,15 @@ Image LoadVolume(const fs::path& fileName, vk::PhysicalDevice physicalDevice, vk
 
     auto found = g_ImageCache->find(fileNameStr);
     if (found != g_ImageCache->end())
-        return found->second;
+    {
+        ++found->second.references;
+        return found->second.image;
+    }
 
-    blob data;
-    ReadFile(fileName, data);
+    // Volumes are stored uncompressed, so the file contents are the decoded data
+    blob& data = (*g_DecodedImageCache)[fileNameStr].data;
+    if (data.empty())
+        ReadPrefetchedFile(fileName, data);
     if (data.size() < sizeof(VolumeHeader))
         return Image();
 
@@ -185,220 +378,1177 @@ Image LoadVolume(const fs::path& fileName, vk::PhysicalDevice physicalDevice, vk
 
     LOG("INFO: loaded %dx%dx%d: %s\n", header->width, header->height, header->depth, fileNameStr.c_str());
 
-    (*g_ImageCache)[fileNameStr] = image;
+    (*g_ImageCache)[fileNameStr] = { image, 1 };
 
     return image;
 }
 
-Image LoadTexture(const fs::path& fileName, vk::PhysicalDevice physicalDevice, vk::Device device, vk::Queue queue, vk::CommandBuffer cmdBuf)
+// The mip levels of a texture are stored from the smallest to the largest, in memory and in the
+// bake file, so that the levels needed for the first frames are at the start.
+static int GetMipLevelCount(int width, int height)
 {
-    string fileNameStr = fileName.generic_string();
+    int mipLevels = 1;
+    while (width > 1 && height > 1)
+    {
+        width = std::max(width >> 1, 1);
+        height = std::max(height >> 1, 1);
+        ++mipLevels;
+    }
+    return mipLevels;
+}
 
-    assert(g_ImageCache);
+static size_t GetMipLevelSize(int width, int height, int level)
+{
+    return size_t(std::max(width >> level, 1)) * size_t(std::max(height >> level, 1)) * 4;
+}
 
-    auto found = g_ImageCache->find(fileNameStr);
-    if (found != g_ImageCache->end())
-        return found->second;
+static size_t GetMipLevelOffset(int width, int height, int mipLevels, int level)
+{
+    size_t offset = 0;
+    for (int smaller = level + 1; smaller < mipLevels; smaller++)
+        offset += GetMipLevelSize(width, height, smaller);
+    return offset;
+}
 
-    stbi_set_flip_vertically_on_load(true);
+// Size of the levels from 'level' to the smallest one, i.e. the prefix of the chain that contains them
+static size_t GetMipChainPrefixSize(int width, int height, int mipLevels, int level)
+{
+    return GetMipLevelOffset(width, height, mipLevels, level) + GetMipLevelSize(width, height, level);
+}
 
-    int width = 0;
-    int height = 0;
-    unsigned char* data = stbi_load(fileNameStr.c_str(), &width, &height, nullptr, 4);
+// Finest level that is uploaded before the texture is first used, the other levels are streamed
+static int GetStreamingTailLevel(int width, int height, int mipLevels)
+{
+    int level = 0;
+    while (level < mipLevels - 1 && std::max(width >> level, height >> level) > c_StreamingTailSize)
+        ++level;
+    return level;
+}
 
-    if (!data)
+static void GetCappedTextureSize(int& width, int& height)
+{
+    while (g_TextureSizeLimit > 0 && std::max(width, height) > g_TextureSizeLimit)
     {
-        LOG("ERROR: failed to load image '%s'\n", fileNameStr.c_str());
-        return Image();
+        width = std::max(width >> 1, 1);
+        height = std::max(height >> 1, 1);
     }
+}
 
-    int mipWidth = width;
-    int mipHeight = height;
-    int mipLevels = 1;
-    while (mipWidth > 1 && mipHeight > 1)
+static blob BuildMipChain(const uint8_t* pixels, int width, int height, int mipLevels)
+{
+    blob chain(GetMipChainPrefixSize(width, height, mipLevels, 0));
+    memcpy(chain.data() + GetMipLevelOffset(width, height, mipLevels, 0), pixels, GetMipLevelSize(width, height, 0));
+
+    for (int level = 1; level < mipLevels; level++)
     {
-        mipWidth = std::max(mipWidth >> 1, 1);
-        mipHeight = std::max(mipHeight >> 1, 1);
-        ++mipLevels;
+        auto src = reinterpret_cast<const uint8_t*>(chain.data() + GetMipLevelOffset(width, height, mipLevels, level - 1));
+        auto dst = reinterpret_cast<uint8_t*>(chain.data() + GetMipLevelOffset(width, height, mipLevels, level));
+        DownsampleSrgb(src, std::max(width >> (level - 1), 1), std::max(height >> (level - 1), 1), dst);
     }
 
-    auto imageInfo = vk::ImageCreateInfo()
-        .setExtent(vk::Extent3D(width, height, 1))
-        .setMipLevels(mipLevels)
-        .setArrayLayers(1)
-        .setImageType(vk::ImageType::e2D)
-        .setFormat(vk::Format::eR8G8B8A8Srgb)
-        .setUsage(vk::ImageUsageFlagBits::eTransferSrc | vk::ImageUsageFlagBits::eTransferDst | vk::ImageUsageFlagBits::eSampled);
+    return chain;
+}
 
-    auto image = CreateCommittedImage(physicalDevice, device, imageInfo, vk::ImageViewType::e2D);
+struct TextureBakeHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t sourceWidth;
+    uint32_t sourceHeight;
+    uint32_t width;
+    uint32_t height;
+    uint32_t mipLevels;
+};
 
-    if (!image.image)
-    {
-        free(data);
-        LOG("ERROR: failed to create a %dx%d image with %d mips.\n", width, height, mipLevels);
-        return Image();
-    }
+constexpr uint32_t c_TextureBakeVersion = 1;
 
+static fs::path GetTextureBakeName(const fs::path& fileName)
+{
+    fs::path bakeName = fileName;
+    bakeName += ".mips";
+    return bakeName;
+}
 
-    auto beginInfo = vk::CommandBufferBeginInfo()
-        .setFlags(vk::CommandBufferUsageFlagBits::eOneTimeSubmit);
-    cmdBuf.begin(beginInfo);
+void GetTexturePrefetchFiles(const fs::path& fileName, vector<PrefetchFile>& files)
+{
+    // An up to date bake is read instead of the image, in parts and with its own stream
+    const fs::path bakeName = GetTextureBakeName(fileName);
+
+    std::error_code bakeError;
+    std::error_code imageError;
+    const auto bakeTime = fs::last_write_time(bakeName, bakeError);
+    const auto imageTime = fs::last_write_time(fileName, imageError);
+
+    if (!bakeError && !imageError && imageTime < bakeTime)
+        files.push_back({ bakeName, false });
+    else
+        files.push_back({ fileName, true });
+}
 
-    ImageBarrier(cmdBuf, image.image, ImageState::Undefined, ImageState::TransferDst, 1, 0, mipLevels);
+// Reads the header and the smallest levels of a bake file, up to the tail level.
+// The bake is only valid if it's newer than the image and has the size that the current limit gives.
+static bool ReadTextureBakeTail(const fs::path& fileName, TextureBakeHeader& header, blob& tail)
+{
+    const fs::path bakeName = GetTextureBakeName(fileName);
 
-    Buffer buffer = UploadImage(physicalDevice, device, image.image, cmdBuf, data, width, height, 1, 4);
+    std::error_code error;
+    const auto bakeTime = fs::last_write_time(bakeName, error);
+    if (error)
+        return false;
 
-    free(data);
+    const auto imageTime = fs::last_write_time(fileName, error);
+    if (error || imageTime >= bakeTime)
+        return false;
 
-    if (!buffer.buffer)
-    {
-        cmdBuf.end();
-        DestroyCommittedImage(device, image);
-        return Image();
-    }
+    const auto fileSize = fs::file_size(bakeName, error);
+    if (error || fileSize < sizeof(header))
+        return false;
 
-    mipWidth = width;
-    mipHeight = height;
-    for (int mipLevel = 1; mipLevel < mipLevels; ++mipLevel)
-    {
-        int dstMipWidth = std::max(mipWidth >> 1, 1);
-        int dstMipHeight = std::max(mipHeight >> 1, 1);
+    std::ifstream file(bakeName, std::ios::binary);
+    if (!file.read(reinterpret_cast<char*>(&header), sizeof(header)))
+        return false;
+
+    if (memcmp(header.magic, "MIPS", 4) != 0 || header.version != c_TextureBakeVersion)
+        return false;
+
+    int width = int(header.sourceWidth);
+    int height = int(header.sourceHeight);
+    GetCappedTextureSize(width, height);
+
+    if (width != int(header.width) || height != int(header.height) || width <= 0 || height <= 0 ||
+        int(header.mipLevels) != GetMipLevelCount(width, height))
+        return false;
+
+    if (fileSize != sizeof(header) + GetMipChainPrefixSize(width, height, header.mipLevels, 0))
+        return false;
 
-        ImageBarrier(cmdBuf, image.image, ImageState::TransferDst, ImageState::TransferSrc, 1, mipLevel - 1);
+    const int tailLevel = GetStreamingTailLevel(width, height, header.mipLevels);
+    tail.resize(GetMipChainPrefixSize(width, height, header.mipLevels, tailLevel));
+    return !!file.read(tail.data(), tail.size());
+}
+
+static void WriteTextureBake(const fs::path& fileName, int sourceWidth, int sourceHeight, const DecodedImage& decoded)
+{
+    TextureBakeHeader header;
+    memcpy(header.magic, "MIPS", 4);
+    header.version = c_TextureBakeVersion;
+    header.sourceWidth = uint32_t(sourceWidth);
+    header.sourceHeight = uint32_t(sourceHeight);
+    header.width = uint32_t(decoded.width);
+    header.height = uint32_t(decoded.height);
+    header.mipLevels = uint32_t(decoded.mipLevels);
+
+    blob data(sizeof(header) + decoded.data.size());
+    memcpy(data.data(), &header, sizeof(header));
+    memcpy(data.data() + sizeof(header), decoded.data.data(), decoded.data.size());
+
+    const fs::path bakeName = GetTextureBakeName(fileName);
+    if (!WriteFile(bakeName, data))
+        LOG("WARNING: couldn't write the texture bake file '%s'\n", bakeName.generic_string().c_str());
+}
 
+// Blits the level into all finer levels, which are then sampled as if the level was the finest one.
+// The level and the finer levels must be in the TransferDst state, and they end up as shader resources.
+static void FillFinerMipLevels(vk::CommandBuffer cmdBuf, vk::Image image, int width, int height, int level)
+{
+    ImageBarrier(cmdBuf, image, ImageState::TransferDst, ImageState::TransferSrc, 1, level);
+
+    for (int finer = 0; finer < level; finer++)
+    {
         auto imageBlit = vk::ImageBlit()
             .setSrcSubresource(vk::ImageSubresourceLayers()
                 .setAspectMask(vk::ImageAspectFlagBits::eColor)
-                .setMipLevel(mipLevel - 1)
-                .setBaseArrayLayer(0)
+                .setMipLevel(level)
                 .setLayerCount(1))
             .setDstSubresource(vk::ImageSubresourceLayers()
                 .setAspectMask(vk::ImageAspectFlagBits::eColor)
-                .setMipLevel(mipLevel)
-                .setBaseArrayLayer(0)
+                .setMipLevel(finer)
                 .setLayerCount(1))
             .setSrcOffsets({ vk::Offset3D(0, 0, 0),
-                             vk::Offset3D(mipWidth, mipHeight, 1) })
+                             vk::Offset3D(std::max(width >> level, 1), std::max(height >> level, 1), 1) })
             .setDstOffsets({ vk::Offset3D(0, 0, 0),
-                             vk::Offset3D(dstMipWidth, dstMipHeight, 1) });
+                             vk::Offset3D(std::max(width >> finer, 1), std::max(height >> finer, 1), 1) });
 
-        cmdBuf.blitImage(image.image, vk::ImageLayout::eTransferSrcOptimal,
-            image.image, vk::ImageLayout::eTransferDstOptimal,
+        cmdBuf.blitImage(image, vk::ImageLayout::eTransferSrcOptimal,
+            image, vk::ImageLayout::eTransferDstOptimal,
             { imageBlit }, vk::Filter::eLinear);
-
-        ImageBarrier(cmdBuf, image.image, ImageState::TransferSrc, ImageState::ShaderResource, 1, mipLevel - 1);
-
-        mipWidth = dstMipWidth;
-        mipHeight = dstMipHeight;
     }
 
-    ImageBarrier(cmdBuf, image.image, ImageState::TransferDst, ImageState::ShaderResource, 1, mipLevels - 1);
-
+    if (level > 0)
+        ImageBarrier(cmdBuf, image, ImageState::TransferDst, ImageState::ShaderResource, 1, 0, level);
+    ImageBarrier(cmdBuf, image, ImageState::TransferSrc, ImageState::ShaderResource, 1, level);
+}
 
-    cmdBuf.end();
+static Buffer CreateStagingBuffer(vk::PhysicalDevice physicalDevice, vk::Device device, const char* data, size_t size)
+{
+    auto bufferDesc = vk::BufferCreateInfo()
+        .setSize(size)
+        .setUsage(vk::BufferUsageFlagBits::eTransferSrc);
 
-    auto submitInfo = vk::SubmitInfo()
-        .setCommandBufferCount(1)
-        .setPCommandBuffers(&cmdBuf);
+    auto buffer = CreateCommittedBuffer(physicalDevice, device, bufferDesc, vk::MemoryPropertyFlagBits::eHostVisible);
+    if (!buffer.buffer)
+    {
+        LOG("ERROR: failed to create an upload buffer with %" PRIu64 " byte capacity.\n", bufferDesc.size);
+        return Buffer();
+    }
 
-    auto res = queue.submit(1, &submitInfo, nullptr);
-    assert(res == vk::Result::eSuccess);
+    void* deviceMemory = nullptr;
+    auto res = device.mapMemory(buffer.deviceMemory, 0, bufferDesc.size, vk::MemoryMapFlags(), &deviceMemory);
+    if (!deviceMemory || res != vk::Result::eSuccess)
+    {
+        LOG("ERROR: failed to map the upload buffer.\n");
+        DestroyCommittedBuffer(device, buffer);
+        return Buffer();
+    }
 
-    queue.waitIdle();
+    memcpy(deviceMemory, data, size);
+    device.unmapMemory(buffer.deviceMemory);
 
-    DestroyCommittedBuffer(device, buffer);
+    return buffer;
+}
 
+// Decodes the image, reduces it to the size limit and builds the mip chain
+static bool DecodeTexture(const fs::path& fileName, DecodedImage& decoded, int& sourceWidth, int& sourceHeight)
+{
+    unsigned char* pixels = nullptr;
+    blob encoded;
+    if (ReadPrefetchedFile(fileName, encoded))
+        pixels = stbi_load_from_memory(reinterpret_cast<const stbi_uc*>(encoded.data()), int(encoded.size()),
+            &sourceWidth, &sourceHeight, nullptr, 4);
 
-    LOG("INFO: loaded %dx%d: %s\n", width, height, fileNameStr.c_str());
+    if (!pixels)
+    {
+        LOG("ERROR: failed to load image '%s'\n", fileName.generic_string().c_str());
+        return false;
+    }
 
-    (*g_ImageCache)[fileNameStr] = image;
+    // The rows are flipped here rather than with stbi_set_flip_vertically_on_load, whose setting
+    // is global, because the textures and the cubemaps can be decoded on different threads
+    const size_t rowSize = size_t(sourceWidth) * 4;
+    blob level0(rowSize * sourceHeight);
+    for (int row = 0; row < sourceHeight; row++)
+        memcpy(level0.data() + rowSize * (sourceHeight - 1 - row), pixels + rowSize * row, rowSize);
+    free(pixels);
+
+    // Images larger than the limit are halved right after decoding, so that only the
+    // reduced image is uploaded and kept in memory
+    decoded.width = sourceWidth;
+    decoded.height = sourceHeight;
+    while (g_TextureSizeLimit > 0 && std::max(decoded.width, decoded.height) > g_TextureSizeLimit)
+    {
+        const int halfWidth = std::max(decoded.width >> 1, 1);
+        const int halfHeight = std::max(decoded.height >> 1, 1);
+        blob half(size_t(halfWidth) * halfHeight * 4);
+        DownsampleSrgb(reinterpret_cast<const uint8_t*>(level0.data()), decoded.width, decoded.height,
+            reinterpret_cast<uint8_t*>(half.data()));
+        level0.swap(half);
+        decoded.width = halfWidth;
+        decoded.height = halfHeight;
+    }
 
-    return image;
+    decoded.mipLevels = GetMipLevelCount(decoded.width, decoded.height);
+    decoded.data = BuildMipChain(reinterpret_cast<const uint8_t*>(level0.data()), decoded.width, decoded.height, decoded.mipLevels);
+    return true;
 }
 
-Image CreateCommittedImage(vk::PhysicalDevice physicalDevice, vk::Device device, const vk::ImageCreateInfo& info, vk::ImageViewType viewType)
+// The CPU side of loading a texture, which PrepareTexture does ahead of the upload
+struct PreparedTexture
 {
-    Image image;
-    image.image = device.createImage(info);
-
-    if (!image.image)
-        return image;
-
-    const auto memRequirements = device.getImageMemoryRequirements(image.image);
-    const auto memPropertyFlags = vk::MemoryPropertyFlagBits::eDeviceLocal;
+    DecodedImage decoded;
+    int sourceWidth = 0;
+    int sourceHeight = 0;
+    // Only the smallest levels are read from a bake, the rest is streamed
+    bool fromBake = false;
+    TextureBakeHeader bakeHeader = {};
+    blob bakeTail;
+};
 
-    vk::PhysicalDeviceMemoryProperties memProperties;
-    physicalDevice.getMemoryProperties(&memProperties);
+static std::mutex g_PreparedTexturesMutex;
+static std::unordered_map<string, PreparedTexture> g_PreparedTextures;
 
-    uint32_t memTypeIndex;
-    for (memTypeIndex = 0; memTypeIndex < memProperties.memoryTypeCount; memTypeIndex++)
+// Reads the smallest levels from the bake, or decodes the image if there's no valid bake
+static bool PrepareTextureData(const fs::path& fileName, PreparedTexture& prepared)
+{
+    if (ReadTextureBakeTail(fileName, prepared.bakeHeader, prepared.bakeTail))
     {
-        if ((memRequirements.memoryTypeBits & (1 << memTypeIndex)) &&
-            ((memProperties.memoryTypes[memTypeIndex].propertyFlags & memPropertyFlags) == memPropertyFlags))
-        {
-            break;
-        }
+        prepared.fromBake = true;
+        return true;
     }
-    assert(memTypeIndex < memProperties.memoryTypeCount);
 
-    auto allocInfo = vk::MemoryAllocateInfo()
-        .setAllocationSize(memRequirements.size)
-        .setMemoryTypeIndex(memTypeIndex);
+    return DecodeTexture(fileName, prepared.decoded, prepared.sourceWidth, prepared.sourceHeight);
+}
 
-    image.deviceMemory = device.allocateMemory(allocInfo);
+static bool TakePreparedTexture(const string& fileName, PreparedTexture& prepared)
+{
+    std::lock_guard<std::mutex> lock(g_PreparedTexturesMutex);
 
-    if (!image.deviceMemory)
-        return image;
+    auto found = g_PreparedTextures.find(fileName);
+    if (found == g_PreparedTextures.end())
+        return false;
 
-    device.bindImageMemory(image.image, image.deviceMemory, 0);
+    prepared = std::move(found->second);
+    g_PreparedTextures.erase(found);
+    return true;
+}
 
-    image.imageView = device.createImageView(vk::ImageViewCreateInfo()
-        .setImage(image.image)
-        .setFormat(info.format)
-        .setViewType(viewType)
-        .setSubresourceRange(vk::ImageSubresourceRange()
-            .setLayerCount(info.arrayLayers)
-            .setLevelCount(info.mipLevels)
-            .setAspectMask(vk::ImageAspectFlagBits::eColor)));
+static void AddPreparedTexture(const string& fileName, PreparedTexture&& prepared)
+{
+    std::lock_guard<std::mutex> lock(g_PreparedTexturesMutex);
+    g_PreparedTextures[fileName] = std::move(prepared);
+}
 
-    image.width = info.extent.width;
-    image.height = info.extent.height;
-    image.depth = info.extent.depth;
+static bool IsTexturePrepared(const string& fileName)
+{
+    std::lock_guard<std::mutex> lock(g_PreparedTexturesMutex);
+    return g_PreparedTextures.count(fileName) != 0;
+}
 
-    return image;
+void GetCachedImageNames(std::unordered_set<string>& names)
+{
+    for (const auto& [name, cached] : *g_ImageCache)
+        names.insert(name);
 }
 
-void DestroyCommittedImage(vk::Device device, Image& image)
+void PrepareTexture(const fs::path& fileName)
 {
-    device.destroyImageView(image.imageView);
-    image.imageView = nullptr;
+    const string fileNameStr = fileName.generic_string();
+    if (IsTexturePrepared(fileNameStr))
+        return;
 
-    device.destroyImage(image.image);
-    image.image = nullptr;
+    PreparedTexture prepared;
+    if (PrepareTextureData(fileName, prepared))
+        AddPreparedTexture(fileNameStr, std::move(prepared));
+}
 
-    device.freeMemory(image.deviceMemory);
-    image.deviceMemory = nullptr;
+void DiscardPreparedTextures()
+{
+    std::lock_guard<std::mutex> lock(g_PreparedTexturesMutex);
+    g_PreparedTextures.clear();
 }
 
-struct ImageStateMapping
+Image LoadTexture(const fs::path& fileName, vk::PhysicalDevice physicalDevice, vk::Device device, vk::Queue queue, vk::CommandBuffer cmdBuf)
 {
-    vk::PipelineStageFlags stageMask;
-    vk::AccessFlags accessMask;
-    vk::ImageLayout layout;
-};
+    string fileNameStr = fileName.generic_string();
 
-static const ImageStateMapping g_ImageStates[uint32_t(ImageState::Count)] = {
-    { vk::PipelineStageFlagBits::eTopOfPipe, vk::AccessFlagBits::eNoneKHR, vk::ImageLayout::eUndefined },
-    { vk::PipelineStageFlagBits::eTransfer, vk::AccessFlagBits::eTransferRead, vk::ImageLayout::ePresentSrcKHR },
-    { vk::PipelineStageFlagBits::eFragmentShader, vk::AccessFlagBits::eShaderRead, vk::ImageLayout::eShaderReadOnlyOptimal },
-    { vk::PipelineStageFlagBits::eColorAttachmentOutput, vk::AccessFlagBits::eColorAttachmentWrite, vk::ImageLayout::eColorAttachmentOptimal },
-    { vk::PipelineStageFlagBits::eTransfer, vk::AccessFlagBits::eTransferRead, vk::ImageLayout::eTransferSrcOptimal },
-    { vk::PipelineStageFlagBits::eTransfer, vk::AccessFlagBits::eTransferWrite, vk::ImageLayout::eTransferDstOptimal }
-};
+    assert(g_ImageCache);
 
-void ImageBarrier(vk::CommandBuffer cmdBuf, vk::Image image,
-    ImageState before,
-    ImageState after,
+    auto found = g_ImageCache->find(fileNameStr);
+    if (found != g_ImageCache->end())
+    {
+        ++found->second.references;
+        return found->second.image;
+    }
+
+    auto streaming = std::make_shared<StreamingTexture>();
+    DecodedImage& decoded = (*g_DecodedImageCache)[fileNameStr];
+    streaming->decoded = &decoded;
+
+    // The smallest levels are uploaded now, the rest is streamed by UpdateTextureStreaming.
+    // They come from memory after a device loss, or from the bake file, or from decoding the image,
+    // which PrepareTexture may have done already.
+    PreparedTexture prepared;
+    const TextureBakeHeader& bakeHeader = prepared.bakeHeader;
+    const char* tailData = nullptr;
+    if (!decoded.data.empty())
+    {
+        streaming->chainReady = true;
+    }
+    else if (!TakePreparedTexture(fileNameStr, prepared) && !PrepareTextureData(fileName, prepared))
+    {
+        g_DecodedImageCache->erase(fileNameStr);
+        return Image();
+    }
+    else if (prepared.fromBake)
+    {
+        decoded.width = int(bakeHeader.width);
+        decoded.height = int(bakeHeader.height);
+        decoded.mipLevels = int(bakeHeader.mipLevels);
+        tailData = prepared.bakeTail.data();
+
+        if (decoded.width != int(bakeHeader.sourceWidth))
+        {
+            ReportTextureImport(fileNameStr, int(bakeHeader.sourceWidth), int(bakeHeader.sourceHeight), decoded.width, decoded.height,
+                GetTextureMemorySize(int(bakeHeader.sourceWidth), int(bakeHeader.sourceHeight)) - GetTextureMemorySize(decoded.width, decoded.height));
+        }
+
+        std::shared_ptr<StreamingTexture> target = streaming;
+        g_TextureLoader->AddTask([fileName, target]()
+        {
+            blob data;
+            if (ReadFile(GetTextureBakeName(fileName), data) && data.size() > sizeof(TextureBakeHeader))
+                target->decoded->data.assign(data.begin() + sizeof(TextureBakeHeader), data.end());
+
+            // A bake that has changed since the tail was read makes the remaining levels keep the tail contents
+            if (target->decoded->data.size() != GetMipChainPrefixSize(target->decoded->width, target->decoded->height, target->decoded->mipLevels, 0))
+                target->decoded->data.clear();
+
+            target->chainReady = true;
+        });
+    }
+    else
+    {
+        const int sourceWidth = prepared.sourceWidth;
+        const int sourceHeight = prepared.sourceHeight;
+        decoded = std::move(prepared.decoded);
+
+        if (decoded.width != sourceWidth)
+        {
+            ReportTextureImport(fileNameStr, sourceWidth, sourceHeight, decoded.width, decoded.height,
+                GetTextureMemorySize(sourceWidth, sourceHeight) - GetTextureMemorySize(decoded.width, decoded.height));
+        }
+
+        streaming->chainReady = true;
+
+        // The bake is written in the background, from a copy, because the chain is used for streaming
+        auto bake = std::make_shared<DecodedImage>(decoded);
+        g_TextureLoader->AddTask([fileName, sourceWidth, sourceHeight, bake]()
+        {
+            WriteTextureBake(fileName, sourceWidth, sourceHeight, *bake);
+        });
+    }
+
+    if (!tailData)
+        tailData = decoded.data.data();
+
+    const int width = decoded.width;
+    const int height = decoded.height;
+    const int mipLevels = decoded.mipLevels;
+    const int tailLevel = GetStreamingTailLevel(width, height, mipLevels);
+
+    auto imageInfo = vk::ImageCreateInfo()
+        .setExtent(vk::Extent3D(width, height, 1))
+        .setMipLevels(mipLevels)
+        .setArrayLayers(1)
+        .setImageType(vk::ImageType::e2D)
+        .setFormat(vk::Format::eR8G8B8A8Srgb)
+        .setUsage(vk::ImageUsageFlagBits::eTransferSrc | vk::ImageUsageFlagBits::eTransferDst | vk::ImageUsageFlagBits::eSampled);
+
+    auto image = CreateCommittedImage(physicalDevice, device, imageInfo, vk::ImageViewType::e2D);
+
+    if (!image.image)
+    {
+        LOG("ERROR: failed to create a %dx%d image with %d mips.\n", width, height, mipLevels);
+        return Image();
+    }
+
+    const size_t tailSize = GetMipChainPrefixSize(width, height, mipLevels, tailLevel);
+    Buffer buffer = CreateStagingBuffer(physicalDevice, device, tailData, tailSize);
+
+    if (!buffer.buffer)
+    {
+        DestroyCommittedImage(device, image);
+        return Image();
+    }
+
+    vector<vk::BufferImageCopy> regions;
+    for (int level = tailLevel; level < mipLevels; level++)
+    {
+        regions.push_back(vk::BufferImageCopy()
+            .setBufferOffset(GetMipLevelOffset(width, height, mipLevels, level))
+            .setImageSubresource(vk::ImageSubresourceLayers()
+                .setAspectMask(vk::ImageAspectFlagBits::eColor)
+                .setMipLevel(level)
+                .setLayerCount(1))
+            .setImageExtent(vk::Extent3D(std::max(width >> level, 1), std::max(height >> level, 1), 1)));
+    }
+
+    auto beginInfo = vk::CommandBufferBeginInfo()
+        .setFlags(vk::CommandBufferUsageFlagBits::eOneTimeSubmit);
+    cmdBuf.begin(beginInfo);
+
+    ImageBarrier(cmdBuf, image.image, ImageState::Undefined, ImageState::TransferDst, 1, 0, mipLevels);
+
+    cmdBuf.copyBufferToImage(buffer.buffer, image.image, vk::ImageLayout::eTransferDstOptimal,
+        uint32_t(regions.size()), regions.data());
+
+    if (tailLevel + 1 < mipLevels)
+        ImageBarrier(cmdBuf, image.image, ImageState::TransferDst, ImageState::ShaderResource, 1, tailLevel + 1, mipLevels - tailLevel - 1);
+
+    FillFinerMipLevels(cmdBuf, image.image, width, height, tailLevel);
+
+    cmdBuf.end();
+
+    auto submitInfo = vk::SubmitInfo()
+        .setCommandBufferCount(1)
+        .setPCommandBuffers(&cmdBuf);
+
+    auto res = queue.submit(1, &submitInfo, nullptr);
+    assert(res == vk::Result::eSuccess);
+
+    queue.waitIdle();
+
+    DestroyCommittedBuffer(device, buffer);
+
+
+    LOG("INFO: loaded %dx%d, %zu bytes before streaming: %s\n", width, height, tailSize, fileNameStr.c_str());
+
+    (*g_ImageCache)[fileNameStr] = { image, 1 };
+
+    if (tailLevel > 0)
+    {
+        streaming->image = image.image;
+        streaming->residentLevel = tailLevel;
+        g_StreamingTextures.push_back(std::move(streaming));
+    }
+
+    return image;
+}
+
+bool UpdateTextureStreaming(vk::PhysicalDevice physicalDevice, vk::Device device, vk::CommandBuffer cmdBuf,
+    uint32_t frameSlot, uint64_t byteBudget)
+{
+    // The previous frame in this slot is complete, so its staging buffers are not used anymore
+    if (frameSlot >= g_StagingBuffers.size())
+        g_StagingBuffers.resize(frameSlot + 1);
+
+    for (auto& buffer : g_StagingBuffers[frameSlot])
+        DestroyCommittedBuffer(device, buffer);
+    g_StagingBuffers[frameSlot].clear();
+
+    uint64_t uploadedBytes = 0;
+    for (auto& texture : g_StreamingTextures)
+    {
+        if (!texture->chainReady)
+            continue;
+
+        const DecodedImage& decoded = *texture->decoded;
+
+        // The bake file couldn't be read, the texture stays at the tail resolution
+        if (decoded.data.empty())
+        {
+            texture->residentLevel = 0;
+            continue;
+        }
+
+        // At least one level is uploaded on every frame, even if it's over the budget
+        while (texture->residentLevel > 0 && (uploadedBytes == 0 || uploadedBytes < byteBudget))
+        {
+            const int level = texture->residentLevel - 1;
+            const size_t levelSize = GetMipLevelSize(decoded.width, decoded.height, level);
+            const char* levelData = decoded.data.data() + GetMipLevelOffset(decoded.width, decoded.height, decoded.mipLevels, level);
+
+            Buffer buffer = CreateStagingBuffer(physicalDevice, device, levelData, levelSize);
+            if (!buffer.buffer)
+                return uploadedBytes != 0;
+
+            g_StagingBuffers[frameSlot].push_back(buffer);
+
+            auto region = vk::BufferImageCopy()
+                .setImageSubresource(vk::ImageSubresourceLayers()
+                    .setAspectMask(vk::ImageAspectFlagBits::eColor)
+                    .setMipLevel(level)
+                    .setLayerCount(1))
+                .setImageExtent(vk::Extent3D(std::max(decoded.width >> level, 1), std::max(decoded.height >> level, 1), 1));
+
+            ImageBarrier(cmdBuf, texture->image, ImageState::ShaderResource, ImageState::TransferDst, 1, 0, level + 1);
+            cmdBuf.copyBufferToImage(buffer.buffer, texture->image, vk::ImageLayout::eTransferDstOptimal, 1, &region);
+            FillFinerMipLevels(cmdBuf, texture->image, decoded.width, decoded.height, level);
+
+            texture->residentLevel = level;
+            uploadedBytes += levelSize;
+        }
+
+        if (uploadedBytes >= byteBudget)
+            break;
+    }
+
+    g_StreamingTextures.erase(std::remove_if(g_StreamingTextures.begin(), g_StreamingTextures.end(),
+        [](const auto& texture) { return texture->residentLevel == 0; }), g_StreamingTextures.end());
+
+    return uploadedBytes != 0;
+}
+
+// Cubemap faces with all their mips, as stored in the bake file after the header
+struct CubemapBakeHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t size;
+    uint32_t mipLevels;
+};
+
+constexpr uint32_t c_CubemapBakeVersion = 1;
+constexpr int c_CubemapFaces = 6;
+
+static size_t GetCubemapFaceDataSize(int size, int mipLevels)
+{
+    size_t result = 0;
+    for (int level = 0; level < mipLevels; level++)
+    {
+        const size_t levelSize = size_t(std::max(size >> level, 1));
+        result += levelSize * levelSize * 4;
+    }
+    return result;
+}
+
+static fs::path GetCubemapFaceName(const fs::path& fileName, int face)
+{
+    if (face == 0)
+        return fileName;
+
+    fs::path faceName = fileName;
+    faceName.replace_filename(fileName.stem().generic_string() + "_" + to_string(face) + fileName.extension().generic_string());
+    return faceName;
+}
+
+// The faces with their mips are baked into one file next to the first face
+static fs::path GetCubemapBakeName(const fs::path& fileName)
+{
+    fs::path bakeName = fileName;
+    bakeName.replace_extension(".cube");
+    return bakeName;
+}
+
+static bool IsCubemapBakeCurrent(const fs::path& bakeName, const fs::path* faceNames)
+{
+    std::error_code error;
+    const auto bakeTime = fs::last_write_time(bakeName, error);
+    if (error)
+        return false;
+
+    // The bake is stale if any of the faces has been replaced since
+    for (int face = 0; face < c_CubemapFaces; face++)
+    {
+        const auto faceTime = fs::last_write_time(faceNames[face], error);
+        if (error || faceTime >= bakeTime)
+            return false;
+    }
+
+    return true;
+}
+
+void GetCubemapPrefetchFiles(const fs::path& fileName, vector<PrefetchFile>& files)
+{
+    fs::path faceNames[c_CubemapFaces];
+    for (int face = 0; face < c_CubemapFaces; face++)
+        faceNames[face] = GetCubemapFaceName(fileName, face);
+
+    const fs::path bakeName = GetCubemapBakeName(fileName);
+    if (IsCubemapBakeCurrent(bakeName, faceNames))
+    {
+        files.push_back({ bakeName, true });
+        return;
+    }
+
+    for (const auto& faceName : faceNames)
+        files.push_back({ faceName, true });
+}
+
+static bool ReadCubemapBake(const fs::path& bakeName, const fs::path* faceNames, DecodedImage& decoded)
+{
+    if (!IsCubemapBakeCurrent(bakeName, faceNames))
+        return false;
+
+    blob data;
+    if (!ReadPrefetchedFile(bakeName, data) || data.size() < sizeof(CubemapBakeHeader))
+        return false;
+
+    CubemapBakeHeader header;
+    memcpy(&header, data.data(), sizeof(header));
+    if (memcmp(header.magic, "CUBE", 4) != 0 || header.version != c_CubemapBakeVersion || header.size == 0 ||
+        header.mipLevels == 0 || header.mipLevels > 32)
+        return false;
+
+    const size_t dataSize = GetCubemapFaceDataSize(int(header.size), int(header.mipLevels)) * c_CubemapFaces;
+    if (data.size() != sizeof(header) + dataSize)
+        return false;
+
+    decoded.data.assign(data.begin() + sizeof(header), data.end());
+    decoded.width = int(header.size);
+    decoded.height = int(header.size);
+    decoded.mipLevels = int(header.mipLevels);
+    return true;
+}
+
+static bool WriteCubemapBake(const fs::path& bakeName, const DecodedImage& decoded)
+{
+    CubemapBakeHeader header;
+    memcpy(header.magic, "CUBE", 4);
+    header.version = c_CubemapBakeVersion;
+    header.size = uint32_t(decoded.width);
+    header.mipLevels = uint32_t(decoded.mipLevels);
+
+    blob data(sizeof(header) + decoded.data.size());
+    memcpy(data.data(), &header, sizeof(header));
+    memcpy(data.data() + sizeof(header), decoded.data.data(), decoded.data.size());
+
+    return WriteFile(bakeName, data);
+}
+
+// Decodes the faces and generates their mips, one face per thread
+static bool BakeCubemap(const fs::path* faceNames, DecodedImage& decoded)
+{
+    array<DecodedImage, c_CubemapFaces> faces;
+
+    // Shadertoy doesn't flip the cubemap faces, which is the default of stb_image
+    {
+        ThreadPool threads(int(std::min(std::max(thread::hardware_concurrency(), 1u), unsigned(c_CubemapFaces))));
+
+        for (int face = 0; face < c_CubemapFaces; face++)
+        {
+            threads.AddTask([&faces, faceNames, face]()
+            {
+                DecodedImage& result = faces[face];
+                const string faceNameStr = faceNames[face].generic_string();
+
+                unsigned char* pixels = nullptr;
+                blob encoded;
+                if (ReadPrefetchedFile(faceNames[face], encoded))
+                    pixels = stbi_load_from_memory(reinterpret_cast<const stbi_uc*>(encoded.data()), int(encoded.size()),
+                        &result.width, &result.height, nullptr, 4);
+                if (!pixels)
+                {
+                    LOG("ERROR: failed to load image '%s'\n", faceNameStr.c_str());
+                    return;
+                }
+
+                if (result.width != result.height)
+                {
+                    LOG("ERROR: cubemap face '%s' is not square: %dx%d\n", faceNameStr.c_str(), result.width, result.height);
+                    free(pixels);
+                    return;
+                }
+
+                result.mipLevels = 1;
+                for (int size = result.width; size > 1; size >>= 1)
+                    ++result.mipLevels;
+
+                result.data.resize(GetCubemapFaceDataSize(result.width, result.mipLevels));
+                memcpy(result.data.data(), pixels, size_t(result.width) * result.height * 4);
+                free(pixels);
+
+                size_t offset = 0;
+                for (int level = 1; level < result.mipLevels; level++)
+                {
+                    const int srcSize = std::max(result.width >> (level - 1), 1);
+                    const size_t srcBytes = size_t(srcSize) * srcSize * 4;
+                    auto src = reinterpret_cast<const uint8_t*>(result.data.data() + offset);
+                    auto dst = reinterpret_cast<uint8_t*>(result.data.data() + offset + srcBytes);
+                    DownsampleSrgb(src, srcSize, srcSize, dst);
+                    offset += srcBytes;
+                }
+            });
+        }
+
+        threads.WaitForAll();
+    }
+
+    for (int face = 0; face < c_CubemapFaces; face++)
+    {
+        if (faces[face].data.empty())
+            return false;
+
+        if (faces[face].width != faces[0].width)
+        {
+            LOG("ERROR: cubemap faces '%s' and '%s' have different sizes\n",
+                faceNames[0].generic_string().c_str(), faceNames[face].generic_string().c_str());
+            return false;
+        }
+    }
+
+    decoded.width = faces[0].width;
+    decoded.height = faces[0].height;
+    decoded.mipLevels = faces[0].mipLevels;
+    decoded.data.clear();
+    for (const auto& face : faces)
+        decoded.data.insert(decoded.data.end(), face.data.begin(), face.data.end());
+
+    return true;
+}
+
+// Reads the bake or decodes the faces and writes the bake, and drops the levels above the size limit
+static bool DecodeCubemap(const fs::path& fileName, DecodedImage& decoded)
+{
+    fs::path faceNames[c_CubemapFaces];
+    for (int face = 0; face < c_CubemapFaces; face++)
+        faceNames[face] = GetCubemapFaceName(fileName, face);
+
+    const fs::path bakeName = GetCubemapBakeName(fileName);
+
+    if (!ReadCubemapBake(bakeName, faceNames, decoded))
+    {
+        if (!BakeCubemap(faceNames, decoded))
+            return false;
+
+        if (!WriteCubemapBake(bakeName, decoded))
+            LOG("WARNING: couldn't write the cubemap bake file '%s'\n", bakeName.generic_string().c_str());
+    }
+
+    // The bake has the full mip chain, the levels above the size limit are just dropped
+    int firstLevel = 0;
+    while (g_TextureSizeLimit > 0 && (decoded.width >> firstLevel) > g_TextureSizeLimit && firstLevel < decoded.mipLevels - 1)
+        ++firstLevel;
+
+    if (firstLevel > 0)
+    {
+        const int sourceSize = decoded.width;
+        const size_t sourceFaceSize = GetCubemapFaceDataSize(sourceSize, decoded.mipLevels);
+        const size_t skippedSize = sourceFaceSize - GetCubemapFaceDataSize(sourceSize >> firstLevel, decoded.mipLevels - firstLevel);
+
+        blob trimmed;
+        for (int face = 0; face < c_CubemapFaces; face++)
+        {
+            auto faceStart = decoded.data.begin() + face * sourceFaceSize;
+            trimmed.insert(trimmed.end(), faceStart + skippedSize, faceStart + sourceFaceSize);
+        }
+
+        decoded.data.swap(trimmed);
+        decoded.width >>= firstLevel;
+        decoded.height >>= firstLevel;
+        decoded.mipLevels -= firstLevel;
+
+        ReportTextureImport(fileName.generic_string(), sourceSize, sourceSize, decoded.width, decoded.height, uint64_t(skippedSize) * c_CubemapFaces);
+    }
+
+    return true;
+}
+
+void PrepareCubemap(const fs::path& fileName)
+{
+    const string fileNameStr = fileName.generic_string();
+    if (IsTexturePrepared(fileNameStr))
+        return;
+
+    PreparedTexture prepared;
+    if (DecodeCubemap(fileName, prepared.decoded))
+        AddPreparedTexture(fileNameStr, std::move(prepared));
+}
+
+Image LoadCubemap(const fs::path& fileName, vk::PhysicalDevice physicalDevice, vk::Device device, vk::Queue queue, vk::CommandBuffer cmdBuf)
+{
+    string fileNameStr = fileName.generic_string();
+
+    assert(g_ImageCache);
+
+    auto found = g_ImageCache->find(fileNameStr);
+    if (found != g_ImageCache->end())
+    {
+        ++found->second.references;
+        return found->second.image;
+    }
+
+    // The data comes from memory after a device loss, or from PrepareCubemap, or is decoded now
+    DecodedImage& decoded = (*g_DecodedImageCache)[fileNameStr];
+    if (decoded.data.empty())
+    {
+        PreparedTexture prepared;
+        if (TakePreparedTexture(fileNameStr, prepared))
+        {
+            decoded = std::move(prepared.decoded);
+        }
+        else if (!DecodeCubemap(fileName, decoded))
+        {
+            g_DecodedImageCache->erase(fileNameStr);
+            return Image();
+        }
+    }
+
+    const int size = decoded.width;
+    const int mipLevels = decoded.mipLevels;
+
+    auto imageInfo = vk::ImageCreateInfo()
+        .setExtent(vk::Extent3D(size, size, 1))
+        .setMipLevels(mipLevels)
+        .setArrayLayers(c_CubemapFaces)
+        .setImageType(vk::ImageType::e2D)
+        .setFormat(vk::Format::eR8G8B8A8Srgb)
+        .setFlags(vk::ImageCreateFlagBits::eCubeCompatible)
+        .setUsage(vk::ImageUsageFlagBits::eTransferDst | vk::ImageUsageFlagBits::eSampled);
+
+    auto image = CreateCommittedImage(physicalDevice, device, imageInfo, vk::ImageViewType::eCube);
+
+    if (!image.image)
+    {
+        LOG("ERROR: failed to create a %dx%d cubemap with %d mips.\n", size, size, mipLevels);
+        return Image();
+    }
+
+    auto bufferDesc = vk::BufferCreateInfo()
+        .setSize(decoded.data.size())
+        .setUsage(vk::BufferUsageFlagBits::eTransferSrc);
+
+    auto buffer = CreateCommittedBuffer(physicalDevice, device, bufferDesc, vk::MemoryPropertyFlagBits::eHostVisible);
+
+    void* deviceMemory = nullptr;
+    if (buffer.buffer)
+    {
+        auto res = device.mapMemory(buffer.deviceMemory, 0, bufferDesc.size, vk::MemoryMapFlags(), &deviceMemory);
+        if (res != vk::Result::eSuccess)
+            deviceMemory = nullptr;
+    }
+
+    if (!deviceMemory)
+    {
+        LOG("ERROR: failed to create an upload buffer with %" PRIu64 " byte capacity.\n", bufferDesc.size);
+        DestroyCommittedBuffer(device, buffer);
+        DestroyCommittedImage(device, image);
+        return Image();
+    }
+
+    memcpy(deviceMemory, decoded.data.data(), decoded.data.size());
+    device.unmapMemory(buffer.deviceMemory);
+
+    // All faces and levels are uploaded with one copy, the mips are already in the data
+    vector<vk::BufferImageCopy> regions;
+    vk::DeviceSize offset = 0;
+    for (int face = 0; face < c_CubemapFaces; face++)
+    {
+        for (int level = 0; level < mipLevels; level++)
+        {
+            const uint32_t levelSize = uint32_t(std::max(size >> level, 1));
+
+            regions.push_back(vk::BufferImageCopy()
+                .setBufferOffset(offset)
+                .setImageSubresource(vk::ImageSubresourceLayers()
+                    .setAspectMask(vk::ImageAspectFlagBits::eColor)
+                    .setMipLevel(level)
+                    .setBaseArrayLayer(face)
+                    .setLayerCount(1))
+                .setImageExtent(vk::Extent3D(levelSize, levelSize, 1)));
+
+            offset += vk::DeviceSize(levelSize) * levelSize * 4;
+        }
+    }
+
+    auto beginInfo = vk::CommandBufferBeginInfo()
+        .setFlags(vk::CommandBufferUsageFlagBits::eOneTimeSubmit);
+    cmdBuf.begin(beginInfo);
+
+    ImageBarrier(cmdBuf, image.image, ImageState::Undefined, ImageState::TransferDst, c_CubemapFaces, 0, mipLevels);
+
+    cmdBuf.copyBufferToImage(buffer.buffer, image.image, vk::ImageLayout::eTransferDstOptimal,
+        uint32_t(regions.size()), regions.data());
+
+    ImageBarrier(cmdBuf, image.image, ImageState::TransferDst, ImageState::ShaderResource, c_CubemapFaces, 0, mipLevels);
+
+    cmdBuf.end();
+
+    auto submitInfo = vk::SubmitInfo()
+        .setCommandBufferCount(1)
+        .setPCommandBuffers(&cmdBuf);
+
+    auto res = queue.submit(1, &submitInfo, nullptr);
+    assert(res == vk::Result::eSuccess);
+
+    queue.waitIdle();
+
+    DestroyCommittedBuffer(device, buffer);
+
+
+    LOG("INFO: loaded %dx%d cubemap: %s\n", size, size, fileNameStr.c_str());
+
+    (*g_ImageCache)[fileNameStr] = { image, 1 };
+
+    return image;
+}
+
+// Converts RGBA8 texels into the linear floats of the software renderer
+static vector<float> GetSoftwareTexels(const char* data, size_t texelCount, bool srgb)
+{
+    vector<float> texels(texelCount * 4);
+    auto src = reinterpret_cast<const uint8_t*>(data);
+    for (size_t index = 0; index < texels.size(); index++)
+    {
+        const bool color = (index & 3) != 3;
+        texels[index] = (srgb && color) ? SrgbToLinear(src[index]) : float(src[index]) / 255.f;
+    }
+    return texels;
+}
+
+bool LoadSoftwareTexture(const fs::path& fileName, SoftwareTextureType type, SoftwareTexture& texture)
+{
+    texture = SoftwareTexture();
+    texture.type = type;
+
+    if (type == SoftwareTextureType::Texture2D)
+    {
+        DecodedImage decoded;
+        int sourceWidth = 0;
+        int sourceHeight = 0;
+        if (!DecodeTexture(fileName, decoded, sourceWidth, sourceHeight))
+            return false;
+
+        texture.width = decoded.width;
+        texture.height = decoded.height;
+        for (int level = 0; level < decoded.mipLevels; level++)
+        {
+            texture.levels.push_back(GetSoftwareTexels(decoded.data.data() + GetMipLevelOffset(decoded.width, decoded.height, decoded.mipLevels, level),
+                GetMipLevelSize(decoded.width, decoded.height, level) / 4, true));
+        }
+        return true;
+    }
+
+    if (type == SoftwareTextureType::Cube)
+    {
+        fs::path faceNames[c_CubemapFaces];
+        for (int face = 0; face < c_CubemapFaces; face++)
+            faceNames[face] = GetCubemapFaceName(fileName, face);
+
+        DecodedImage decoded;
+        if (!ReadCubemapBake(GetCubemapBakeName(fileName), faceNames, decoded) && !BakeCubemap(faceNames, decoded))
+            return false;
+
+        // The same levels as the GPU cubemap, with the faces of each level together
+        int firstLevel = 0;
+        while (g_TextureSizeLimit > 0 && (decoded.width >> firstLevel) > g_TextureSizeLimit && firstLevel < decoded.mipLevels - 1)
+            ++firstLevel;
+
+        const size_t faceSize = GetCubemapFaceDataSize(decoded.width, decoded.mipLevels);
+        texture.width = texture.height = std::max(decoded.width >> firstLevel, 1);
+        size_t levelOffset = GetCubemapFaceDataSize(decoded.width, firstLevel);
+        for (int level = firstLevel; level < decoded.mipLevels; level++)
+        {
+            const size_t levelSize = size_t(std::max(decoded.width >> level, 1));
+            vector<float> texels;
+            for (int face = 0; face < c_CubemapFaces; face++)
+            {
+                const auto faceTexels = GetSoftwareTexels(decoded.data.data() + face * faceSize + levelOffset, levelSize * levelSize, true);
+                texels.insert(texels.end(), faceTexels.begin(), faceTexels.end());
+            }
+            texture.levels.push_back(std::move(texels));
+            levelOffset += levelSize * levelSize * 4;
+        }
+        return true;
+    }
+
+    blob data;
+    if (!ReadPrefetchedFile(fileName, data) || data.size() < sizeof(VolumeHeader))
+        return false;
+
+    VolumeHeader header;
+    memcpy(&header, data.data(), sizeof(header));
+    if (memcmp(header.magic, "BIN", 4) != 0 || header.width == 0 || header.height == 0 || header.depth == 0 ||
+        header.channels == 0 || header.channels > 4 ||
+        data.size() != sizeof(VolumeHeader) + size_t(header.width) * header.height * header.depth * header.channels)
+        return false;
+
+    // The missing channels read as 0, and alpha as 1, like from the GPU formats with fewer channels
+    const size_t texelCount = size_t(header.width) * header.height * header.depth;
+    auto src = reinterpret_cast<const uint8_t*>(data.data() + sizeof(VolumeHeader));
+    vector<float> texels(texelCount * 4);
+    for (size_t texel = 0; texel < texelCount; texel++)
+    {
+        for (uint32_t channel = 0; channel < 4; channel++)
+        {
+            texels[texel * 4 + channel] = channel < header.channels
+                ? float(src[texel * header.channels + channel]) / 255.f
+                : (channel == 3 ? 1.f : 0.f);
+        }
+    }
+
+    texture.width = int(header.width);
+    texture.height = int(header.height);
+    texture.depth = int(header.depth);
+    texture.levels.push_back(std::move(texels));
+    return true;
+}
+
+Image CreateCommittedImage(vk::PhysicalDevice physicalDevice, vk::Device device, const vk::ImageCreateInfo& info, vk::ImageViewType viewType)
+{
+    Image image;
+    image.image = device.createImage(info);
+
+    if (!image.image)
+        return image;
+
+    const auto memRequirements = device.getImageMemoryRequirements(image.image);
+    const auto memPropertyFlags = vk::MemoryPropertyFlagBits::eDeviceLocal;
+
+    vk::PhysicalDeviceMemoryProperties memProperties;
+    physicalDevice.getMemoryProperties(&memProperties);
+
+    uint32_t memTypeIndex;
+    for (memTypeIndex = 0; memTypeIndex < memProperties.memoryTypeCount; memTypeIndex++)
+    {
+        if ((memRequirements.memoryTypeBits & (1 << memTypeIndex)) &&
+            ((memProperties.memoryTypes[memTypeIndex].propertyFlags & memPropertyFlags) == memPropertyFlags))
+        {
+            break;
+        }
+    }
+    assert(memTypeIndex < memProperties.memoryTypeCount);
+
+    auto allocInfo = vk::MemoryAllocateInfo()
+        .setAllocationSize(memRequirements.size)
+        .setMemoryTypeIndex(memTypeIndex);
+
+    image.deviceMemory = device.allocateMemory(allocInfo);
+
+    if (!image.deviceMemory)
+        return image;
+
+    device.bindImageMemory(image.image, image.deviceMemory, 0);
+
+    image.imageView = device.createImageView(vk::ImageViewCreateInfo()
+        .setImage(image.image)
+        .setFormat(info.format)
+        .setViewType(viewType)
+        .setSubresourceRange(vk::ImageSubresourceRange()
+            .setLayerCount(info.arrayLayers)
+            .setLevelCount(info.mipLevels)
+            .setAspectMask(vk::ImageAspectFlagBits::eColor)));
+
+    if (info.mipLevels > 1 && (info.usage & vk::ImageUsageFlagBits::eStorage))
+    {
+        for (uint32_t level = 0; level < info.mipLevels; level++)
+        {
+            image.levelViews.push_back(device.createImageView(vk::ImageViewCreateInfo()
+                .setImage(image.image)
+                .setFormat(info.format)
+                .setViewType(viewType)
+                .setSubresourceRange(vk::ImageSubresourceRange()
+                    .setLayerCount(info.arrayLayers)
+                    .setBaseMipLevel(level)
+                    .setLevelCount(1)
+                    .setAspectMask(vk::ImageAspectFlagBits::eColor))));
+        }
+    }
+
+    image.width = info.extent.width;
+    image.height = info.extent.height;
+    image.depth = info.extent.depth;
+    image.mipLevels = int(info.mipLevels);
+    image.memorySize = memRequirements.size;
+
+    return image;
+}
+
+void DestroyCommittedImage(vk::Device device, Image& image)
+{
+    for (auto view : image.levelViews)
+        device.destroyImageView(view);
+    image.levelViews.clear();
+
+    device.destroyImageView(image.imageView);
+    image.imageView = nullptr;
+
+    device.destroyImage(image.image);
+    image.image = nullptr;
+
+    device.freeMemory(image.deviceMemory);
+    image.deviceMemory = nullptr;
+}
+
+struct ImageStateMapping
+{
+    vk::PipelineStageFlags stageMask;
+    vk::AccessFlags accessMask;
+    vk::ImageLayout layout;
+};
+
+static const ImageStateMapping g_ImageStates[uint32_t(ImageState::Count)] = {
+    { vk::PipelineStageFlagBits::eTopOfPipe, vk::AccessFlagBits::eNoneKHR, vk::ImageLayout::eUndefined },
+    { vk::PipelineStageFlagBits::eTransfer, vk::AccessFlagBits::eTransferRead, vk::ImageLayout::ePresentSrcKHR },
+    { vk::PipelineStageFlagBits::eFragmentShader | vk::PipelineStageFlagBits::eComputeShader, vk::AccessFlagBits::eShaderRead, vk::ImageLayout::eShaderReadOnlyOptimal },
+    { vk::PipelineStageFlagBits::eColorAttachmentOutput, vk::AccessFlagBits::eColorAttachmentWrite, vk::ImageLayout::eColorAttachmentOptimal },
+    { vk::PipelineStageFlagBits::eTransfer, vk::AccessFlagBits::eTransferRead, vk::ImageLayout::eTransferSrcOptimal },
+    { vk::PipelineStageFlagBits::eTransfer, vk::AccessFlagBits::eTransferWrite, vk::ImageLayout::eTransferDstOptimal },
+    { vk::PipelineStageFlagBits::eComputeShader, vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eShaderWrite, vk::ImageLayout::eGeneral }
+};
+
+void ImageBarrier(vk::CommandBuffer cmdBuf, vk::Image image,
+    ImageState before,
+    ImageState after,
     uint32_t layerCount,
     uint32_t baseMipLevel,
     uint32_t mipLevels)
@@ -427,15 +1577,169 @@ void ImageBarrier(vk::CommandBuffer cmdBuf, vk::Image image,
         });
 }
 
-void ClearImage(vk::CommandBuffer vkCmdBuf, vk::Image vkImage, uint32_t layerCount, ImageState stateBefore)
+void ClearImage(vk::CommandBuffer vkCmdBuf, vk::Image vkImage, uint32_t layerCount, ImageState stateBefore, uint32_t mipLevels)
 {
-    ImageBarrier(vkCmdBuf, vkImage, stateBefore, ImageState::TransferDst, layerCount);
+    ImageBarrier(vkCmdBuf, vkImage, stateBefore, ImageState::TransferDst, layerCount, 0, mipLevels);
 
     vkCmdBuf.clearColorImage(vkImage, vk::ImageLayout::eTransferDstOptimal, vk::ClearColorValue(),
         { vk::ImageSubresourceRange()
             .setLayerCount(layerCount)
-            .setLevelCount(1)
+            .setLevelCount(mipLevels)
             .setAspectMask(vk::ImageAspectFlagBits::eColor) });
 
-    ImageBarrier(vkCmdBuf, vkImage, ImageState::TransferDst, ImageState::ShaderResource, layerCount);
+    ImageBarrier(vkCmdBuf, vkImage, ImageState::TransferDst, ImageState::ShaderResource, layerCount, 0, mipLevels);
+}
+
+bool ReadbackImage(vk::PhysicalDevice physicalDevice, vk::Device device, vk::Queue queue, vk::CommandBuffer cmdBuf,
+    const Image& image, uint32_t bytesPerPixel, blob& data)
+{
+    const vk::DeviceSize size = vk::DeviceSize(image.width) * image.height * bytesPerPixel;
+
+    auto bufferDesc = vk::BufferCreateInfo()
+        .setSize(size)
+        .setUsage(vk::BufferUsageFlagBits::eTransferDst);
+
+    auto buffer = CreateCommittedBuffer(physicalDevice, device, bufferDesc,
+        vk::MemoryPropertyFlagBits::eHostVisible);
+
+    if (!buffer.buffer)
+    {
+        LOG("ERROR: failed to create a readback buffer with %" PRIu64 " byte capacity.\n", size);
+        return false;
+    }
+
+    auto beginInfo = vk::CommandBufferBeginInfo()
+        .setFlags(vk::CommandBufferUsageFlagBits::eOneTimeSubmit);
+    cmdBuf.begin(beginInfo);
+
+    ImageBarrier(cmdBuf, image.image, ImageState::ShaderResource, ImageState::TransferSrc);
+
+    auto imageCopy = vk::BufferImageCopy()
+        .setBufferOffset(0)
+        .setBufferRowLength(image.width)
+        .setBufferImageHeight(image.height)
+        .setImageSubresource(vk::ImageSubresourceLayers()
+            .setAspectMask(vk::ImageAspectFlagBits::eColor)
+            .setMipLevel(0)
+            .setBaseArrayLayer(0)
+            .setLayerCount(1))
+        .setImageOffset(vk::Offset3D())
+        .setImageExtent(vk::Extent3D(image.width, image.height, 1));
+
+    cmdBuf.copyImageToBuffer(image.image, vk::ImageLayout::eTransferSrcOptimal,
+        buffer.buffer, 1, &imageCopy);
+
+    ImageBarrier(cmdBuf, image.image, ImageState::TransferSrc, ImageState::ShaderResource);
+
+    cmdBuf.end();
+
+    auto submitInfo = vk::SubmitInfo()
+        .setCommandBufferCount(1)
+        .setPCommandBuffers(&cmdBuf);
+
+    auto res = queue.submit(1, &submitInfo, nullptr);
+    assert(res == vk::Result::eSuccess);
+
+    queue.waitIdle();
+
+    void* mappedMemory = nullptr;
+    res = device.mapMemory(buffer.deviceMemory, 0, size, vk::MemoryMapFlags(), &mappedMemory);
+    if (!mappedMemory || res != vk::Result::eSuccess)
+    {
+        LOG("ERROR: failed to map the readback buffer.\n");
+        DestroyCommittedBuffer(device, buffer);
+        return false;
+    }
+
+    // The memory is not necessarily coherent
+    auto range = vk::MappedMemoryRange()
+        .setMemory(buffer.deviceMemory)
+        .setOffset(0)
+        .setSize(VK_WHOLE_SIZE);
+    (void)device.invalidateMappedMemoryRanges(1, &range);
+
+    data.resize(size_t(size));
+    memcpy(data.data(), mappedMemory, data.size());
+
+    device.unmapMemory(buffer.deviceMemory);
+    DestroyCommittedBuffer(device, buffer);
+
+    return true;
+}
+
+void CopyImage(vk::CommandBuffer cmdBuf, const Image& src, const Image& dst)
+{
+    // The mips are copied as well, so that the copy doesn't have to be followed by mip generation
+    const uint32_t mipLevels = uint32_t(std::min(src.mipLevels, dst.mipLevels));
+
+    ImageBarrier(cmdBuf, src.image, ImageState::ShaderResource, ImageState::TransferSrc, 1, 0, mipLevels);
+    ImageBarrier(cmdBuf, dst.image, ImageState::ShaderResource, ImageState::TransferDst, 1, 0, mipLevels);
+
+    std::vector<vk::ImageCopy> regions;
+    for (uint32_t level = 0; level < mipLevels; level++)
+    {
+        const auto subresource = vk::ImageSubresourceLayers()
+            .setAspectMask(vk::ImageAspectFlagBits::eColor)
+            .setMipLevel(level)
+            .setLayerCount(1);
+
+        regions.push_back(vk::ImageCopy()
+            .setSrcSubresource(subresource)
+            .setDstSubresource(subresource)
+            .setExtent(vk::Extent3D(
+                std::max(std::min(src.width, dst.width) >> level, 1),
+                std::max(std::min(src.height, dst.height) >> level, 1), 1)));
+    }
+
+    cmdBuf.copyImage(src.image, vk::ImageLayout::eTransferSrcOptimal,
+        dst.image, vk::ImageLayout::eTransferDstOptimal, uint32_t(regions.size()), regions.data());
+
+    ImageBarrier(cmdBuf, src.image, ImageState::TransferSrc, ImageState::ShaderResource, 1, 0, mipLevels);
+    ImageBarrier(cmdBuf, dst.image, ImageState::TransferDst, ImageState::ShaderResource, 1, 0, mipLevels);
+}
+
+static float ClampedChannel(const blob& image, size_t index)
+{
+    uint16_t value;
+    memcpy(&value, image.data() + index * sizeof(uint16_t), sizeof(value));
+    const float result = HalfToFloat(value);
+    // NaN compares false and ends up as 0, which is what the display would likely show as well
+    return result > 0.f ? std::min(result, 1.f) : 0.f;
+}
+
+bool CompareDisplayedImages(const blob& a, const blob& b, double pixelErrorThreshold, ImageDifference& result)
+{
+    const size_t pixelSize = sizeof(uint16_t) * 4;
+    if (a.size() != b.size() || a.empty() || a.size() % pixelSize != 0)
+        return false;
+
+    const size_t pixelCount = a.size() / pixelSize;
+    size_t differentPixels = 0;
+    double maxError = 0;
+    double sumError = 0;
+    double sumSquaredError = 0;
+    for (size_t pixel = 0; pixel < pixelCount; pixel++)
+    {
+        double pixelError = 0;
+        for (size_t channel = 0; channel < 3; channel++)
+        {
+            const size_t index = pixel * 4 + channel;
+            const double error = fabs(double(ClampedChannel(a, index)) - double(ClampedChannel(b, index)));
+            pixelError = std::max(pixelError, error);
+            sumError += error;
+            sumSquaredError += error * error;
+        }
+
+        maxError = std::max(maxError, pixelError);
+        if (pixelError > pixelErrorThreshold)
+            ++differentPixels;
+    }
+
+    const double sampleCount = double(pixelCount) * 3.0;
+    const double meanSquaredError = sumSquaredError / sampleCount;
+    result.maxError = maxError;
+    result.meanError = sumError / sampleCount;
+    result.psnrDb = meanSquaredError > 0 ? std::min(10.0 * log10(1.0 / meanSquaredError), 100.0) : 100.0;
+    result.differentFraction = double(differentPixels) / double(pixelCount);
+    return true;
 }
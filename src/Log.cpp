@@ -0,0 +1,496 @@
+/*
+* Copyright (c) 2022, NVIDIA CORPORATION. All rights reserved.
+*
+* Permission is hereby granted, free of charge, to any person obtaining a
+* copy of this software and associated documentation files (the "Software"),
+* to deal in the Software without restriction, including without limitation
+* the rights to use, copy, modify, merge, publish, distribute, sublicense,
+* and/or sell copies of the Software, and to permit persons to whom the
+* Software is furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+* THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+* DEALINGS IN THE SOFTWARE.
+*/
+
+
+
+#include "ShaderProj.h"
+
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <json/writer.h>
+
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+// While the rate limit is on, every LOG statement can write a burst of info messages, and then
+// one message per interval. The messages over the limit are counted and reported with the next
+// one that gets through. Errors and warnings are never limited.
+static constexpr int64_t c_LogIntervalNs = 100'000'000;
+static constexpr int64_t c_LogBurst = 64;
+
+// Bounded multi-producer single-consumer ring, the writer thread is the only consumer.
+// Messages that don't fit into a slot are copied into a heap string instead.
+static constexpr size_t c_LogRingSize = 1024;
+static constexpr size_t c_LogInlineText = 256;
+
+// Info messages don't wake up the writer, so they're written within this time
+static constexpr auto c_LogIdleWait = std::chrono::milliseconds(20);
+
+struct LogRecord
+{
+    int64_t time = 0;
+    int thread = 0;
+    LogLevel level = LogLevel::Info;
+    const char* subsystem = "";
+    int subsystemLength = 0;
+    uint32_t suppressed = 0;
+    uint32_t length = 0;
+    std::string* longText = nullptr;
+    char text[c_LogInlineText];
+};
+
+struct LogSlot
+{
+    std::atomic<size_t> sequence{ 0 };
+    LogRecord record;
+};
+
+static LogSlot g_LogRing[c_LogRingSize];
+static std::atomic<size_t> g_LogEnqueuePosition{ 0 };
+static size_t g_LogDequeuePosition = 0;
+
+static std::atomic<bool> g_LogRunning{ false };
+static std::atomic<bool> g_LogWriterSleeping{ false };
+static std::atomic<int> g_LogLevel{ int(LogLevel::Info) };
+static std::atomic<bool> g_LogLevelChanged{ false };
+static std::atomic<bool> g_LogRateLimit{ false };
+static std::atomic<uint32_t> g_LogDropped{ 0 };
+static std::atomic<int> g_LogThreadCount{ 0 };
+static bool g_LogJson = false;
+static bool g_LogForked = false;
+static const auto g_LogStartTime = std::chrono::steady_clock::now();
+
+static std::mutex g_LogWakeMutex;
+static std::condition_variable g_LogWake;
+static bool g_LogStop = false;
+static std::thread g_LogThread;
+
+static thread_local int t_LogThread = -1;
+
+LogSite::LogSite(const char* file)
+{
+    const char* name = file;
+    for (const char* c = file; *c; c++)
+    {
+        if (*c == '/' || *c == '\\')
+            name = c + 1;
+    }
+
+    const char* extension = strrchr(name, '.');
+    subsystem = name;
+    subsystemLength = extension ? int(extension - name) : int(strlen(name));
+}
+
+static LogLevel GetMessageLevel(const char* format)
+{
+    if (strncmp(format, "ERROR", 5) == 0)
+        return LogLevel::Error;
+    if (strncmp(format, "WARNING", 7) == 0)
+        return LogLevel::Warning;
+    return LogLevel::Info;
+}
+
+static const char* GetLevelName(LogLevel level)
+{
+    switch (level)
+    {
+    case LogLevel::Error: return "error";
+    case LogLevel::Warning: return "warning";
+    default: return "info";
+    }
+}
+
+static int64_t GetLogTime()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - g_LogStartTime).count();
+}
+
+static int GetLogThread()
+{
+    if (t_LogThread < 0)
+        t_LogThread = g_LogThreadCount.fetch_add(1, std::memory_order_relaxed);
+    return t_LogThread;
+}
+
+// Returns false if the site has used up its burst, without blocking
+static bool AllowLogMessage(LogSite& site, int64_t now)
+{
+    int64_t next = site.nextTime.load(std::memory_order_relaxed);
+    for (;;)
+    {
+        const int64_t start = std::max(next, now - c_LogBurst * c_LogIntervalNs);
+        if (start > now)
+        {
+            site.suppressed.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+
+        if (site.nextTime.compare_exchange_weak(next, start + c_LogIntervalNs, std::memory_order_relaxed))
+            return true;
+    }
+}
+
+static void FormatLogRecord(LogRecord& record, LogSite& site, LogLevel level, int64_t time, const char* format, va_list args)
+{
+    va_list argsCopy;
+    va_copy(argsCopy, args);
+
+    const int length = vsnprintf(record.text, sizeof(record.text), format, args);
+    record.longText = nullptr;
+    if (length >= int(sizeof(record.text)))
+    {
+        record.longText = new std::string(size_t(length), '\0');
+        vsnprintf(record.longText->data(), size_t(length) + 1, format, argsCopy);
+    }
+    va_end(argsCopy);
+
+    record.time = time;
+    record.thread = GetLogThread();
+    record.level = level;
+    record.subsystem = site.subsystem;
+    record.subsystemLength = site.subsystemLength;
+    record.suppressed = site.suppressed.exchange(0, std::memory_order_relaxed);
+    record.length = length > 0 ? uint32_t(length) : 0;
+}
+
+static void AppendLogRecord(std::string& output, const LogRecord& record)
+{
+    const char* text = record.longText ? record.longText->c_str() : record.text;
+    const std::string subsystem(record.subsystem, size_t(record.subsystemLength));
+
+    if (!g_LogJson)
+    {
+        if (record.suppressed)
+        {
+            output += "(" + std::to_string(record.suppressed) + " messages from " + subsystem + " were suppressed)\n";
+        }
+        output.append(text, record.length);
+        return;
+    }
+
+    // Partial lines are separate messages here, the trailing line breaks are not part of them
+    uint32_t length = record.length;
+    while (length > 0 && text[length - 1] == '\n')
+        --length;
+
+    Json::Value line;
+    line["time"] = double(record.time) * 1e-9;
+    line["thread"] = record.thread;
+    line["subsystem"] = subsystem;
+    line["level"] = GetLevelName(record.level);
+    line["message"] = std::string(text, length);
+    if (record.suppressed)
+        line["suppressed"] = record.suppressed;
+
+    Json::StreamWriterBuilder builder;
+    builder["indentation"] = "";
+    output += Json::writeString(builder, line);
+    output += '\n';
+}
+
+static void WriteLogOutput(const std::string& output)
+{
+    if (output.empty())
+        return;
+
+    fwrite(output.data(), 1, output.size(), stdout);
+    fflush(stdout);
+}
+
+static void WriteDroppedMessages(std::string& output)
+{
+    static LogSite site(__FILE__);
+
+    const uint32_t dropped = g_LogDropped.exchange(0, std::memory_order_relaxed);
+    if (!dropped)
+        return;
+
+    LogRecord record;
+    record.length = uint32_t(snprintf(record.text, sizeof(record.text),
+        "WARNING: %u log messages were dropped because the log was full\n", dropped));
+    record.time = GetLogTime();
+    record.thread = GetLogThread();
+    record.level = LogLevel::Warning;
+    record.subsystem = site.subsystem;
+    record.subsystemLength = site.subsystemLength;
+    AppendLogRecord(output, record);
+}
+
+// Written by the writer thread, because CycleLogLevel can be called from a signal handler
+static void WriteLogLevelChange(std::string& output)
+{
+    static LogSite site(__FILE__);
+
+    if (!g_LogLevelChanged.exchange(false, std::memory_order_relaxed))
+        return;
+
+    LogRecord record;
+    record.length = uint32_t(snprintf(record.text, sizeof(record.text),
+        "The log level is now %s\n", GetLevelName(GetLogLevel())));
+    record.time = GetLogTime();
+    record.thread = GetLogThread();
+    record.level = LogLevel::Info;
+    record.subsystem = site.subsystem;
+    record.subsystemLength = site.subsystemLength;
+    AppendLogRecord(output, record);
+}
+
+static bool DrainLogRing(std::string& output)
+{
+    bool any = false;
+    for (;;)
+    {
+        LogSlot& slot = g_LogRing[g_LogDequeuePosition & (c_LogRingSize - 1)];
+        if (slot.sequence.load(std::memory_order_acquire) != g_LogDequeuePosition + 1)
+            break;
+
+        AppendLogRecord(output, slot.record);
+        delete slot.record.longText;
+        slot.record.longText = nullptr;
+
+        slot.sequence.store(g_LogDequeuePosition + c_LogRingSize, std::memory_order_release);
+        ++g_LogDequeuePosition;
+        any = true;
+    }
+
+    WriteDroppedMessages(output);
+    WriteLogLevelChange(output);
+    return any;
+}
+
+static void LogWriterMain()
+{
+    std::string output;
+    for (;;)
+    {
+        output.clear();
+        if (DrainLogRing(output))
+        {
+            WriteLogOutput(output);
+            continue;
+        }
+        WriteLogOutput(output);
+
+        std::unique_lock<std::mutex> lock(g_LogWakeMutex);
+        if (g_LogStop)
+            break;
+
+        // The producers only wake the writer up when this is set, and they may miss it;
+        // the timeout takes care of that.
+        g_LogWriterSleeping.store(true, std::memory_order_seq_cst);
+        LogSlot& slot = g_LogRing[g_LogDequeuePosition & (c_LogRingSize - 1)];
+        if (slot.sequence.load(std::memory_order_acquire) != g_LogDequeuePosition + 1)
+            g_LogWake.wait_for(lock, c_LogIdleWait);
+        g_LogWriterSleeping.store(false, std::memory_order_relaxed);
+    }
+
+    output.clear();
+    DrainLogRing(output);
+    WriteLogOutput(output);
+}
+
+static void WriteLogMessage(LogSite& site, LogLevel level, int64_t time, const char* format, va_list args)
+{
+    LogRecord record;
+    FormatLogRecord(record, site, level, time, format, args);
+
+    std::string output;
+    AppendLogRecord(output, record);
+    delete record.longText;
+
+    WriteLogOutput(output);
+}
+
+void LogMessage(LogSite& site, const char* format, ...)
+{
+    const LogLevel level = GetMessageLevel(format);
+    if (int(level) > g_LogLevel.load(std::memory_order_relaxed))
+        return;
+
+    const int64_t now = GetLogTime();
+    if (level == LogLevel::Info && g_LogRateLimit.load(std::memory_order_relaxed) && !AllowLogMessage(site, now))
+        return;
+
+    va_list args;
+    va_start(args, format);
+
+    if (!g_LogRunning.load(std::memory_order_acquire))
+    {
+        WriteLogMessage(site, level, now, format, args);
+        va_end(args);
+        return;
+    }
+
+    size_t position = g_LogEnqueuePosition.load(std::memory_order_relaxed);
+    LogSlot* slot = nullptr;
+    for (;;)
+    {
+        LogSlot& candidate = g_LogRing[position & (c_LogRingSize - 1)];
+        const size_t sequence = candidate.sequence.load(std::memory_order_acquire);
+        const intptr_t difference = intptr_t(sequence) - intptr_t(position);
+
+        if (difference == 0)
+        {
+            if (g_LogEnqueuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+            {
+                slot = &candidate;
+                break;
+            }
+        }
+        else if (difference < 0)
+        {
+            // Full: never wait for the writer on the caller's thread
+            g_LogDropped.fetch_add(1, std::memory_order_relaxed);
+            va_end(args);
+            return;
+        }
+        else
+        {
+            position = g_LogEnqueuePosition.load(std::memory_order_relaxed);
+        }
+    }
+
+    FormatLogRecord(slot->record, site, level, now, format, args);
+    va_end(args);
+
+    slot->sequence.store(position + 1, std::memory_order_release);
+
+    // Errors and warnings are written right away, in case the process is about to exit
+    if (level != LogLevel::Info && g_LogWriterSleeping.load(std::memory_order_seq_cst))
+        g_LogWake.notify_one();
+}
+
+#ifndef _WIN32
+// The compile workers are forked from the player. Keep stdout consistent across the fork,
+// and make the child write synchronously because it doesn't have the writer thread.
+static void LogBeforeFork()
+{
+    flockfile(stdout);
+    fflush(stdout);
+}
+
+static void LogAfterForkParent()
+{
+    funlockfile(stdout);
+}
+
+static void LogAfterForkChild()
+{
+    g_LogForked = true;
+    g_LogRunning.store(false, std::memory_order_relaxed);
+    funlockfile(stdout);
+}
+#endif
+
+void InitLog(const LogParams& params)
+{
+    SetLogLevel(params.level);
+    g_LogJson = params.json;
+
+    if (g_LogRunning.load() || g_LogForked)
+        return;
+
+    for (size_t index = 0; index < c_LogRingSize; index++)
+        g_LogRing[index].sequence.store(index, std::memory_order_relaxed);
+    g_LogEnqueuePosition.store(0, std::memory_order_relaxed);
+    g_LogDequeuePosition = 0;
+    g_LogStop = false;
+
+#ifndef _WIN32
+    static bool atForkRegistered = false;
+    if (!atForkRegistered)
+    {
+        pthread_atfork(LogBeforeFork, LogAfterForkParent, LogAfterForkChild);
+        atForkRegistered = true;
+    }
+#endif
+
+    g_LogThread = std::thread(LogWriterMain);
+    g_LogRunning.store(true, std::memory_order_release);
+}
+
+void ShutdownLog()
+{
+    if (g_LogForked || !g_LogRunning.exchange(false))
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(g_LogWakeMutex);
+        g_LogStop = true;
+    }
+    g_LogWake.notify_one();
+    g_LogThread.join();
+
+    // Messages from the threads that were in the middle of LOG when the writer stopped
+    std::string output;
+    DrainLogRing(output);
+    WriteLogOutput(output);
+}
+
+void SetLogLevel(LogLevel level)
+{
+    g_LogLevel.store(int(level), std::memory_order_relaxed);
+}
+
+LogLevel GetLogLevel()
+{
+    return LogLevel(g_LogLevel.load(std::memory_order_relaxed));
+}
+
+void CycleLogLevel()
+{
+    // Only lock-free atomics, so that it's safe in a signal handler
+    int level = g_LogLevel.load(std::memory_order_relaxed);
+    while (!g_LogLevel.compare_exchange_weak(level, level == int(LogLevel::Info) ? int(LogLevel::Error) : level + 1,
+        std::memory_order_relaxed))
+    {
+    }
+
+    g_LogLevelChanged.store(true, std::memory_order_relaxed);
+}
+
+void SetLogRateLimit(bool enabled)
+{
+    g_LogRateLimit.store(enabled, std::memory_order_relaxed);
+}
+
+bool ParseLogLevel(const char* name, LogLevel& level)
+{
+    if (strcmp(name, "error") == 0)
+        level = LogLevel::Error;
+    else if (strcmp(name, "warning") == 0)
+        level = LogLevel::Warning;
+    else if (strcmp(name, "info") == 0)
+        level = LogLevel::Info;
+    else
+        return false;
+
+    return true;
+}
+
+// Writes the messages that are still queued when main returns early or exit is called
+static struct LogShutdownGuard
+{
+    ~LogShutdownGuard() { ShutdownLog(); }
+} g_LogShutdownGuard;
@@ -1,4 +1,56 @@
 
 #pragma once
 
-#define LOG(...) printf(__VA_ARGS__)
+#include <atomic>
+#include <cstdint>
+
+// Messages are formatted on the calling thread and written to stdout by a background thread,
+// so that a slow console doesn't stall the frames. Before InitLog, after ShutdownLog and in
+// forked processes, they are written synchronously.
+
+enum class LogLevel
+{
+    Error,
+    Warning,
+    Info
+};
+
+// State of one LOG statement, used to limit how often it can write info messages
+struct LogSite
+{
+    const char* subsystem;   // source file name without the directory and extension
+    int subsystemLength;
+    std::atomic<int64_t> nextTime{ INT64_MIN };
+    std::atomic<uint32_t> suppressed{ 0 };
+
+    explicit LogSite(const char* file);
+};
+
+#if defined(__GNUC__) || defined(__clang__)
+#define LOG_FORMAT_ATTRIBUTE __attribute__((format(printf, 2, 3)))
+#else
+#define LOG_FORMAT_ATTRIBUTE
+#endif
+
+// The level comes from the message prefix: "ERROR", "WARNING" or anything else for info
+void LogMessage(LogSite& site, const char* format, ...) LOG_FORMAT_ATTRIBUTE;
+
+#define LOG(...) do { static LogSite logSite(__FILE__); LogMessage(logSite, __VA_ARGS__); } while (false)
+
+struct LogParams
+{
+    LogLevel level = LogLevel::Info;
+    // One JSON object per message with the timestamp, thread, subsystem and level fields
+    bool json = false;
+};
+
+void InitLog(const LogParams& params);
+void ShutdownLog();
+void SetLogLevel(LogLevel level);
+[[nodiscard]] LogLevel GetLogLevel();
+// Goes from error to warning to info and back to error. It can be called from a signal handler,
+// and the new level is written to the log by the writer thread.
+void CycleLogLevel();
+// The rate limit is meant for the playback, the command line tools and reports are never limited
+void SetLogRateLimit(bool enabled);
+bool ParseLogLevel(const char* name, LogLevel& level);
@@ -0,0 +1,178 @@
+/*
+* Copyright (c) 2022, NVIDIA CORPORATION. All rights reserved.
+*
+* Permission is hereby granted, free of charge, to any person obtaining a
+* copy of this software and associated documentation files (the "Software"),
+* to deal in the Software without restriction, including without limitation
+* the rights to use, copy, modify, merge, publish, distribute, sublicense,
+* and/or sell copies of the Software, and to permit persons to whom the
+* Software is furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+* THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+* DEALINGS IN THE SOFTWARE.
+*/
+
+
+
+#include "ShaderProj.h"
+
+#include <unordered_map>
+#include <unordered_set>
+
+static double ToMegabytes(uint64_t bytes)
+{
+    return double(bytes) / (1024.0 * 1024.0);
+}
+
+// Static inputs of a program, each image once even if several passes sample it
+static std::vector<const Image*> GetProgramTextures(const ShProgram& program)
+{
+    std::vector<const Image*> textures;
+    std::unordered_set<VkImage> seen;
+
+    for (const auto& pass : program.GetPasses())
+    {
+        for (uint32_t channel = 0; channel < c_MaxPassInputs; channel++)
+        {
+            const Image& input = pass->GetStaticInput(int(channel));
+            if (input.image && seen.insert(VkImage(input.image)).second)
+                textures.push_back(&input);
+        }
+    }
+
+    return textures;
+}
+
+void ShaderProj::WriteMemoryReport(bool print)
+{
+    if (!print && !IsStatsEnabled())
+        return;
+
+    uint32_t width, height;
+    GetWindowDimensions(width, height);
+
+    // Textures are shared through the image cache, so each program is charged
+    // an equal part of the textures that it uses with other programs.
+    std::vector<std::vector<const Image*>> programTextures(m_Programs.size());
+    std::unordered_map<VkImage, int> textureOwners;
+
+    for (size_t index = 0; index < m_Programs.size(); index++)
+    {
+        if (m_Programs[index]->IsReleased())
+            continue;
+
+        programTextures[index] = GetProgramTextures(*m_Programs[index]);
+        for (const Image* texture : programTextures[index])
+            ++textureOwners[VkImage(texture->image)];
+    }
+
+    ProgramMemory total;
+
+    for (size_t index = 0; index < m_Programs.size(); index++)
+    {
+        const ShProgram& program = *m_Programs[index];
+        if (program.IsReleased())
+            continue;
+
+        ProgramMemory memory;
+
+        for (const auto& pass : program.GetPasses())
+        {
+            pass->AccumulateMemory(memory);
+
+            // The render targets are shared by all programs and sized for the active one,
+            // so this is what the program needs at the current output size, not what is allocated.
+            const float scale = pass->GetScale() * program.GetRenderScale() * m_Throttle.renderScale;
+            int imageWidth = std::max(int(float(width) * scale + 0.5f), 1);
+            int imageHeight = std::max(int(float(height) * scale + 0.5f), 1);
+            const uint32_t mipLevels = pass->GeneratesMips() ? GetRenderTargetMipLevels(imageWidth, imageHeight) : 1;
+
+            uint64_t passBytes = 0;
+            for (uint32_t mip = 0; mip < mipLevels; mip++)
+            {
+                // RGBA16F
+                passBytes += uint64_t(imageWidth) * uint64_t(imageHeight) * 8;
+                imageWidth = std::max(imageWidth / 2, 1);
+                imageHeight = std::max(imageHeight / 2, 1);
+            }
+            memory.renderTargetBytes += passBytes * c_HistoryLength;
+        }
+
+        for (const Image* texture : programTextures[index])
+        {
+            const uint64_t owners = uint64_t(textureOwners[VkImage(texture->image)]);
+            memory.textureBytes += texture->memorySize / owners;
+            memory.decodedImageBytes += GetDecodedImageSize(*texture) / owners;
+        }
+
+        total.spirvBytes += memory.spirvBytes;
+        total.declarationBytes += memory.declarationBytes;
+        total.decodedImageBytes += memory.decodedImageBytes;
+        total.shaderModuleBytes += memory.shaderModuleBytes;
+        total.textureBytes += memory.textureBytes;
+        total.renderTargetBytes += memory.renderTargetBytes;
+        total.pipelines += memory.pipelines;
+        total.descriptorSets += memory.descriptorSets;
+
+        if (print)
+        {
+            LOG("%s: CPU %.2f MB (SPIR-V %.2f, declarations %.2f, decoded images %.2f), GPU %.2f MB (textures %.2f, "
+                "render targets %.2f, shader modules %.2f), %d pipelines, %d descriptor sets\n",
+                program.GetName().c_str(), ToMegabytes(memory.GetCpuBytes()), ToMegabytes(memory.spirvBytes),
+                ToMegabytes(memory.declarationBytes), ToMegabytes(memory.decodedImageBytes),
+                ToMegabytes(memory.GetGpuBytes()), ToMegabytes(memory.textureBytes),
+                ToMegabytes(memory.renderTargetBytes), ToMegabytes(memory.shaderModuleBytes),
+                memory.pipelines, memory.descriptorSets);
+        }
+
+        Json::Value record;
+        record["type"] = "program_memory";
+        record["program"] = program.GetName();
+        record["spirv_bytes"] = Json::UInt64(memory.spirvBytes);
+        record["declaration_bytes"] = Json::UInt64(memory.declarationBytes);
+        record["decoded_image_bytes"] = Json::UInt64(memory.decodedImageBytes);
+        record["shader_module_bytes"] = Json::UInt64(memory.shaderModuleBytes);
+        record["texture_bytes"] = Json::UInt64(memory.textureBytes);
+        record["render_target_bytes"] = Json::UInt64(memory.renderTargetBytes);
+        record["pipelines"] = memory.pipelines;
+        record["descriptor_sets"] = memory.descriptorSets;
+        record["cpu_bytes"] = Json::UInt64(memory.GetCpuBytes());
+        record["gpu_bytes"] = Json::UInt64(memory.GetGpuBytes());
+        WriteStats(record);
+    }
+
+    // What is actually allocated: the render targets only exist once for all programs
+    uint64_t allocatedRenderTargetBytes = 0;
+    for (const Image& image : m_Images)
+        allocatedRenderTargetBytes += image.memorySize;
+
+    if (print)
+    {
+        LOG("Total: CPU %.2f MB, GPU %.2f MB, %d pipelines, %d descriptor sets; %.2f MB of render targets allocated\n",
+            ToMegabytes(total.GetCpuBytes()), ToMegabytes(total.GetGpuBytes()), total.pipelines, total.descriptorSets,
+            ToMegabytes(allocatedRenderTargetBytes));
+    }
+
+    Json::Value record;
+    record["type"] = "memory_totals";
+    record["spirv_bytes"] = Json::UInt64(total.spirvBytes);
+    record["declaration_bytes"] = Json::UInt64(total.declarationBytes);
+    record["decoded_image_bytes"] = Json::UInt64(total.decodedImageBytes);
+    record["shader_module_bytes"] = Json::UInt64(total.shaderModuleBytes);
+    record["texture_bytes"] = Json::UInt64(total.textureBytes);
+    record["render_target_bytes"] = Json::UInt64(total.renderTargetBytes);
+    record["allocated_render_target_bytes"] = Json::UInt64(allocatedRenderTargetBytes);
+    record["pipelines"] = total.pipelines;
+    record["descriptor_sets"] = total.descriptorSets;
+    record["cpu_bytes"] = Json::UInt64(total.GetCpuBytes());
+    record["gpu_bytes"] = Json::UInt64(total.GetGpuBytes());
+    WriteStats(record);
+}
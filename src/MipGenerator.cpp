@@ -0,0 +1,287 @@
+/*
+* Copyright (c) 2022, NVIDIA CORPORATION. All rights reserved.
+*
+* Permission is hereby granted, free of charge, to any person obtaining a
+* copy of this software and associated documentation files (the "Software"),
+* to deal in the Software without restriction, including without limitation
+* the rights to use, copy, modify, merge, publish, distribute, sublicense,
+* and/or sell copies of the Software, and to permit persons to whom the
+* Software is furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+* THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+* DEALINGS IN THE SOFTWARE.
+*/
+
+
+
+
+#include "ShaderProj.h"
+#include "Log.h"
+
+#include "shader-mipgen.h"
+
+// Levels 1-12 are generated from level 0, so that's the longest chain: up to 4096x4096.
+// Larger images get 6 generated levels, which only take the first stage of the shader.
+constexpr uint32_t c_MaxGeneratedMips = 12;
+constexpr uint32_t c_FirstStageMips = 6;
+constexpr uint32_t c_TileSize = 64;
+
+struct MipGeneratorPushConstants
+{
+    int32_t sourceSize[2];
+    int32_t mipCount;
+    int32_t workgroupCount;
+};
+
+uint32_t GetRenderTargetMipLevels(int width, int height)
+{
+    uint32_t levels = 1;
+    for (int size = std::max(width, height); size > 1; size >>= 1)
+        ++levels;
+
+    const uint32_t maxLevels = std::max(width, height) > int(c_TileSize << c_FirstStageMips)
+        ? c_FirstStageMips : c_MaxGeneratedMips;
+
+    return std::min(levels, maxLevels + 1);
+}
+
+bool MipGenerator::Init(vk::PhysicalDevice physicalDevice, vk::Device device, vk::PipelineCache pipelineCache)
+{
+    Shutdown();
+
+    m_Device = device;
+
+    // One completion counter per image, each in its own aligned range
+    const auto limits = physicalDevice.getProperties().limits;
+    const vk::DeviceSize counterStride = std::max<vk::DeviceSize>(limits.minStorageBufferOffsetAlignment, sizeof(uint32_t));
+
+    m_CounterBuffer = CreateCommittedBuffer(physicalDevice, device, vk::BufferCreateInfo()
+        .setSize(counterStride * c_RenderImageCount)
+        .setUsage(vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eTransferDst),
+        vk::MemoryPropertyFlagBits::eDeviceLocal);
+
+    if (!m_CounterBuffer.buffer)
+    {
+        LOG("ERROR: failed to create the mip generator counter buffer.\n");
+        return false;
+    }
+
+    m_Sampler = device.createSampler(vk::SamplerCreateInfo()
+        .setMinFilter(vk::Filter::eLinear)
+        .setMagFilter(vk::Filter::eLinear)
+        .setMipmapMode(vk::SamplerMipmapMode::eNearest)
+        .setAddressModeU(vk::SamplerAddressMode::eClampToEdge)
+        .setAddressModeV(vk::SamplerAddressMode::eClampToEdge)
+        .setAddressModeW(vk::SamplerAddressMode::eClampToEdge));
+
+    const vk::DescriptorSetLayoutBinding bindings[] = {
+        vk::DescriptorSetLayoutBinding()
+            .setStageFlags(vk::ShaderStageFlagBits::eCompute)
+            .setDescriptorType(vk::DescriptorType::eCombinedImageSampler)
+            .setDescriptorCount(1)
+            .setBinding(0),
+        vk::DescriptorSetLayoutBinding()
+            .setStageFlags(vk::ShaderStageFlagBits::eCompute)
+            .setDescriptorType(vk::DescriptorType::eStorageImage)
+            .setDescriptorCount(c_MaxGeneratedMips)
+            .setBinding(1),
+        vk::DescriptorSetLayoutBinding()
+            .setStageFlags(vk::ShaderStageFlagBits::eCompute)
+            .setDescriptorType(vk::DescriptorType::eStorageBuffer)
+            .setDescriptorCount(1)
+            .setBinding(2)
+    };
+
+    m_SetLayout = device.createDescriptorSetLayout(vk::DescriptorSetLayoutCreateInfo()
+        .setBindingCount(uint32_t(std::size(bindings)))
+        .setPBindings(bindings));
+
+    auto pushConstantRange = vk::PushConstantRange()
+        .setSize(sizeof(MipGeneratorPushConstants))
+        .setStageFlags(vk::ShaderStageFlagBits::eCompute);
+
+    m_PipelineLayout = device.createPipelineLayout(vk::PipelineLayoutCreateInfo()
+        .setSetLayoutCount(1)
+        .setPSetLayouts(&m_SetLayout)
+        .setPushConstantRangeCount(1)
+        .setPPushConstantRanges(&pushConstantRange));
+
+    const vk::DescriptorPoolSize poolSizes[] = {
+        vk::DescriptorPoolSize().setType(vk::DescriptorType::eCombinedImageSampler).setDescriptorCount(c_RenderImageCount),
+        vk::DescriptorPoolSize().setType(vk::DescriptorType::eStorageImage).setDescriptorCount(c_RenderImageCount * c_MaxGeneratedMips),
+        vk::DescriptorPoolSize().setType(vk::DescriptorType::eStorageBuffer).setDescriptorCount(c_RenderImageCount)
+    };
+
+    m_DescriptorPool = device.createDescriptorPool(vk::DescriptorPoolCreateInfo()
+        .setMaxSets(c_RenderImageCount)
+        .setPoolSizeCount(uint32_t(std::size(poolSizes)))
+        .setPPoolSizes(poolSizes));
+
+    std::array<vk::DescriptorSetLayout, c_RenderImageCount> setLayouts;
+    setLayouts.fill(m_SetLayout);
+
+    auto allocateInfo = vk::DescriptorSetAllocateInfo()
+        .setDescriptorPool(m_DescriptorPool)
+        .setDescriptorSetCount(c_RenderImageCount)
+        .setPSetLayouts(setLayouts.data());
+
+    if (device.allocateDescriptorSets(&allocateInfo, m_DescriptorSets.data()) != vk::Result::eSuccess)
+    {
+        LOG("ERROR: failed to allocate the mip generator descriptor sets.\n");
+        return false;
+    }
+
+    // The counters are written with one buffer descriptor per image, they don't depend on the images
+    for (uint32_t index = 0; index < c_RenderImageCount; index++)
+    {
+        auto bufferInfo = vk::DescriptorBufferInfo()
+            .setBuffer(m_CounterBuffer.buffer)
+            .setOffset(counterStride * index)
+            .setRange(sizeof(uint32_t));
+
+        device.updateDescriptorSets({ vk::WriteDescriptorSet()
+            .setDstSet(m_DescriptorSets[index])
+            .setDstBinding(2)
+            .setDescriptorCount(1)
+            .setDescriptorType(vk::DescriptorType::eStorageBuffer)
+            .setPBufferInfo(&bufferInfo) }, {});
+    }
+
+    vk::ShaderModule shader = CreateShaderModule(device, g_MipGenComputeShader, sizeof(g_MipGenComputeShader));
+    if (!shader)
+        return false;
+
+    auto pipelineInfo = vk::ComputePipelineCreateInfo()
+        .setStage(vk::PipelineShaderStageCreateInfo()
+            .setStage(vk::ShaderStageFlagBits::eCompute)
+            .setModule(shader)
+            .setPName("main"))
+        .setLayout(m_PipelineLayout);
+
+    const vk::Result res = device.createComputePipelines(pipelineCache, 1, &pipelineInfo, nullptr, &m_Pipeline);
+    device.destroyShaderModule(shader);
+
+    if (res != vk::Result::eSuccess)
+    {
+        LOG("ERROR: Failed to create the mip generator pipeline, result = %s\n", VulkanResultToString(res));
+        m_Pipeline = nullptr;
+        return false;
+    }
+
+    m_CountersInitd = false;
+
+    return true;
+}
+
+void MipGenerator::Shutdown()
+{
+    if (!m_Device)
+        return;
+
+    m_Device.destroyPipeline(m_Pipeline);
+    m_Pipeline = nullptr;
+
+    m_Device.destroyPipelineLayout(m_PipelineLayout);
+    m_PipelineLayout = nullptr;
+
+    m_Device.destroyDescriptorPool(m_DescriptorPool);
+    m_DescriptorPool = nullptr;
+    m_DescriptorSets.fill(nullptr);
+
+    m_Device.destroyDescriptorSetLayout(m_SetLayout);
+    m_SetLayout = nullptr;
+
+    m_Device.destroySampler(m_Sampler);
+    m_Sampler = nullptr;
+
+    DestroyCommittedBuffer(m_Device, m_CounterBuffer);
+
+    m_Device = nullptr;
+    m_CountersInitd = false;
+}
+
+void MipGenerator::SetImage(uint32_t index, const Image& image)
+{
+    if (!m_Pipeline || image.levelViews.empty())
+        return;
+
+    auto sourceInfo = vk::DescriptorImageInfo()
+        .setImageLayout(vk::ImageLayout::eShaderReadOnlyOptimal)
+        .setImageView(image.levelViews[0])
+        .setSampler(m_Sampler);
+
+    // The shader doesn't write the levels that the image doesn't have, but the descriptors must be valid
+    std::array<vk::DescriptorImageInfo, c_MaxGeneratedMips> mipInfos;
+    for (uint32_t level = 1; level <= c_MaxGeneratedMips; level++)
+    {
+        mipInfos[level - 1] = vk::DescriptorImageInfo()
+            .setImageLayout(vk::ImageLayout::eGeneral)
+            .setImageView(image.levelViews[std::min(level, uint32_t(image.levelViews.size()) - 1)]);
+    }
+
+    m_Device.updateDescriptorSets({
+        vk::WriteDescriptorSet()
+            .setDstSet(m_DescriptorSets[index])
+            .setDstBinding(0)
+            .setDescriptorCount(1)
+            .setDescriptorType(vk::DescriptorType::eCombinedImageSampler)
+            .setPImageInfo(&sourceInfo),
+        vk::WriteDescriptorSet()
+            .setDstSet(m_DescriptorSets[index])
+            .setDstBinding(1)
+            .setDescriptorCount(c_MaxGeneratedMips)
+            .setDescriptorType(vk::DescriptorType::eStorageImage)
+            .setPImageInfo(mipInfos.data())
+        }, {});
+}
+
+void MipGenerator::Generate(vk::CommandBuffer cmdBuf, uint32_t index, const Image& image)
+{
+    if (!m_Pipeline || image.mipLevels <= 1)
+        return;
+
+    if (!m_CountersInitd)
+    {
+        // The shader resets the counters after use, so they only need to be cleared once
+        cmdBuf.fillBuffer(m_CounterBuffer.buffer, 0, VK_WHOLE_SIZE, 0);
+        cmdBuf.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eComputeShader,
+            vk::DependencyFlags(), { vk::MemoryBarrier()
+                .setSrcAccessMask(vk::AccessFlagBits::eTransferWrite)
+                .setDstAccessMask(vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eShaderWrite) }, {}, {});
+        m_CountersInitd = true;
+    }
+
+    const uint32_t mipCount = uint32_t(image.mipLevels) - 1;
+    const uint32_t groupsX = (uint32_t(image.width) + c_TileSize - 1) / c_TileSize;
+    const uint32_t groupsY = (uint32_t(image.height) + c_TileSize - 1) / c_TileSize;
+
+    MipGeneratorPushConstants pushConstants;
+    pushConstants.sourceSize[0] = image.width;
+    pushConstants.sourceSize[1] = image.height;
+    pushConstants.mipCount = int32_t(mipCount);
+    pushConstants.workgroupCount = int32_t(groupsX * groupsY);
+
+    // Level 0 stays readable, the other levels are only written and read by the shader
+    ImageBarrier(cmdBuf, image.image, ImageState::ShaderResource, ImageState::Storage, 1, 1, mipCount);
+
+    cmdBuf.bindPipeline(vk::PipelineBindPoint::eCompute, m_Pipeline);
+    cmdBuf.bindDescriptorSets(vk::PipelineBindPoint::eCompute, m_PipelineLayout, 0, 1, &m_DescriptorSets[index], 0, nullptr);
+    cmdBuf.pushConstants(m_PipelineLayout, vk::ShaderStageFlagBits::eCompute, 0, sizeof(pushConstants), &pushConstants);
+    cmdBuf.dispatch(groupsX, groupsY, 1);
+
+    ImageBarrier(cmdBuf, image.image, ImageState::Storage, ImageState::ShaderResource, 1, 1, mipCount);
+
+    // The next dispatch on this image uses the counter that the last workgroup has reset
+    cmdBuf.pipelineBarrier(vk::PipelineStageFlagBits::eComputeShader, vk::PipelineStageFlagBits::eComputeShader,
+        vk::DependencyFlags(), { vk::MemoryBarrier()
+            .setSrcAccessMask(vk::AccessFlagBits::eShaderWrite)
+            .setDstAccessMask(vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eShaderWrite) }, {}, {});
+}
@@ -0,0 +1,450 @@
+/*
+* Copyright (c) 2022, NVIDIA CORPORATION. All rights reserved.
+*
+* Permission is hereby granted, free of charge, to any person obtaining a
+* copy of this software and associated documentation files (the "Software"),
+* to deal in the Software without restriction, including without limitation
+* the rights to use, copy, modify, merge, publish, distribute, sublicense,
+* and/or sell copies of the Software, and to permit persons to whom the
+* Software is furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+* THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+* DEALINGS IN THE SOFTWARE.
+*/
+
+
+// A no-op Vulkan implementation that is installed directly into the Vulkan-Hpp dispatcher.
+// It hands out fake handles and ignores all commands, which makes it possible to measure
+// the CPU cost of the player without any GPU or driver work being involved.
+
+#include "VulkanApp.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+static std::atomic<uint64_t> g_NextHandle = 0;
+static std::atomic<int64_t> g_LiveObjects = 0;
+static std::atomic<int64_t> g_DescriptorSets = 0;
+
+struct NullMemoryAllocation
+{
+    VkDeviceSize size = 0;
+    std::vector<char> hostData;
+};
+
+static std::mutex g_NullDriverMutex;
+static std::unordered_map<uint64_t, VkDeviceSize> g_ResourceSizes;
+static std::unordered_map<uint64_t, NullMemoryAllocation> g_MemoryAllocations;
+static std::unordered_map<uint64_t, uint32_t> g_DescriptorPoolUsage;
+
+template<typename T>
+static T NewHandle()
+{
+    return (T)(uintptr_t)(++g_NextHandle);
+}
+
+template<typename T>
+static uint64_t HandleKey(T handle)
+{
+    return (uint64_t)(uintptr_t)handle;
+}
+
+template<typename Info, typename Handle>
+static VKAPI_ATTR VkResult VKAPI_CALL NullCreate(VkDevice, const Info*, const VkAllocationCallbacks*, Handle* handle)
+{
+    *handle = NewHandle<Handle>();
+    ++g_LiveObjects;
+    return VK_SUCCESS;
+}
+
+template<typename Handle>
+static VKAPI_ATTR void VKAPI_CALL NullDestroy(VkDevice, Handle handle, const VkAllocationCallbacks*)
+{
+    if (handle)
+        --g_LiveObjects;
+}
+
+template<typename... Args>
+static VKAPI_ATTR void VKAPI_CALL NullCommand(VkCommandBuffer, Args...)
+{
+}
+
+template<typename Handle>
+static VKAPI_ATTR VkResult VKAPI_CALL NullSuccess(Handle)
+{
+    return VK_SUCCESS;
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL NullCreateDevice(VkPhysicalDevice, const VkDeviceCreateInfo*, const VkAllocationCallbacks*, VkDevice* device)
+{
+    *device = NewHandle<VkDevice>();
+    return VK_SUCCESS;
+}
+
+static VKAPI_ATTR void VKAPI_CALL NullDestroyDevice(VkDevice, const VkAllocationCallbacks*)
+{
+}
+
+static VKAPI_ATTR void VKAPI_CALL NullGetDeviceQueue(VkDevice, uint32_t, uint32_t, VkQueue* queue)
+{
+    *queue = NewHandle<VkQueue>();
+}
+
+static VKAPI_ATTR void VKAPI_CALL NullGetPhysicalDeviceProperties(VkPhysicalDevice, VkPhysicalDeviceProperties* properties)
+{
+    *properties = VkPhysicalDeviceProperties();
+    properties->apiVersion = VK_API_VERSION_1_2;
+    properties->deviceType = VK_PHYSICAL_DEVICE_TYPE_CPU;
+    properties->limits.timestampPeriod = 1.f;
+    properties->limits.maxPushConstantsSize = 128;
+    strncpy(properties->deviceName, "Null Vulkan Device", VK_MAX_PHYSICAL_DEVICE_NAME_SIZE - 1);
+}
+
+static VKAPI_ATTR void VKAPI_CALL NullGetPhysicalDeviceMemoryProperties(VkPhysicalDevice, VkPhysicalDeviceMemoryProperties* properties)
+{
+    *properties = VkPhysicalDeviceMemoryProperties();
+    properties->memoryTypeCount = 1;
+    properties->memoryTypes[0].heapIndex = 0;
+    properties->memoryTypes[0].propertyFlags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT
+        | VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
+        | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+    properties->memoryHeapCount = 1;
+    properties->memoryHeaps[0].size = VkDeviceSize(1) << 40;
+    properties->memoryHeaps[0].flags = VK_MEMORY_HEAP_DEVICE_LOCAL_BIT;
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL NullCreateImage(VkDevice, const VkImageCreateInfo* info, const VkAllocationCallbacks*, VkImage* image)
+{
+    // Assume the widest format and a full mip chain, the size is only used to back mapped memory.
+    VkDeviceSize size = VkDeviceSize(info->extent.width) * info->extent.height * info->extent.depth * info->arrayLayers * 16;
+    if (info->mipLevels > 1)
+        size = size * 4 / 3;
+
+    *image = NewHandle<VkImage>();
+    ++g_LiveObjects;
+
+    std::lock_guard<std::mutex> lock(g_NullDriverMutex);
+    g_ResourceSizes[HandleKey(*image)] = size;
+    return VK_SUCCESS;
+}
+
+static VKAPI_ATTR void VKAPI_CALL NullDestroyImage(VkDevice, VkImage image, const VkAllocationCallbacks*)
+{
+    if (!image)
+        return;
+
+    --g_LiveObjects;
+
+    std::lock_guard<std::mutex> lock(g_NullDriverMutex);
+    g_ResourceSizes.erase(HandleKey(image));
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL NullCreateBuffer(VkDevice, const VkBufferCreateInfo* info, const VkAllocationCallbacks*, VkBuffer* buffer)
+{
+    *buffer = NewHandle<VkBuffer>();
+    ++g_LiveObjects;
+
+    std::lock_guard<std::mutex> lock(g_NullDriverMutex);
+    g_ResourceSizes[HandleKey(*buffer)] = info->size;
+    return VK_SUCCESS;
+}
+
+static VKAPI_ATTR void VKAPI_CALL NullDestroyBuffer(VkDevice, VkBuffer buffer, const VkAllocationCallbacks*)
+{
+    if (!buffer)
+        return;
+
+    --g_LiveObjects;
+
+    std::lock_guard<std::mutex> lock(g_NullDriverMutex);
+    g_ResourceSizes.erase(HandleKey(buffer));
+}
+
+template<typename Handle>
+static VKAPI_ATTR void VKAPI_CALL NullGetMemoryRequirements(VkDevice, Handle resource, VkMemoryRequirements* requirements)
+{
+    std::lock_guard<std::mutex> lock(g_NullDriverMutex);
+    auto found = g_ResourceSizes.find(HandleKey(resource));
+    requirements->size = (found != g_ResourceSizes.end()) ? found->second : 0;
+    requirements->alignment = 256;
+    requirements->memoryTypeBits = 1;
+}
+
+template<typename Handle>
+static VKAPI_ATTR VkResult VKAPI_CALL NullBindMemory(VkDevice, Handle, VkDeviceMemory, VkDeviceSize)
+{
+    return VK_SUCCESS;
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL NullAllocateMemory(VkDevice, const VkMemoryAllocateInfo* info, const VkAllocationCallbacks*, VkDeviceMemory* memory)
+{
+    *memory = NewHandle<VkDeviceMemory>();
+
+    std::lock_guard<std::mutex> lock(g_NullDriverMutex);
+    g_MemoryAllocations[HandleKey(*memory)].size = info->allocationSize;
+    return VK_SUCCESS;
+}
+
+static VKAPI_ATTR void VKAPI_CALL NullFreeMemory(VkDevice, VkDeviceMemory memory, const VkAllocationCallbacks*)
+{
+    std::lock_guard<std::mutex> lock(g_NullDriverMutex);
+    g_MemoryAllocations.erase(HandleKey(memory));
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL NullMapMemory(VkDevice, VkDeviceMemory memory, VkDeviceSize offset, VkDeviceSize, VkMemoryMapFlags, void** data)
+{
+    std::lock_guard<std::mutex> lock(g_NullDriverMutex);
+    auto found = g_MemoryAllocations.find(HandleKey(memory));
+    if (found == g_MemoryAllocations.end())
+        return VK_ERROR_MEMORY_MAP_FAILED;
+
+    // Host storage is only created for the allocations that are actually mapped.
+    auto& allocation = found->second;
+    allocation.hostData.resize(allocation.size);
+    *data = allocation.hostData.data() + offset;
+    return VK_SUCCESS;
+}
+
+static VKAPI_ATTR void VKAPI_CALL NullUnmapMemory(VkDevice, VkDeviceMemory)
+{
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL NullInvalidateMappedMemoryRanges(VkDevice, uint32_t, const VkMappedMemoryRange*)
+{
+    return VK_SUCCESS;
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL NullCreateGraphicsPipelines(VkDevice, VkPipelineCache, uint32_t count,
+    const VkGraphicsPipelineCreateInfo*, const VkAllocationCallbacks*, VkPipeline* pipelines)
+{
+    for (uint32_t index = 0; index < count; index++)
+        pipelines[index] = NewHandle<VkPipeline>();
+    g_LiveObjects += count;
+    return VK_SUCCESS;
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL NullCreateComputePipelines(VkDevice, VkPipelineCache, uint32_t count,
+    const VkComputePipelineCreateInfo*, const VkAllocationCallbacks*, VkPipeline* pipelines)
+{
+    for (uint32_t index = 0; index < count; index++)
+        pipelines[index] = NewHandle<VkPipeline>();
+    g_LiveObjects += count;
+    return VK_SUCCESS;
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL NullAllocateDescriptorSets(VkDevice, const VkDescriptorSetAllocateInfo* info, VkDescriptorSet* sets)
+{
+    for (uint32_t index = 0; index < info->descriptorSetCount; index++)
+        sets[index] = NewHandle<VkDescriptorSet>();
+
+    g_DescriptorSets += info->descriptorSetCount;
+
+    std::lock_guard<std::mutex> lock(g_NullDriverMutex);
+    g_DescriptorPoolUsage[HandleKey(info->descriptorPool)] += info->descriptorSetCount;
+    return VK_SUCCESS;
+}
+
+static VKAPI_ATTR void VKAPI_CALL NullDestroyDescriptorPool(VkDevice, VkDescriptorPool pool, const VkAllocationCallbacks*)
+{
+    if (!pool)
+        return;
+
+    --g_LiveObjects;
+
+    // Destroying a pool implicitly frees all the sets allocated from it.
+    std::lock_guard<std::mutex> lock(g_NullDriverMutex);
+    auto found = g_DescriptorPoolUsage.find(HandleKey(pool));
+    if (found != g_DescriptorPoolUsage.end())
+    {
+        g_DescriptorSets -= found->second;
+        g_DescriptorPoolUsage.erase(found);
+    }
+}
+
+static VKAPI_ATTR void VKAPI_CALL NullUpdateDescriptorSets(VkDevice, uint32_t, const VkWriteDescriptorSet*, uint32_t, const VkCopyDescriptorSet*)
+{
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL NullAllocateCommandBuffers(VkDevice, const VkCommandBufferAllocateInfo* info, VkCommandBuffer* cmdBufs)
+{
+    for (uint32_t index = 0; index < info->commandBufferCount; index++)
+        cmdBufs[index] = NewHandle<VkCommandBuffer>();
+    return VK_SUCCESS;
+}
+
+static VKAPI_ATTR void VKAPI_CALL NullFreeCommandBuffers(VkDevice, VkCommandPool, uint32_t, const VkCommandBuffer*)
+{
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL NullBeginCommandBuffer(VkCommandBuffer, const VkCommandBufferBeginInfo*)
+{
+    return VK_SUCCESS;
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL NullWaitForFences(VkDevice, uint32_t, const VkFence*, VkBool32, uint64_t)
+{
+    return VK_SUCCESS;
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL NullResetFences(VkDevice, uint32_t, const VkFence*)
+{
+    return VK_SUCCESS;
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL NullQueueSubmit(VkQueue, uint32_t, const VkSubmitInfo*, VkFence)
+{
+    return VK_SUCCESS;
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL NullGetSwapchainImages(VkDevice, VkSwapchainKHR, uint32_t* count, VkImage* images)
+{
+    constexpr uint32_t c_NullSwapChainImageCount = 3;
+
+    if (!images)
+    {
+        *count = c_NullSwapChainImageCount;
+        return VK_SUCCESS;
+    }
+
+    *count = std::min(*count, c_NullSwapChainImageCount);
+    for (uint32_t index = 0; index < *count; index++)
+        images[index] = NewHandle<VkImage>();
+    return VK_SUCCESS;
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL NullAcquireNextImage(VkDevice, VkSwapchainKHR, uint64_t, VkSemaphore, VkFence, uint32_t* index)
+{
+    static std::atomic<uint32_t> s_SwapChainIndex = 0;
+    *index = (s_SwapChainIndex++) % 3;
+    return VK_SUCCESS;
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL NullQueuePresent(VkQueue, const VkPresentInfoKHR*)
+{
+    return VK_SUCCESS;
+}
+
+void InitNullDriver()
+{
+    auto& d = VULKAN_HPP_DEFAULT_DISPATCHER;
+
+    d.vkCreateDevice = NullCreateDevice;
+    d.vkDestroyDevice = NullDestroyDevice;
+    d.vkGetDeviceQueue = NullGetDeviceQueue;
+    d.vkDeviceWaitIdle = NullSuccess<VkDevice>;
+    d.vkQueueWaitIdle = NullSuccess<VkQueue>;
+    d.vkGetPhysicalDeviceProperties = NullGetPhysicalDeviceProperties;
+    d.vkGetPhysicalDeviceMemoryProperties = NullGetPhysicalDeviceMemoryProperties;
+
+    d.vkAllocateMemory = NullAllocateMemory;
+    d.vkFreeMemory = NullFreeMemory;
+    d.vkMapMemory = NullMapMemory;
+    d.vkUnmapMemory = NullUnmapMemory;
+    d.vkInvalidateMappedMemoryRanges = NullInvalidateMappedMemoryRanges;
+
+    d.vkCreateImage = NullCreateImage;
+    d.vkDestroyImage = NullDestroyImage;
+    d.vkGetImageMemoryRequirements = NullGetMemoryRequirements<VkImage>;
+    d.vkBindImageMemory = NullBindMemory<VkImage>;
+    d.vkCreateImageView = NullCreate;
+    d.vkDestroyImageView = NullDestroy;
+    d.vkCreateBuffer = NullCreateBuffer;
+    d.vkDestroyBuffer = NullDestroyBuffer;
+    d.vkGetBufferMemoryRequirements = NullGetMemoryRequirements<VkBuffer>;
+    d.vkBindBufferMemory = NullBindMemory<VkBuffer>;
+    d.vkCreateSampler = NullCreate;
+    d.vkDestroySampler = NullDestroy;
+
+    d.vkCreateShaderModule = NullCreate;
+    d.vkDestroyShaderModule = NullDestroy;
+    d.vkCreateDescriptorSetLayout = NullCreate;
+    d.vkDestroyDescriptorSetLayout = NullDestroy;
+    d.vkCreatePipelineLayout = NullCreate;
+    d.vkDestroyPipelineLayout = NullDestroy;
+    d.vkCreateRenderPass2 = NullCreate;
+    d.vkCreateRenderPass2KHR = NullCreate;
+    d.vkDestroyRenderPass = NullDestroy;
+    d.vkCreateFramebuffer = NullCreate;
+    d.vkDestroyFramebuffer = NullDestroy;
+    d.vkCreateGraphicsPipelines = NullCreateGraphicsPipelines;
+    d.vkCreateComputePipelines = NullCreateComputePipelines;
+    d.vkDestroyPipeline = NullDestroy;
+    d.vkCreatePipelineCache = NullCreate;
+    d.vkDestroyPipelineCache = NullDestroy;
+
+    d.vkCreateDescriptorPool = NullCreate;
+    d.vkDestroyDescriptorPool = NullDestroyDescriptorPool;
+    d.vkAllocateDescriptorSets = NullAllocateDescriptorSets;
+    d.vkUpdateDescriptorSets = NullUpdateDescriptorSets;
+
+    d.vkCreateCommandPool = NullCreate;
+    d.vkDestroyCommandPool = NullDestroy;
+    d.vkAllocateCommandBuffers = NullAllocateCommandBuffers;
+    d.vkFreeCommandBuffers = NullFreeCommandBuffers;
+    d.vkBeginCommandBuffer = NullBeginCommandBuffer;
+    d.vkEndCommandBuffer = NullSuccess<VkCommandBuffer>;
+
+    d.vkCreateFence = NullCreate;
+    d.vkDestroyFence = NullDestroy;
+    d.vkWaitForFences = NullWaitForFences;
+    d.vkResetFences = NullResetFences;
+    d.vkCreateSemaphore = NullCreate;
+    d.vkDestroySemaphore = NullDestroy;
+    d.vkQueueSubmit = NullQueueSubmit;
+
+    d.vkCmdPipelineBarrier = NullCommand;
+    d.vkCmdClearColorImage = NullCommand;
+    d.vkCmdUpdateBuffer = NullCommand;
+    d.vkCmdCopyBufferToImage = NullCommand;
+    d.vkCmdBlitImage = NullCommand;
+    d.vkCmdBeginRenderPass = NullCommand;
+    d.vkCmdEndRenderPass = NullCommand;
+    d.vkCmdBindPipeline = NullCommand;
+    d.vkCmdBindDescriptorSets = NullCommand;
+    d.vkCmdPushConstants = NullCommand;
+    d.vkCmdDraw = NullCommand;
+    d.vkCmdDispatch = NullCommand;
+    d.vkCmdFillBuffer = NullCommand;
+    d.vkCmdCopyImage = NullCommand;
+    d.vkCmdCopyImageToBuffer = NullCommand;
+    d.vkCmdSetViewport = NullCommand;
+    d.vkCmdSetScissor = NullCommand;
+
+    d.vkCreateSwapchainKHR = NullCreate;
+    d.vkDestroySwapchainKHR = NullDestroy;
+    d.vkGetSwapchainImagesKHR = NullGetSwapchainImages;
+    d.vkAcquireNextImageKHR = NullAcquireNextImage;
+    d.vkQueuePresentKHR = NullQueuePresent;
+}
+
+NullDriverStats GetNullDriverStats()
+{
+    NullDriverStats stats;
+    stats.liveObjects = uint64_t(std::max<int64_t>(g_LiveObjects, 0));
+    stats.descriptorSets = uint64_t(std::max<int64_t>(g_DescriptorSets, 0));
+
+    std::lock_guard<std::mutex> lock(g_NullDriverMutex);
+    stats.memoryAllocations = g_MemoryAllocations.size();
+    for (const auto& [handle, allocation] : g_MemoryAllocations)
+        stats.memoryBytes += allocation.size;
+
+    return stats;
+}
+
+vk::PhysicalDevice GetNullPhysicalDevice()
+{
+    static const VkPhysicalDevice s_PhysicalDevice = NewHandle<VkPhysicalDevice>();
+    return vk::PhysicalDevice(s_PhysicalDevice);
+}
@@ -52,6 +52,38 @@ bool CommandLineOptions::parse(int argc, char** argv)
                 "   -s, --shader <name>: start with a particular shader\n"
                 "   -t, --script <path>: path to the script file, default is script.json\n"
                 "   -i, --interval <value>: set the interval between shaders in seconds\n"
+                "   --stats <path>: append statistics records to a JSON-lines file\n"
+                "   --cpu-bench <frames>: measure the CPU overhead on a null Vulkan driver and exit\n"
+                "   --soak <hours>: run a headless soak test for the given simulated time and exit\n"
+                "   --compile-workers <count>: number of compiler processes, 0 to compile in-process\n"
+                "   --compile-timeout <seconds>: abort compiling a shader after this time\n"
+                "   --compile-memory-limit <MB>: address space that a compiler process may add, 0 for no limit\n"
+                "   --precision-report: compare the programs compiled with relaxed and full precision and exit\n"
+                "   --memory-report: print the memory used by each program and exit\n"
+                "   --select-pass-scales: select the scales of the \"auto\" passScales entries, save them next to the script and exit\n"
+                "   --no-pipeline-library: create monolithic pipelines even if graphics pipeline libraries are supported\n"
+                "   --no-dirty-tracking: render all passes on every frame, even if their inputs haven't changed\n"
+                "   --max-texture-size <pixels>: reduce the textures that are larger than this when loading them\n"
+                "   --full-res-textures: don't reduce the textures that are larger than the output\n"
+                "   --no-io-uring: read the program files with a thread pool instead of io_uring\n"
+                "   --log-level <error|warning|info>: only print the messages of this level and above\n"
+                "   --log-json: print the messages as JSON objects with the time, thread, source and level\n"
+                "   --governor: reduce the rendering load when the system is too hot or uses too much power\n"
+                "   --max-temp <celsius>: temperature limit for the governor, default is 80\n"
+                "   --max-power <watts>: power limit for the governor, default is no limit\n"
+                "   --frame-budget <ms>: quarantine the programs that take longer per frame, 0 to disable, default is 200\n"
+                "   --budget-frames <count>: number of frames to check against the budget, default is 30\n"
+                "   --quarantine <path>: path to the quarantine file, default is quarantine.json in the project\n"
+                "   --list-quarantine: print the quarantined programs and exit\n"
+                "   --clear-quarantine: remove all programs from the quarantine and exit\n"
+                "   --energy: report the energy used by each program every 10 minutes and when exiting\n"
+                "   --sysfs-root <path>: where to find the thermal and powercap sensors, default is /sys\n"
+                "   --software <path>: render on the CPU without Vulkan and write raw RGB8 frames to a file or FIFO\n"
+                "   --software-bench <frames>: measure the CPU renderer on every program and exit\n"
+                "   --software-threads <count>: number of CPU renderer threads, default is one per core\n"
+                "   --sync-leader <port>: lead the playback of other players that follow this one over UDP\n"
+                "   --sync-follower <host:port>: follow the time and the program switches of a leader player\n"
+                "   --sync-swap-barrier: start the frames on the ticks of the shared clock\n"
             ;
             return false;
         }
@@ -111,6 +143,189 @@ bool CommandLineOptions::parse(int argc, char** argv)
             interval = atoi(value);
             ++i;
         }
+        else if (strcmp(arg, "--stats") == 0)
+        {
+            if (!value) return novalue(arg);
+            statsFile = value;
+            ++i;
+        }
+        else if (strcmp(arg, "--cpu-bench") == 0)
+        {
+            if (!value) return novalue(arg);
+            cpuBenchmarkFrames = atoi(value);
+            ++i;
+        }
+        else if (strcmp(arg, "--soak") == 0)
+        {
+            if (!value) return novalue(arg);
+            soakHours = atof(value);
+            ++i;
+        }
+        else if (strcmp(arg, "--compile-workers") == 0)
+        {
+            if (!value) return novalue(arg);
+            compileWorkers = atoi(value);
+            ++i;
+        }
+        else if (strcmp(arg, "--software") == 0)
+        {
+            if (!value) return novalue(arg);
+            softwareOutput = value;
+            ++i;
+        }
+        else if (strcmp(arg, "--software-bench") == 0)
+        {
+            if (!value) return novalue(arg);
+            softwareBenchmarkFrames = atoi(value);
+            ++i;
+        }
+        else if (strcmp(arg, "--software-threads") == 0)
+        {
+            if (!value) return novalue(arg);
+            softwareThreads = atoi(value);
+            ++i;
+        }
+        else if (strcmp(arg, "--sync-leader") == 0)
+        {
+            if (!value) return novalue(arg);
+            syncLeader = true;
+            syncPort = atoi(value);
+            if (syncPort <= 0 || syncPort > 65535)
+            {
+                errorMessage = "invalid sync port " + std::string(value);
+                return false;
+            }
+            ++i;
+        }
+        else if (strcmp(arg, "--sync-follower") == 0)
+        {
+            if (!value) return novalue(arg);
+            const char* separator = strrchr(value, ':');
+            syncPort = separator ? atoi(separator + 1) : 0;
+            if (!separator || separator == value || syncPort <= 0 || syncPort > 65535)
+            {
+                errorMessage = "expected host:port for " + std::string(arg);
+                return false;
+            }
+            syncLeaderAddress.assign(value, separator);
+            ++i;
+        }
+        else if (strcmp(arg, "--sync-swap-barrier") == 0)
+        {
+            syncSwapBarrier = true;
+        }
+        else if (strcmp(arg, "--precision-report") == 0)
+        {
+            precisionReport = true;
+        }
+        else if (strcmp(arg, "--memory-report") == 0)
+        {
+            memoryReport = true;
+        }
+        else if (strcmp(arg, "--select-pass-scales") == 0)
+        {
+            selectPassScales = true;
+        }
+        else if (strcmp(arg, "--no-pipeline-library") == 0)
+        {
+            pipelineLibrary = false;
+        }
+        else if (strcmp(arg, "--no-dirty-tracking") == 0)
+        {
+            dirtyTracking = false;
+        }
+        else if (strcmp(arg, "--max-texture-size") == 0)
+        {
+            if (!value) return novalue(arg);
+            maxTextureSize = atoi(value);
+            ++i;
+        }
+        else if (strcmp(arg, "--full-res-textures") == 0)
+        {
+            fullResTextures = true;
+        }
+        else if (strcmp(arg, "--no-io-uring") == 0)
+        {
+            ioUring = false;
+        }
+        else if (strcmp(arg, "--log-level") == 0)
+        {
+            if (!value) return novalue(arg);
+            if (!ParseLogLevel(value, logLevel))
+            {
+                errorMessage = "unknown log level " + std::string(value);
+                return false;
+            }
+            ++i;
+        }
+        else if (strcmp(arg, "--log-json") == 0)
+        {
+            logJson = true;
+        }
+        else if (strcmp(arg, "--governor") == 0)
+        {
+            governor = true;
+        }
+        else if (strcmp(arg, "--frame-budget") == 0)
+        {
+            if (!value) return novalue(arg);
+            frameBudget = atof(value);
+            ++i;
+        }
+        else if (strcmp(arg, "--budget-frames") == 0)
+        {
+            if (!value) return novalue(arg);
+            budgetFrames = atoi(value);
+            ++i;
+        }
+        else if (strcmp(arg, "--quarantine") == 0)
+        {
+            if (!value) return novalue(arg);
+            quarantineFile = value;
+            ++i;
+        }
+        else if (strcmp(arg, "--list-quarantine") == 0)
+        {
+            listQuarantine = true;
+        }
+        else if (strcmp(arg, "--clear-quarantine") == 0)
+        {
+            clearQuarantine = true;
+        }
+        else if (strcmp(arg, "--energy") == 0)
+        {
+            energy = true;
+        }
+        else if (strcmp(arg, "--max-temp") == 0)
+        {
+            if (!value) return novalue(arg);
+            maxTemperature = atof(value);
+            ++i;
+        }
+        else if (strcmp(arg, "--max-power") == 0)
+        {
+            if (!value) return novalue(arg);
+            maxPower = atof(value);
+            ++i;
+        }
+        else if (strcmp(arg, "--sysfs-root") == 0)
+        {
+            if (!value) return novalue(arg);
+            sysfsRoot = value;
+            ++i;
+        }
+        else if (strcmp(arg, "--compile-timeout") == 0)
+        {
+            if (!value) return novalue(arg);
+            compileTimeout = atof(value);
+            ++i;
+        }
+        else if (strcmp(arg, "--compile-memory-limit") == 0)
+        {
+            if (!value) return novalue(arg);
+            compileMemoryLimit = atoi(value);
+            ++i;
+        }
         else
         {
             errorMessage = "unrecognized option " + std::string(arg);
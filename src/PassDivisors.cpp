@@ -0,0 +1,145 @@
+/*
+* Copyright (c) 2022, NVIDIA CORPORATION. All rights reserved.
+*
+* Permission is hereby granted, free of charge, to any person obtaining a
+* copy of this software and associated documentation files (the "Software"),
+* to deal in the Software without restriction, including without limitation
+* the rights to use, copy, modify, merge, publish, distribute, sublicense,
+* and/or sell copies of the Software, and to permit persons to whom the
+* Software is furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+* THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+* DEALINGS IN THE SOFTWARE.
+*/
+
+
+#include "ShaderProj.h"
+
+#include <cmath>
+
+// Automatic selection of the pass update divisors: the outputs of the candidate passes are read
+// back on two consecutive frames, shortly after the program starts, and the divisor is chosen
+// so that holding the output constant doesn't deviate from the real output by more than
+// c_MaxHeldChange, assuming that the pass output changes at a constant rate.
+
+static constexpr int c_PassChangeSampleFrame = 30;
+static constexpr double c_MaxHeldChange = 0.01;
+static constexpr int c_MaxAutoDivisor = 8;
+
+// Mean absolute difference between two RGBA16F images, relative to their mean magnitude
+static double GetRelativeChange(const blob& before, const blob& after)
+{
+    const size_t count = std::min(before.size(), after.size()) / sizeof(uint16_t);
+
+    double sumDifference = 0;
+    double sumMagnitude = 0;
+    for (size_t index = 0; index < count; index++)
+    {
+        uint16_t a, b;
+        memcpy(&a, before.data() + index * sizeof(uint16_t), sizeof(a));
+        memcpy(&b, after.data() + index * sizeof(uint16_t), sizeof(b));
+
+        const double valueA = HalfToFloat(a);
+        const double valueB = HalfToFloat(b);
+        if (!std::isfinite(valueA) || !std::isfinite(valueB))
+            continue;
+
+        sumDifference += fabs(valueA - valueB);
+        sumMagnitude += 0.5 * (fabs(valueA) + fabs(valueB));
+    }
+
+    return sumMagnitude > 0 ? sumDifference / sumMagnitude : 0.0;
+}
+
+void ShaderProj::MeasurePassChange()
+{
+    ShProgram& program = *m_Programs[m_ActiveProgram];
+
+    if (!program.IsAutoPassDivisors() || m_ResetRequired || !m_Images[0].image)
+        return;
+
+    if (m_FrameIndex != c_PassChangeSampleFrame && m_FrameIndex != c_PassChangeSampleFrame + 1)
+        return;
+
+    // Only the passes that don't feed the history are considered: decimating a simulation
+    // would slow it down rather than just delay its output.
+    std::vector<std::shared_ptr<ShRenderpass>> candidates;
+    for (const auto& pass : program.GetPasses())
+    {
+        if (pass != program.GetPasses()[program.GetImagePassIndex()] && !pass->FeedsHistory() && pass->GetUpdateDivisor() == 1)
+            candidates.push_back(pass);
+    }
+
+    if (candidates.empty())
+    {
+        program.SetAutoPassDivisors(false);
+        return;
+    }
+
+    // The command buffer for the next frame is not recording yet, so it can be used for the readback
+    const uint32_t lastHistoryIndex = (m_FrameIndex - 1) % c_HistoryLength;
+    std::vector<blob> samples(candidates.size());
+    for (size_t index = 0; index < candidates.size(); index++)
+    {
+        const auto& image = m_Images[candidates[index]->GetRenderTargetIndex(lastHistoryIndex)];
+        if (!ReadbackImage(GetPhysicalDevice(), GetDevice(), GetGraphicsQueue(), GetCurrentCmdBuf(), image,
+            sizeof(uint16_t) * 4, samples[index]))
+        {
+            program.SetAutoPassDivisors(false);
+            m_PassChangeSamples.clear();
+            return;
+        }
+    }
+
+    if (m_FrameIndex == c_PassChangeSampleFrame)
+    {
+        m_PassChangeSamples = std::move(samples);
+        return;
+    }
+
+    bool divisorsChanged = false;
+    for (size_t index = 0; index < candidates.size(); index++)
+    {
+        const double change = GetRelativeChange(m_PassChangeSamples[index], samples[index]);
+
+        int divisor = 1;
+        while (divisor * 2 <= c_MaxAutoDivisor && double(divisor * 2 - 1) * change <= c_MaxHeldChange)
+            divisor *= 2;
+
+        auto& pass = candidates[index];
+        LOG("%s: '%s' changes by %.3f%% per frame, rendering every %d frame(s)\n",
+            program.GetName().c_str(), pass->GetPassName().c_str(), change * 100.0, divisor);
+
+        Json::Value record;
+        record["type"] = "pass_divisor";
+        record["program"] = program.GetName();
+        record["pass"] = pass->GetPassName();
+        record["change_per_frame"] = change;
+        record["divisor"] = divisor;
+        WriteStats(record);
+
+        if (divisor != 1)
+        {
+            pass->SetUpdateDivisor(divisor);
+            divisorsChanged = true;
+        }
+    }
+
+    program.SetAutoPassDivisors(false);
+    m_PassChangeSamples.clear();
+
+    if (divisorsChanged)
+    {
+        // The pinned passes now use different history slots
+        GetDevice().waitIdle();
+        RebuildProgramBindings(program);
+    }
+}
@@ -0,0 +1,241 @@
+/*
+* Copyright (c) 2022, NVIDIA CORPORATION. All rights reserved.
+*
+* Permission is hereby granted, free of charge, to any person obtaining a
+* copy of this software and associated documentation files (the "Software"),
+* to deal in the Software without restriction, including without limitation
+* the rights to use, copy, modify, merge, publish, distribute, sublicense,
+* and/or sell copies of the Software, and to permit persons to whom the
+* Software is furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+* THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+* DEALINGS IN THE SOFTWARE.
+*/
+
+
+#include "ShaderProj.h"
+
+#include <fstream>
+
+// Selection of the pass resolution scales, done offline with --select-pass-scales: the program
+// is rendered for a number of frames with all buffer passes at full resolution, and then the
+// buffer passes are scaled down one at a time, keeping each scale only if the final image stays
+// the same within the tolerance. The buffers that are read with texelFetch or that store data in
+// specific pixels usually fail this test, so they stay at full resolution. The selected scales
+// are saved next to the script and used by the "auto" script entries during playback.
+
+static constexpr int c_PassScaleFrames = 30;
+static constexpr double c_PassScalePixelError = 2.0 / 255.0;
+static constexpr double c_PassScaleMaxDifferentPixels = 0.005;
+static constexpr float c_PassScaleCandidates[] = { 0.5f, 0.25f };
+
+fs::path GetPassScalesFile(const fs::path& scriptFileName)
+{
+    return scriptFileName.parent_path() / "pass_scales.json";
+}
+
+static Json::Value ReadPassScalesFile(const fs::path& fileName)
+{
+    std::ifstream file(fileName.generic_string());
+    if (!file.is_open())
+        return Json::Value(Json::objectValue);
+
+    Json::Value root;
+    try
+    {
+        file >> root;
+    }
+    catch (const std::exception& e)
+    {
+        LOG("WARNING: Cannot parse '%s', ignoring the saved pass scales: %s\n", fileName.generic_string().c_str(), e.what());
+        return Json::Value(Json::objectValue);
+    }
+
+    return root.isObject() ? root : Json::Value(Json::objectValue);
+}
+
+void LoadSelectedPassScales(const fs::path& fileName, std::vector<ScriptEntry>& script)
+{
+    Json::Value saved;
+    bool loaded = false;
+
+    for (auto& entry : script)
+    {
+        if (!entry.autoPassScales)
+            continue;
+
+        if (!loaded)
+        {
+            saved = ReadPassScalesFile(fileName);
+            loaded = true;
+        }
+
+        const auto& scales = saved[entry.programName];
+        if (!scales.isObject())
+        {
+            LOG("WARNING: %s: the pass scales have not been selected yet, run with --select-pass-scales\n", entry.programName.c_str());
+            continue;
+        }
+
+        // The scales that are set explicitly in the entry take precedence
+        for (const auto& passName : scales.getMemberNames())
+        {
+            if (scales[passName].isNumeric())
+                entry.passScales.emplace(passName, scales[passName].asFloat());
+        }
+    }
+}
+
+bool ShaderProj::SelectPassScales(ShProgram& program, GpuTimer& timer, Json::Value& scales)
+{
+    const auto& imagePass = program.GetPasses()[program.GetImagePassIndex()];
+
+    for (const auto& pass : program.GetPasses())
+    {
+        if (!pass->GetPipeline())
+        {
+            LOG("ERROR: %s: the program is not compiled, its pass scales cannot be selected\n", program.GetName().c_str());
+            return false;
+        }
+    }
+
+    std::vector<std::shared_ptr<ShRenderpass>> candidates;
+    for (const auto& pass : program.GetPasses())
+    {
+        if (pass != imagePass)
+        {
+            pass->SetScale(1.f);
+            candidates.push_back(pass);
+        }
+    }
+
+    scales = Json::Value(Json::objectValue);
+    if (candidates.empty())
+        return true;
+
+    double referenceGpuNs = 0;
+    blob reference;
+    if (!RenderProgramOffline(program, c_PassScaleFrames, &timer, referenceGpuNs, reference))
+    {
+        LOG("ERROR: %s: failed to render the reference image for the pass scales\n", program.GetName().c_str());
+        return false;
+    }
+
+    double gpuTimeNs = referenceGpuNs;
+    for (auto& pass : candidates)
+    {
+        ImageDifference keptDifference;
+        keptDifference.psnrDb = 100.0;
+        for (float scale : c_PassScaleCandidates)
+        {
+            const float previousScale = pass->GetScale();
+            pass->SetScale(scale);
+
+            double candidateGpuNs = 0;
+            blob image;
+            ImageDifference difference;
+            if (!RenderProgramOffline(program, c_PassScaleFrames, &timer, candidateGpuNs, image) ||
+                !CompareDisplayedImages(reference, image, c_PassScalePixelError, difference) ||
+                difference.differentFraction > c_PassScaleMaxDifferentPixels)
+            {
+                pass->SetScale(previousScale);
+                break;
+            }
+
+            keptDifference = difference;
+            gpuTimeNs = candidateGpuNs;
+        }
+
+        if (IsDeviceLost())
+            return false;
+
+        LOG("%s: rendering '%s' at %.0f%% resolution, %.3f%% pixels differ\n",
+            program.GetName().c_str(), pass->GetPassName().c_str(),
+            pass->GetScale() * 100.0, keptDifference.differentFraction * 100.0);
+
+        Json::Value record;
+        record["type"] = "pass_scale";
+        record["program"] = program.GetName();
+        record["pass"] = pass->GetPassName();
+        record["scale"] = pass->GetScale();
+        record["different_pixels"] = keptDifference.differentFraction;
+        record["psnr_db"] = keptDifference.psnrDb;
+        WriteStats(record);
+
+        scales[pass->GetPassName()] = pass->GetScale();
+    }
+
+    if (referenceGpuNs > 0)
+    {
+        LOG("%s: GPU time %.3f ms at full resolution, %.3f ms with the selected scales\n",
+            program.GetName().c_str(), referenceGpuNs * 1e-6, gpuTimeNs * 1e-6);
+    }
+
+    return true;
+}
+
+bool ShaderProj::RunPassScaleSelection(const PassScaleParams& params)
+{
+    const auto vkPhysicalDevice = GetPhysicalDevice();
+    const auto vkDevice = GetDevice();
+
+    WaitForPipelines();
+    vkDevice.waitIdle();
+
+    GpuTimer timer;
+    if (!timer.Init(vkPhysicalDevice, vkDevice, 2))
+        LOG("WARNING: GPU timing is not available, only the image differences will be used.\n");
+
+    // The programs that are not selected now keep their saved scales
+    Json::Value saved = ReadPassScalesFile(params.outputFile);
+    int selectedPrograms = 0;
+    bool success = true;
+
+    for (auto& program : m_Programs)
+    {
+        if (!program->IsAutoPassScales())
+            continue;
+
+        Json::Value scales;
+        if (!SelectPassScales(*program, timer, scales))
+        {
+            success = false;
+            if (IsDeviceLost())
+                break;
+            continue;
+        }
+
+        saved[program->GetName()] = scales;
+        ++selectedPrograms;
+    }
+
+    timer.Shutdown();
+
+    if (selectedPrograms == 0)
+    {
+        LOG("WARNING: No script entry has \"passScales\": \"auto\", nothing to select.\n");
+        return success;
+    }
+
+    // Indented, because it's meant to be read and edited by people
+    Json::StreamWriterBuilder builder;
+    builder["indentation"] = "  ";
+    const std::string text = Json::writeString(builder, saved) + "\n";
+
+    if (!WriteFile(params.outputFile, std::vector<char>(text.begin(), text.end())))
+    {
+        LOG("ERROR: Cannot write the pass scales file '%s'\n", params.outputFile.generic_string().c_str());
+        return false;
+    }
+
+    LOG("Saved the pass scales of %d program(s) to '%s'.\n", selectedPrograms, params.outputFile.generic_string().c_str());
+    return success;
+}
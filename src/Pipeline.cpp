@@ -23,6 +23,9 @@
 #include "ShaderProj.h"
 #include "Log.h"
 
+#include <cassert>
+#include <chrono>
+
 vk::ShaderModule CreateShaderModule(vk::Device device, const uint32_t* data, size_t size)
 {
     auto shaderInfo = vk::ShaderModuleCreateInfo()
@@ -46,14 +49,122 @@ vk::ShaderModule CreateShaderModule(vk::Device device, const blob& data)
     return CreateShaderModule(device, (const uint32_t*)data.data(), data.size());
 }
 
+// Fixed-function state shared by all quad pipelines, both monolithic and library-based.
+// The viewport and scissor are dynamic so that the pipelines don't depend on the window size
+// and don't have to be re-created on resize.
+struct QuadPipelineState
+{
+    vk::PipelineInputAssemblyStateCreateInfo inputAssembly;
+    vk::PipelineVertexInputStateCreateInfo vertexInput;
+    vk::PipelineViewportStateCreateInfo viewportState;
+    vk::DynamicState dynamicStates[2];
+    vk::PipelineDynamicStateCreateInfo dynamicState;
+    vk::PipelineRasterizationStateCreateInfo rasterizer;
+    vk::PipelineMultisampleStateCreateInfo multisample;
+    vk::PipelineDepthStencilStateCreateInfo depthStencil;
+    vk::PipelineColorBlendAttachmentState colorAttachment;
+    vk::PipelineColorBlendStateCreateInfo colorBlend;
+
+    QuadPipelineState()
+    {
+        inputAssembly.setTopology(vk::PrimitiveTopology::eTriangleStrip);
+
+        viewportState
+            .setViewportCount(1)
+            .setScissorCount(1);
+
+        dynamicStates[0] = vk::DynamicState::eViewport;
+        dynamicStates[1] = vk::DynamicState::eScissor;
+        dynamicState
+            .setDynamicStateCount(uint32_t(std::size(dynamicStates)))
+            .setPDynamicStates(dynamicStates);
+
+        rasterizer
+            .setCullMode(vk::CullModeFlagBits::eNone)
+            .setLineWidth(1.f);
+
+        colorAttachment.setColorWriteMask(vk::ColorComponentFlags(0xf));
+
+        colorBlend
+            .setAttachmentCount(1)
+            .setPAttachments(&colorAttachment);
+    }
+
+    // The state is referenced by pointers, so it can't be moved
+    QuadPipelineState(const QuadPipelineState&) = delete;
+    QuadPipelineState& operator=(const QuadPipelineState&) = delete;
+};
+
+static uint64_t ElapsedNanoseconds(std::chrono::steady_clock::time_point start)
+{
+    return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count());
+}
+
+// Creates one pipeline, optionally with VK_EXT_pipeline_creation_feedback attached,
+// and fills the stats. The pipeline info must have at most 2 stages.
+static vk::Pipeline CreatePipelineWithFeedback(
+    vk::Device device,
+    vk::PipelineCache pipelineCache,
+    vk::GraphicsPipelineCreateInfo pipelineInfo,
+    PipelineCreationStats* stats,
+    bool creationFeedback)
+{
+    vk::PipelineCreationFeedbackEXT pipelineFeedback;
+    vk::PipelineCreationFeedbackEXT stageFeedbacks[2];
+    auto feedbackInfo = vk::PipelineCreationFeedbackCreateInfoEXT()
+        .setPNext(pipelineInfo.pNext)
+        .setPPipelineCreationFeedback(&pipelineFeedback)
+        .setPipelineStageCreationFeedbackCount(pipelineInfo.stageCount)
+        .setPPipelineStageCreationFeedbacks(stageFeedbacks);
+
+    assert(pipelineInfo.stageCount <= std::size(stageFeedbacks));
+
+    if (stats && creationFeedback)
+        pipelineInfo.setPNext(&feedbackInfo);
+
+    const auto start = std::chrono::steady_clock::now();
+
+    vk::Pipeline pipeline;
+    const vk::Result res = device.createGraphicsPipelines(pipelineCache, 1, &pipelineInfo, nullptr, &pipeline);
+
+    if (res != vk::Result::eSuccess)
+    {
+        LOG("ERROR: Failed to create a graphics pipeline, result = %s\n", VulkanResultToString(res));
+        return vk::Pipeline();
+    }
+
+    if (stats)
+    {
+        stats->wallTimeNs = ElapsedNanoseconds(start);
+
+        if (creationFeedback && (pipelineFeedback.flags & vk::PipelineCreationFeedbackFlagBitsEXT::eValid))
+        {
+            stats->feedbackValid = true;
+            stats->feedbackNs = pipelineFeedback.duration;
+            stats->cacheHit = !!(pipelineFeedback.flags & vk::PipelineCreationFeedbackFlagBitsEXT::eApplicationPipelineCacheHit);
+
+            for (uint32_t stage = 0; stage < pipelineInfo.stageCount; stage++)
+            {
+                if (pipelineInfo.pStages[stage].stage == vk::ShaderStageFlagBits::eFragment &&
+                    (stageFeedbacks[stage].flags & vk::PipelineCreationFeedbackFlagBitsEXT::eValid))
+                    stats->fragmentStageNs = stageFeedbacks[stage].duration;
+            }
+        }
+    }
+
+    return pipeline;
+}
+
 vk::Pipeline CreateQuadPipeline(
     vk::Device device,
     vk::PipelineLayout pipelineLayout,
     vk::ShaderModule vertexShader,
     vk::ShaderModule fragmentShader,
     vk::RenderPass renderPass,
-    uint32_t width,
-    uint32_t height)
+    vk::PipelineCache pipelineCache,
+    PipelineCreationStats* stats,
+    bool creationFeedback)
 {
     vk::PipelineShaderStageCreateInfo shaderStages[] = {
         vk::PipelineShaderStageCreateInfo()
@@ -66,45 +177,207 @@ vk::Pipeline CreateQuadPipeline(
             .setModule(fragmentShader)
     };
 
-    auto inputAssembly = vk::PipelineInputAssemblyStateCreateInfo()
-        .setTopology(vk::PrimitiveTopology::eTriangleStrip);
+    const QuadPipelineState state;
 
-    auto vertexInput = vk::PipelineVertexInputStateCreateInfo();
+    auto pipelineInfo = vk::GraphicsPipelineCreateInfo()
+        .setLayout(pipelineLayout)
+        .setStageCount(uint32_t(std::size(shaderStages)))
+        .setPStages(shaderStages)
+        .setPInputAssemblyState(&state.inputAssembly)
+        .setPVertexInputState(&state.vertexInput)
+        .setPViewportState(&state.viewportState)
+        .setPRasterizationState(&state.rasterizer)
+        .setPMultisampleState(&state.multisample)
+        .setPDepthStencilState(&state.depthStencil)
+        .setPColorBlendState(&state.colorBlend)
+        .setPDynamicState(&state.dynamicState)
+        .setRenderPass(renderPass);
 
-    auto viewport = vk::Viewport().setWidth(float(width)).setHeight(-float(height)).setY(float(height));
-    auto scissor = vk::Rect2D().setExtent(vk::Extent2D().setWidth(width).setHeight(height));
-    auto viewportState = vk::PipelineViewportStateCreateInfo()
-        .setViewportCount(1)
-        .setPViewports(&viewport)
-        .setScissorCount(1)
-        .setPScissors(&scissor);
+    if (stats)
+        *stats = PipelineCreationStats();
 
-    auto rasterizer = vk::PipelineRasterizationStateCreateInfo()
-        .setCullMode(vk::CullModeFlagBits::eNone)
-        .setLineWidth(1.f);
+    return CreatePipelineWithFeedback(device, pipelineCache, pipelineInfo, stats, creationFeedback);
+}
 
-    auto multisample = vk::PipelineMultisampleStateCreateInfo();
+#ifdef VK_EXT_graphics_pipeline_library
 
-    auto depthStencil = vk::PipelineDepthStencilStateCreateInfo();
+static vk::Pipeline CreateLibraryPart(
+    vk::Device device,
+    vk::PipelineCache pipelineCache,
+    vk::GraphicsPipelineLibraryFlagsEXT parts,
+    vk::GraphicsPipelineCreateInfo pipelineInfo)
+{
+    auto libraryInfo = vk::GraphicsPipelineLibraryCreateInfoEXT()
+        .setFlags(parts);
 
-    auto colorAttachment = vk::PipelineColorBlendAttachmentState()
-        .setColorWriteMask(vk::ColorComponentFlags(0xf));
+    pipelineInfo
+        .setPNext(&libraryInfo)
+        .setFlags(vk::PipelineCreateFlagBits::eLibraryKHR);
 
-    auto colorBlend = vk::PipelineColorBlendStateCreateInfo()
-        .setAttachmentCount(1)
-        .setPAttachments(&colorAttachment);
+    vk::Pipeline pipeline;
+    const vk::Result res = device.createGraphicsPipelines(pipelineCache, 1, &pipelineInfo, nullptr, &pipeline);
 
-    return device.createGraphicsPipeline(nullptr, vk::GraphicsPipelineCreateInfo()
-        .setLayout(pipelineLayout)
-        .setStageCount(uint32_t(std::size(shaderStages)))
-        .setPStages(shaderStages)
-        .setPInputAssemblyState(&inputAssembly)
-        .setPVertexInputState(&vertexInput)
-        .setPViewportState(&viewportState)
-        .setPRasterizationState(&rasterizer)
-        .setPMultisampleState(&multisample)
-        .setPDepthStencilState(&depthStencil)
-        .setPColorBlendState(&colorBlend)
-        .setRenderPass(renderPass)
-    ).value;
+    if (res != vk::Result::eSuccess)
+    {
+        LOG("ERROR: Failed to create a graphics pipeline library, result = %s\n", VulkanResultToString(res));
+        return vk::Pipeline();
+    }
+
+    return pipeline;
+}
+
+#endif
+
+bool QuadPipelineLibrary::Init(
+    vk::Device device,
+    vk::PipelineLayout pipelineLayout,
+    vk::ShaderModule vertexShader,
+    vk::RenderPass renderPass,
+    vk::PipelineCache pipelineCache)
+{
+    Shutdown();
+
+#ifdef VK_EXT_graphics_pipeline_library
+    m_Device = device;
+    m_PipelineLayout = pipelineLayout;
+    m_RenderPass = renderPass;
+
+    const QuadPipelineState state;
+
+    m_VertexInput = CreateLibraryPart(device, pipelineCache,
+        vk::GraphicsPipelineLibraryFlagBitsEXT::eVertexInputInterface,
+        vk::GraphicsPipelineCreateInfo()
+            .setPInputAssemblyState(&state.inputAssembly)
+            .setPVertexInputState(&state.vertexInput));
+
+    auto vertexStage = vk::PipelineShaderStageCreateInfo()
+        .setStage(vk::ShaderStageFlagBits::eVertex)
+        .setPName("main")
+        .setModule(vertexShader);
+
+    m_PreRasterization = CreateLibraryPart(device, pipelineCache,
+        vk::GraphicsPipelineLibraryFlagBitsEXT::ePreRasterizationShaders,
+        vk::GraphicsPipelineCreateInfo()
+            .setLayout(pipelineLayout)
+            .setStageCount(1)
+            .setPStages(&vertexStage)
+            .setPViewportState(&state.viewportState)
+            .setPRasterizationState(&state.rasterizer)
+            .setPDynamicState(&state.dynamicState)
+            .setRenderPass(renderPass));
+
+    m_FragmentOutput = CreateLibraryPart(device, pipelineCache,
+        vk::GraphicsPipelineLibraryFlagBitsEXT::eFragmentOutputInterface,
+        vk::GraphicsPipelineCreateInfo()
+            .setLayout(pipelineLayout)
+            .setPMultisampleState(&state.multisample)
+            .setPColorBlendState(&state.colorBlend)
+            .setRenderPass(renderPass));
+
+    if (!m_VertexInput || !m_PreRasterization || !m_FragmentOutput)
+    {
+        Shutdown();
+        return false;
+    }
+
+    return true;
+#else
+    return false;
+#endif
+}
+
+void QuadPipelineLibrary::Shutdown()
+{
+    if (!m_Device)
+        return;
+
+    m_Device.destroyPipeline(m_VertexInput);
+    m_Device.destroyPipeline(m_PreRasterization);
+    m_Device.destroyPipeline(m_FragmentOutput);
+    m_VertexInput = nullptr;
+    m_PreRasterization = nullptr;
+    m_FragmentOutput = nullptr;
+    m_Device = nullptr;
+}
+
+vk::Pipeline QuadPipelineLibrary::CreatePipeline(
+    vk::ShaderModule fragmentShader,
+    vk::PipelineCache pipelineCache,
+    PipelineCreationStats* stats,
+    bool creationFeedback) const
+{
+    if (stats)
+        *stats = PipelineCreationStats();
+
+#ifdef VK_EXT_graphics_pipeline_library
+    if (!IsValid())
+        return vk::Pipeline();
+
+    const QuadPipelineState state;
+
+    auto fragmentStage = vk::PipelineShaderStageCreateInfo()
+        .setStage(vk::ShaderStageFlagBits::eFragment)
+        .setPName("main")
+        .setModule(fragmentShader);
+
+    auto fragmentLibraryInfo = vk::GraphicsPipelineLibraryCreateInfoEXT()
+        .setFlags(vk::GraphicsPipelineLibraryFlagBitsEXT::eFragmentShader);
+
+    // Only the fragment shader part is compiled per pass, the rest is shared.
+    vk::Pipeline fragmentLibrary = CreatePipelineWithFeedback(m_Device, pipelineCache,
+        vk::GraphicsPipelineCreateInfo()
+            .setPNext(&fragmentLibraryInfo)
+            .setFlags(vk::PipelineCreateFlagBits::eLibraryKHR)
+            .setLayout(m_PipelineLayout)
+            .setStageCount(1)
+            .setPStages(&fragmentStage)
+            .setPMultisampleState(&state.multisample)
+            .setPDepthStencilState(&state.depthStencil)
+            .setRenderPass(m_RenderPass),
+        stats, creationFeedback);
+
+    if (!fragmentLibrary)
+        return vk::Pipeline();
+
+    const vk::Pipeline libraries[] = {
+        m_VertexInput,
+        m_PreRasterization,
+        fragmentLibrary,
+        m_FragmentOutput
+    };
+
+    auto linkInfo = vk::PipelineLibraryCreateInfoKHR()
+        .setLibraryCount(uint32_t(std::size(libraries)))
+        .setPLibraries(libraries);
+
+    // Fast link: no eLinkTimeOptimizationEXT, so the driver just combines the precompiled parts.
+    auto pipelineInfo = vk::GraphicsPipelineCreateInfo()
+        .setPNext(&linkInfo)
+        .setLayout(m_PipelineLayout);
+
+    const auto linkStart = std::chrono::steady_clock::now();
+
+    vk::Pipeline pipeline;
+    const vk::Result res = m_Device.createGraphicsPipelines(pipelineCache, 1, &pipelineInfo, nullptr, &pipeline);
+
+    // The libraries are not needed after linking
+    m_Device.destroyPipeline(fragmentLibrary);
+
+    if (res != vk::Result::eSuccess)
+    {
+        LOG("ERROR: Failed to link a graphics pipeline, result = %s\n", VulkanResultToString(res));
+        return vk::Pipeline();
+    }
+
+    if (stats)
+    {
+        stats->fastLink = true;
+        stats->linkTimeNs = ElapsedNanoseconds(linkStart);
+        stats->wallTimeNs += stats->linkTimeNs;
+    }
+
+    return pipeline;
+#else
+    return vk::Pipeline();
+#endif
 }
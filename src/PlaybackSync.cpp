@@ -0,0 +1,613 @@
+/*
+* Copyright (c) 2022, NVIDIA CORPORATION. All rights reserved.
+*
+* Permission is hereby granted, free of charge, to any person obtaining a
+* copy of this software and associated documentation files (the "Software"),
+* to deal in the Software without restriction, including without limitation
+* the rights to use, copy, modify, merge, publish, distribute, sublicense,
+* and/or sell copies of the Software, and to permit persons to whom the
+* Software is furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+* THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+* DEALINGS IN THE SOFTWARE.
+*/
+
+
+
+#include "ShaderProj.h"
+
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <random>
+
+#ifndef _WIN32
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+// The followers measure their clock offset this often, and the leader reports the skew of every follower
+// at the report interval. A follower that hasn't been heard from for the timeout is forgotten, and
+// a follower that hasn't heard from the leader for the timeout plays on its own until it's back.
+constexpr double c_SyncPingInterval = 0.1;
+constexpr double c_SyncReportInterval = 10.0;
+constexpr double c_SyncFollowerTimeout = 3.0;
+constexpr double c_SyncLeaderTimeout = 3.0;
+// The offset is taken from the sample with the shortest round trip among the last ones,
+// which is the one least affected by queuing. The follower only plays on the leader's clock
+// once it has a few samples, because the first pongs can be a backlog from a stalled leader.
+constexpr size_t c_SyncOffsetSamples = 16;
+constexpr size_t c_SyncMinOffsetSamples = 4;
+
+constexpr uint32_t c_SyncMagic = 0x434e5953; // "SYNC"
+
+enum class SyncMessageType : uint32_t
+{
+    Ping = 1,       // follower to leader
+    Pong = 2,       // leader to follower, the reply to a ping
+    Announce = 3    // leader to followers, when a switch is announced
+};
+
+// All players are expected to run on the same architecture, so the message is sent as is
+struct SyncMessage
+{
+    uint32_t magic;
+    SyncMessageType type;
+    uint32_t sequence;          // of the ping, repeated in the pong
+    uint32_t epoch;             // leader: random for every run, see SyncSwitch
+    double pingTime;            // follower clock when the ping was sent, repeated in the pong
+    double leaderTime;          // leader clock when the pong was sent
+    double frameTime;           // follower: start of its last frame on the shared clock
+    double uncertainty;         // follower: half of the round trip time of its offset
+    SyncSwitch switches[2];     // leader: the last two announced switches
+};
+
+#ifdef _WIN32
+
+PlaybackSync::~PlaybackSync()
+{
+}
+
+bool PlaybackSync::Start(const SyncParams& params)
+{
+    LOG("ERROR: playback synchronization is not supported on Windows.\n");
+    return false;
+}
+
+void PlaybackSync::Stop()
+{
+}
+
+#else
+
+PlaybackSync::~PlaybackSync()
+{
+    Stop();
+}
+
+static string FormatAddress(const sockaddr_in& address)
+{
+    char host[INET_ADDRSTRLEN] = {};
+    inet_ntop(AF_INET, &address.sin_addr, host, sizeof(host));
+    return string(host) + ":" + to_string(ntohs(address.sin_port));
+}
+
+bool PlaybackSync::Start(const SyncParams& params)
+{
+    m_Params = params;
+
+    m_Socket = socket(AF_INET, SOCK_DGRAM, 0);
+    if (m_Socket < 0)
+    {
+        LOG("ERROR: couldn't create the sync socket: %s\n", strerror(errno));
+        return false;
+    }
+
+    if (params.leader)
+    {
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_ANY);
+        address.sin_port = htons(params.port);
+
+        if (bind(m_Socket, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0)
+        {
+            LOG("ERROR: couldn't bind the sync socket to port %d: %s\n", int(params.port), strerror(errno));
+            Stop();
+            return false;
+        }
+
+        random_device random;
+        do
+            m_Epoch = random();
+        while (m_Epoch == 0);
+
+        LOG("Leading the playback sync on port %d\n", int(params.port));
+        m_Thread = thread(&PlaybackSync::LeaderThreadProc, this);
+    }
+    else
+    {
+        addrinfo hints = {};
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_DGRAM;
+
+        addrinfo* addresses = nullptr;
+        const string port = to_string(params.port);
+        const int error = getaddrinfo(params.leaderAddress.c_str(), port.c_str(), &hints, &addresses);
+        if (error != 0 || !addresses)
+        {
+            LOG("ERROR: couldn't resolve the sync leader address '%s': %s\n", params.leaderAddress.c_str(), gai_strerror(error));
+            Stop();
+            return false;
+        }
+
+        // A connected socket only receives from the leader
+        const bool connected = connect(m_Socket, addresses->ai_addr, addresses->ai_addrlen) == 0;
+        freeaddrinfo(addresses);
+        if (!connected)
+        {
+            LOG("ERROR: couldn't connect the sync socket to '%s:%s': %s\n", params.leaderAddress.c_str(), port.c_str(), strerror(errno));
+            Stop();
+            return false;
+        }
+
+        LOG("Following the playback sync leader at %s:%d\n", params.leaderAddress.c_str(), int(params.port));
+        m_Thread = thread(&PlaybackSync::FollowerThreadProc, this);
+    }
+
+    return true;
+}
+
+void PlaybackSync::Stop()
+{
+    m_Terminate = true;
+    if (m_Thread.joinable())
+        m_Thread.join();
+
+    if (m_Socket >= 0)
+        close(m_Socket);
+    m_Socket = -1;
+}
+
+void PlaybackSync::LeaderThreadProc()
+{
+    struct Follower
+    {
+        sockaddr_in address = {};
+        double lastSeen = 0;
+        double maxSkew = 0;
+        double uncertainty = 0;
+        int samples = 0;
+    };
+
+    map<string, Follower> followers;
+    double nextReport = GetLocalTime() + c_SyncReportInterval;
+
+    while (!m_Terminate)
+    {
+        pollfd pollFd = { m_Socket, POLLIN, 0 };
+        poll(&pollFd, 1, 10);
+
+        SyncMessage reply = {};
+        reply.magic = c_SyncMagic;
+        reply.epoch = m_Epoch;
+        {
+            lock_guard<mutex> lock(m_Mutex);
+            reply.switches[0] = m_Switches[0];
+            reply.switches[1] = m_Switches[1];
+        }
+
+        if (m_SwitchChanged.exchange(false))
+        {
+            reply.type = SyncMessageType::Announce;
+            reply.leaderTime = GetLocalTime();
+            for (const auto& [name, follower] : followers)
+                sendto(m_Socket, &reply, sizeof(reply), 0, reinterpret_cast<const sockaddr*>(&follower.address), sizeof(follower.address));
+        }
+
+        for (;;)
+        {
+            SyncMessage message;
+            sockaddr_in address = {};
+            socklen_t addressSize = sizeof(address);
+            const ssize_t size = recvfrom(m_Socket, &message, sizeof(message), MSG_DONTWAIT,
+                reinterpret_cast<sockaddr*>(&address), &addressSize);
+            if (size < 0)
+                break;
+
+            if (size != ssize_t(sizeof(message)) || message.magic != c_SyncMagic || message.type != SyncMessageType::Ping)
+                continue;
+
+            reply.type = SyncMessageType::Pong;
+            reply.sequence = message.sequence;
+            reply.pingTime = message.pingTime;
+            reply.leaderTime = GetLocalTime();
+            sendto(m_Socket, &reply, sizeof(reply), 0, reinterpret_cast<const sockaddr*>(&address), sizeof(address));
+
+            const string name = FormatAddress(address);
+            auto found = followers.find(name);
+            if (found == followers.end())
+            {
+                LOG("Sync follower %s joined\n", name.c_str());
+                found = followers.emplace(name, Follower()).first;
+                found->second.address = address;
+            }
+
+            Follower& follower = found->second;
+            follower.lastSeen = reply.leaderTime;
+            follower.uncertainty = message.uncertainty;
+
+            // Both players render the content for the shared time at the start of their frames, so the
+            // difference between the frame starts is how far apart the displays are, up to the clock error
+            const double frameTime = m_FrameTime;
+            const double framePeriod = m_FramePeriod;
+            if (message.frameTime > 0 && frameTime > 0 && framePeriod > 0)
+            {
+                double difference = message.frameTime - frameTime;
+                difference -= framePeriod * std::round(difference / framePeriod);
+                follower.maxSkew = std::max(follower.maxSkew, std::fabs(difference) + message.uncertainty);
+                ++follower.samples;
+            }
+        }
+
+        const double now = GetLocalTime();
+        for (auto it = followers.begin(); it != followers.end();)
+        {
+            if (now - it->second.lastSeen > c_SyncFollowerTimeout)
+            {
+                LOG("Sync follower %s left\n", it->first.c_str());
+                it = followers.erase(it);
+            }
+            else
+                ++it;
+        }
+
+        if (now < nextReport)
+            continue;
+        nextReport = now + c_SyncReportInterval;
+
+        const double framePeriod = m_FramePeriod;
+        for (auto& [name, follower] : followers)
+        {
+            if (follower.samples == 0)
+                continue;
+
+            if (framePeriod > 0 && follower.maxSkew > framePeriod)
+            {
+                LOG("WARNING: sync follower %s is up to %.2f ms apart, more than a frame (%.2f ms).\n",
+                    name.c_str(), follower.maxSkew * 1e3, framePeriod * 1e3);
+            }
+            else
+            {
+                LOG("Sync follower %s: skew up to %.2f ms, clock uncertainty %.2f ms\n",
+                    name.c_str(), follower.maxSkew * 1e3, follower.uncertainty * 1e3);
+            }
+
+            Json::Value record;
+            record["type"] = "sync_skew";
+            record["follower"] = name;
+            record["max_skew_ms"] = follower.maxSkew * 1e3;
+            record["uncertainty_ms"] = follower.uncertainty * 1e3;
+            record["frame_period_ms"] = framePeriod * 1e3;
+            record["samples"] = follower.samples;
+            WriteStats(record);
+
+            follower.maxSkew = 0;
+            follower.samples = 0;
+        }
+    }
+}
+
+void PlaybackSync::FollowerThreadProc()
+{
+    struct OffsetSample
+    {
+        double offset;
+        double roundTrip;
+    };
+
+    deque<OffsetSample> samples;
+    uint32_t sequence = 0;
+    uint32_t leaderEpoch = 0;
+    bool leaderLost = false;
+    double lastHeard = 0;
+    double nextPing = GetLocalTime();
+
+    while (!m_Terminate)
+    {
+        double now = GetLocalTime();
+        if (now >= nextPing)
+        {
+            SyncMessage ping = {};
+            ping.magic = c_SyncMagic;
+            ping.type = SyncMessageType::Ping;
+            ping.sequence = ++sequence;
+            ping.frameTime = m_FrameTime;
+            ping.uncertainty = m_Uncertainty;
+            ping.pingTime = GetLocalTime();
+            send(m_Socket, &ping, sizeof(ping), 0);
+
+            nextPing = std::max(nextPing + c_SyncPingInterval, now);
+        }
+
+        pollfd pollFd = { m_Socket, POLLIN, 0 };
+        poll(&pollFd, 1, std::clamp(int((nextPing - now) * 1000.0), 1, 10));
+
+        for (;;)
+        {
+            SyncMessage message;
+            const ssize_t size = recv(m_Socket, &message, sizeof(message), MSG_DONTWAIT);
+            if (size < 0)
+                break;
+
+            const double receiveTime = GetLocalTime();
+            if (size != ssize_t(sizeof(message)) || message.magic != c_SyncMagic)
+                continue;
+
+            if (message.type != SyncMessageType::Pong && message.type != SyncMessageType::Announce)
+                continue;
+
+            // A restarted leader counts its switches from the start again, and it may run on another
+            // machine with another clock, so nothing that was received from the previous one is kept.
+            // The new leader is only taken from a pong, which brings its clock along with its switches.
+            // A leader that comes back after the timeout is taken the same way.
+            const bool restarted = message.epoch != leaderEpoch || leaderLost;
+            if (restarted)
+            {
+                if (message.type != SyncMessageType::Pong)
+                    continue;
+                if (message.epoch == leaderEpoch)
+                    LOG("The sync leader is back\n");
+                else if (leaderEpoch != 0)
+                    LOG("The sync leader has restarted\n");
+                leaderEpoch = message.epoch;
+                leaderLost = false;
+                samples.clear();
+                m_Synchronized = false;
+            }
+            lastHeard = receiveTime;
+
+            if (message.type == SyncMessageType::Pong)
+            {
+                const double roundTrip = receiveTime - message.pingTime;
+                if (roundTrip < 0)
+                    continue;
+
+                samples.push_back({ message.leaderTime - (message.pingTime + receiveTime) * 0.5, roundTrip });
+                if (samples.size() > c_SyncOffsetSamples)
+                    samples.pop_front();
+
+                const OffsetSample best = *min_element(samples.begin(), samples.end(),
+                    [](const OffsetSample& a, const OffsetSample& b) { return a.roundTrip < b.roundTrip; });
+                m_Offset = best.offset;
+                m_Uncertainty = best.roundTrip * 0.5;
+            }
+
+            lock_guard<mutex> lock(m_Mutex);
+            if (restarted || message.switches[1].sequence > m_Switches[1].sequence)
+            {
+                m_Switches[0] = message.switches[0];
+                m_Switches[1] = message.switches[1];
+            }
+        }
+
+        // The local time may be ahead of the leader's, and it must not hold the shared time back
+        if (!m_Synchronized && !leaderLost && samples.size() >= c_SyncMinOffsetSamples)
+        {
+            m_ClockReset = true;
+            m_Synchronized = true;
+            LOG("Synchronized with the sync leader, clock offset %.3f ms, uncertainty %.3f ms\n",
+                double(m_Offset) * 1e3, double(m_Uncertainty) * 1e3);
+        }
+
+        // The time continues from the last offset, and the player switches the programs by itself
+        if (m_Synchronized && GetLocalTime() - lastHeard > c_SyncLeaderTimeout)
+        {
+            LOG("WARNING: the sync leader hasn't answered for %.0f seconds, playing on our own until it's back.\n", c_SyncLeaderTimeout);
+            m_Synchronized = false;
+            leaderLost = true;
+        }
+    }
+}
+
+#endif
+
+double PlaybackSync::GetLocalTime() const
+{
+    return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+double PlaybackSync::GetTime()
+{
+    // A new offset estimate can be slightly behind the previous one, and the time must not go backwards
+    const double time = GetLocalTime() + (m_Params.leader ? 0.0 : double(m_Offset));
+    if (m_ClockReset.exchange(false))
+        m_LastTime = time;
+    m_LastTime = std::max(m_LastTime, time);
+    return m_LastTime;
+}
+
+void PlaybackSync::RecordFrame(double sharedTime)
+{
+    const double previous = m_FrameTime;
+    if (previous > 0)
+    {
+        const double interval = sharedTime - previous;
+        const double period = m_FramePeriod;
+        m_FramePeriod = period > 0 ? period + (interval - period) * 0.05 : interval;
+    }
+    m_FrameTime = sharedTime;
+}
+
+void PlaybackSync::WaitForTick(double period)
+{
+    if (period <= 0)
+        return;
+
+    const double now = GetTime();
+    const double tick = (std::floor(now / period) + 1.0) * period;
+    this_thread::sleep_for(chrono::duration<double>(tick - now));
+}
+
+void PlaybackSync::AnnounceSwitch(const SyncSwitch& value)
+{
+    lock_guard<mutex> lock(m_Mutex);
+    m_Switches[0] = m_Switches[1];
+    m_Switches[1] = value;
+    m_Switches[1].epoch = m_Epoch;
+    m_SwitchChanged = true;
+}
+
+bool PlaybackSync::GetSwitch(double time, SyncSwitch& result)
+{
+    lock_guard<mutex> lock(m_Mutex);
+    for (int index = 1; index >= 0; index--)
+    {
+        if (m_Switches[index].sequence != 0 && m_Switches[index].startTime <= time)
+        {
+            result = m_Switches[index];
+            return true;
+        }
+    }
+    return false;
+}
+
+bool ShaderProj::EnablePlaybackSync(const SyncParams& params)
+{
+    auto sync = std::make_unique<PlaybackSync>();
+    if (!sync->Start(params))
+        return false;
+
+    m_Sync = std::move(sync);
+    return true;
+}
+
+static void SetSwitchProgram(SyncSwitch& value, const string& name)
+{
+    strncpy(value.program, name.c_str(), sizeof(value.program) - 1);
+}
+
+// Returns the entry of the local script that plays the program of the switch, or -1 if there is none
+int ShaderProj::FindSyncScriptIndex(const SyncSwitch& value) const
+{
+    int result = -1;
+    for (int index = 0; index < int(m_Script.size()); index++)
+    {
+        const string& name = m_Programs[m_Script[index].programIndex]->GetName();
+        if (strncmp(name.c_str(), value.program, sizeof(value.program) - 1) != 0)
+            continue;
+
+        if (index == value.scriptIndex)
+            return index;
+        if (result < 0)
+            result = index;
+    }
+    return result;
+}
+
+void ShaderProj::UpdatePlaybackSync()
+{
+    const double now = m_Sync->GetTime();
+
+    if (m_Sync->IsLeader())
+    {
+        // A switch that wasn't scheduled, like a key press or a quarantined program, is sent right away.
+        // If the same program continues at a different index of a reloaded script, its time continues too.
+        if (m_ScriptIndex != m_SyncScriptIndex)
+        {
+            if (m_ResetRequired)
+                m_SyncProgramStart = now;
+
+            SyncSwitch value;
+            value.sequence = ++m_SyncAnnounced;
+            value.scriptIndex = m_ScriptIndex;
+            value.startTime = m_SyncProgramStart;
+            SetSwitchProgram(value, m_Programs[m_ActiveProgram]->GetName());
+            m_Sync->AnnounceSwitch(value);
+            m_SyncScriptIndex = m_ScriptIndex;
+            m_SyncNextSequence = 0;
+        }
+
+        // The end of the program is announced as soon as it starts, well before the followers need it
+        if (m_SyncNextSequence == 0 && m_CurrentDuration > 0)
+        {
+            SyncSwitch value;
+            value.sequence = ++m_SyncAnnounced;
+            value.scriptIndex = FindNextScriptIndex();
+            value.startTime = m_SyncProgramStart + m_CurrentDuration;
+            SetSwitchProgram(value, m_Programs[m_Script[value.scriptIndex].programIndex]->GetName());
+            m_Sync->AnnounceSwitch(value);
+            m_SyncNextSequence = value.sequence;
+        }
+    }
+
+    SyncSwitch current;
+    if (!m_Sync->IsSynchronized() || !m_Sync->GetSwitch(now, current))
+    {
+        // Until the leader is heard from, and while it's lost, the follower plays on its own
+        if (m_CurrentDuration > 0 && m_CurrentTime > m_CurrentDuration)
+        {
+            ApplyLoadedScript();
+            NextProgram();
+        }
+        return;
+    }
+
+    // The leader has already switched to the programs that it announced for the current time
+    const bool switched = current.epoch != m_SyncEpoch || current.sequence != m_SyncSequence;
+    if (switched && (!m_Sync->IsLeader() || current.sequence == m_SyncNextSequence))
+    {
+        // The switch is resolved in the script that is loaded now, which may not be the one that was
+        // loaded when the switch was announced
+        ApplyLoadedScript();
+
+        bool played = false;
+        const int scriptIndex = FindSyncScriptIndex(current);
+        if (scriptIndex < 0)
+        {
+            LOG("WARNING: the sync leader switched to program '%s', which is not in the script here.\n", current.program);
+            NextProgram();
+        }
+        else
+        {
+            m_ScriptIndex = scriptIndex;
+            m_ActiveProgram = m_Script[m_ScriptIndex].programIndex;
+            m_CurrentDuration = m_Script[m_ScriptIndex].duration;
+            m_ResetRequired = true;
+            played = true;
+
+            if (IsProgramSkipped(m_ActiveProgram))
+            {
+                LOG("WARNING: the sync leader switched to program '%s', which is skipped here.\n", current.program);
+                NextProgram();
+                played = false;
+            }
+        }
+
+        // When the leader plays another program than it announced, that one is announced on the next frame
+        if (m_Sync->IsLeader())
+        {
+            m_SyncScriptIndex = played ? m_ScriptIndex : -1;
+            m_SyncNextSequence = 0;
+        }
+    }
+
+    m_SyncEpoch = current.epoch;
+    m_SyncSequence = current.sequence;
+    m_SyncProgramStart = current.startTime;
+    m_CurrentTime = std::max(now - m_SyncProgramStart, 0.0);
+}
@@ -0,0 +1,126 @@
+/*
+* Copyright (c) 2022, NVIDIA CORPORATION. All rights reserved.
+*
+* Permission is hereby granted, free of charge, to any person obtaining a
+* copy of this software and associated documentation files (the "Software"),
+* to deal in the Software without restriction, including without limitation
+* the rights to use, copy, modify, merge, publish, distribute, sublicense,
+* and/or sell copies of the Software, and to permit persons to whom the
+* Software is furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+* THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+* DEALINGS IN THE SOFTWARE.
+*/
+
+
+
+#include "ShaderProj.h"
+
+#include <algorithm>
+#include <fstream>
+
+static bool ReadSysfsValue(const fs::path& fileName, uint64_t& value)
+{
+    std::ifstream file(fileName.generic_string());
+    if (!file.is_open())
+        return false;
+
+    file >> value;
+    return !file.fail();
+}
+
+bool PowerSensors::Init(const fs::path& sysfsRoot)
+{
+    m_ThermalZones.clear();
+    m_EnergyCounters.clear();
+    m_EnergyRanges.clear();
+    m_LastEnergy.clear();
+    m_TotalEnergy = 0;
+    m_EnergyStarted = false;
+
+    std::error_code ec;
+
+    for (const auto& entry : fs::directory_iterator(sysfsRoot / "class" / "thermal", ec))
+    {
+        const std::string name = entry.path().filename().generic_string();
+        if (name.rfind("thermal_zone", 0) == 0 && fs::exists(entry.path() / "temp", ec))
+            m_ThermalZones.push_back(entry.path() / "temp");
+    }
+
+    // Only the top-level domains like 'intel-rapl:0' are used, because their subzones
+    // like 'intel-rapl:0:0' are already included in the package energy.
+    for (const auto& entry : fs::directory_iterator(sysfsRoot / "class" / "powercap", ec))
+    {
+        const std::string name = entry.path().filename().generic_string();
+        if (std::count(name.begin(), name.end(), ':') == 1 && fs::exists(entry.path() / "energy_uj", ec))
+            m_EnergyCounters.push_back(entry.path() / "energy_uj");
+    }
+
+    std::sort(m_ThermalZones.begin(), m_ThermalZones.end());
+    std::sort(m_EnergyCounters.begin(), m_EnergyCounters.end());
+
+    for (const auto& counter : m_EnergyCounters)
+    {
+        uint64_t range = 0;
+        ReadSysfsValue(counter.parent_path() / "max_energy_range_uj", range);
+        m_EnergyRanges.push_back(range);
+    }
+    m_LastEnergy.resize(m_EnergyCounters.size());
+
+    return HasTemperature() || HasEnergy();
+}
+
+bool PowerSensors::ReadTemperature(double& celsius) const
+{
+    bool found = false;
+    for (const auto& zone : m_ThermalZones)
+    {
+        // The values are in millidegrees
+        uint64_t value = 0;
+        if (!ReadSysfsValue(zone, value))
+            continue;
+
+        const double temperature = double(value) * 1e-3;
+        celsius = found ? std::max(celsius, temperature) : temperature;
+        found = true;
+    }
+
+    return found;
+}
+
+bool PowerSensors::ReadEnergy(double& joules)
+{
+    if (m_EnergyCounters.empty())
+        return false;
+
+    for (size_t index = 0; index < m_EnergyCounters.size(); index++)
+    {
+        // The values are in microjoules and wrap around at max_energy_range_uj
+        uint64_t value = 0;
+        if (!ReadSysfsValue(m_EnergyCounters[index], value))
+            return false;
+
+        if (m_EnergyStarted)
+        {
+            uint64_t delta = value - m_LastEnergy[index];
+            if (value < m_LastEnergy[index])
+                delta = m_EnergyRanges[index] > m_LastEnergy[index] ? m_EnergyRanges[index] - m_LastEnergy[index] + value : 0;
+
+            m_TotalEnergy += double(delta) * 1e-6;
+        }
+
+        m_LastEnergy[index] = value;
+    }
+
+    m_EnergyStarted = true;
+    joules = m_TotalEnergy;
+    return true;
+}
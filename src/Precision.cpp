@@ -0,0 +1,137 @@
+/*
+* Copyright (c) 2022, NVIDIA CORPORATION. All rights reserved.
+*
+* Permission is hereby granted, free of charge, to any person obtaining a
+* copy of this software and associated documentation files (the "Software"),
+* to deal in the Software without restriction, including without limitation
+* the rights to use, copy, modify, merge, publish, distribute, sublicense,
+* and/or sell copies of the Software, and to permit persons to whom the
+* Software is furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+* THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+* DEALINGS IN THE SOFTWARE.
+*/
+
+
+#include "ShaderProj.h"
+
+#include <algorithm>
+
+using namespace std;
+
+struct PrecisionVariantResult
+{
+    double gpuTimeNs = 0;
+    blob image;
+};
+
+void ShaderProj::RunPrecisionReport(const PrecisionReportParams& params)
+{
+    const auto vkPhysicalDevice = GetPhysicalDevice();
+    const auto vkDevice = GetDevice();
+    const int frames = std::max(params.frames, 1);
+
+    uint32_t width, height;
+    GetWindowDimensions(width, height);
+
+    WaitForPipelines();
+    vkDevice.waitIdle();
+
+    GpuTimer timer;
+    if (!timer.Init(vkPhysicalDevice, vkDevice, 2))
+        LOG("WARNING: GPU timing is not available, only the image differences will be reported.\n");
+
+    int safePrograms = 0;
+    int testedPrograms = 0;
+
+    for (auto& program : m_Programs)
+    {
+        if (!program->HasRelaxedPrecisionPasses())
+        {
+            LOG("%s: all passes feed the history or are read by one, relaxed precision doesn't apply\n", program->GetName().c_str());
+            continue;
+        }
+
+        // Compiles the program with the current precision setting and renders it
+        auto renderVariant = [&](PrecisionVariantResult& result)
+        {
+            if (!CompilePrograms({ program }))
+                return false;
+
+            for (auto& pass : program->GetPasses())
+            {
+                pass->DestroyPipeline(vkDevice);
+
+                if (!pass->CreateFragmentShader(vkDevice))
+                    return false;
+
+                pass->CreatePipeline(GetPassPipelineParams());
+
+                if (!pass->InstallPendingPipeline())
+                    return false;
+            }
+
+            return RenderProgramOffline(*program, frames, &timer, result.gpuTimeNs, result.image);
+        };
+
+        const bool relaxedConfigured = program->IsRelaxedPrecision();
+
+        PrecisionVariantResult full, relaxed;
+        program->SetRelaxedPrecision(false);
+        bool success = renderVariant(full);
+        program->SetRelaxedPrecision(true);
+        success = success && renderVariant(relaxed);
+        program->SetRelaxedPrecision(relaxedConfigured);
+
+        // Compare the displayed colors, i.e. RGB clamped to [0, 1]
+        ImageDifference difference;
+        if (!success || !CompareDisplayedImages(full.image, relaxed.image, params.pixelErrorThreshold, difference))
+        {
+            LOG("ERROR: %s: failed to render the precision variants\n", program->GetName().c_str());
+            if (IsDeviceLost())
+                break;
+            continue;
+        }
+
+        const bool safe = difference.differentFraction <= params.maxDifferentPixels;
+        const double speedup = relaxed.gpuTimeNs > 0 ? full.gpuTimeNs / relaxed.gpuTimeNs : 0.0;
+
+        ++testedPrograms;
+        if (safe)
+            ++safePrograms;
+
+        LOG("%s: fp32 %.3f ms, relaxed %.3f ms (%.2fx), max error %.4f, PSNR %.1f dB, %.3f%% pixels differ -> %s\n",
+            program->GetName().c_str(),
+            full.gpuTimeNs * 1e-6, relaxed.gpuTimeNs * 1e-6, speedup,
+            difference.maxError, difference.psnrDb, difference.differentFraction * 100.0,
+            safe ? "safe" : "not safe");
+
+        Json::Value record;
+        record["type"] = "precision_report";
+        record["program"] = program->GetName();
+        record["width"] = width;
+        record["height"] = height;
+        record["frames"] = frames;
+        record["full_gpu_ns"] = full.gpuTimeNs;
+        record["relaxed_gpu_ns"] = relaxed.gpuTimeNs;
+        record["speedup"] = speedup;
+        record["max_error"] = difference.maxError;
+        record["mean_error"] = difference.meanError;
+        record["psnr_db"] = difference.psnrDb;
+        record["different_pixels"] = difference.differentFraction;
+        record["safe"] = safe;
+        WriteStats(record);
+    }
+
+    LOG("Relaxed precision is safe for %d out of %d tested programs.\n", safePrograms, testedPrograms);
+
+    timer.Shutdown();
+}
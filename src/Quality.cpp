@@ -0,0 +1,164 @@
+/*
+* Copyright (c) 2022, NVIDIA CORPORATION. All rights reserved.
+*
+* Permission is hereby granted, free of charge, to any person obtaining a
+* copy of this software and associated documentation files (the "Software"),
+* to deal in the Software without restriction, including without limitation
+* the rights to use, copy, modify, merge, publish, distribute, sublicense,
+* and/or sell copies of the Software, and to permit persons to whom the
+* Software is furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+* THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+* DEALINGS IN THE SOFTWARE.
+*/
+
+
+
+#include "ShaderProj.h"
+
+// Programs can declare quality levels: sets of macro values, like a lower AA or STEPS setting,
+// that make the program faster at the cost of the image quality. The variants are compiled in the
+// background after the full quality shaders, and the quality level of every program follows its
+// measured GPU time, so that the image quality drops instead of the frame rate.
+
+// Fraction of the frame interval that the programs can use, the rest is left for the blit and the
+// variations of the GPU time within the measurement window
+static constexpr double c_QualityTargetFraction = 0.8;
+// Number of frames that are averaged after the quality level changes before the next decision
+static constexpr int c_QualitySettleFrames = 60;
+// A higher level is used again when its estimated time is this far below the target
+static constexpr double c_QualityUpgradeMargin = 0.85;
+// Assumed ratio of the GPU time of two adjacent levels before it's measured
+static constexpr double c_DefaultStepCost = 2.0;
+
+bool ShaderProj::HasQualityLevels() const
+{
+    for (const auto& program : m_Programs)
+    {
+        if (program->GetQualityLevelCount() > 1)
+            return true;
+    }
+
+    return false;
+}
+
+void ShaderProj::InstallQualityVariants()
+{
+    if (m_QualityVariantsInstalled || !m_QualityCompileDone)
+        return;
+
+    WaitForQualityCompilation();
+    m_QualityVariantsInstalled = true;
+
+    const auto vkDevice = GetDevice();
+    const PassPipelineParams params = GetPassPipelineParams();
+
+    // Start with the active program, like CreatePassPipelines
+    const int programCount = int(m_Programs.size());
+    for (int offset = 0; offset < programCount; offset++)
+    {
+        auto& program = m_Programs[(m_ActiveProgram + offset) % programCount];
+        for (int level = 1; level < program->GetQualityLevelCount(); level++)
+        {
+            bool levelCompiled = true;
+            for (auto& pass : program->GetPasses())
+            {
+                levelCompiled = levelCompiled && pass->HasShaderData(level);
+            }
+
+            if (!levelCompiled)
+            {
+                LOG("WARNING: program '%s' failed to compile quality level %d, it won't be used.\n", program->GetName().c_str(), level);
+                continue;
+            }
+
+            for (auto& pass : program->GetPasses())
+            {
+                if (pass->CreateFragmentShader(vkDevice, level))
+                    m_PipelineThreads->AddTask([pass, params, level]() { pass->CreatePipeline(params, level); });
+            }
+        }
+    }
+}
+
+void ShaderProj::UpdateQualityLevel(int programIndex, int qualityLevel, double gpuTimeNs)
+{
+    ShProgram& program = *m_Programs[programIndex];
+    if (program.GetQualityLevelCount() <= 1 || qualityLevel != program.GetQualityLevel())
+        return;
+
+    QualityState& state = m_QualityStates[programIndex];
+    state.gpuTimeNs = state.samples == 0 ? gpuTimeNs : state.gpuTimeNs + (gpuTimeNs - state.gpuTimeNs) * 0.05;
+    if (++state.samples < c_QualitySettleFrames)
+        return;
+
+    // Measure the cost of the last step between adjacent levels
+    if (state.previousTimeNs > 0 && state.gpuTimeNs > 0)
+    {
+        if (state.previousLevel == qualityLevel - 1)
+            state.stepCost[state.previousLevel] = state.previousTimeNs / state.gpuTimeNs;
+        else if (state.previousLevel == qualityLevel + 1)
+            state.stepCost[qualityLevel] = state.gpuTimeNs / state.previousTimeNs;
+    }
+    state.previousLevel = -1;
+
+    int refreshRate = int(GetVulkanParams().refreshRate);
+    if (m_Throttle.fpsCap > 0)
+        refreshRate = std::min(refreshRate, m_Throttle.fpsCap);
+    const double targetNs = 1e9 / double(std::max(refreshRate, 1)) * c_QualityTargetFraction;
+
+    int newLevel = qualityLevel;
+    if (state.gpuTimeNs > targetNs)
+    {
+        for (int level = qualityLevel + 1; level < program.GetQualityLevelCount(); level++)
+        {
+            if (program.IsQualityLevelReady(level))
+            {
+                newLevel = level;
+                break;
+            }
+        }
+    }
+    else
+    {
+        double estimateNs = state.gpuTimeNs;
+        for (int level = qualityLevel - 1; level >= 0; level--)
+        {
+            estimateNs *= state.stepCost[level] > 0 ? state.stepCost[level] : c_DefaultStepCost;
+            if (program.IsQualityLevelReady(level))
+            {
+                if (estimateNs < targetNs * c_QualityUpgradeMargin)
+                    newLevel = level;
+                break;
+            }
+        }
+    }
+
+    if (newLevel == qualityLevel)
+        return;
+
+    LOG("Program '%s' switched to quality level %d, GPU time %.2f ms, target %.2f ms\n",
+        program.GetName().c_str(), newLevel, state.gpuTimeNs * 1e-6, targetNs * 1e-6);
+
+    Json::Value record;
+    record["type"] = "quality_level";
+    record["program"] = program.GetName();
+    record["level"] = newLevel;
+    record["previous_level"] = qualityLevel;
+    record["gpu_time_ms"] = state.gpuTimeNs * 1e-6;
+    record["target_ms"] = targetNs * 1e-6;
+    WriteStats(record);
+
+    program.SetQualityLevel(newLevel);
+    state.previousLevel = qualityLevel;
+    state.previousTimeNs = state.gpuTimeNs;
+    state.samples = 0;
+}
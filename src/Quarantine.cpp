@@ -0,0 +1,80 @@
+/*
+* Copyright (c) 2022, NVIDIA CORPORATION. All rights reserved.
+*
+* Permission is hereby granted, free of charge, to any person obtaining a
+* copy of this software and associated documentation files (the "Software"),
+* to deal in the Software without restriction, including without limitation
+* the rights to use, copy, modify, merge, publish, distribute, sublicense,
+* and/or sell copies of the Software, and to permit persons to whom the
+* Software is furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+* THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+* DEALINGS IN THE SOFTWARE.
+*/
+
+
+
+#include "ShaderProj.h"
+
+#include <fstream>
+#include <json/reader.h>
+#include <json/writer.h>
+
+void Quarantine::Load(const fs::path& fileName)
+{
+    m_FileName = fileName;
+    Clear();
+
+    std::ifstream file(fileName.generic_string());
+    if (!file.is_open())
+        return;
+
+    Json::Value root;
+    try
+    {
+        file >> root;
+    }
+    catch (const std::exception& e)
+    {
+        LOG("WARNING: Cannot parse '%s', starting with an empty quarantine: %s\n", fileName.generic_string().c_str(), e.what());
+        return;
+    }
+
+    if (!root.isObject())
+    {
+        LOG("WARNING: '%s' is not a valid quarantine file, starting with an empty quarantine.\n", fileName.generic_string().c_str());
+        return;
+    }
+
+    m_Entries = root;
+}
+
+bool Quarantine::Save() const
+{
+    // Indented, because it's meant to be read and edited by people
+    Json::StreamWriterBuilder builder;
+    builder["indentation"] = "  ";
+    const std::string text = Json::writeString(builder, m_Entries) + "\n";
+
+    // Replaces the file at once, so that a crash while writing doesn't leave a truncated quarantine
+    if (!WriteFile(m_FileName, std::vector<char>(text.begin(), text.end())))
+    {
+        LOG("ERROR: Cannot write the quarantine file '%s'\n", m_FileName.generic_string().c_str());
+        return false;
+    }
+
+    return true;
+}
+
+void Quarantine::Add(const std::string& programName, const Json::Value& details)
+{
+    m_Entries[programName] = details;
+}
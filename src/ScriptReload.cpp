@@ -0,0 +1,357 @@
+/*
+* Copyright (c) 2022, NVIDIA CORPORATION. All rights reserved.
+*
+* Permission is hereby granted, free of charge, to any person obtaining a
+* copy of this software and associated documentation files (the "Software"),
+* to deal in the Software without restriction, including without limitation
+* the rights to use, copy, modify, merge, publish, distribute, sublicense,
+* and/or sell copies of the Software, and to permit persons to whom the
+* Software is furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+* THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+* DEALINGS IN THE SOFTWARE.
+*/
+
+#include "ShaderProj.h"
+
+#include <unordered_set>
+
+using namespace std;
+
+// Live script reload: the script file is checked for changes every c_ScriptPollInterval seconds.
+// The programs that the new version refers to and that are not loaded yet are loaded, compiled and
+// have their textures decoded on a background thread, and everything else happens at the next
+// program transition: the new programs get their GPU objects and upload their textures, the new
+// script replaces the old one, and the programs that it doesn't use anymore are released. The
+// settings of the programs that stay loaded, like their precision or pass divisors, are kept;
+// only the order and the durations come from the new script.
+
+static constexpr double c_ScriptPollInterval = 1.0;
+
+void ShaderProj::EnableScriptReload(const fs::path& scriptPath, const fs::path& projectPath)
+{
+    m_ScriptPath = scriptPath;
+    m_ProjectPath = projectPath;
+
+    std::error_code error;
+    m_ScriptTime = fs::last_write_time(m_ScriptPath, error);
+}
+
+void ShaderProj::ResolveScript(const vector<ScriptEntry>& script, vector<ScriptEntry>& result) const
+{
+    result.clear();
+
+    for (ScriptEntry entry : script)
+    {
+        entry.duration *= m_BaseInterval;
+        entry.programIndex = -1;
+
+        for (int index = 0; index < int(m_Programs.size()); index++)
+        {
+            if (m_Programs[index]->GetName() == entry.programName && !m_Programs[index]->IsReleased())
+            {
+                entry.programIndex = index;
+                break;
+            }
+        }
+
+        if (entry.programIndex < 0)
+        {
+            LOG("WARNING: program '%s' used in the script was not loaded.\n", entry.programName.c_str());
+            continue;
+        }
+
+        result.push_back(entry);
+    }
+}
+
+void ShaderProj::WaitForScriptLoad()
+{
+    if (m_ScriptLoadThread.joinable())
+        m_ScriptLoadThread.join();
+}
+
+void ShaderProj::UpdateScriptReload(double elapsedSeconds)
+{
+    if (m_ScriptPath.empty() || m_ScriptLoadPending)
+        return;
+
+    m_ScriptPollTime += elapsedSeconds;
+    if (m_ScriptPollTime < c_ScriptPollInterval)
+        return;
+    m_ScriptPollTime = 0;
+
+    // The compiler can't run the quality jobs and the script jobs at the same time,
+    // so the check waits until the quality variants are installed
+    if (!m_QualityVariantsInstalled)
+        return;
+
+    std::error_code error;
+    const auto scriptTime = fs::last_write_time(m_ScriptPath, error);
+    if (error || scriptTime == m_ScriptTime)
+        return;
+
+    m_ScriptTime = scriptTime;
+
+    vector<ScriptEntry> script;
+    if (!LoadScript(m_ScriptPath, script))
+    {
+        LOG("WARNING: the script has changed but can't be loaded, playing the previous version.\n");
+        return;
+    }
+
+    unordered_set<string> loadedNames;
+    for (const auto& program : m_Programs)
+    {
+        if (!program->IsReleased())
+            loadedNames.insert(program->GetName());
+    }
+
+    // Only the programs that are not loaded yet are loaded; the quarantine is checked here
+    // because the main thread updates it
+    vector<string> newNames;
+    for (const auto& entry : script)
+    {
+        if (loadedNames.count(entry.programName) || std::find(newNames.begin(), newNames.end(), entry.programName) != newNames.end())
+            continue;
+
+        if (m_Quarantine.Contains(entry.programName))
+        {
+            LOG("Skipping program '%s' because it's in quarantine.\n", entry.programName.c_str());
+            continue;
+        }
+
+        newNames.push_back(entry.programName);
+    }
+
+    LOG("The script has changed, loading %d new program(s) in the background.\n", int(newNames.size()));
+
+    m_LoadedScript = script;
+    m_LoadedPrograms.clear();
+    m_ScriptLoadPending = true;
+
+    if (newNames.empty())
+    {
+        m_ScriptLoadDone = true;
+        return;
+    }
+
+    // The textures that are already loaded are shared with the new programs, so they are not decoded again
+    unordered_set<string> cachedImages;
+    GetCachedImageNames(cachedImages);
+
+    m_ScriptLoadThread = std::thread([this, newNames, cachedImages]()
+    {
+        vector<PrefetchFile> descriptionFiles;
+        for (const auto& name : newNames)
+            descriptionFiles.push_back({ m_ProjectPath / name / "description.json", true });
+        PrefetchFiles(descriptionFiles);
+
+        vector<shared_ptr<ShProgram>> programs;
+        for (const auto& name : newNames)
+        {
+            auto program = make_shared<ShProgram>(name);
+            if (!program->Load(m_ProjectPath / name / "description.json", m_ProjectPath))
+                continue;
+
+            ApplyScriptSettings(*program, m_LoadedScript);
+
+            vector<PrefetchFile> programFiles;
+            program->GetPrefetchFiles(programFiles);
+            PrefetchFiles(programFiles);
+
+            programs.push_back(program);
+        }
+
+        GetShaderPreamble(m_ScriptPreamble);
+
+        vector<CompileJob> jobs;
+        for (auto& program : programs)
+            program->GetCompileJobs(m_ScriptPreamble, jobs);
+        RunCompileJobs(jobs, m_CompileWorkerParams);
+
+        vector<CompileJob> qualityJobs;
+        for (auto& program : programs)
+            program->GetQualityCompileJobs(m_ScriptPreamble, qualityJobs);
+        if (!qualityJobs.empty())
+            RunCompileJobs(qualityJobs, m_CompileWorkerParams);
+
+        for (auto& program : programs)
+        {
+            bool compiled = true;
+            for (const auto& pass : program->GetPasses())
+                compiled = compiled && pass->HasShaderData(0);
+
+            if (compiled)
+                m_LoadedPrograms.push_back(program);
+            else
+                LOG("WARNING: program '%s' failed to compile, it won't be played.\n", program->GetName().c_str());
+        }
+
+        // The transition only uploads the textures
+        for (auto& program : m_LoadedPrograms)
+        {
+            for (const auto& pass : program->GetPasses())
+                pass->PrepareTextures(cachedImages);
+        }
+
+        m_ScriptLoadDone = true;
+    });
+}
+
+void ShaderProj::InstallLoadedProgram(const shared_ptr<ShProgram>& program)
+{
+    const auto vkPhysicalDevice = GetPhysicalDevice();
+    const auto vkDevice = GetDevice();
+    const PassPipelineParams params = GetPassPipelineParams();
+
+    vk::DescriptorPoolSize poolSizes[] = {
+        vk::DescriptorPoolSize().setType(vk::DescriptorType::eCombinedImageSampler).setDescriptorCount(c_RenderImageCount * c_MaxPasses),
+        vk::DescriptorPoolSize().setType(vk::DescriptorType::eUniformBuffer).setDescriptorCount(c_RenderImageCount)
+    };
+
+    auto descriptorPool = vkDevice.createDescriptorPool(vk::DescriptorPoolCreateInfo()
+        .setMaxSets(c_RenderImageCount)
+        .setPoolSizeCount(uint32_t(std::size(poolSizes)))
+        .setPPoolSizes(poolSizes));
+
+    for (auto& pass : program->GetPasses())
+    {
+        pass->CreateFragmentShader(vkDevice);
+        pass->LoadTextures(vkPhysicalDevice, vkDevice, GetGraphicsQueue(), GetCurrentCmdBuf());
+        pass->AllocateDescriptorSets(vkDevice, descriptorPool, m_PassDescriptorSetLayout);
+        m_PipelineThreads->AddTask([pass, params]() { pass->CreatePipeline(params); });
+    }
+
+    // The levels that failed to compile are never ready, so they are not selected
+    for (int level = 1; level < program->GetQualityLevelCount(); level++)
+    {
+        bool levelCompiled = true;
+        for (auto& pass : program->GetPasses())
+        {
+            levelCompiled = levelCompiled && pass->HasShaderData(level);
+        }
+
+        if (!levelCompiled)
+            continue;
+
+        for (auto& pass : program->GetPasses())
+        {
+            if (pass->CreateFragmentShader(vkDevice, level))
+                m_PipelineThreads->AddTask([pass, params, level]() { pass->CreatePipeline(params, level); });
+        }
+    }
+
+    // The slot of a released program is reused, so that the list doesn't grow with every reload
+    int programIndex = 0;
+    while (programIndex < int(m_Programs.size()) && !m_Programs[programIndex]->IsReleased())
+        programIndex++;
+
+    if (programIndex == int(m_Programs.size()))
+    {
+        m_Programs.push_back(program);
+        m_ProgramCosts.resize(m_Programs.size());
+        m_ProgramEnergy.resize(m_Programs.size());
+        m_QualityStates.resize(m_Programs.size());
+        m_ProgramDescriptorPools.resize(m_Programs.size());
+    }
+    else
+    {
+        m_Programs[programIndex] = program;
+        m_ProgramCosts[programIndex] = ProgramCost();
+        m_ProgramEnergy[programIndex] = ProgramEnergy();
+        m_QualityStates[programIndex] = QualityState();
+        if (m_EnergyProgram == programIndex)
+            m_EnergyProgram = -1;
+    }
+    m_ProgramDescriptorPools[programIndex] = descriptorPool;
+
+    RebuildProgramBindings(*program);
+
+    LOG("Loaded program '%s' from the new script.\n", program->GetName().c_str());
+}
+
+void ShaderProj::ReleaseProgram(int programIndex)
+{
+    // The frames in flight don't use the program anymore when their GPU time is read back
+    for (auto& slotProgram : m_FrameSlotPrograms)
+    {
+        if (slotProgram == programIndex)
+            slotProgram = -1;
+    }
+
+    LOG("Released program '%s' that the new script doesn't use.\n", m_Programs[programIndex]->GetName().c_str());
+
+    // The program stays in the list, so that the indices of the other programs don't change,
+    // and its slot is reused by the next program that a reload installs
+    m_Programs[programIndex]->Release(GetDevice());
+
+    GetDevice().destroyDescriptorPool(m_ProgramDescriptorPools[programIndex]);
+    m_ProgramDescriptorPools[programIndex] = nullptr;
+}
+
+// Called at the program transitions, before the next program is selected
+void ShaderProj::ApplyLoadedScript()
+{
+    if (!m_ScriptLoadDone)
+        return;
+
+    WaitForScriptLoad();
+    m_ScriptLoadDone = false;
+    m_ScriptLoadPending = false;
+
+    // The program that was playing is still used by the frames in flight, and the new programs
+    // load their textures with the current command buffer, which is not recording before the frame
+    // starts. The wait is short, and it happens at a transition, where the output is black.
+    GetDevice().waitIdle();
+    WaitForPipelines();
+    WaitForQualityCompilation();
+
+    for (const auto& program : m_LoadedPrograms)
+        InstallLoadedProgram(program);
+    m_LoadedPrograms.clear();
+
+    // Nothing should be left, but a leftover would be kept in memory until the next reload
+    DiscardPreparedTextures();
+
+    vector<ScriptEntry> script;
+    ResolveScript(m_LoadedScript, script);
+    if (script.empty())
+    {
+        LOG("WARNING: none of the programs in the new script could be loaded, playing the previous version.\n");
+        return;
+    }
+
+    // Continue from the program that was playing if the new script has it, or from the start
+    const int previousProgram = m_ActiveProgram;
+    m_Script.swap(script);
+    m_ScriptIndex = -1;
+    for (int index = 0; index < int(m_Script.size()); index++)
+    {
+        if (m_Script[index].programIndex == previousProgram)
+        {
+            m_ScriptIndex = index;
+            break;
+        }
+    }
+
+    unordered_set<int> usedPrograms;
+    for (const auto& entry : m_Script)
+        usedPrograms.insert(entry.programIndex);
+
+    for (int index = 0; index < int(m_Programs.size()); index++)
+    {
+        if (!usedPrograms.count(index) && !m_Programs[index]->IsReleased())
+            ReleaseProgram(index);
+    }
+
+    LOG("Switched to the new script with %d entries.\n", int(m_Script.size()));
+}
@@ -22,7 +22,8 @@
 
 #include "ShaderProj.h"
 
-#include <fstream>
+#include <algorithm>
+#include <sstream>
 #include <json/reader.h>
 
 ShProgram::ShProgram(const std::string& name)
@@ -31,8 +32,8 @@ ShProgram::ShProgram(const std::string& name)
 
 bool ShProgram::Load(const fs::path& descriptionFileName, const fs::path& projectPath)
 {
-    std::ifstream shaderFile(descriptionFileName.generic_string());
-    if (!shaderFile.is_open())
+    blob description;
+    if (!ReadPrefetchedFile(descriptionFileName, description))
     {
         LOG("WARNING: Cannot open file '%s'\n", descriptionFileName.generic_string().c_str());
         return false;
@@ -41,13 +42,13 @@ bool ShProgram::Load(const fs::path& descriptionFileName, const fs::path& projec
     Json::Value root;
     try
     {
+        std::istringstream shaderFile(std::string(description.begin(), description.end()));
         shaderFile >> root;
     }
     catch(const std::exception& e)
     {
         LOG("WARNING: Cannot parse '%s': %s\n", descriptionFileName.generic_string().c_str(), e.what());
     }
-    shaderFile.close();
     
     std::shared_ptr<ShRenderpass> imagePass;
     for (const auto& node : root[0]["renderpass"])
@@ -73,21 +74,286 @@ bool ShProgram::Load(const fs::path& descriptionFileName, const fs::path& projec
 
     m_ImagePassIndex = int(m_Passes.size());
     m_Passes.push_back(imagePass);
-    
+
+    // Not a Shadertoy field: macro sets for the reduced quality levels, can be overridden by the script
+    std::vector<MacroSet> qualityLevels;
+    if (ParseQualityLevels(root[0]["qualityLevels"], qualityLevels))
+        SetQualityLevels(qualityLevels);
+
+    // The image pass is presented every frame, at full resolution
+    imagePass->SetUpdateDivisor(1);
+    imagePass->SetScale(1.f);
+
+    for (auto& pass : m_Passes)
+    {
+        for (int channel = 0; channel < int(c_MaxPassInputs); channel++)
+        {
+            for (int source = 0; source < int(m_Passes.size()); source++)
+            {
+                if (!pass->GetChannelInputId(channel).empty() && m_Passes[source]->GetOutputId() == pass->GetChannelInputId(channel))
+                {
+                    pass->SetChannelSource(channel, source);
+                    if (pass->IsChannelMipmapped(channel))
+                        m_Passes[source]->SetGeneratesMips(true);
+                }
+            }
+        }
+    }
+
+    // A pass feeds the history if its output is read by itself or by an earlier pass,
+    // i.e. on the next frame.
+    for (size_t producer = 0; producer < m_Passes.size(); producer++)
+    {
+        const std::string& outputId = m_Passes[producer]->GetOutputId();
+        for (size_t consumer = 0; consumer <= producer; consumer++)
+        {
+            const auto& inputIds = m_Passes[consumer]->GetInputIds();
+            if (std::find(inputIds.begin(), inputIds.end(), outputId) != inputIds.end())
+                m_Passes[producer]->SetFeedsHistory(true);
+        }
+    }
+
+    // The passes that those passes read, directly or through other passes, also need full precision,
+    // otherwise their rounding errors still end up in the history. The mark is propagated upstream
+    // until nothing changes, because the input graph can have cycles.
+    for (auto& pass : m_Passes)
+        pass->SetNeedsFullPrecision(pass->FeedsHistory());
+
+    bool marked = true;
+    while (marked)
+    {
+        marked = false;
+        for (const auto& consumer : m_Passes)
+        {
+            if (!consumer->NeedsFullPrecision())
+                continue;
+
+            const auto& inputIds = consumer->GetInputIds();
+            for (auto& producer : m_Passes)
+            {
+                if (!producer->NeedsFullPrecision() &&
+                    std::find(inputIds.begin(), inputIds.end(), producer->GetOutputId()) != inputIds.end())
+                {
+                    producer->SetNeedsFullPrecision(true);
+                    marked = true;
+                }
+            }
+        }
+    }
+
     return true;
 }
 
-bool ShProgram::CompileShaders(blob& preamble)
+void ShProgram::Release(vk::Device device)
+{
+    for (auto& pass : m_Passes)
+    {
+        pass->Cleanup(device);
+        pass->ReleaseTextures(device);
+    }
+
+    m_Passes.clear();
+    m_QualityMacros.clear();
+    m_QualityLevel = 0;
+    m_CommonSource = blob();
+    m_Released = true;
+}
+
+void ShProgram::GetPrefetchFiles(std::vector<PrefetchFile>& files) const
 {
-    blob commonSource;
     if (!m_CommonSourcePath.empty())
-        ReadFile(m_CommonSourcePath, commonSource);
+        files.push_back({ m_CommonSourcePath, true });
+
+    for (const auto& pass : m_Passes)
+        pass->GetPrefetchFiles(files);
+}
+
+void ShProgram::GetCompileJobs(blob& preamble, std::vector<CompileJob>& jobs)
+{
+    // The common source is kept in the program because the jobs refer to it.
+    m_CommonSource.clear();
+    if (!m_CommonSourcePath.empty())
+        ReadPrefetchedFile(m_CommonSourcePath, m_CommonSource);
+
+    for (auto& pass : m_Passes)
+    {
+        const bool relaxed = m_RelaxedPrecision && !pass->NeedsFullPrecision();
+        jobs.push_back(pass->GetCompileJob(preamble, m_CommonSource, relaxed));
+    }
+}
+
+void ShProgram::GetQualityCompileJobs(blob& preamble, std::vector<CompileJob>& jobs)
+{
+    for (int level = 1; level < GetQualityLevelCount(); level++)
+    {
+        for (auto& pass : m_Passes)
+        {
+            const bool relaxed = m_RelaxedPrecision && !pass->NeedsFullPrecision();
+            pass->ClearShaderData(level);
+            jobs.push_back(pass->GetCompileJob(preamble, m_CommonSource, relaxed, level, &m_QualityMacros[level - 1]));
+        }
+    }
+}
+
+void ShProgram::SetQualityLevels(const std::vector<MacroSet>& levels)
+{
+    m_QualityMacros.clear();
+    m_QualityLevel = 0;
+
+    for (const auto& macros : levels)
+    {
+        if (GetQualityLevelCount() >= c_MaxQualityLevels)
+        {
+            LOG("WARNING: program '%s' has more than %d quality levels, ignoring the rest.\n", m_Name.c_str(), c_MaxQualityLevels - 1);
+            break;
+        }
+
+        std::string text;
+        for (const auto& [name, value] : macros)
+            text += "#define " + name + " " + value + "\n";
+
+        m_QualityMacros.emplace_back(text.begin(), text.end());
+    }
+}
+
+void ShProgram::SetQualityLevel(int level)
+{
+    m_QualityLevel = level;
 
     for (auto& pass : m_Passes)
     {
-        if (!pass->CompilePassShader(preamble, commonSource))
+        pass->SetQualityLevel(level);
+    }
+}
+
+bool ShProgram::IsQualityLevelReady(int level) const
+{
+    for (const auto& pass : m_Passes)
+    {
+        if (!pass->IsPipelineReady(level))
             return false;
     }
 
     return true;
 }
+
+bool ParseQualityLevels(const Json::Value& node, std::vector<MacroSet>& levels)
+{
+    // An array of objects that map macro names to values, from the highest reduced quality to
+    // the lowest, e.g. [ { "AA": 1 }, { "AA": 1, "STEPS": 64 } ]
+    if (!node.isArray())
+        return false;
+
+    levels.clear();
+    for (const auto& levelNode : node)
+    {
+        if (!levelNode.isObject())
+            continue;
+
+        MacroSet macros;
+        for (const auto& name : levelNode.getMemberNames())
+        {
+            const auto& value = levelNode[name];
+            if (value.isString())
+                macros[name] = value.asString();
+            else if (value.type() == Json::realValue)
+            {
+                // Keep the value a float literal in GLSL, e.g. 1.0 instead of 1
+                char text[32];
+                snprintf(text, sizeof(text), "%.9g", value.asDouble());
+                macros[name] = text;
+                if (macros[name].find_first_of(".e") == std::string::npos)
+                    macros[name] += ".0";
+            }
+            else if (value.isIntegral())
+                macros[name] = std::to_string(value.asInt64());
+        }
+
+        levels.push_back(macros);
+    }
+
+    return true;
+}
+
+void ShProgram::UpdateDirtyFlags(const ShadertoyUniforms& uniforms, uint32_t historyIndex, int frameIndex, bool invalidate, bool trackChanges)
+{
+    for (auto& pass : m_Passes)
+    {
+        // The versions of the images that are bound to the channels on this frame, see ShRenderpass::CreateBindingSets
+        std::array<uint64_t, c_MaxPassInputs> inputVersions{};
+        for (uint32_t channel = 0; channel < c_MaxPassInputs; channel++)
+        {
+            const int source = pass->GetChannelSource(channel);
+            if (source < 0)
+                continue;
+
+            const auto& producer = m_Passes[source];
+            uint32_t slot = producer == pass ? !historyIndex : historyIndex;
+            if (producer->IsPinnedToFirstSlot())
+                slot = 0;
+
+            inputVersions[channel] = producer->GetSlotVersion(slot);
+        }
+
+        if (invalidate)
+            pass->InvalidateOutput();
+
+        const int divisor = pass->GetUpdateDivisor();
+        const bool scheduled = divisor <= 1 || frameIndex % divisor == 0;
+
+        pass->UpdateDirtyFlag(uniforms, inputVersions, historyIndex, scheduled, trackChanges, m_ContentVersion);
+    }
+}
+
+bool ShProgram::SetPassDivisor(const std::string& passName, int divisor)
+{
+    for (int index = 0; index < int(m_Passes.size()); index++)
+    {
+        if (m_Passes[index]->GetPassName() != passName)
+            continue;
+
+        if (index == m_ImagePassIndex)
+        {
+            LOG("WARNING: program '%s': the image pass is rendered every frame, ignoring its divisor.\n", m_Name.c_str());
+            return false;
+        }
+
+        m_Passes[index]->SetUpdateDivisor(divisor);
+        return true;
+    }
+
+    LOG("WARNING: program '%s' has no pass named '%s'.\n", m_Name.c_str(), passName.c_str());
+    return false;
+}
+
+bool ShProgram::SetPassScale(const std::string& passName, float scale)
+{
+    for (int index = 0; index < int(m_Passes.size()); index++)
+    {
+        if (m_Passes[index]->GetPassName() != passName)
+            continue;
+
+        if (index == m_ImagePassIndex)
+        {
+            LOG("WARNING: program '%s': the image pass is rendered at full resolution, ignoring its scale.\n", m_Name.c_str());
+            return false;
+        }
+
+        m_Passes[index]->SetScale(scale);
+        return true;
+    }
+
+    LOG("WARNING: program '%s' has no pass named '%s'.\n", m_Name.c_str(), passName.c_str());
+    return false;
+}
+
+bool ShProgram::HasRelaxedPrecisionPasses() const
+{
+    for (const auto& pass : m_Passes)
+    {
+        if (!pass->NeedsFullPrecision())
+            return true;
+    }
+
+    return false;
+}
@@ -22,6 +22,37 @@
 
 #include "ShaderProj.h"
 
+#include <json/writer.h>
+
+// Makes the shader code after the preamble use RelaxedPrecision floats, which lets the driver
+// use fp16 math. The uniforms and outputs are declared in the preamble and stay at full precision.
+static const char* g_RelaxedPrecisionText = "precision mediump float;\n";
+static blob g_RelaxedPrecisionPreamble(g_RelaxedPrecisionText, g_RelaxedPrecisionText + strlen(g_RelaxedPrecisionText));
+
+// The uniform buffer members in the order of the preamble declaration, which is the bit order of
+// the masks returned by ReflectPassResources
+static const std::pair<size_t, size_t> c_UniformFields[] = {
+    { offsetof(ShadertoyUniforms, iResolution), sizeof(ShadertoyUniforms::iResolution) },
+    { offsetof(ShadertoyUniforms, iTime), sizeof(ShadertoyUniforms::iTime) },
+    { offsetof(ShadertoyUniforms, iMouse), sizeof(ShadertoyUniforms::iMouse) },
+    { offsetof(ShadertoyUniforms, iDate), sizeof(ShadertoyUniforms::iDate) },
+    { offsetof(ShadertoyUniforms, iTimeDelta), sizeof(ShadertoyUniforms::iTimeDelta) },
+    { offsetof(ShadertoyUniforms, iFrameRate), sizeof(ShadertoyUniforms::iFrameRate) },
+    { offsetof(ShadertoyUniforms, iSampleRate), sizeof(ShadertoyUniforms::iSampleRate) },
+    { offsetof(ShadertoyUniforms, iFrame), sizeof(ShadertoyUniforms::iFrame) },
+};
+
+static uint32_t GetChangedUniforms(const ShadertoyUniforms& a, const ShadertoyUniforms& b)
+{
+    uint32_t mask = 0;
+    for (size_t index = 0; index < std::size(c_UniformFields); index++)
+    {
+        const auto [offset, size] = c_UniformFields[index];
+        if (memcmp(reinterpret_cast<const char*>(&a) + offset, reinterpret_cast<const char*>(&b) + offset, size) != 0)
+            mask |= 1u << index;
+    }
+    return mask;
+}
 
 ShRenderpass::ShRenderpass(
 	const std::string& programName,
@@ -33,18 +64,30 @@ ShRenderpass::ShRenderpass(
     , m_ProjectPath(projectPath)
 {
     m_OutputId = m_Declaration["outputs"][0]["id"].asString();
+    m_PassName = m_Declaration["name"].asString();
+
+    // Not a Shadertoy field: can be added to the description to render the pass less often
+    if (m_Declaration["updateDivisor"].isInt())
+        SetUpdateDivisor(m_Declaration["updateDivisor"].asInt());
+    if (m_Declaration["scale"].isNumeric())
+        SetScale(m_Declaration["scale"].asFloat());
     
     std::stringstream inputDecls;
     for (const auto& node : m_Declaration["inputs"])
     {
+        int samplerChannel = node["channel"].asInt();
+
         if (node["type"] == "buffer")
         {
             std::string inputId = node["id"].asString();
             m_InputIds.push_back(inputId);
+            if (samplerChannel >= 0 && samplerChannel < int(c_MaxPassInputs))
+            {
+                m_ChannelInputIds[samplerChannel] = inputId;
+                m_ChannelMipmaps[samplerChannel] = node["sampler"]["filter"] == "mipmap";
+            }
         }
 
-        int samplerChannel = node["channel"].asInt();
-
         std::string samplerType = "sampler2D";
         if (node["type"] == "cubemap")
             samplerType = "samplerCube";
@@ -61,31 +104,86 @@ ShRenderpass::ShRenderpass(
     memset(&m_Push, 0, sizeof(m_Push));
 
     m_RenderTargetIndices.fill(0);
+    m_ChannelSources.fill(-1);
+    m_UsedUniforms.fill(~0u);
+    m_UsedChannels.fill(~0u);
 }
 
-bool ShRenderpass::CompilePassShader(blob& preamble, blob& commonSource)
+CompileJob ShRenderpass::GetCompileJob(blob& preamble, blob& commonSource, bool relaxedPrecision, int qualityLevel, blob* qualityMacros)
 {
-    std::vector<blob*> preambles;
-    preambles.push_back(&preamble);
-    preambles.push_back(&m_InputDeclarations);
-    preambles.push_back(&commonSource);
-
-    return CompileShader(m_ShaderFile, preambles, m_ShaderData);
+    CompileJob job;
+    job.shaderFile = m_ShaderFile;
+    job.preambles.push_back(&preamble);
+    // The quality macros go right after the version directive, before anything can use them
+    if (qualityMacros)
+        job.preambles.push_back(qualityMacros);
+    if (relaxedPrecision)
+        job.preambles.push_back(&g_RelaxedPrecisionPreamble);
+    job.preambles.push_back(&m_InputDeclarations);
+    job.preambles.push_back(&commonSource);
+    job.macroOverrides = qualityMacros;
+    job.cacheVariant = relaxedPrecision ? "relaxed" : "";
+    if (qualityLevel > 0)
+        job.cacheVariant += (job.cacheVariant.empty() ? "q" : ".q") + std::to_string(qualityLevel);
+    job.output = &m_ShaderData[qualityLevel];
+
+    return job;
 }
 
-bool ShRenderpass::CreateFragmentShader(vk::Device device)
+bool ShRenderpass::CreateFragmentShader(vk::Device device, int qualityLevel)
 {
-    DestroyFragmentShader(device);
+    device.destroyShaderModule(m_FragmentShaders[qualityLevel]);
+    m_FragmentShaders[qualityLevel] = nullptr;
+
+    if (m_ShaderData[qualityLevel].empty())
+        return false;
 
-    m_FragmentShader = CreateShaderModule(device, m_ShaderData);
+    m_FragmentShaders[qualityLevel] = CreateShaderModule(device, m_ShaderData[qualityLevel]);
+    ReflectPassResources(m_ShaderData[qualityLevel], m_UsedUniforms[qualityLevel], m_UsedChannels[qualityLevel]);
 
-    return !!m_FragmentShader;
+    return !!m_FragmentShaders[qualityLevel];
 }
 
 void ShRenderpass::DestroyFragmentShader(vk::Device device)
 {
-    device.destroyShaderModule(m_FragmentShader);
-    m_FragmentShader = nullptr;
+    for (auto& shader : m_FragmentShaders)
+    {
+        device.destroyShaderModule(shader);
+        shader = nullptr;
+    }
+}
+
+bool ShRenderpass::GetInputFileName(const Json::Value& input, fs::path& result) const
+{
+    std::string fileName = input["filepath"].asString();
+    if (fileName.size() <= 1)
+        return false;
+
+    if (fileName[0] == '/')
+        fileName.erase(fileName.begin(), fileName.begin() + 1);
+
+    result = m_ProjectPath / fileName;
+    return true;
+}
+
+void ShRenderpass::GetPrefetchFiles(std::vector<PrefetchFile>& files) const
+{
+    // The shader is compiled in a worker process, so its source only goes into the OS cache
+    files.push_back({ m_ShaderFile, false });
+
+    for (const auto& node : m_Declaration["inputs"])
+    {
+        fs::path fileName;
+        if (!GetInputFileName(node, fileName))
+            continue;
+
+        if (node["type"] == "texture")
+            GetTexturePrefetchFiles(fileName, files);
+        else if (node["type"] == "volume")
+            files.push_back({ fileName, true });
+        else if (node["type"] == "cubemap")
+            GetCubemapPrefetchFiles(fileName, files);
+    }
 }
 
 void ShRenderpass::LoadTextures(vk::PhysicalDevice physicalDevice, vk::Device device, vk::Queue queue, vk::CommandBuffer cmdBuf)
@@ -124,14 +222,10 @@ void ShRenderpass::LoadTextures(vk::PhysicalDevice physicalDevice, vk::Device de
         m_Samplers[samplerChannel] = device.createSampler(samplerDesc);
 
 
-        std::string fileName = node["filepath"].asString();
-        if (fileName.size() <= 1)
+        fs::path textureFileName;
+        if (!GetInputFileName(node, textureFileName))
             continue;
 
-        if (fileName[0] == '/')
-            fileName.erase(fileName.begin(), fileName.begin() + 1);
-
-        auto textureFileName = m_ProjectPath / fileName;
         if (node["type"] == "texture")
         {
             m_StaticInputs[samplerChannel] = LoadTexture(textureFileName, physicalDevice, device, queue, cmdBuf);
@@ -140,18 +234,102 @@ void ShRenderpass::LoadTextures(vk::PhysicalDevice physicalDevice, vk::Device de
         {
             m_StaticInputs[samplerChannel] = LoadVolume(textureFileName, physicalDevice, device, queue, cmdBuf);
         }
+        else if (node["type"] == "cubemap")
+        {
+            m_StaticInputs[samplerChannel] = LoadCubemap(textureFileName, physicalDevice, device, queue, cmdBuf);
+        }
+    }
+}
+
+void ShRenderpass::PrepareTextures(const std::unordered_set<std::string>& cachedImages) const
+{
+    for (const auto& node : m_Declaration["inputs"])
+    {
+        fs::path textureFileName;
+        if (!GetInputFileName(node, textureFileName) || cachedImages.count(textureFileName.generic_string()))
+            continue;
+
+        if (node["type"] == "texture")
+            PrepareTexture(textureFileName);
+        else if (node["type"] == "cubemap")
+            PrepareCubemap(textureFileName);
+    }
+}
+
+void ShRenderpass::ReleaseTextures(vk::Device device)
+{
+    for (const auto& node : m_Declaration["inputs"])
+    {
+        const int samplerChannel = node["channel"].asInt();
+
+        fs::path textureFileName;
+        if (!GetInputFileName(node, textureFileName) || !m_StaticInputs[samplerChannel].image)
+            continue;
+
+        ReleaseImage(device, textureFileName);
+        m_StaticInputs[samplerChannel] = Image();
+    }
+}
+
+void ShRenderpass::LoadSoftwareInputs(
+    std::map<std::string, std::shared_ptr<SoftwareTexture>>& textureCache,
+    std::array<SoftwareChannel, c_MaxPassInputs>& channels)
+{
+    // The dirty tracking needs to know what the shader reads, which is normally found when the module is created
+    ReflectPassResources(m_ShaderData[0], m_UsedUniforms[0], m_UsedChannels[0]);
+
+    channels = {};
+
+    for (const auto& node : m_Declaration["inputs"])
+    {
+        int samplerChannel = node["channel"].asInt();
+        if (samplerChannel < 0 || samplerChannel >= int(c_MaxPassInputs))
+            continue;
+
+        SoftwareChannel& channel = channels[samplerChannel];
+        auto samplerNode = node["sampler"];
+        channel.linear = samplerNode["filter"] == "linear" || samplerNode["filter"] == "mipmap";
+        channel.mipmap = samplerNode["filter"] == "mipmap";
+        channel.repeat = samplerNode["wrap"] != "clamp";
+
+        fs::path textureFileName;
+        if (!GetInputFileName(node, textureFileName))
+            continue;
+
+        SoftwareTextureType type;
+        if (node["type"] == "texture")
+            type = SoftwareTextureType::Texture2D;
+        else if (node["type"] == "volume")
+            type = SoftwareTextureType::Volume;
+        else if (node["type"] == "cubemap")
+            type = SoftwareTextureType::Cube;
+        else
+            continue;
+
+        const std::string textureName = textureFileName.generic_string();
+        auto found = textureCache.find(textureName);
+        if (found == textureCache.end())
+        {
+            auto texture = std::make_shared<SoftwareTexture>();
+            if (!LoadSoftwareTexture(textureFileName, type, *texture))
+            {
+                LOG("ERROR: failed to load texture '%s'\n", textureName.c_str());
+                texture.reset();
+            }
+            found = textureCache.emplace(textureName, texture).first;
+        }
+
+        channel.texture = found->second.get();
     }
 }
 
-bool ShRenderpass::CreatePipelineAndFramebuffers(
+bool ShRenderpass::CreateFramebuffers(
     vk::Device device,
-    vk::ShaderModule vertexShader,
-    vk::PipelineLayout pipelineLayout,
     vk::RenderPass renderPass,
     uint32_t width,
     uint32_t height)
 {
-    DestroyPipelineAndFramebuffers(device);
+    DestroyFramebuffers(device);
 
     for (uint32_t frame = 0; frame < 2; frame++)
     {
@@ -166,32 +344,118 @@ bool ShRenderpass::CreatePipelineAndFramebuffers(
         m_Framebuffers[frame] = device.createFramebuffer(framebufferInfo);
     }
 
-    m_Pipeline = CreateQuadPipeline(
-        device,
-        pipelineLayout,
-        vertexShader,
-        m_FragmentShader,
-        renderPass,
-        width, height);
-    
-    return !!m_Pipeline;
+    return true;
 }
 
-void ShRenderpass::DestroyPipelineAndFramebuffers(vk::Device device)
+void ShRenderpass::DestroyFramebuffers(vk::Device device)
 {
     for (auto& framebuffer : m_Framebuffers)
     {
         device.destroyFramebuffer(framebuffer);
         framebuffer = nullptr;
     }
+}
+
+void ShRenderpass::CreatePipeline(const PassPipelineParams& params, int qualityLevel)
+{
+    // This function runs on a pipeline creation thread. It only reads the pass state that
+    // doesn't change until all pipeline tasks are finished, see ShaderProj::ReloadShaders.
+    PipelineCreationStats stats;
+    vk::Pipeline pipeline;
+    if (params.library && params.library->IsValid())
+    {
+        pipeline = params.library->CreatePipeline(
+            m_FragmentShaders[qualityLevel],
+            params.pipelineCache,
+            &stats,
+            params.creationFeedback);
+    }
+    else
+    {
+        pipeline = CreateQuadPipeline(
+            params.device,
+            params.pipelineLayout,
+            params.vertexShader,
+            m_FragmentShaders[qualityLevel],
+            params.renderPass,
+            params.pipelineCache,
+            &stats,
+            params.creationFeedback);
+    }
+
+    std::string shaderName = m_ShaderFile.filename().generic_string();
+    if (qualityLevel > 0)
+        shaderName += " (quality " + std::to_string(qualityLevel) + ")";
+
+    if (!pipeline)
+    {
+        LOG("ERROR: program '%s' failed to create the pipeline for '%s'\n", m_ProgramName.c_str(), shaderName.c_str());
+        m_PipelineFailed[qualityLevel] = true;
+        return;
+    }
+
+    if (stats.feedbackValid)
+    {
+        LOG("Created pipeline for %s/%s in %.2f ms (fragment %.2f ms%s)%s\n",
+            m_ProgramName.c_str(), shaderName.c_str(),
+            double(stats.wallTimeNs) * 1e-6, double(stats.fragmentStageNs) * 1e-6,
+            stats.fastLink ? ", fast link" : "",
+            stats.cacheHit ? ", cache hit" : "");
+    }
+
+    if (IsStatsEnabled())
+    {
+        Json::Value record;
+        record["type"] = "pipeline_creation";
+        record["program"] = m_ProgramName;
+        record["shader"] = shaderName;
+        record["wall_ns"] = Json::UInt64(stats.wallTimeNs);
+        record["fast_link"] = stats.fastLink;
+        if (stats.fastLink)
+            record["link_ns"] = Json::UInt64(stats.linkTimeNs);
+        if (stats.feedbackValid)
+        {
+            record["driver_ns"] = Json::UInt64(stats.feedbackNs);
+            record["fragment_ns"] = Json::UInt64(stats.fragmentStageNs);
+            record["cache_hit"] = stats.cacheHit;
+        }
+        WriteStats(record);
+    }
+
+    m_PendingPipelines[qualityLevel].store(pipeline);
+}
+
+bool ShRenderpass::InstallPendingPipeline()
+{
+    for (int level = 0; level < c_MaxQualityLevels; level++)
+    {
+        if (!m_Pipelines[level])
+        {
+            vk::Pipeline pending = m_PendingPipelines[level].exchange(VK_NULL_HANDLE);
+            if (pending)
+                m_Pipelines[level] = pending;
+        }
+    }
+
+    return !!m_Pipelines[m_QualityLevel];
+}
 
-    device.destroyPipeline(m_Pipeline);
-    m_Pipeline = nullptr;
+void ShRenderpass::DestroyPipeline(vk::Device device)
+{
+    InstallPendingPipeline();
+
+    for (int level = 0; level < c_MaxQualityLevels; level++)
+    {
+        device.destroyPipeline(m_Pipelines[level]);
+        m_Pipelines[level] = nullptr;
+        m_PipelineFailed[level] = false;
+    }
 }
 
 void ShRenderpass::Cleanup(vk::Device device)
 {
-    DestroyPipelineAndFramebuffers(device);
+    DestroyFramebuffers(device);
+    DestroyPipeline(device);
     DestroyFragmentShader(device);
 
     for (auto& sampler : m_Samplers)
@@ -201,6 +465,30 @@ void ShRenderpass::Cleanup(vk::Device device)
     }
 }
 
+void ShRenderpass::AccumulateMemory(ProgramMemory& memory) const
+{
+    Json::StreamWriterBuilder builder;
+    builder["indentation"] = "";
+    memory.declarationBytes += Json::writeString(builder, m_Declaration).size() + m_InputDeclarations.size();
+
+    for (int level = 0; level < c_MaxQualityLevels; level++)
+    {
+        memory.spirvBytes += m_ShaderData[level].size();
+
+        if (m_FragmentShaders[level])
+            memory.shaderModuleBytes += m_ShaderData[level].size();
+
+        if (m_Pipelines[level] || m_PendingPipelines[level].load())
+            ++memory.pipelines;
+    }
+
+    for (auto descriptorSet : m_DescriptorSets)
+    {
+        if (descriptorSet)
+            ++memory.descriptorSets;
+    }
+}
+
 bool ShRenderpass::AllocateDescriptorSets(vk::Device device, vk::DescriptorPool descriptorPool, vk::DescriptorSetLayout setLayout)
 {
     auto allocateInfo = vk::DescriptorSetAllocateInfo()
@@ -292,11 +580,13 @@ void ShRenderpass::CreateBindingSets(
                     if (pass->m_OutputId == bufferId)
                     {
                         int sourceFrame = (pass.get() == this) ? !frame : frame;
+                        if (pass->IsPinnedToFirstSlot())
+                            sourceFrame = 0;
                         int sourceBufferIndex = passIndex * 2 + sourceFrame;
                         imageView = common.images[sourceBufferIndex].imageView;
                         
-                        inputSize[0] = common.width;
-                        inputSize[1] = common.height;
+                        inputSize[0] = common.images[sourceBufferIndex].width;
+                        inputSize[1] = common.images[sourceBufferIndex].height;
                         inputSize[2] = 1;
                         break;
                     }
@@ -322,7 +612,56 @@ void ShRenderpass::CreateBindingSets(
         
         common.device.updateDescriptorSets(uint32_t(std::size(descriptors)), descriptors, 0, nullptr);
 
-        m_RenderTargetIndices[frame] = outputIndex * 2 + frame;
-        m_RenderTargetViews[frame] = common.images[m_RenderTargetIndices[frame]].imageView;
+        m_RenderTargetIndices[frame] = outputIndex * 2 + (IsPinnedToFirstSlot() ? 0 : frame);
+        // Render targets with mips are rendered through the view of level 0
+        const Image& renderTarget = common.images[m_RenderTargetIndices[frame]];
+        m_RenderTargetViews[frame] = renderTarget.levelViews.empty() ? renderTarget.imageView : renderTarget.levelViews[0];
+    }
+
+    // Buffer passes may render at a reduced scale, so iResolution is per pass
+    const Image& target = common.images[m_RenderTargetIndices[0]];
+    m_Push.iResolution[0] = float(target.width);
+    m_Push.iResolution[1] = float(target.height);
+    m_Push.iResolution[2] = 1.f;
+
+    // The targets may have been re-created, so their contents are undefined
+    m_SlotVersions.fill(0);
+    m_OutputValid = false;
+}
+
+void ShRenderpass::UpdateDirtyFlag(
+    const ShadertoyUniforms& uniforms,
+    const std::array<uint64_t, c_MaxPassInputs>& inputVersions,
+    uint32_t historyIndex,
+    bool scheduled,
+    bool trackChanges,
+    uint64_t& contentVersion)
+{
+    const uint32_t slot = IsPinnedToFirstSlot() ? 0 : historyIndex;
+
+    bool inputsChanged = false;
+    for (uint32_t channel = 0; channel < c_MaxPassInputs; channel++)
+    {
+        if ((m_UsedChannels[m_QualityLevel] & (1u << channel)) && inputVersions[channel] != m_InputVersions[channel])
+            inputsChanged = true;
+    }
+
+    const bool uniformsChanged = (GetChangedUniforms(uniforms, m_RenderedUniforms) & m_UsedUniforms[m_QualityLevel]) != 0;
+
+    m_Dirty = !m_OutputValid || (scheduled && (!trackChanges || inputsChanged || uniformsChanged));
+    m_CopyHistory = false;
+
+    if (m_Dirty)
+    {
+        m_SlotVersions[slot] = ++contentVersion;
+        m_InputVersions = inputVersions;
+        m_RenderedUniforms = uniforms;
+        m_OutputValid = true;
+    }
+    else if (!IsPinnedToFirstSlot() && m_SlotVersions[!historyIndex] > m_SlotVersions[slot])
+    {
+        // Once the last output is copied, both slots are the same until the pass is rendered again
+        m_CopyHistory = true;
+        m_SlotVersions[slot] = m_SlotVersions[!historyIndex];
     }
 }
@@ -41,7 +41,7 @@ static const char* g_PreambleText =
     "layout(location = 0) out vec4 o_color;\n"
     "in vec4 gl_FragCoord;\n"
     "layout(set = 0, binding = 4) uniform UniformBufferObject {\n"
-    "  vec3  iResolution;\n"
+    "  vec3  iWindowResolution;\n"
     "  float iTime;\n"
     "  vec4  iMouse;\n"
     "  vec4  iDate;\n"
@@ -53,6 +53,7 @@ static const char* g_PreambleText =
     "layout(push_constant) uniform PushConstants {\n"
     "  vec4  iChannelResolution[4];\n"
     "  float iChannelTime[4];\n"
+    "  vec3  iResolution;\n"
     "};\n"
     "void mainImage( out vec4 fragColor, in vec2 fragCoord );\n"
     "void main() {\n"
@@ -60,6 +61,11 @@ static const char* g_PreambleText =
     "  mainImage(o_color, fragCoord);\n"
     "}\n";
 
+void GetShaderPreamble(blob& preamble)
+{
+    preamble.assign(g_PreambleText, g_PreambleText + strlen(g_PreambleText));
+}
+
 
 ShaderProj::ShaderProj(const vector<shared_ptr<ShProgram>>& programs)
     : VulkanApp()
@@ -67,32 +73,16 @@ ShaderProj::ShaderProj(const vector<shared_ptr<ShProgram>>& programs)
 {
 }
 
-bool ShaderProj::SetScript(const vector<ScriptEntry>& script, double baseInterval)
+ShaderProj::~ShaderProj()
 {
-    for (ScriptEntry entry : script)
-    {
-        entry.duration *= baseInterval;
-        entry.programIndex = -1;
-
-        int index = 0;
-        for (auto& program : m_Programs)
-        {
-            if (program->GetName() == entry.programName)
-            {
-                entry.programIndex = index;
-                break;
-            }
-            ++index;
-        }
-
-        if (entry.programIndex < 0)
-        {
-            LOG("WARNING: program '%s' used in the script was not loaded.\n", entry.programName.c_str());
-            continue;
-        }
+    WaitForScriptLoad();
+    WaitForQualityCompilation();
+}
 
-        m_Script.push_back(entry);
-    }
+bool ShaderProj::SetScript(const vector<ScriptEntry>& script, double baseInterval)
+{
+    m_BaseInterval = baseInterval;
+    ResolveScript(script, m_Script);
 
     if (m_Script.empty())
         return false;
@@ -103,19 +93,84 @@ bool ShaderProj::SetScript(const vector<ScriptEntry>& script, double baseInterva
     return true;
 }
 
+int ShaderProj::GetTextureSizeLimit(uint32_t width, uint32_t height) const
+{
+    // A texture that is larger than the output can't show more detail, unless it's magnified
+    int textureSizeLimit = m_MaxTextureSize;
+    if (m_FitTexturesToOutput)
+    {
+        int outputLimit = 1;
+        while (outputLimit < int(std::max(width, height)))
+            outputLimit <<= 1;
+
+        textureSizeLimit = textureSizeLimit > 0 ? std::min(textureSizeLimit, outputLimit) : outputLimit;
+    }
+    return textureSizeLimit;
+}
+
 bool ShaderProj::LoadShaders()
 {
+    if (!CompilePrograms(m_Programs))
+        return false;
+
+    StartQualityCompilation();
+    return true;
+}
+
+bool ShaderProj::CompilePrograms(const vector<shared_ptr<ShProgram>>& programs)
+{
+    // The quality variants use the common sources that are re-read here, and the compiler
+    // can only run one set of jobs at a time
+    WaitForScriptLoad();
+    WaitForQualityCompilation();
+
     blob preamble;
-    preamble.assign(g_PreambleText, g_PreambleText + strlen(g_PreambleText));
+    GetShaderPreamble(preamble);
     
-    bool allShadersCompiled = true;
-    for (auto& program : m_Programs)
+    std::vector<CompileJob> jobs;
+    for (auto& program : programs)
     {
-        if (!program->CompileShaders(preamble))
-            allShadersCompiled = false;
+        program->GetCompileJobs(preamble, jobs);
     }
     
-    return allShadersCompiled;
+    return RunCompileJobs(jobs, m_CompileWorkerParams);
+}
+
+void ShaderProj::StartQualityCompilation()
+{
+    WaitForQualityCompilation();
+
+    for (auto& program : m_Programs)
+    {
+        program->SetQualityLevel(0);
+    }
+
+    GetShaderPreamble(m_QualityPreamble);
+    m_QualityJobs.clear();
+    for (auto& program : m_Programs)
+    {
+        program->GetQualityCompileJobs(m_QualityPreamble, m_QualityJobs);
+    }
+
+    m_QualityVariantsInstalled = m_QualityJobs.empty();
+    if (m_QualityJobs.empty())
+        return;
+
+    LOG("Compiling %d quality variants in the background\n", int(m_QualityJobs.size()));
+
+    // The jobs write into the passes, which are not used for the reduced levels until the thread is joined
+    m_QualityCompileDone = false;
+    m_QualityCompileThread = std::thread([this]()
+    {
+        RunCompileJobs(m_QualityJobs, m_CompileWorkerParams);
+        m_QualityCompileDone = true;
+    });
+}
+
+void ShaderProj::WaitForQualityCompilation()
+{
+    if (m_QualityCompileThread.joinable())
+        m_QualityCompileThread.join();
 }
 
 bool ShaderProj::CreateShaderObjects()
@@ -156,6 +211,16 @@ void ShaderProj::DestroyShaderObjects(vk::Device device)
 }
 
 bool ShaderProj::Init()
+{
+    m_ProgramCosts.resize(m_Programs.size());
+    m_ProgramEnergy.resize(m_Programs.size());
+    m_QualityStates.resize(m_Programs.size());
+    m_ProgramDescriptorPools.resize(m_Programs.size());
+
+    return CreateDeviceObjects();
+}
+
+bool ShaderProj::CreateDeviceObjects()
 {
     const auto vkPhysicalDevice = GetPhysicalDevice();
     const auto vkDevice = GetDevice();
@@ -207,9 +272,17 @@ bool ShaderProj::Init()
 
     m_Sampler = vkDevice.createSampler(samplerDesc);
 
+    // After a device loss, start with the pipelines that the lost device has compiled
+    m_PipelineCache = vkDevice.createPipelineCache(vk::PipelineCacheCreateInfo()
+        .setInitialDataSize(m_PipelineCacheData.size())
+        .setPInitialData(m_PipelineCacheData.data()));
+
     if (!CreateShaderObjects())
         return false;
 
+    if (!m_MipGenerator.Init(vkPhysicalDevice, vkDevice, m_PipelineCache))
+        return false;
+
     
     // Create the blit pipeline layout
     auto blitInputImageLayoutBinding = vk::DescriptorSetLayoutBinding()
@@ -341,9 +414,44 @@ bool ShaderProj::Init()
         }
     }
 
+    // The blit pipeline is needed for every frame, even before the program pipelines are ready
+    m_BlitPipeline = CreateQuadPipeline(
+        vkDevice,
+        m_BlitPipelineLayout,
+        m_VertexShader,
+        m_BlitFragmentShader,
+        m_BlitRenderPass,
+        m_PipelineCache);
+
+    if (!m_BlitPipeline)
+        return false;
+
+    if (m_PipelineLibraryEnabled && IsPipelineLibrarySupported())
+    {
+        if (m_PassPipelineLibrary.Init(vkDevice, m_PassPipelineLayout, m_VertexShader, m_PassRenderPass, m_PipelineCache))
+            LOG("Using graphics pipeline libraries for the pass pipelines\n");
+    }
+
+    // Leave one core for the render thread
+    const int pipelineThreadCount = std::max(int(std::thread::hardware_concurrency()) - 1, 1);
+    m_PipelineThreads = std::make_unique<ThreadPool>(pipelineThreadCount);
+
+    CreatePassPipelines();
+
+    // The GPU time of every frame is measured for the governor, the energy accounting, the
+    // frame budget and the quality levels, with a pair of queries per frame slot
+    m_FrameSlotPrograms.assign(GetFrameSlotCount(), -1);
+    m_FrameSlotQuality.assign(GetFrameSlotCount(), 0);
+    if ((m_Governor || m_EnergySensors || m_FrameBudget.budget > 0 || HasQualityLevels()) && !m_FrameTimer.Init(vkPhysicalDevice, vkDevice, GetFrameSlotCount() * 2))
+        LOG("WARNING: the GPU time of the programs can't be measured.\n");
+
     const auto vkQueue = GetGraphicsQueue();
     const auto cmdBuf = GetCurrentCmdBuf();
 
+    uint32_t width, height;
+    GetWindowDimensions(width, height);
+    SetTextureSizeLimit(GetTextureSizeLimit(width, height));
+
     for (auto& program : m_Programs)
     {
         for (auto& pass : program->GetPasses())
@@ -356,9 +464,24 @@ bool ShaderProj::Init()
 }
 
 void ShaderProj::Shutdown()
+{
+    WaitForScriptLoad();
+    WaitForQualityCompilation();
+    DestroyDeviceObjects();
+
+    VulkanApp::Shutdown();
+}
+
+void ShaderProj::DestroyDeviceObjects()
 {
     const auto vkDevice = GetDevice();
 
+    // Finish the pipeline tasks before destroying the objects that they use
+    m_PipelineThreads.reset();
+    m_PassPipelineLibrary.Shutdown();
+    m_FrameTimer.Shutdown();
+    m_MipGenerator.Shutdown();
+
     for (auto& program : m_Programs)
     {
         for (auto& pass : program->GetPasses())
@@ -380,8 +503,18 @@ void ShaderProj::Shutdown()
     vkDevice.destroyDescriptorPool(m_DescriptorPool);
     m_DescriptorPool = nullptr;
 
+    // The device objects are re-created with one pool for all the programs
+    for (auto& pool : m_ProgramDescriptorPools)
+    {
+        vkDevice.destroyDescriptorPool(pool);
+        pool = nullptr;
+    }
+
     vkDevice.destroyPipeline(m_BlitPipeline);
     m_BlitPipeline = nullptr;
+
+    vkDevice.destroyPipelineCache(m_PipelineCache);
+    m_PipelineCache = nullptr;
     
     vkDevice.destroyPipelineLayout(m_BlitPipelineLayout);
     m_BlitPipelineLayout = nullptr;
@@ -403,7 +536,15 @@ void ShaderProj::Shutdown()
 
     BackBufferResizing();
 
-    VulkanApp::Shutdown();
+    m_StaticResourcesInitd = false;
+    m_BufferLayoutInitd = false;
+
+    // The shaders of all quality levels are gone, the variants are installed again when needed
+    for (auto& program : m_Programs)
+    {
+        program->SetQualityLevel(0);
+    }
+    m_QualityVariantsInstalled = !HasQualityLevels();
 }
 
 void ShaderProj::BackBufferResizing()
@@ -430,25 +571,94 @@ void ShaderProj::KeyboardUpdate(int key, int scancode, int action, int mods)
     }
     else if (key == GLFW_KEY_R && action == GLFW_PRESS)
     {
-        if (LoadShaders())
-        {
-            CreateShaderObjects();
-            BackBufferResizing();
-        }
-        m_ResetRequired = true;
+        ReloadShaders();
+    }
+    else if ((key == GLFW_KEY_LEFT || key == GLFW_KEY_RIGHT) && action == GLFW_PRESS && m_Sync && !m_Sync->IsLeader())
+    {
+        LOG("The programs are switched by the sync leader.\n");
     }
     else if (key == GLFW_KEY_LEFT && action == GLFW_PRESS)
     {
+        ApplyLoadedScript();
         PreviousProgram();
     }
     else if (key == GLFW_KEY_RIGHT && action == GLFW_PRESS)
     {
+        ApplyLoadedScript();
         NextProgram();
     }
     else if (key == GLFW_KEY_SPACE && action == GLFW_PRESS)
     {
         m_Paused = !m_Paused;
     }
+    else if (key == GLFW_KEY_L && action == GLFW_PRESS)
+    {
+        CycleLogLevel();
+    }
+}
+
+void ShaderProj::ReloadShaders()
+{
+    if (LoadShaders())
+    {
+        // The pipeline tasks use the shader modules, and the GPU may still use the pipelines
+        WaitForPipelines();
+        GetDevice().waitIdle();
+        DestroyPassPipelines();
+
+        CreateShaderObjects();
+        CreatePassPipelines();
+        BackBufferResizing();
+    }
+    m_ResetRequired = true;
+}
+
+PassPipelineParams ShaderProj::GetPassPipelineParams()
+{
+    PassPipelineParams params;
+    params.device = GetDevice();
+    params.pipelineCache = m_PipelineCache;
+    params.pipelineLayout = m_PassPipelineLayout;
+    params.renderPass = m_PassRenderPass;
+    params.vertexShader = m_VertexShader;
+    params.library = &m_PassPipelineLibrary;
+    params.creationFeedback = IsDeviceExtensionEnabled(VK_EXT_PIPELINE_CREATION_FEEDBACK_EXTENSION_NAME);
+    return params;
+}
+
+void ShaderProj::CreatePassPipelines()
+{
+    const PassPipelineParams params = GetPassPipelineParams();
+
+    // Start with the active program so that it's the first one to become ready
+    const int programCount = int(m_Programs.size());
+    for (int offset = 0; offset < programCount; offset++)
+    {
+        auto& program = m_Programs[(m_ActiveProgram + offset) % programCount];
+        for (auto& pass : program->GetPasses())
+        {
+            m_PipelineThreads->AddTask([pass, params]() { pass->CreatePipeline(params); });
+        }
+    }
+}
+
+void ShaderProj::DestroyPassPipelines()
+{
+    const auto vkDevice = GetDevice();
+
+    for (auto& program : m_Programs)
+    {
+        for (auto& pass : program->GetPasses())
+        {
+            pass->DestroyPipeline(vkDevice);
+        }
+    }
+}
+
+void ShaderProj::WaitForPipelines()
+{
+    if (m_PipelineThreads)
+        m_PipelineThreads->WaitForAll();
 }
 
 void ShaderProj::MousePosUpdate(double xpos, double ypos)
@@ -486,20 +696,41 @@ void ShaderProj::PreviousProgram()
     if (m_Script.empty())
         return;
 
-    --m_ScriptIndex;
-    if (m_ScriptIndex < 0)
-        m_ScriptIndex = int(m_Script.size()) - 1;
+    // Skip the quarantined programs and those that the governor considers too expensive,
+    // unless all of them are
+    for (size_t attempt = 0; attempt < m_Script.size(); attempt++)
+    {
+        --m_ScriptIndex;
+        if (m_ScriptIndex < 0)
+            m_ScriptIndex = int(m_Script.size()) - 1;
+
+        if (!IsProgramSkipped(m_Script[m_ScriptIndex].programIndex))
+            break;
+    }
     m_ActiveProgram = m_Script[m_ScriptIndex].programIndex;
     m_CurrentDuration = m_Script[m_ScriptIndex].duration;
     m_ResetRequired = true;
 }
 
+int ShaderProj::FindNextScriptIndex() const
+{
+    int scriptIndex = m_ScriptIndex;
+    for (size_t attempt = 0; attempt < m_Script.size(); attempt++)
+    {
+        scriptIndex = (scriptIndex + 1) % int(m_Script.size());
+
+        if (!IsProgramSkipped(m_Script[scriptIndex].programIndex))
+            break;
+    }
+    return scriptIndex;
+}
+
 void ShaderProj::NextProgram()
 {
     if (m_Script.empty())
         return;
 
-    m_ScriptIndex = (m_ScriptIndex + 1) % int(m_Script.size());
+    m_ScriptIndex = FindNextScriptIndex();
     m_ActiveProgram = m_Script[m_ScriptIndex].programIndex;
     m_CurrentDuration = m_Script[m_ScriptIndex].duration;
     m_ResetRequired = true;
@@ -507,37 +738,142 @@ void ShaderProj::NextProgram()
 
 void ShaderProj::Animate(double fElapsedTimeSeconds)
 {
+    if (m_Throttle.fpsCap > 0)
+    {
+        const auto frameInterval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double>(1.0 / double(m_Throttle.fpsCap)));
+        std::this_thread::sleep_until(m_FrameLimiterTime + frameInterval);
+    }
+    m_FrameLimiterTime = std::chrono::steady_clock::now();
+
+    if (m_Sync)
+    {
+        // All displays start their frames on the same ticks of the shared clock, like with a swap barrier
+        if (m_Sync->HasSwapBarrier())
+            m_Sync->WaitForTick(1.0 / double(std::max(GetVulkanParams().refreshRate, 1u)));
+        m_Sync->RecordFrame(m_Sync->GetTime());
+    }
+
+    UpdateGovernor(fElapsedTimeSeconds);
+    SampleEnergy(false);
+    InstallQualityVariants();
+    UpdateScriptReload(fElapsedTimeSeconds);
+
+    // Without durations, there are no transitions to wait for
+    if (m_ScriptLoadDone && m_CurrentDuration <= 0)
+    {
+        ApplyLoadedScript();
+        if (m_Programs[m_ActiveProgram]->IsReleased())
+            NextProgram();
+    }
+
     if (m_Paused)
         return;
 
     m_CurrentTime += fElapsedTimeSeconds;
     m_CurrentTimeDelta = fElapsedTimeSeconds;
 
-    if (m_CurrentDuration > 0 && m_CurrentTime > m_CurrentDuration)
+    MeasurePassChange();
+
+    if (m_Sync)
+    {
+        UpdatePlaybackSync();
+    }
+    else if (m_CurrentDuration > 0 && m_CurrentTime > m_CurrentDuration)
     {
+        ApplyLoadedScript();
         NextProgram();
     }
 }
 
 void ShaderProj::CreateBuffersAndBindings(int width, int height)
 {
+    const auto vkDevice = GetDevice();
+
+    UpdateImageSizes(*m_Programs[m_ActiveProgram], width, height);
+
+    m_SwapChainLayoutInitd.clear();
+    m_SwapChainLayoutInitd.resize(GetSwapChainImageCount());
+
+    for (auto& program : m_Programs)
+    {
+        RebuildProgramBindings(*program);
+    }
+
+    // Create the swap chain framebuffers
+
+    assert(m_SwapChainFramebuffers.empty());
+
+    for (uint32_t index = 0; index < GetSwapChainImageCount(); index++)
+    {
+        auto imageView = GetSwapChainImageView(index);
+
+        auto framebufferInfo = vk::FramebufferCreateInfo()
+            .setRenderPass(m_BlitRenderPass)
+            .setAttachmentCount(1)
+            .setPAttachments(&imageView)
+            .setWidth(width)
+            .setHeight(height)
+            .setLayers(1);
+
+        auto framebuffer = vkDevice.createFramebuffer(framebufferInfo);
+
+        m_SwapChainFramebuffers.push_back(framebuffer);
+    }
+}
+
+bool ShaderProj::UpdateImageSizes(const ShProgram& program, uint32_t width, uint32_t height)
+{
+    // The render images are shared by all programs, and they are sized for the pass scales
+    // of the program that is being rendered. Images for the passes that the program doesn't have
+    // are left as they are. Returns true if any images were re-created.
     const auto vkPhysicalDevice = GetPhysicalDevice();
     const auto vkDevice = GetDevice();
+    const auto& passes = program.GetPasses();
 
+    bool changed = false;
     for (size_t index = 0; index < m_Images.size(); index++)
     {
-        std::stringstream ss;
-        ss << "Buffers[" << index << "]";
+        const size_t passIndex = index / c_HistoryLength;
+        if (passIndex >= passes.size() && m_Images[index].image)
+            continue;
+
+        const float passScale = passIndex < passes.size() ? passes[passIndex]->GetScale() : 1.f;
+        const float scale = passScale * program.GetRenderScale() * m_Throttle.renderScale;
+        const int imageWidth = std::max(int(float(width) * scale + 0.5f), 1);
+        const int imageHeight = std::max(int(float(height) * scale + 0.5f), 1);
+
+        // Only the outputs that are sampled with mipmap filtering get the mip chains
+        const bool generatesMips = passIndex < passes.size() && passes[passIndex]->GeneratesMips();
+        const int mipLevels = generatesMips ? int(GetRenderTargetMipLevels(imageWidth, imageHeight)) : 1;
+
+        if (m_Images[index].image && m_Images[index].width == imageWidth && m_Images[index].height == imageHeight &&
+            m_Images[index].mipLevels == mipLevels)
+            continue;
+
+        // The images and their descriptors may be in use by the frames in flight
+        if (!changed && m_Images[index].image)
+            vkDevice.waitIdle();
+
+        changed = true;
+
+        DestroyCommittedImage(vkDevice, m_Images[index]);
 
         auto imageInfo = vk::ImageCreateInfo()
-            .setExtent(vk::Extent3D(width, height, 1))
-            .setMipLevels(1)
+            .setExtent(vk::Extent3D(imageWidth, imageHeight, 1))
+            .setMipLevels(uint32_t(mipLevels))
             .setArrayLayers(1)
             .setImageType(vk::ImageType::e2D)
             .setFormat(vk::Format::eR16G16B16A16Sfloat)
-            .setUsage(vk::ImageUsageFlagBits::eTransferDst | vk::ImageUsageFlagBits::eSampled | vk::ImageUsageFlagBits::eColorAttachment);
+            .setUsage(vk::ImageUsageFlagBits::eTransferSrc | vk::ImageUsageFlagBits::eTransferDst | vk::ImageUsageFlagBits::eSampled | vk::ImageUsageFlagBits::eColorAttachment);
+
+        if (mipLevels > 1)
+            imageInfo.usage |= vk::ImageUsageFlagBits::eStorage;
 
         m_Images[index] = CreateCommittedImage(vkPhysicalDevice, vkDevice, imageInfo, vk::ImageViewType::e2D);
+
+        if (mipLevels > 1)
+            m_MipGenerator.SetImage(uint32_t(index), m_Images[index]);
         
         // Write the blit descriptor set
         auto descriptorInfo = vk::DescriptorImageInfo()
@@ -555,95 +891,80 @@ void ShaderProj::CreateBuffersAndBindings(int width, int height)
         vkDevice.updateDescriptorSets(1, &writeDescriptor, 0, nullptr);
     }
 
-    m_BufferLayoutInitd = false;
-
-    m_SwapChainLayoutInitd.clear();
-    m_SwapChainLayoutInitd.resize(GetSwapChainImageCount());
-
-    CommonResources common;
-    common.device = vkDevice;
-    common.constantBuffer = m_ConstantBuffer.buffer;
-    common.defaultSampler = m_Sampler;
-    common.dummyTexture = m_DummyTexture.imageView;
-    common.dummyCubemap = m_DummyCubemap.imageView;
-    common.dummyVolume = m_DummyVolume.imageView;
-    common.images = m_Images;
-    common.width = width;
-    common.height = height;
-    
-    for (auto& program : m_Programs)
+    if (changed)
     {
-        int index = 0;
-        for (auto& pass : program->GetPasses())
-        {
-            pass->CreateBindingSets(common, program->GetPasses(), index);
-            pass->CreatePipelineAndFramebuffers(vkDevice, m_VertexShader, m_PassPipelineLayout, m_PassRenderPass, width, height);
-            ++index;
-        }
+        // The bindings of all programs refer to the old images now
+        ++m_ImageGeneration;
+        m_BufferLayoutInitd = false;
     }
-    
-    vkDevice.destroyPipeline(m_BlitPipeline);
-    m_BlitPipeline = vk::Pipeline();
 
-    m_BlitPipeline = CreateQuadPipeline(
-        vkDevice,
-        m_BlitPipelineLayout,
-        m_VertexShader,
-        m_BlitFragmentShader,
-        m_BlitRenderPass,
-        width, height);
+    return changed;
+}
 
-    // Create the swap chain framebuffers
+void ShaderProj::RebuildProgramBindings(ShProgram& program)
+{
+    // The caller must make sure that the GPU is not using the descriptor sets and framebuffers
+    if (!m_Images[0].image)
+        return;
 
-    assert(m_SwapChainFramebuffers.empty());
+    const auto vkDevice = GetDevice();
 
-    for (uint32_t index = 0; index < GetSwapChainImageCount(); index++)
-    {
-        auto imageView = GetSwapChainImageView(index);
+    uint32_t width, height;
+    GetWindowDimensions(width, height);
 
-        auto framebufferInfo = vk::FramebufferCreateInfo()
-            .setRenderPass(m_BlitRenderPass)
-            .setAttachmentCount(1)
-            .setPAttachments(&imageView)
-            .setWidth(width)
-            .setHeight(height)
-            .setLayers(1);
+    const CommonResources common = GetCommonResources(width, height);
 
-        auto framebuffer = vkDevice.createFramebuffer(framebufferInfo);
+    int index = 0;
+    for (auto& pass : program.GetPasses())
+    {
+        pass->CreateBindingSets(common, program.GetPasses(), index);
 
-        m_SwapChainFramebuffers.push_back(framebuffer);
+        const Image& target = m_Images[pass->GetRenderTargetIndex(0)];
+        pass->CreateFramebuffers(vkDevice, m_PassRenderPass, target.width, target.height);
+        ++index;
     }
+
+    program.SetBindingGeneration(m_ImageGeneration);
 }
 
-void ShaderProj::Render()
+CommonResources ShaderProj::GetCommonResources(int width, int height)
 {
-    vk::CommandBuffer vkCmdBuf = GetCurrentCmdBuf();
-
-    if (m_Paused)
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
-
-    uint32_t width, height;
-    GetWindowDimensions(width, height);
+    CommonResources common;
+    common.device = GetDevice();
+    common.constantBuffer = m_ConstantBuffer.buffer;
+    common.defaultSampler = m_Sampler;
+    common.dummyTexture = m_DummyTexture.imageView;
+    common.dummyCubemap = m_DummyCubemap.imageView;
+    common.dummyVolume = m_DummyVolume.imageView;
+    common.images = m_Images;
+    common.width = width;
+    common.height = height;
+    return common;
+}
 
+void ShaderProj::PrepareFrameResources(vk::CommandBuffer cmdBuf, ShProgram& program, uint32_t width, uint32_t height)
+{
     if (!m_Images[0].image)
     {
         CreateBuffersAndBindings(width, height);
     }
-            
-    if (!m_StaticResourcesInitd)
+    else
     {
-        ClearImage(vkCmdBuf, m_DummyTexture.image, 1, ImageState::Undefined);
-        ClearImage(vkCmdBuf, m_DummyCubemap.image, 6, ImageState::Undefined);
-        ClearImage(vkCmdBuf, m_DummyVolume.image, 1, ImageState::Undefined);
-        m_StaticResourcesInitd = true;
+        UpdateImageSizes(program, width, height);
     }
 
-    if (m_ResetRequired)
+    // The images may have been re-created for another program since this one was rendered
+    if (program.GetBindingGeneration() != m_ImageGeneration)
     {
-        m_FrameIndex = 0;
-        m_CurrentTime = 0;
-        m_ResetRequired = false;
-        LOG("Playing %s for %.1f seconds\n", m_Programs[m_ActiveProgram]->GetName().c_str(), m_CurrentDuration);
+        RebuildProgramBindings(program);
+    }
+            
+    if (!m_StaticResourcesInitd)
+    {
+        ClearImage(cmdBuf, m_DummyTexture.image, 1, ImageState::Undefined);
+        ClearImage(cmdBuf, m_DummyCubemap.image, 6, ImageState::Undefined);
+        ClearImage(cmdBuf, m_DummyVolume.image, 1, ImageState::Undefined);
+        m_StaticResourcesInitd = true;
     }
 
     if (!m_BufferLayoutInitd)
@@ -651,13 +972,15 @@ void ShaderProj::Render()
         // Clear the buffers and initialize their layouts if they're new
         for (const auto& buffer : m_Images)
         {
-            ClearImage(vkCmdBuf, buffer.image, 1, m_BufferLayoutInitd ? ImageState::ShaderResource : ImageState::Undefined);
+            ClearImage(cmdBuf, buffer.image, 1, m_BufferLayoutInitd ? ImageState::ShaderResource : ImageState::Undefined, uint32_t(buffer.mipLevels));
         }
 
         m_BufferLayoutInitd = true;
     }
+}
 
-    // Fill the uniform buffer.
+ShadertoyUniforms ShaderProj::GetUniforms(uint32_t width, uint32_t height) const
+{
     ShadertoyUniforms uniforms = {};
     uniforms.iResolution[0] = float(width);
     uniforms.iResolution[1] = float(height);
@@ -669,56 +992,267 @@ void ShaderProj::Render()
     uniforms.iMouse[2] = float(m_MouseDragStart.x) * (m_MouseDown ? 1.f : -1.f);
     uniforms.iMouse[3] = float(height - 1.0 - m_MouseDragStart.y) * (m_MouseDown && (m_MouseDragStart.x == m_MousePos.x) && (m_MouseDragStart.y == m_MousePos.y) ? 1.f : -1.f);
     uniforms.iFrame = m_FrameIndex;
-    vkCmdBuf.updateBuffer(m_ConstantBuffer.buffer, 0, sizeof(uniforms), &uniforms);
-    
-    m_MouseChanged = false;
-    
-    auto program = m_Programs[m_ActiveProgram];
+    return uniforms;
+}
 
-    uint32_t historyIndex = m_FrameIndex % c_HistoryLength;
-    
-    // Execute all the passes.
-    for (auto& pass : program->GetPasses())
+void ShaderProj::UpdateUniforms(vk::CommandBuffer cmdBuf, uint32_t width, uint32_t height)
+{
+    const ShadertoyUniforms uniforms = GetUniforms(width, height);
+    cmdBuf.updateBuffer(m_ConstantBuffer.buffer, 0, sizeof(uniforms), &uniforms);
+
+    m_InputChanged = memcmp(uniforms.iMouse, m_Uniforms.iMouse, sizeof(uniforms.iMouse)) != 0;
+    m_Uniforms = uniforms;
+}
+
+void ShaderProj::RenderPasses(vk::CommandBuffer cmdBuf, ShProgram& program, uint32_t historyIndex)
+{
+    // A pass is rendered when the uniforms or the input buffers that it uses have changed, and on
+    // the frames selected by its update divisor. Everything is rendered on the first frame
+    // and when the textures get finer mips.
+    program.UpdateDirtyFlags(m_Uniforms, historyIndex, m_FrameIndex, m_FrameIndex == 0 || m_TexturesStreamed, m_DirtyTrackingEnabled);
+
+    for (auto& pass : program.GetPasses())
     {
-        auto vkDstImage = m_Images[pass->GetRenderTargetIndex(historyIndex)].image;
+        if (!pass->IsDirty())
+        {
+            // Hold the output constant: pinned passes have only one slot, others need
+            // the last output copied into the current slot where the consumers expect it,
+            // unless it's already there.
+            if (pass->NeedsHistoryCopy())
+            {
+                CopyImage(cmdBuf,
+                    m_Images[pass->GetRenderTargetIndex(!historyIndex)],
+                    m_Images[pass->GetRenderTargetIndex(historyIndex)]);
+            }
+            continue;
+        }
+
+        // Each pass renders at the resolution of its own target, which depends on the pass scale
+        const Image& target = m_Images[pass->GetRenderTargetIndex(historyIndex)];
+        const auto viewport = vk::Viewport()
+            .setWidth(float(target.width))
+            .setHeight(-float(target.height))
+            .setY(float(target.height))
+            .setMaxDepth(1.f);
+        const auto scissor = vk::Rect2D().setExtent(vk::Extent2D(target.width, target.height));
+        auto vkDstImage = target.image;
         auto vkRenderPass = m_PassRenderPass;
         auto vkFramebuffer = pass->GetFramebuffer(historyIndex);
         auto vkDescriptorSet = pass->GetDescriptorSet(historyIndex);
         
-        ImageBarrier(vkCmdBuf, vkDstImage, ImageState::ShaderResource, ImageState::RenderTarget);
+        ImageBarrier(cmdBuf, vkDstImage, ImageState::ShaderResource, ImageState::RenderTarget);
 
-        vkCmdBuf.beginRenderPass(vk::RenderPassBeginInfo()
+        cmdBuf.beginRenderPass(vk::RenderPassBeginInfo()
             .setRenderPass(vkRenderPass)
             .setFramebuffer(vkFramebuffer)
-            .setRenderArea(vk::Rect2D()
-                .setExtent(vk::Extent2D(width, height))),
+            .setRenderArea(scissor),
             vk::SubpassContents::eInline);
 
-        vkCmdBuf.bindPipeline(vk::PipelineBindPoint::eGraphics, pass->GetPipeline());
+        cmdBuf.bindPipeline(vk::PipelineBindPoint::eGraphics, pass->GetPipeline());
+        cmdBuf.setViewport(0, 1, &viewport);
+        cmdBuf.setScissor(0, 1, &scissor);
 
-        vkCmdBuf.bindDescriptorSets(vk::PipelineBindPoint::eGraphics, m_PassPipelineLayout, 0, 1, &vkDescriptorSet, 0, nullptr);
+        cmdBuf.bindDescriptorSets(vk::PipelineBindPoint::eGraphics, m_PassPipelineLayout, 0, 1, &vkDescriptorSet, 0, nullptr);
         
         auto pushConstants = pass->GetPushConstants();
-        vkCmdBuf.pushConstants(m_PassPipelineLayout, vk::ShaderStageFlagBits::eFragment, 0, sizeof(pushConstants), &pushConstants);
+        cmdBuf.pushConstants(m_PassPipelineLayout, vk::ShaderStageFlagBits::eFragment, 0, sizeof(pushConstants), &pushConstants);
 
-        vkCmdBuf.draw(4, 1, 0, 0);
+        cmdBuf.draw(4, 1, 0, 0);
 
-        vkCmdBuf.endRenderPass();
+        cmdBuf.endRenderPass();
         
-        ImageBarrier(vkCmdBuf, vkDstImage, ImageState::RenderTarget, ImageState::ShaderResource);
+        ImageBarrier(cmdBuf, vkDstImage, ImageState::RenderTarget, ImageState::ShaderResource);
+
+        if (pass->GeneratesMips())
+            m_MipGenerator.Generate(cmdBuf, pass->GetRenderTargetIndex(historyIndex), target);
     }
+}
+
+bool ShaderProj::RenderProgramOffline(ShProgram& program, int frames, GpuTimer* timer, double& gpuTimeNs, blob& image)
+{
+    // Renders the program from the start for a number of frames with fixed time steps,
+    // measures the average GPU time of the passes, and reads back the final image.
+    // The pipelines of the program must be ready.
+    const auto vkPhysicalDevice = GetPhysicalDevice();
+    const auto vkDevice = GetDevice();
+    const auto vkQueue = GetGraphicsQueue();
+    const double frameTime = 1.0 / 60.0;
+
+    uint32_t width, height;
+    GetWindowDimensions(width, height);
+
+    // Start from cleared buffers, as if the program was just selected
+    m_FrameIndex = 0;
+    m_CurrentTime = 0;
+    m_CurrentTimeDelta = frameTime;
+    m_BufferLayoutInitd = false;
+    gpuTimeNs = 0;
+
+    for (int frame = 0; frame < frames; frame++)
+    {
+        auto cmdBuf = GetCurrentCmdBuf();
+        cmdBuf.begin(vk::CommandBufferBeginInfo().setFlags(vk::CommandBufferUsageFlagBits::eOneTimeSubmit));
+
+        PrepareFrameResources(cmdBuf, program, width, height);
+        UpdateUniforms(cmdBuf, width, height);
+
+        if (timer)
+        {
+            timer->Reset(cmdBuf, 0, 2);
+            timer->WriteTimestamp(cmdBuf, 0);
+        }
+        RenderPasses(cmdBuf, program, m_FrameIndex % c_HistoryLength);
+        if (timer)
+            timer->WriteTimestamp(cmdBuf, 1);
+
+        cmdBuf.end();
+
+        auto submitInfo = vk::SubmitInfo()
+            .setCommandBufferCount(1)
+            .setPCommandBuffers(&cmdBuf);
+
+        auto res = vkQueue.submit(1, &submitInfo, nullptr);
+        if (res == vk::Result::eSuccess)
+        {
+            try
+            {
+                vkQueue.waitIdle();
+            }
+            catch (const vk::DeviceLostError&)
+            {
+                res = vk::Result::eErrorDeviceLost;
+            }
+        }
+
+        if (res != vk::Result::eSuccess)
+        {
+            if (res == vk::Result::eErrorDeviceLost)
+                SetDeviceLost();
+
+            LOG("ERROR: %s: failed to render frame %d offline, result = %s\n",
+                program.GetName().c_str(), frame, VulkanResultToString(res));
+            return false;
+        }
+
+        double frameNs = 0;
+        if (timer && timer->GetElapsedNanoseconds(0, 1, frameNs, true))
+            gpuTimeNs += frameNs / double(frames);
+
+        ++m_FrameIndex;
+        m_CurrentTime += frameTime;
+    }
+
+    const auto& imagePass = program.GetPasses()[program.GetImagePassIndex()];
+    const auto& target = m_Images[imagePass->GetRenderTargetIndex((m_FrameIndex - 1) % c_HistoryLength)];
+
+    return ReadbackImage(vkPhysicalDevice, vkDevice, vkQueue, GetCurrentCmdBuf(), target,
+        sizeof(uint16_t) * 4, image);
+}
+
+void ShaderProj::Render()
+{
+    vk::CommandBuffer vkCmdBuf = GetCurrentCmdBuf();
+
+    if (m_Paused)
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    // The GPU has finished the previous frame in this slot, so its timestamps are available.
+    // This can switch the program, so it's done before the program is selected for this frame.
+    const uint32_t frameSlot = GetFrameSlot();
+    if (m_FrameTimer.IsValid())
+    {
+        double gpuTimeNs = 0;
+        if (m_FrameSlotPrograms[frameSlot] >= 0 && m_FrameTimer.GetElapsedNanoseconds(frameSlot * 2, frameSlot * 2 + 1, gpuTimeNs, false))
+        {
+            RecordProgramCost(m_FrameSlotPrograms[frameSlot], gpuTimeNs);
+            CheckFrameBudget(m_FrameSlotPrograms[frameSlot], gpuTimeNs);
+            UpdateQualityLevel(m_FrameSlotPrograms[frameSlot], m_FrameSlotQuality[frameSlot], gpuTimeNs);
+        }
+    }
+
+    // Add the finer mips of the textures that are still streaming, and render the passes
+    // again when they change, because the passes that only use textures aren't dirty otherwise.
+    m_TexturesStreamed = UpdateTextureStreaming(GetPhysicalDevice(), GetDevice(), vkCmdBuf, frameSlot, c_TextureStreamingBudget);
+
+    uint32_t width, height;
+    GetWindowDimensions(width, height);
+
+    auto program = m_Programs[m_ActiveProgram];
+
+    PrepareFrameResources(vkCmdBuf, *program, width, height);
+
+    // Pick up the pipelines that were created since the last frame.
+    bool programReady = true;
+    bool programPending = false;
+    for (auto& program : m_Programs)
+    {
+        const bool active = program == m_Programs[m_ActiveProgram];
+        for (auto& pass : program->GetPasses())
+        {
+            if (!pass->InstallPendingPipeline() && active)
+            {
+                programReady = false;
+                programPending = programPending || pass->IsPipelinePending();
+            }
+        }
+    }
+
+    if (programPending)
+    {
+        // Hold the program at its first frame until it can be rendered.
+        m_CurrentTime = 0;
+        m_ResetRequired = true;
+    }
+    else if (m_ResetRequired)
+    {
+        m_FrameIndex = 0;
+        m_CurrentTime = 0;
+        m_ResetRequired = false;
+        LOG("Playing %s for %.1f seconds\n", m_Programs[m_ActiveProgram]->GetName().c_str(), m_CurrentDuration);
+        StartFrameBudgetCheck();
+    }
+
+    // The recovery is complete when the first frame after it is rendered
+    if (programReady && m_RecoveryPending)
+        FinishDeviceRecovery();
+
+    UpdateUniforms(vkCmdBuf, width, height);
+    
+    m_MouseChanged = false;
+
+    uint32_t historyIndex = m_FrameIndex % c_HistoryLength;
+    
+    if (m_FrameTimer.IsValid())
+    {
+        m_FrameTimer.Reset(vkCmdBuf, frameSlot * 2, 2);
+        m_FrameTimer.WriteTimestamp(vkCmdBuf, frameSlot * 2);
+    }
+
+    // Execute all the passes, unless some of their pipelines are not ready yet:
+    // in that case, the blit below just outputs black.
+    if (programReady)
+        RenderPasses(vkCmdBuf, *program, historyIndex);
+
+    if (m_FrameTimer.IsValid())
+        m_FrameTimer.WriteTimestamp(vkCmdBuf, frameSlot * 2 + 1);
+    m_FrameSlotPrograms[frameSlot] = programReady ? m_ActiveProgram : -1;
+    m_FrameSlotQuality[frameSlot] = program->GetQualityLevel();
 
     // Blit the final image into the swap chain.
     {
         float factor = 1.f;
-        if (m_CurrentDuration > 0)
+        if (!programReady)
+        {
+            factor = 0.f;
+        }
+        else if (m_CurrentDuration > 0)
         {
             const double transitionTime = 0.5;
             factor = float(std::min(m_CurrentTime, m_CurrentDuration - m_CurrentTime) / transitionTime);
             factor = std::max(0.f, std::min(1.f, factor));
         }
 
-        int finalBufferIndex = program->GetImagePassIndex() * c_HistoryLength + historyIndex;
+        int finalBufferIndex = program->GetPasses()[program->GetImagePassIndex()]->GetRenderTargetIndex(historyIndex);
         
         int swapChainIndex = GetCurrentSwapChainIndex();
         
@@ -736,7 +1270,16 @@ void ShaderProj::Render()
                 .setExtent(vk::Extent2D(width, height))),
             vk::SubpassContents::eInline);
 
+        const auto viewport = vk::Viewport()
+            .setWidth(float(width))
+            .setHeight(-float(height))
+            .setY(float(height))
+            .setMaxDepth(1.f);
+        const auto scissor = vk::Rect2D().setExtent(vk::Extent2D(width, height));
+
         vkCmdBuf.bindPipeline(vk::PipelineBindPoint::eGraphics, m_BlitPipeline);
+        vkCmdBuf.setViewport(0, 1, &viewport);
+        vkCmdBuf.setScissor(0, 1, &scissor);
 
         vkCmdBuf.bindDescriptorSets(vk::PipelineBindPoint::eGraphics, m_BlitPipelineLayout, 0, 1, &vkDescriptorSet, 0, nullptr);
         
@@ -749,7 +1292,10 @@ void ShaderProj::Render()
         ImageBarrier(vkCmdBuf, vkDstImage, ImageState::RenderTarget, ImageState::Present);
     }
     
-    ++m_FrameIndex;
+    // While paused, the frames only advance on input, so that the passes that use iFrame or
+    // read their own output don't have to be rendered again
+    if (!m_Paused || m_InputChanged || m_FrameIndex == 0)
+        ++m_FrameIndex;
 }
 
 
@@ -787,6 +1333,42 @@ bool LoadScript(const fs::path& scriptFileName, vector<ScriptEntry>& script)
             entry.programName = node["program"].asString();
             if (node["duration"].isNumeric())
                 entry.duration = node["duration"].asDouble();
+            if (node["precision"] == "relaxed")
+                entry.relaxedPrecision = true;
+            if (node["frameBudget"].isNumeric())
+                entry.frameBudget = node["frameBudget"].asDouble();
+
+            // Either "auto" or an object that maps pass names to divisors, e.g. { "Buffer B": 4 }
+            const auto& divisors = node["updateDivisors"];
+            if (divisors == "auto")
+            {
+                entry.autoPassDivisors = true;
+            }
+            else if (divisors.isObject())
+            {
+                for (const auto& passName : divisors.getMemberNames())
+                {
+                    if (divisors[passName].isInt())
+                        entry.passDivisors[passName] = divisors[passName].asInt();
+                }
+            }
+
+            ParseQualityLevels(node["qualityLevels"], entry.qualityLevels);
+
+            // Either "auto" or an object that maps pass names to resolution scales, e.g. { "Buffer A": 0.5 }
+            const auto& scales = node["passScales"];
+            if (scales == "auto")
+            {
+                entry.autoPassScales = true;
+            }
+            else if (scales.isObject())
+            {
+                for (const auto& passName : scales.getMemberNames())
+                {
+                    if (scales[passName].isNumeric())
+                        entry.passScales[passName] = scales[passName].asFloat();
+                }
+            }
         }
         else
             continue;
@@ -800,5 +1382,37 @@ bool LoadScript(const fs::path& scriptFileName, vector<ScriptEntry>& script)
         return false;
     }
 
+    LoadSelectedPassScales(GetPassScalesFile(scriptFileName), script);
+
     return true;
 }
+
+void ApplyScriptSettings(ShProgram& program, const vector<ScriptEntry>& script)
+{
+    for (const auto& entry : script)
+    {
+        if (entry.programName != program.GetName())
+            continue;
+
+        if (entry.relaxedPrecision)
+            program.SetRelaxedPrecision(true);
+
+        if (entry.frameBudget > 0)
+            program.SetFrameBudget(entry.frameBudget);
+
+        if (entry.autoPassDivisors)
+            program.SetAutoPassDivisors(true);
+
+        for (const auto& [passName, divisor] : entry.passDivisors)
+            program.SetPassDivisor(passName, divisor);
+
+        if (entry.autoPassScales)
+            program.SetAutoPassScales(true);
+
+        for (const auto& [passName, scale] : entry.passScales)
+            program.SetPassScale(passName, scale);
+
+        if (!entry.qualityLevels.empty())
+            program.SetQualityLevels(entry.qualityLevels);
+    }
+}
@@ -23,24 +23,118 @@
 #pragma once
 
 #include "VulkanApp.h"
+#include "Log.h"
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <functional>
 #include <filesystem>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
 #include <vector>
 
 #include <json/value.h>
 
-#define LOG(...) printf(__VA_ARGS__)
-
 namespace fs = std::filesystem;
 
 typedef std::vector<char> blob;
 
 bool ReadFile(const fs::path& name, std::vector<char>& result);
+bool WriteFile(const fs::path& name, const std::vector<char>& data);
+uint64_t GetProcessResidentBytes();
+float HalfToFloat(uint16_t value);
+
+bool InitStats(const fs::path& fileName);
+void ShutdownStats();
+bool IsStatsEnabled();
+void WriteStats(const Json::Value& record);
+
+struct PrefetchFile
+{
+    fs::path name;
+    bool keepData = true; // false only brings the file into the OS cache, for readers in other processes
+};
+
+// Reads batches of files in the background, with io_uring on Linux or with a thread pool
+void InitFilePrefetch(bool useIoUring);
+void ShutdownFilePrefetch();
+void PrefetchFiles(const std::vector<PrefetchFile>& files);
+// Returns the prefetched contents of a file, waiting for its read if needed, or reads the file if it wasn't prefetched
+bool ReadPrefetchedFile(const fs::path& name, blob& result);
+// Releases the prefetched data that nobody has taken
+void DiscardPrefetchedFiles();
+
+struct CompilerStats
+{
+    uint64_t compilations = 0;
+    uint64_t cacheHits = 0;
+    uint64_t failures = 0;
+    size_t scratchBytes = 0;
+    size_t peakScratchBytes = 0;
+};
 
 void InitCompiler();
 void ShutdownCompiler();
-bool CompileShader(const fs::path& shaderFile, const std::vector<blob*>& preambles, blob& output);
+void SetShaderCacheEnabled(bool enabled);
+CompilerStats GetCompilerStats();
+void AccumulateCompilerStats(const CompilerStats& stats);
+// The macros defined in 'macroOverrides' replace the definitions of the same macros in the other
+// preambles and in the shader source. The overrides must also be one of the preambles.
+// The variants of a shader that are used at the same time have their own cache files, named with
+// 'cacheVariant'; each file only keeps the last compilation of its variant.
+bool CompileShader(const fs::path& shaderFile, const std::vector<blob*>& preambles, blob& output, const blob* macroOverrides = nullptr,
+    const std::string& cacheVariant = std::string());
+
+struct CompileJob
+{
+    fs::path shaderFile;
+    std::vector<blob*> preambles;
+    blob* macroOverrides = nullptr;
+    std::string cacheVariant;
+    blob* output = nullptr;
+    bool success = false;
+};
+
+struct CompileWorkerParams
+{
+    int workerCount = 0; // 0 means compile in-process
+    double timeoutSeconds = 60.0;
+    uint64_t memoryLimitBytes = uint64_t(2) << 30;
+};
+
+bool RunCompileJobs(std::vector<CompileJob>& jobs, const CompileWorkerParams& params);
+// The declarations that are added before the code of every pass
+void GetShaderPreamble(blob& preamble);
+
+
+class ThreadPool
+{
+private:
+    std::condition_variable m_AllTasksDone;
+    std::condition_variable m_TaskAvailable;
+    std::deque<std::function<void()>> m_Tasks;
+    std::mutex m_Mutex;
+    std::vector<std::thread> m_Threads;
+    size_t m_PendingTasks = 0;
+    bool m_Terminate = false;
+
+    void ThreadProc();
+
+public:
+    explicit ThreadPool(int threadCount);
+    ~ThreadPool();
+
+    void AddTask(std::function<void()> task);
+    void WaitForAll();
+
+    [[nodiscard]] int GetThreadCount() const { return int(m_Threads.size()); }
+};
 
 
 struct Image
@@ -51,6 +145,10 @@ struct Image
     int width = 0;
     int height = 0;
     int depth = 0;
+    int mipLevels = 1;
+    uint64_t memorySize = 0;
+    // Single-level views, only created for the images with mips that can be written by shaders
+    std::vector<vk::ImageView> levelViews;
 };
 
 enum class ImageState
@@ -61,18 +159,58 @@ enum class ImageState
     RenderTarget,
     TransferSrc,
     TransferDst,
+    Storage,
 
     Count
 };
 
 void InitImageCache();
+void ReleaseImageCache(vk::Device device);
 void ShutdownImageCache(vk::Device device);
+// Drops a use of the image that LoadTexture, LoadVolume or LoadCubemap returned for the file. After the last one,
+// the image and its decoded copy are freed, so the GPU must be done with it.
+void ReleaseImage(vk::Device device, const fs::path& fileName);
+// Size of the CPU copy that is kept of a cached image for device loss recovery, with all its mip levels
+uint64_t GetDecodedImageSize(const Image& image);
+// Textures that are larger than this in either dimension are reduced by halving when they're decoded, 0 means no limit
+void SetTextureSizeLimit(int maxSize);
 Image LoadVolume(const fs::path& fileName, vk::PhysicalDevice physicalDevice, vk::Device device, vk::Queue queue, vk::CommandBuffer cmdBuf);
+// Uploads the smallest mips of a texture, the finer mips are added later by UpdateTextureStreaming
 Image LoadTexture(const fs::path& fileName, vk::PhysicalDevice physicalDevice, vk::Device device, vk::Queue queue, vk::CommandBuffer cmdBuf);
+// Records the upload of the next finer mips of the loaded textures, about byteBudget bytes in total.
+// The frame slot must be idle. Returns true if any texture has changed.
+bool UpdateTextureStreaming(vk::PhysicalDevice physicalDevice, vk::Device device, vk::CommandBuffer cmdBuf,
+    uint32_t frameSlot, uint64_t byteBudget);
+// Loads the 6 faces of a Shadertoy cubemap: the file itself and the files with _1 to _5 suffixes
+Image LoadCubemap(const fs::path& fileName, vk::PhysicalDevice physicalDevice, vk::Device device, vk::Queue queue, vk::CommandBuffer cmdBuf);
+// The files that LoadTexture and LoadCubemap will read, depending on whether the bake files are up to date
+void GetTexturePrefetchFiles(const fs::path& fileName, std::vector<PrefetchFile>& files);
+void GetCubemapPrefetchFiles(const fs::path& fileName, std::vector<PrefetchFile>& files);
+// Does the reading and decoding of LoadTexture and LoadCubemap ahead of time, on any thread, so that they
+// only upload the data. The results that are never loaded are freed by DiscardPreparedTextures.
+void PrepareTexture(const fs::path& fileName);
+void PrepareCubemap(const fs::path& fileName);
+void DiscardPreparedTextures();
+// The file names of the loaded images, which don't need to be prepared
+void GetCachedImageNames(std::unordered_set<std::string>& names);
 
 Image CreateCommittedImage(vk::PhysicalDevice physicalDevice, vk::Device device, const vk::ImageCreateInfo& info, vk::ImageViewType viewType);
 void DestroyCommittedImage(vk::Device device, Image& image);
-void ClearImage(vk::CommandBuffer vkCmdBuf, vk::Image vkImage, uint32_t layerCount, ImageState stateBefore);
+void ClearImage(vk::CommandBuffer vkCmdBuf, vk::Image vkImage, uint32_t layerCount, ImageState stateBefore, uint32_t mipLevels = 1);
+void CopyImage(vk::CommandBuffer cmdBuf, const Image& src, const Image& dst);
+bool ReadbackImage(vk::PhysicalDevice physicalDevice, vk::Device device, vk::Queue queue, vk::CommandBuffer cmdBuf,
+    const Image& image, uint32_t bytesPerPixel, blob& data);
+
+// Differences between two RGBA16F images as they would be displayed, i.e. with RGB clamped to [0, 1]
+struct ImageDifference
+{
+    double maxError = 0;
+    double meanError = 0;
+    double psnrDb = 0;
+    double differentFraction = 0; // fraction of pixels with an error above the threshold
+};
+
+bool CompareDisplayedImages(const blob& a, const blob& b, double pixelErrorThreshold, ImageDifference& result);
 void ImageBarrier(vk::CommandBuffer cmdBuf, vk::Image image,
     ImageState before,
     ImageState after,
@@ -103,17 +241,312 @@ void BufferBarrier(vk::CommandBuffer cmdBuf, vk::Buffer buffer,
     BufferState after);
 
 
+class GpuTimer
+{
+private:
+    vk::Device m_Device;
+    vk::QueryPool m_QueryPool;
+    uint32_t m_QueryCount = 0;
+    double m_TimestampPeriodNs = 1.0;
+
+public:
+    bool Init(vk::PhysicalDevice physicalDevice, vk::Device device, uint32_t queryCount);
+    void Shutdown();
+
+    void Reset(vk::CommandBuffer cmdBuf, uint32_t firstQuery, uint32_t queryCount);
+    void WriteTimestamp(vk::CommandBuffer cmdBuf, uint32_t query);
+
+    // Returns false if the results are not available yet, unless 'wait' is set.
+    bool GetElapsedNanoseconds(uint32_t beginQuery, uint32_t endQuery, double& nanoseconds, bool wait);
+
+    [[nodiscard]] bool IsValid() const { return !!m_QueryPool; }
+};
+
+
+// Reads the temperature and energy sensors that Linux exposes in sysfs: thermal zones and
+// RAPL powercap domains. The root directory is configurable so that a fake tree can be used.
+class PowerSensors
+{
+private:
+    std::vector<fs::path> m_ThermalZones;
+    std::vector<fs::path> m_EnergyCounters;
+    std::vector<uint64_t> m_EnergyRanges;
+    std::vector<uint64_t> m_LastEnergy;
+    double m_TotalEnergy = 0;
+    bool m_EnergyStarted = false;
+
+public:
+    bool Init(const fs::path& sysfsRoot);
+
+    // Highest temperature of all thermal zones, in degrees Celsius
+    bool ReadTemperature(double& celsius) const;
+    // Energy consumed by all top-level domains since the first call, in joules
+    bool ReadEnergy(double& joules);
+
+    [[nodiscard]] bool HasTemperature() const { return !m_ThermalZones.empty(); }
+    [[nodiscard]] bool HasEnergy() const { return !m_EnergyCounters.empty(); }
+};
+
+struct GovernorParams
+{
+    fs::path sysfsRoot = "/sys";
+    double maxTemperature = 80.0;      // degrees Celsius
+    double temperatureHysteresis = 5.0;
+    double maxPower = 0;               // watts, 0 means no limit
+    double updateInterval = 1.0;       // seconds
+    double holdTime = 10.0;            // minimum time between throttle level changes, in seconds
+};
+
+struct ThrottleSettings
+{
+    float renderScale = 1.f;
+    int fpsCap = 0;                    // 0 means no cap
+    bool skipExpensivePrograms = false;
+};
+
+// Raises the throttle level when the temperature or power is over the limit, and lowers it
+// when they have been below the limit for a while. Each level is a fixed set of throttle settings.
+class PowerGovernor
+{
+private:
+    GovernorParams m_Params;
+    PowerSensors m_Sensors;
+    int m_Level = 0;
+    double m_Time = 0;
+    double m_LastUpdate = 0;
+    double m_LastChange = 0;
+    double m_LastEnergy = 0;
+    double m_Temperature = 0;
+    double m_Power = 0;
+    std::string m_Reason;
+
+public:
+    bool Init(const GovernorParams& params);
+
+    // Returns true if the throttle level has changed
+    bool Update(double elapsedSeconds);
+
+    [[nodiscard]] ThrottleSettings GetSettings() const;
+    [[nodiscard]] int GetLevel() const { return m_Level; }
+    [[nodiscard]] double GetTemperature() const { return m_Temperature; }
+    [[nodiscard]] double GetPower() const { return m_Power; }
+    [[nodiscard]] const std::string& GetReason() const { return m_Reason; }
+};
+
+struct SyncParams
+{
+    bool leader = false;
+    // The leader receives on this port, and the followers send to it at the leader address
+    std::string leaderAddress;
+    uint16_t port = 0;
+    // Start the frames on the ticks of the shared clock, so that the displays swap at the same time
+    bool swapBarrier = false;
+};
+
+constexpr size_t c_SyncMaxProgramName = 128;
+
+// A program switch announced by the leader: every player starts the program at the shared time. The
+// scripts can be reloaded at different times on the players, so the program is sent by name, and the
+// script index of the leader only picks between the entries of a program that appears several times.
+struct SyncSwitch
+{
+    // Random for every run of the leader, whose sequence numbers start over when it restarts
+    uint32_t epoch = 0;
+    uint32_t sequence = 0;
+    int scriptIndex = 0;
+    double startTime = 0;
+    char program[c_SyncMaxProgramName] = {};
+};
+
+// Keeps several players on the clock of a leader player, see PlaybackSync.cpp. All the network traffic
+// is handled by a background thread, and the render thread only reads the latest estimates.
+class PlaybackSync
+{
+private:
+    SyncParams m_Params;
+    int m_Socket = -1;
+    std::thread m_Thread;
+    std::atomic<bool> m_Terminate{ false };
+
+    // Follower: the leader clock minus the local clock, and half of the round trip time of its measurement
+    std::atomic<double> m_Offset{ 0 };
+    std::atomic<double> m_Uncertainty{ 0 };
+    std::atomic<bool> m_Synchronized{ false };
+    // Set when the leader restarts, possibly on another machine, so that the shared time may go back once
+    std::atomic<bool> m_ClockReset{ false };
+
+    // The start of the last frame and the average frame interval, for the skew measurement
+    std::atomic<double> m_FrameTime{ 0 };
+    std::atomic<double> m_FramePeriod{ 0 };
+    double m_LastTime = 0;
+
+    // The last two switches, so that a follower that joins after the next switch has been announced
+    // still gets the current one
+    std::mutex m_Mutex;
+    std::array<SyncSwitch, 2> m_Switches;
+    std::atomic<bool> m_SwitchChanged{ false };
+    uint32_t m_Epoch = 0;
+
+    void LeaderThreadProc();
+    void FollowerThreadProc();
+    [[nodiscard]] double GetLocalTime() const;
+
+public:
+    ~PlaybackSync();
+
+    bool Start(const SyncParams& params);
+    void Stop();
+
+    [[nodiscard]] bool IsLeader() const { return m_Params.leader; }
+    // Followers run on their own clock until the first reply from the leader
+    [[nodiscard]] bool IsSynchronized() const { return m_Params.leader || m_Synchronized; }
+    // The shared time in seconds, which never goes backwards; only for the render thread
+    double GetTime();
+    void RecordFrame(double sharedTime);
+    [[nodiscard]] bool HasSwapBarrier() const { return m_Params.swapBarrier; }
+    // Sleeps until the next multiple of the period on the shared clock
+    void WaitForTick(double period);
+
+    // Leader only: the switch is sent to the followers by the background thread, with the epoch of this run
+    void AnnounceSwitch(const SyncSwitch& value);
+    // Returns the last switch that has started by the given shared time, or false if there is none
+    bool GetSwitch(double time, SyncSwitch& result);
+};
+
+constexpr int c_MaxQualityLevels = 4;
+
+// Tracks the GPU time of a program with quality variants, see ShaderProj::UpdateQualityLevel
+struct QualityState
+{
+    double gpuTimeNs = 0;
+    int samples = 0;
+    int previousLevel = -1;
+    double previousTimeNs = 0;
+    // Ratio of the GPU time at level N to the time at level N + 1, 0 if not measured yet
+    std::array<double, c_MaxQualityLevels> stepCost{};
+};
+
+// Measured GPU time of a program per frame, scaled to the full render resolution
+struct ProgramCost
+{
+    double gpuTimeNs = 0;
+    int samples = 0;
+};
+
+// Programs that are skipped because they exceeded the frame budget or caused problems before.
+// The list is kept in a JSON file that maps program names to the details of the incident.
+class Quarantine
+{
+private:
+    fs::path m_FileName;
+    Json::Value m_Entries{ Json::objectValue };
+
+public:
+    // A missing or unreadable file is the same as an empty one
+    void Load(const fs::path& fileName);
+    bool Save() const;
+
+    void Add(const std::string& programName, const Json::Value& details);
+    void Clear() { m_Entries = Json::Value(Json::objectValue); }
+    [[nodiscard]] bool Contains(const std::string& programName) const { return m_Entries.isMember(programName); }
+    [[nodiscard]] const Json::Value& GetEntries() const { return m_Entries; }
+};
+
+struct FrameBudgetParams
+{
+    double budget = 200.0;            // milliseconds of GPU time per frame, 0 to disable
+    int frames = 30;                  // number of frames that are checked after a program starts
+    float reducedRenderScale = 0.5f;  // scale to try before quarantining the program
+};
+
+// Energy and time attributed to a program while it was playing
+struct ProgramEnergy
+{
+    double joules = 0;
+    double seconds = 0;
+    double gpuBusyNs = 0;
+};
+
+// Memory held by a program. Vulkan doesn't report the sizes of shader modules, pipelines and
+// descriptor sets, so the modules are counted as their SPIR-V size and the others are only counted.
+struct ProgramMemory
+{
+    uint64_t spirvBytes = 0;
+    uint64_t declarationBytes = 0;
+    uint64_t decodedImageBytes = 0; // divided between the programs like the textures
+    uint64_t shaderModuleBytes = 0;
+    uint64_t textureBytes = 0;      // shared textures are divided between the programs that use them
+    uint64_t renderTargetBytes = 0; // at the current output size, the render targets are shared by all programs
+    int pipelines = 0;
+    int descriptorSets = 0;
+
+    [[nodiscard]] uint64_t GetCpuBytes() const { return spirvBytes + declarationBytes + decodedImageBytes; }
+    [[nodiscard]] uint64_t GetGpuBytes() const { return shaderModuleBytes + textureBytes + renderTargetBytes; }
+};
+
+
 vk::ShaderModule CreateShaderModule(vk::Device device, const uint32_t* data, size_t size);
 vk::ShaderModule CreateShaderModule(vk::Device device, const blob& data);
 
+// Finds which members of the uniform buffer and which iChannel samplers a pass shader uses, as bit masks.
+// Anything that can't be determined is reported as used.
+void ReflectPassResources(const blob& spirv, uint32_t& usedUniforms, uint32_t& usedChannels);
+
+struct PipelineCreationStats
+{
+    uint64_t wallTimeNs = 0;
+    // The fields below come from VK_EXT_pipeline_creation_feedback and are only valid if feedbackValid is set
+    bool feedbackValid = false;
+    bool cacheHit = false;
+    uint64_t feedbackNs = 0;
+    uint64_t fragmentStageNs = 0;
+    // Set when the pipeline was linked from libraries, see QuadPipelineLibrary
+    bool fastLink = false;
+    uint64_t linkTimeNs = 0;
+};
+
 vk::Pipeline CreateQuadPipeline(
     vk::Device device,
     vk::PipelineLayout pipelineLayout,
     vk::ShaderModule vertexShader,
     vk::ShaderModule fragmentShader,
     vk::RenderPass renderPass,
-    uint32_t width,
-    uint32_t height);
+    vk::PipelineCache pipelineCache = vk::PipelineCache(),
+    PipelineCreationStats* stats = nullptr,
+    bool creationFeedback = false);
+
+// Pre-built parts of the quad pipeline for VK_EXT_graphics_pipeline_library:
+// every pass has the same vertex input, vertex shader and output interface, so only
+// the fragment shader part is compiled per pass, and then fast-linked with the shared parts.
+class QuadPipelineLibrary
+{
+private:
+    vk::Device m_Device;
+    vk::Pipeline m_FragmentOutput;
+    vk::Pipeline m_PreRasterization;
+    vk::Pipeline m_VertexInput;
+    vk::PipelineLayout m_PipelineLayout;
+    vk::RenderPass m_RenderPass;
+
+public:
+    bool Init(
+        vk::Device device,
+        vk::PipelineLayout pipelineLayout,
+        vk::ShaderModule vertexShader,
+        vk::RenderPass renderPass,
+        vk::PipelineCache pipelineCache);
+
+    void Shutdown();
+
+    // Thread-safe, can be called from the pipeline creation threads.
+    vk::Pipeline CreatePipeline(
+        vk::ShaderModule fragmentShader,
+        vk::PipelineCache pipelineCache,
+        PipelineCreationStats* stats,
+        bool creationFeedback) const;
+
+    [[nodiscard]] bool IsValid() const { return !!m_Device; }
+};
 
 
 struct ShadertoyUniforms
@@ -132,12 +565,14 @@ struct ShadertoyPushConstants
 {
     float     iChannelResolution[4][4];
     float     iChannelTime[4];
+    float     iResolution[3]; // render target resolution of the pass (in pixels)
 };
 
 constexpr uint32_t c_MaxPassInputs = 4;
 constexpr uint32_t c_MaxPasses = 4;
 constexpr uint32_t c_HistoryLength = 2;
 constexpr uint32_t c_RenderImageCount = (c_MaxPasses + 1) * c_HistoryLength;
+constexpr uint64_t c_TextureStreamingBudget = 4 * 1024 * 1024; // Bytes of texture mips uploaded per frame
 
 struct CommonResources
 {
@@ -152,21 +587,144 @@ struct CommonResources
     std::array<Image, c_RenderImageCount> images;
 };
 
+// Number of mip levels of a render target that is sampled with mipmap filtering
+uint32_t GetRenderTargetMipLevels(int width, int height);
+
+// Generates the mip chains of the render targets with one compute dispatch per image,
+// see mipgen.comp.glsl. The images are identified by their index in CommonResources::images.
+class MipGenerator
+{
+private:
+    vk::Device m_Device;
+    Buffer m_CounterBuffer;
+    vk::DescriptorPool m_DescriptorPool;
+    vk::DescriptorSetLayout m_SetLayout;
+    vk::PipelineLayout m_PipelineLayout;
+    vk::Pipeline m_Pipeline;
+    vk::Sampler m_Sampler;
+    std::array<vk::DescriptorSet, c_RenderImageCount> m_DescriptorSets;
+    bool m_CountersInitd = false;
+
+public:
+    bool Init(vk::PhysicalDevice physicalDevice, vk::Device device, vk::PipelineCache pipelineCache);
+    void Shutdown();
+
+    // Must be called when an image with mips is created at the index
+    void SetImage(uint32_t index, const Image& image);
+    // Level 0 must be in the ShaderResource state, and the whole image is in that state afterwards
+    void Generate(vk::CommandBuffer cmdBuf, uint32_t index, const Image& image);
+
+    [[nodiscard]] bool IsValid() const { return !!m_Pipeline; }
+};
+
+// The software renderer runs the SPIR-V of the passes on the CPU, see SpirvInterpreter.cpp.
+// Pixels are shaded in 4x2 blocks, one pixel per lane, so that the derivatives can be taken
+// between the neighboring lanes.
+constexpr int c_SoftwareBlockWidth = 4;
+constexpr int c_SoftwareBlockHeight = 2;
+constexpr int c_SoftwareLanes = c_SoftwareBlockWidth * c_SoftwareBlockHeight;
+
+enum class SoftwareTextureType
+{
+    Texture2D,
+    Cube,
+    Volume
+};
+
+// RGBA float texels, starting with the largest level; a cubemap level has its 6 faces one after another
+struct SoftwareTexture
+{
+    SoftwareTextureType type = SoftwareTextureType::Texture2D;
+    int width = 0;
+    int height = 0;
+    int depth = 1;
+    std::vector<std::vector<float>> levels;
+};
+
+struct SoftwareChannel
+{
+    const SoftwareTexture* texture = nullptr;
+    bool repeat = true;
+    bool linear = true;
+    bool mipmap = false;
+};
+
+struct SoftwareShaderInputs
+{
+    ShadertoyUniforms uniforms{};
+    ShadertoyPushConstants push{};
+    std::array<SoftwareChannel, c_MaxPassInputs> channels;
+};
+
+class SpirvShader;
+class SpirvMachine;
+
+// Returns null and sets the error if the shader uses something that the interpreter doesn't support
+std::shared_ptr<const SpirvShader> LoadSpirvShader(const blob& spirv, std::string& error);
+// Decodes a texture input with the same size limit and mips as the GPU texture, see Image.cpp
+bool LoadSoftwareTexture(const fs::path& fileName, SoftwareTextureType type, SoftwareTexture& texture);
+
+// Executes a shader for blocks of pixels. It holds the registers and variables, so every thread needs its own.
+class SpirvInvocation
+{
+private:
+    std::unique_ptr<SpirvMachine> m_Machine;
+
+public:
+    explicit SpirvInvocation(std::shared_ptr<const SpirvShader> shader);
+    ~SpirvInvocation();
+
+    // The textures must stay alive until the next call
+    void SetInputs(const SoftwareShaderInputs& inputs);
+    // Shades the block with the lower left pixel at x, y. Returns the mask of the lanes
+    // that were not discarded; only their colors are written.
+    uint32_t ShadeBlock(int x, int y, float (&colors)[c_SoftwareLanes][4]);
+};
+
+struct PassPipelineParams
+{
+    vk::Device device;
+    vk::PipelineCache pipelineCache;
+    vk::PipelineLayout pipelineLayout;
+    vk::RenderPass renderPass;
+    vk::ShaderModule vertexShader;
+    const QuadPipelineLibrary* library = nullptr;
+    bool creationFeedback = false;
+};
+
+// Macro names and values that make up one quality level of a program, e.g. { "AA": "1" }
+typedef std::map<std::string, std::string> MacroSet;
+
+bool ParseQualityLevels(const Json::Value& node, std::vector<MacroSet>& levels);
+
 struct ScriptEntry
 {
     std::string programName;
     int programIndex = -1;
     double duration = 1.0;
+    bool relaxedPrecision = false;
+    bool autoPassDivisors = false;
+    std::map<std::string, int> passDivisors;
+    bool autoPassScales = false;
+    std::map<std::string, float> passScales;
+    double frameBudget = 0;
+    std::vector<MacroSet> qualityLevels;
 };
 
 bool LoadScript(const fs::path& scriptFileName, std::vector<ScriptEntry>& script);
+// The pass scales selected with --select-pass-scales are saved next to the script
+fs::path GetPassScalesFile(const fs::path& scriptFileName);
+// Fills the scales of the "auto" script entries from the saved selection
+void LoadSelectedPassScales(const fs::path& fileName, std::vector<ScriptEntry>& script);
+// Applies the settings of the script entries that refer to the program
+void ApplyScriptSettings(ShProgram& program, const std::vector<ScriptEntry>& script);
 
 
 class ShRenderpass
 {
 private:
     blob m_InputDeclarations;
-    blob m_ShaderData;
+    std::array<blob, c_MaxQualityLevels> m_ShaderData;
     fs::path m_ProjectPath;
     fs::path m_ShaderFile;
 
@@ -180,11 +738,39 @@ private:
     std::array<vk::ImageView, c_HistoryLength> m_RenderTargetViews;
     std::array<vk::Sampler, c_MaxPassInputs> m_Samplers;
     std::string m_OutputId;
+    std::string m_PassName;
     std::string m_ProgramName;
     std::vector<std::string> m_InputIds;
+    std::array<std::string, c_MaxPassInputs> m_ChannelInputIds;
+    std::array<int, c_MaxPassInputs> m_ChannelSources;
+    std::array<bool, c_MaxPassInputs> m_ChannelMipmaps{};
+    bool m_FeedsHistory = false;
+    bool m_NeedsFullPrecision = false;
+    bool m_GeneratesMips = false;
+    int m_UpdateDivisor = 1;
+    float m_Scale = 1.f;
+    int m_QualityLevel = 0;
 
-    vk::Pipeline m_Pipeline;
-    vk::ShaderModule m_FragmentShader;
+    // Dirty tracking: the version of the content in each history slot, and the uniforms and input
+    // versions that the last output was rendered from
+    std::array<uint32_t, c_MaxQualityLevels> m_UsedUniforms;
+    std::array<uint32_t, c_MaxQualityLevels> m_UsedChannels;
+    std::array<uint64_t, c_HistoryLength> m_SlotVersions{};
+    std::array<uint64_t, c_MaxPassInputs> m_InputVersions{};
+    ShadertoyUniforms m_RenderedUniforms{};
+    bool m_OutputValid = false;
+    bool m_Dirty = true;
+    bool m_CopyHistory = false;
+
+    // One shader and pipeline per quality level, level 0 is the unmodified shader
+    std::array<vk::Pipeline, c_MaxQualityLevels> m_Pipelines;
+    std::array<vk::ShaderModule, c_MaxQualityLevels> m_FragmentShaders;
+
+    // Written by a pipeline creation thread, picked up by InstallPendingPipeline at a frame boundary
+    std::array<std::atomic<VkPipeline>, c_MaxQualityLevels> m_PendingPipelines{};
+    std::array<std::atomic<bool>, c_MaxQualityLevels> m_PipelineFailed{};
+
+    bool GetInputFileName(const Json::Value& input, fs::path& result) const;
 
 public:
     ShRenderpass(
@@ -194,52 +780,178 @@ public:
         const fs::path& projectPath);
 
     bool AllocateDescriptorSets(vk::Device device, vk::DescriptorPool descriptorPool, vk::DescriptorSetLayout setLayout);
-    bool CompilePassShader(blob& preamble, blob& commonSource);
+    CompileJob GetCompileJob(blob& preamble, blob& commonSource, bool relaxedPrecision, int qualityLevel = 0, blob* qualityMacros = nullptr);
 
     void CreateBindingSets(
         const CommonResources& common,
         const std::vector<std::shared_ptr<ShRenderpass>>& passes,
         int outputIndex);
     
-    bool CreateFragmentShader(vk::Device device);
+    bool CreateFragmentShader(vk::Device device, int qualityLevel = 0);
 
-    bool CreatePipelineAndFramebuffers(
+    bool CreateFramebuffers(
         vk::Device device,
-        vk::ShaderModule vertexShader,
-        vk::PipelineLayout pipelineLayout,
         vk::RenderPass renderPass,
         uint32_t width,
         uint32_t height);
 
+    void CreatePipeline(const PassPipelineParams& params, int qualityLevel = 0);
+    bool InstallPendingPipeline();
+
     void Cleanup(vk::Device device);
     void DestroyFragmentShader(vk::Device device);
-    void DestroyPipelineAndFramebuffers(vk::Device device);
+    void DestroyFramebuffers(vk::Device device);
+    void DestroyPipeline(vk::Device device);
     void LoadTextures(vk::PhysicalDevice physicalDevice, vk::Device device, vk::Queue queue, vk::CommandBuffer cmdBuf);
+    // Decodes the textures and cubemaps that are not in 'cachedImages', so that LoadTextures only uploads them
+    void PrepareTextures(const std::unordered_set<std::string>& cachedImages) const;
+    void ReleaseTextures(vk::Device device);
+    // Sets up the channels of the software renderer with the same sampler settings as LoadTextures.
+    // The textures are shared between passes through the cache, and the buffer channels are left empty.
+    // Also finds the uniforms and channels that the shader reads, for the dirty tracking.
+    void LoadSoftwareInputs(
+        std::map<std::string, std::shared_ptr<SoftwareTexture>>& textureCache,
+        std::array<SoftwareChannel, c_MaxPassInputs>& channels);
+    void GetPrefetchFiles(std::vector<PrefetchFile>& files) const;
 
-    [[nodiscard]] vk::Pipeline GetPipeline() const { return m_Pipeline; }
+    [[nodiscard]] vk::Pipeline GetPipeline() const { return m_Pipelines[m_QualityLevel]; }
+    [[nodiscard]] bool IsPipelinePending() const { return !m_Pipelines[m_QualityLevel] && !m_PipelineFailed[m_QualityLevel]; }
     [[nodiscard]] vk::Framebuffer GetFramebuffer(int frame) const { return m_Framebuffers[frame]; }
     [[nodiscard]] uint32_t GetRenderTargetIndex(int frame) const { return m_RenderTargetIndices[frame]; }
     [[nodiscard]] vk::DescriptorSet GetDescriptorSet(int frame) const { return m_DescriptorSets[frame]; }
     [[nodiscard]] ShadertoyPushConstants GetPushConstants() const { return m_Push; }
+    [[nodiscard]] const std::string& GetOutputId() const { return m_OutputId; }
+    [[nodiscard]] const std::vector<std::string>& GetInputIds() const { return m_InputIds; }
+    // True if the pass output is read on the next frame, which accumulates precision errors
+    [[nodiscard]] bool FeedsHistory() const { return m_FeedsHistory; }
+    void SetFeedsHistory(bool value) { m_FeedsHistory = value; }
+    // True if the pass feeds the history or is read by a pass that needs full precision,
+    // so that the errors of its output would accumulate too
+    [[nodiscard]] bool NeedsFullPrecision() const { return m_NeedsFullPrecision; }
+    void SetNeedsFullPrecision(bool value) { m_NeedsFullPrecision = value; }
+
+    // The pass is rendered on every N-th frame, and its output is held constant in between
+    [[nodiscard]] int GetUpdateDivisor() const { return m_UpdateDivisor; }
+    void SetUpdateDivisor(int divisor) { m_UpdateDivisor = std::max(divisor, 1); }
+    // Decimated passes that don't feed the history always use the first history slot, so that
+    // nothing needs to be done on the frames when they're skipped
+    [[nodiscard]] bool IsPinnedToFirstSlot() const { return m_UpdateDivisor > 1 && !m_FeedsHistory; }
+    [[nodiscard]] const std::string& GetPassName() const { return m_PassName; }
+
+    // The pass renders at this fraction of the window resolution in both dimensions
+    [[nodiscard]] float GetScale() const { return m_Scale; }
+    void SetScale(float scale) { m_Scale = std::clamp(scale, 0.0625f, 1.f); }
+
+    // The pass renders with the shader variant of this quality level
+    [[nodiscard]] int GetQualityLevel() const { return m_QualityLevel; }
+    void SetQualityLevel(int level) { m_OutputValid = m_OutputValid && level == m_QualityLevel; m_QualityLevel = level; }
+    [[nodiscard]] bool HasShaderData(int level) const { return !m_ShaderData[level].empty(); }
+    [[nodiscard]] const blob& GetShaderData(int level) const { return m_ShaderData[level]; }
+    // Adds the memory of the pass, except the textures, which can be shared with other passes
+    void AccumulateMemory(ProgramMemory& memory) const;
+    [[nodiscard]] const Image& GetStaticInput(int channel) const { return m_StaticInputs[channel]; }
+    [[nodiscard]] bool HasFragmentShader(int level) const { return !!m_FragmentShaders[level]; }
+    [[nodiscard]] bool IsPipelineReady(int level) const { return !!m_Pipelines[level]; }
+    void ClearShaderData(int level) { m_ShaderData[level].clear(); }
+
+    // Index of the pass that renders the buffer bound to the channel, or -1
+    [[nodiscard]] const std::string& GetChannelInputId(int channel) const { return m_ChannelInputIds[channel]; }
+    [[nodiscard]] int GetChannelSource(int channel) const { return m_ChannelSources[channel]; }
+    void SetChannelSource(int channel, int passIndex) { m_ChannelSources[channel] = passIndex; }
+    // True if the channel is sampled with mipmap filtering
+    [[nodiscard]] bool IsChannelMipmapped(int channel) const { return m_ChannelMipmaps[channel]; }
+
+    // The output has a mip chain that is generated after the pass is rendered, because
+    // a consumer samples it with mipmap filtering
+    [[nodiscard]] bool GeneratesMips() const { return m_GeneratesMips; }
+    void SetGeneratesMips(bool value) { m_GeneratesMips = value; }
+
+    // The pass is rendered on this frame only if it's dirty; otherwise, its last output is held
+    void UpdateDirtyFlag(
+        const ShadertoyUniforms& uniforms,
+        const std::array<uint64_t, c_MaxPassInputs>& inputVersions,
+        uint32_t historyIndex,
+        bool scheduled,
+        bool trackChanges,
+        uint64_t& contentVersion);
+    void InvalidateOutput() { m_OutputValid = false; }
+    [[nodiscard]] bool IsDirty() const { return m_Dirty; }
+    // True if the last output must be copied into the current history slot for the consumers
+    [[nodiscard]] bool NeedsHistoryCopy() const { return m_CopyHistory; }
+    [[nodiscard]] uint64_t GetSlotVersion(uint32_t slot) const { return m_SlotVersions[slot]; }
 };
 
 
 class ShProgram
 {
 private:
+    blob m_CommonSource;
     fs::path m_CommonSourcePath;
     std::vector<std::shared_ptr<ShRenderpass>> m_Passes;
+    // Macro overrides of the reduced quality levels, starting with level 1
+    std::vector<blob> m_QualityMacros;
     int m_ImagePassIndex = 0;
+    int m_QualityLevel = 0;
+    bool m_AutoPassDivisors = false;
+    bool m_AutoPassScales = false;
+    bool m_RelaxedPrecision = false;
+    bool m_Quarantined = false;
+    bool m_Released = false;
+    float m_RenderScale = 1.f;
+    double m_FrameBudget = 0;
+    uint64_t m_BindingGeneration = 0;
+    uint64_t m_ContentVersion = 0;
     std::string m_Name;
 
 public:
     ShProgram(const std::string& name);
-    bool CompileShaders(blob& preamble);
+    void GetCompileJobs(blob& preamble, std::vector<CompileJob>& jobs);
+    // Jobs for the reduced quality levels, must be called after GetCompileJobs
+    void GetQualityCompileJobs(blob& preamble, std::vector<CompileJob>& jobs);
     bool Load(const fs::path& descriptionFileName, const fs::path& projectPath);
+    // The files that are read when the program is compiled and its textures are loaded
+    void GetPrefetchFiles(std::vector<PrefetchFile>& files) const;
 
     [[nodiscard]] const std::vector<std::shared_ptr<ShRenderpass>>& GetPasses() const { return m_Passes; }
     [[nodiscard]] int GetImagePassIndex() const { return m_ImagePassIndex; }
     [[nodiscard]] const std::string& GetName() const { return m_Name; }
+    [[nodiscard]] bool IsRelaxedPrecision() const { return m_RelaxedPrecision; }
+    [[nodiscard]] bool HasRelaxedPrecisionPasses() const;
+    void SetRelaxedPrecision(bool relaxed) { m_RelaxedPrecision = relaxed; }
+    [[nodiscard]] bool IsAutoPassDivisors() const { return m_AutoPassDivisors; }
+    void SetAutoPassDivisors(bool enabled) { m_AutoPassDivisors = enabled; }
+    bool SetPassDivisor(const std::string& passName, int divisor);
+    [[nodiscard]] bool IsAutoPassScales() const { return m_AutoPassScales; }
+    void SetAutoPassScales(bool enabled) { m_AutoPassScales = enabled; }
+    bool SetPassScale(const std::string& passName, float scale);
+
+    // Scale of all passes of the program, lowered when it doesn't fit into the frame budget
+    [[nodiscard]] float GetRenderScale() const { return m_RenderScale; }
+    void SetRenderScale(float scale) { m_RenderScale = scale; }
+    // GPU time budget per frame in milliseconds, 0 to use the global budget
+    [[nodiscard]] double GetFrameBudget() const { return m_FrameBudget; }
+    void SetFrameBudget(double milliseconds) { m_FrameBudget = milliseconds; }
+    [[nodiscard]] bool IsQuarantined() const { return m_Quarantined; }
+    void SetQuarantined(bool quarantined) { m_Quarantined = quarantined; }
+
+    // Level 0 is the unmodified program, higher levels are faster and look worse
+    [[nodiscard]] int GetQualityLevelCount() const { return 1 + int(m_QualityMacros.size()); }
+    [[nodiscard]] int GetQualityLevel() const { return m_QualityLevel; }
+    void SetQualityLevel(int level);
+    void SetQualityLevels(const std::vector<MacroSet>& levels);
+    // Destroys the passes of a program that the script doesn't use anymore
+    void Release(vk::Device device);
+    [[nodiscard]] bool IsReleased() const { return m_Released; }
+    // True if the pipelines of all passes for the level are created
+    [[nodiscard]] bool IsQualityLevelReady(int level) const;
+
+    // Decides which passes are rendered on this frame, in the pass order, so that the passes
+    // that read from a re-rendered pass are re-rendered as well
+    void UpdateDirtyFlags(const ShadertoyUniforms& uniforms, uint32_t historyIndex, int frameIndex, bool invalidate, bool trackChanges);
+
+    // Matches the render image generation of ShaderProj when the bindings are up to date
+    [[nodiscard]] uint64_t GetBindingGeneration() const { return m_BindingGeneration; }
+    void SetBindingGeneration(uint64_t generation) { m_BindingGeneration = generation; }
 };
 
 
@@ -256,6 +968,39 @@ struct CommandLineOptions
     std::string shader;
     std::string projectPath;
     std::string scriptFile;
+    std::string statsFile;
+    int cpuBenchmarkFrames = 0;
+    int compileWorkers = -1;
+    double compileTimeout = 60.0;
+    int compileMemoryLimit = 2048;
+    bool pipelineLibrary = true;
+    bool dirtyTracking = true;
+    int maxTextureSize = 0;
+    bool fullResTextures = false;
+    bool ioUring = true;
+    bool precisionReport = false;
+    bool memoryReport = false;
+    bool selectPassScales = false;
+    LogLevel logLevel = LogLevel::Info;
+    bool logJson = false;
+    double soakHours = 0;
+    bool governor = false;
+    bool energy = false;
+    double frameBudget = 200.0;
+    int budgetFrames = 30;
+    std::string quarantineFile;
+    bool listQuarantine = false;
+    bool clearQuarantine = false;
+    std::string softwareOutput;
+    int softwareBenchmarkFrames = 0;
+    int softwareThreads = 0;
+    bool syncLeader = false;
+    std::string syncLeaderAddress;
+    int syncPort = 0;
+    bool syncSwapBarrier = false;
+    double maxTemperature = 80.0;
+    double maxPower = 0;
+    std::string sysfsRoot;
     
     std::string errorMessage;
 
@@ -263,6 +1008,52 @@ struct CommandLineOptions
     bool novalue(const char* arg);
 };
 
+struct CpuBenchmarkParams
+{
+    fs::path projectPath;
+    fs::path scriptPath;
+    int frames = 1000;
+    int iterations = 20;
+    int resizes = 20;
+};
+
+struct SoakParams
+{
+    double simulatedHours = 24.0;
+    double timestep = 0.1;
+    double programInterval = 60.0;
+    double reloadInterval = 3600.0;
+    double resizeInterval = 1800.0;
+    double sampleInterval = 600.0;
+};
+
+struct SoftwareRendererParams
+{
+    // Raw RGB8 frames, top row first, are written here; a FIFO works for streaming
+    fs::path outputPath;
+    uint32_t width = 1280;
+    uint32_t height = 720;
+    int refreshRate = 60;
+    // 0 means one per CPU core
+    int threads = 0;
+    // If not 0, every program is rendered for this many frames without output, and the time is reported
+    int benchmarkFrames = 0;
+};
+
+struct PrecisionReportParams
+{
+    int frames = 60;
+    // A pixel counts as different if any channel differs by more than this, after clamping to [0, 1]
+    double pixelErrorThreshold = 2.0 / 255.0;
+    // The relaxed variant is considered safe if no more than this fraction of pixels are different
+    double maxDifferentPixels = 0.001;
+};
+
+struct PassScaleParams
+{
+    fs::path outputFile;
+};
+
 struct Point2D
 {
     double x = 0;
@@ -288,23 +1079,93 @@ private:
     int m_ActiveProgram = 0;
     int m_FrameIndex = 0;
     int m_ScriptIndex = 0;
+    uint64_t m_ImageGeneration = 0;
+    ShadertoyUniforms m_Uniforms{};
+    bool m_DirtyTrackingEnabled = true;
+    bool m_InputChanged = false;
+    bool m_TexturesStreamed = false;
+    int m_MaxTextureSize = 0;
+    bool m_FitTexturesToOutput = true;
 
     Buffer m_ConstantBuffer;
+    CompileWorkerParams m_CompileWorkerParams;
     Image m_DummyCubemap;
     Image m_DummyTexture;
     Image m_DummyVolume;
 
     std::array<Image, c_RenderImageCount> m_Images;
+    MipGenerator m_MipGenerator;
+    std::unique_ptr<PowerGovernor> m_Governor;
+    ThrottleSettings m_Throttle;
+    GpuTimer m_FrameTimer;
+    std::vector<int> m_FrameSlotPrograms;
+    std::vector<int> m_FrameSlotQuality;
+    std::vector<ProgramCost> m_ProgramCosts;
+    std::unique_ptr<PowerSensors> m_EnergySensors;
+    // Synchronization with other players: the shared time when the current program started,
+    // and the sequence numbers of the last switch that was applied and announced
+    std::unique_ptr<PlaybackSync> m_Sync;
+    double m_SyncProgramStart = 0;
+    uint32_t m_SyncEpoch = 0;
+    uint32_t m_SyncSequence = 0;
+    uint32_t m_SyncAnnounced = 0;
+    uint32_t m_SyncNextSequence = 0;
+    int m_SyncScriptIndex = -1;
+    std::vector<ProgramEnergy> m_ProgramEnergy;
+    std::chrono::steady_clock::time_point m_EnergySampleTime;
+    std::chrono::steady_clock::time_point m_EnergyReportTime;
+    double m_LastEnergy = 0;
+    int m_EnergyProgram = -1;
+    FrameBudgetParams m_FrameBudget;
+    Quarantine m_Quarantine;
+    int m_BudgetProgram = -1;
+    int m_BudgetFrames = 0;
+    double m_BudgetTimeNs = 0;
+    std::chrono::steady_clock::time_point m_FrameLimiterTime;
+    std::unique_ptr<ThreadPool> m_PipelineThreads;
+    QuadPipelineLibrary m_PassPipelineLibrary;
+    bool m_PipelineLibraryEnabled = true;
     std::array<vk::DescriptorSet, c_RenderImageCount> m_BlitDescriptorSets;
     std::vector<bool> m_SwapChainLayoutInitd;
     std::vector<ScriptEntry> m_Script;
+    std::vector<blob> m_PassChangeSamples;
     std::vector<std::shared_ptr<ShProgram>> m_Programs;
     std::vector<vk::Framebuffer> m_SwapChainFramebuffers;
 
+    blob m_QualityPreamble;
+    std::vector<CompileJob> m_QualityJobs;
+    std::thread m_QualityCompileThread;
+    std::atomic<bool> m_QualityCompileDone{ false };
+    bool m_QualityVariantsInstalled = true;
+    std::vector<QualityState> m_QualityStates;
+
+    // The script file is polled for changes; the programs that a new version adds are loaded and
+    // compiled in the background, and the new script replaces the old one at the next transition
+    fs::path m_ScriptPath;
+    fs::path m_ProjectPath;
+    fs::file_time_type m_ScriptTime;
+    double m_BaseInterval = 1.0;
+    double m_ScriptPollTime = 0;
+    blob m_ScriptPreamble;
+    std::vector<ScriptEntry> m_LoadedScript;
+    std::vector<std::shared_ptr<ShProgram>> m_LoadedPrograms;
+    std::thread m_ScriptLoadThread;
+    std::atomic<bool> m_ScriptLoadDone{ false };
+    bool m_ScriptLoadPending = false;
+    // By program index: the programs that a script reload installed have their own descriptor pool, which
+    // is destroyed when they are released; the others allocate from m_DescriptorPool
+    std::vector<vk::DescriptorPool> m_ProgramDescriptorPools;
+
+    blob m_PipelineCacheData;
+    std::chrono::steady_clock::time_point m_DeviceLostTime;
+    int m_DeviceLostProgram = -1;
+    bool m_RecoveryPending = false;
+
     vk::DescriptorPool m_DescriptorPool;
     vk::DescriptorSetLayout m_BlitDescriptorSetLayout;
     vk::DescriptorSetLayout m_PassDescriptorSetLayout;
     vk::Pipeline m_BlitPipeline;
+    vk::PipelineCache m_PipelineCache;
     vk::PipelineLayout m_BlitPipelineLayout;
     vk::PipelineLayout m_PassPipelineLayout;
     vk::RenderPass m_BlitRenderPass;
@@ -313,15 +1174,57 @@ private:
     vk::ShaderModule m_BlitFragmentShader;
     vk::ShaderModule m_VertexShader;
 
+    bool CompilePrograms(const std::vector<std::shared_ptr<ShProgram>>& programs);
+    bool CreateDeviceObjects();
     bool CreateShaderObjects();
     void CreateBuffersAndBindings(int width, int height);
+    void CreatePassPipelines();
+    void DestroyPassPipelines();
+    CommonResources GetCommonResources(int width, int height);
+    PassPipelineParams GetPassPipelineParams();
+    void DestroyDeviceObjects();
     void DestroyShaderObjects(vk::Device device);
+    void FinishDeviceRecovery();
+    bool HasQualityLevels() const;
+    void InstallQualityVariants();
+    void ApplyLoadedScript();
+    void InstallLoadedProgram(const std::shared_ptr<ShProgram>& program);
+    void ReleaseProgram(int programIndex);
+    void ResolveScript(const std::vector<ScriptEntry>& script, std::vector<ScriptEntry>& result) const;
+    void UpdateScriptReload(double elapsedSeconds);
+    void WaitForScriptLoad();
+    void CheckFrameBudget(int programIndex, double gpuTimeNs);
+    bool IsProgramSkipped(int programIndex) const;
+    bool IsProgramThrottled(int programIndex) const;
+    int FindNextScriptIndex() const;
+    int FindSyncScriptIndex(const SyncSwitch& value) const;
     void NextProgram();
+    void MeasurePassChange();
+    void PrepareFrameResources(vk::CommandBuffer cmdBuf, ShProgram& program, uint32_t width, uint32_t height);
     void PreviousProgram();
+    void RebuildProgramBindings(ShProgram& program);
+    void RecordProgramCost(int programIndex, double gpuTimeNs);
+    void QuarantineProgram(int programIndex, const Json::Value& details);
+    void SampleEnergy(bool force);
+    void StartQualityCompilation();
+    void StartFrameBudgetCheck();
+    void ReloadShaders();
+    void RenderPasses(vk::CommandBuffer cmdBuf, ShProgram& program, uint32_t historyIndex);
+    bool RenderProgramOffline(ShProgram& program, int frames, GpuTimer* timer, double& gpuTimeNs, blob& image);
+    bool SelectPassScales(ShProgram& program, GpuTimer& timer, Json::Value& scales);
+    bool UpdateImageSizes(const ShProgram& program, uint32_t width, uint32_t height);
+    void UpdateGovernor(double elapsedSeconds);
+    void UpdatePlaybackSync();
+    void UpdateQualityLevel(int programIndex, int qualityLevel, double gpuTimeNs);
+    ShadertoyUniforms GetUniforms(uint32_t width, uint32_t height) const;
+    int GetTextureSizeLimit(uint32_t width, uint32_t height) const;
+    void UpdateUniforms(vk::CommandBuffer cmdBuf, uint32_t width, uint32_t height);
 
 protected:
     void Animate(double fElapsedTimeSeconds) override;
     void BackBufferResizing() override;
+    void DeviceLost() override;
+    bool DeviceRecreated() override;
     void KeyboardUpdate(int key, int scancode, int action, int mods) override;
     void MouseButtonUpdate(int button, int action, int mods) override;
     void MousePosUpdate(double xpos, double ypos) override;
@@ -329,8 +1232,33 @@ protected:
 
 public:
     ShaderProj(const std::vector<std::shared_ptr<ShProgram>>& programs);
+    ~ShaderProj() override;
     bool Init();
     bool LoadShaders();
+    void RunCpuBenchmark(const CpuBenchmarkParams& params);
+    bool RunSoakTest(const SoakParams& params);
+    bool RunSoftwareRenderer(const SoftwareRendererParams& params);
+    void RunPrecisionReport(const PrecisionReportParams& params);
+    // Selects the scales of the passes of the "auto" programs and saves them to 'params.outputFile'
+    bool RunPassScaleSelection(const PassScaleParams& params);
     bool SetScript(const std::vector<ScriptEntry>& script, double baseInterval);
+    // Watches the script file and plays its new version without restarting
+    void EnableScriptReload(const fs::path& scriptPath, const fs::path& projectPath);
+    void SetCompileWorkerParams(const CompileWorkerParams& params) { m_CompileWorkerParams = params; }
+    void SetPipelineLibraryEnabled(bool enabled) { m_PipelineLibraryEnabled = enabled; }
+    void SetDirtyTrackingEnabled(bool enabled) { m_DirtyTrackingEnabled = enabled; }
+    // The textures are limited to the output size rounded up to a power of 2, and to 'maxSize' if it's not 0
+    void SetTextureImportLimits(int maxSize, bool fitToOutput) { m_MaxTextureSize = maxSize; m_FitTexturesToOutput = fitToOutput; }
+    bool EnableGovernor(const GovernorParams& params);
+    bool EnablePlaybackSync(const SyncParams& params);
+    bool EnableEnergyAccounting(const fs::path& sysfsRoot);
+    void SetFrameBudget(const FrameBudgetParams& params) { m_FrameBudget = params; }
+    void SetQuarantine(const Quarantine& quarantine) { m_Quarantine = quarantine; }
+    // Writes the energy used by every program so far to the stats file, and to the log if 'print' is true
+    void WriteEnergyReport(bool print);
+    // Writes the memory used by every program to the stats file, and to the log if 'print' is true
+    void WriteMemoryReport(bool print);
+    void WaitForPipelines();
+    void WaitForQualityCompilation();
     void Shutdown() override;
 };
\ No newline at end of file
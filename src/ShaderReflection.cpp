@@ -0,0 +1,121 @@
+/*
+* Copyright (c) 2022, NVIDIA CORPORATION. All rights reserved.
+*
+* Permission is hereby granted, free of charge, to any person obtaining a
+* copy of this software and associated documentation files (the "Software"),
+* to deal in the Software without restriction, including without limitation
+* the rights to use, copy, modify, merge, publish, distribute, sublicense,
+* and/or sell copies of the Software, and to permit persons to whom the
+* Software is furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+* THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+* DEALINGS IN THE SOFTWARE.
+*/
+
+
+
+
+#include "ShaderProj.h"
+#include "Spirv.h"
+
+#include <unordered_map>
+
+// A minimal SPIR-V parser that finds which uniforms and input channels a pass shader uses,
+// for the dirty tracking of the passes. It only looks at the instructions that glslang generates
+// for the Shadertoy preamble: the uniform buffer members are accessed through OpAccessChain with
+// a constant member index, and the samplers are loaded from their variables.
+
+void ReflectPassResources(const blob& spirv, uint32_t& usedUniforms, uint32_t& usedChannels)
+{
+    usedUniforms = ~0u;
+    usedChannels = ~0u;
+
+    const uint32_t* words = reinterpret_cast<const uint32_t*>(spirv.data());
+    const size_t wordCount = spirv.size() / sizeof(uint32_t);
+    if (wordCount < c_SpirvHeaderWords || words[0] != c_SpirvMagic)
+        return;
+
+    // The declarations come before the functions
+    std::unordered_map<uint32_t, uint32_t> bindings;
+    std::unordered_map<uint32_t, uint32_t> constants;
+    std::unordered_map<uint32_t, uint32_t> storageClasses;
+    size_t firstFunction = wordCount;
+
+    for (size_t pos = c_SpirvHeaderWords; pos < wordCount; )
+    {
+        const uint32_t length = words[pos] >> 16;
+        const uint16_t opcode = uint16_t(words[pos] & 0xffff);
+        if (length == 0 || pos + length > wordCount)
+            return;
+
+        if (opcode == c_OpDecorate && length >= 4 && words[pos + 2] == c_DecorationBinding)
+            bindings[words[pos + 1]] = words[pos + 3];
+        else if (opcode == c_OpConstant && length >= 4)
+            constants[words[pos + 2]] = words[pos + 3];
+        else if (opcode == c_OpVariable && length >= 4 && pos < firstFunction)
+            storageClasses[words[pos + 2]] = words[pos + 3];
+        else if (opcode == c_OpFunction && firstFunction == wordCount)
+            firstFunction = pos;
+
+        pos += length;
+    }
+
+    uint32_t uniformBuffer = 0;
+    std::array<uint32_t, c_MaxPassInputs> channels{};
+    for (const auto& [id, binding] : bindings)
+    {
+        auto storageClass = storageClasses.find(id);
+        if (storageClass == storageClasses.end())
+            continue;
+
+        if (storageClass->second == c_StorageClassUniform && binding == c_UniformBufferBinding)
+            uniformBuffer = id;
+        else if (storageClass->second == c_StorageClassUniformConstant && binding < c_MaxPassInputs)
+            channels[binding] = id;
+    }
+
+    usedUniforms = 0;
+    usedChannels = 0;
+
+    // Any other reference to the variables, e.g. passing them to a function, counts as a use
+    // of everything in them. Literal operands may be mistaken for references, which is safe.
+    for (size_t pos = firstFunction; pos < wordCount; )
+    {
+        const uint32_t length = words[pos] >> 16;
+        const uint16_t opcode = uint16_t(words[pos] & 0xffff);
+
+        if ((opcode == c_OpAccessChain || opcode == c_OpInBoundsAccessChain) && length >= 5 && uniformBuffer && words[pos + 3] == uniformBuffer)
+        {
+            auto member = constants.find(words[pos + 4]);
+            if (member != constants.end() && member->second < 32)
+                usedUniforms |= 1u << member->second;
+            else
+                usedUniforms = ~0u;
+        }
+        else
+        {
+            for (uint32_t operand = 1; operand < length; operand++)
+            {
+                const uint32_t id = words[pos + operand];
+                if (uniformBuffer && id == uniformBuffer)
+                    usedUniforms = ~0u;
+
+                for (uint32_t channel = 0; channel < c_MaxPassInputs; channel++)
+                {
+                    if (channels[channel] && id == channels[channel])
+                        usedChannels |= 1u << channel;
+                }
+            }
+        }
+
+        pos += length;
+    }
+}
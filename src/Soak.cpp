@@ -0,0 +1,221 @@
+/*
+* Copyright (c) 2022, NVIDIA CORPORATION. All rights reserved.
+*
+* Permission is hereby granted, free of charge, to any person obtaining a
+* copy of this software and associated documentation files (the "Software"),
+* to deal in the Software without restriction, including without limitation
+* the rights to use, copy, modify, merge, publish, distribute, sublicense,
+* and/or sell copies of the Software, and to permit persons to whom the
+* Software is furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+* THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+* DEALINGS IN THE SOFTWARE.
+*/
+
+
+#include "ShaderProj.h"
+
+#include <algorithm>
+#include <chrono>
+
+using namespace std;
+
+struct SoakSample
+{
+    double simulatedTime = 0;
+    double frameNs = 0;
+    uint64_t residentBytes = 0;
+    NullDriverStats driver;
+};
+
+// Reports growth when every sample in the second half of the run is above every sample
+// in the first half. The first quarter of the samples is skipped as warm-up. Comparing
+// the extremes makes the test insensitive to the periodic resizes and program switches.
+static bool DetectGrowth(const vector<double>& series, double tolerance)
+{
+    if (series.size() < 8)
+        return false;
+
+    const size_t start = series.size() / 4;
+    const size_t middle = start + (series.size() - start) / 2;
+
+    const double earlyMax = *max_element(series.begin() + start, series.begin() + middle);
+    const double lateMin = *min_element(series.begin() + middle, series.end());
+
+    return lateMin > earlyMax + tolerance;
+}
+
+static double Average(vector<double>::const_iterator begin, vector<double>::const_iterator end)
+{
+    if (begin == end)
+        return 0.0;
+
+    double sum = 0.0;
+    for (auto it = begin; it != end; ++it)
+        sum += *it;
+    return sum / double(end - begin);
+}
+
+bool ShaderProj::RunSoakTest(const SoakParams& params)
+{
+    // Make every reload go through the compiler, like editing the shaders would.
+    SetShaderCacheEnabled(false);
+
+    uint32_t baseWidth, baseHeight;
+    GetWindowDimensions(baseWidth, baseHeight);
+
+    const double duration = params.simulatedHours * 3600.0;
+    double simulatedTime = 0.0;
+    double nextProgramTime = params.programInterval;
+    double nextReloadTime = params.reloadInterval;
+    double nextResizeTime = params.resizeInterval;
+    double nextSampleTime = params.sampleInterval;
+    bool smallWindow = false;
+
+    double frameNsSum = 0.0;
+    int frameCount = 0;
+    vector<SoakSample> samples;
+
+    LOG("Running a soak test for %.1f simulated hours...\n", params.simulatedHours);
+
+    while (simulatedTime < duration)
+    {
+        if (simulatedTime >= nextProgramTime)
+        {
+            NextProgram();
+            nextProgramTime += params.programInterval;
+        }
+
+        if (simulatedTime >= nextReloadTime)
+        {
+            ReloadShaders();
+            nextReloadTime += params.reloadInterval;
+        }
+
+        if (simulatedTime >= nextResizeTime)
+        {
+            smallWindow = !smallWindow;
+            SetBackBufferSize(
+                smallWindow ? std::max(baseWidth / 2, 1u) : baseWidth,
+                smallWindow ? std::max(baseHeight / 2, 1u) : baseHeight);
+            nextResizeTime += params.resizeInterval;
+        }
+
+        const auto frameStart = chrono::steady_clock::now();
+
+        Animate(params.timestep);
+        BeginFrame();
+        Render();
+        Present();
+
+        frameNsSum += chrono::duration<double, nano>(chrono::steady_clock::now() - frameStart).count();
+        ++frameCount;
+
+        simulatedTime += params.timestep;
+
+        if (simulatedTime >= nextSampleTime)
+        {
+            SoakSample sample;
+            sample.simulatedTime = simulatedTime;
+            sample.frameNs = frameNsSum / double(std::max(frameCount, 1));
+            sample.residentBytes = GetProcessResidentBytes();
+            sample.driver = GetNullDriverStats();
+            samples.push_back(sample);
+
+            Json::Value record;
+            record["type"] = "soak_sample";
+            record["simulated_time"] = sample.simulatedTime;
+            record["frame_ns"] = sample.frameNs;
+            record["resident_bytes"] = Json::UInt64(sample.residentBytes);
+            record["vulkan_allocations"] = Json::UInt64(sample.driver.memoryAllocations);
+            record["vulkan_allocated_bytes"] = Json::UInt64(sample.driver.memoryBytes);
+            record["vulkan_objects"] = Json::UInt64(sample.driver.liveObjects);
+            record["descriptor_sets"] = Json::UInt64(sample.driver.descriptorSets);
+
+            const CompilerStats compilerStats = GetCompilerStats();
+            record["shader_compilations"] = Json::UInt64(compilerStats.compilations);
+            record["compiler_scratch_bytes"] = Json::UInt64(compilerStats.scratchBytes);
+            WriteStats(record);
+
+            LOG("Soak: %.1f h, frame %.0f ns, RSS %.1f MB, %llu allocations (%.1f MB), %llu objects, %llu descriptor sets\n",
+                simulatedTime / 3600.0, sample.frameNs, double(sample.residentBytes) / 1048576.0,
+                (unsigned long long)sample.driver.memoryAllocations, double(sample.driver.memoryBytes) / 1048576.0,
+                (unsigned long long)sample.driver.liveObjects, (unsigned long long)sample.driver.descriptorSets);
+
+            frameNsSum = 0.0;
+            frameCount = 0;
+            nextSampleTime += params.sampleInterval;
+        }
+    }
+
+    SetShaderCacheEnabled(true);
+
+    vector<double> residentBytes, allocations, allocatedBytes, objects, descriptorSets, frameTimes;
+    for (const auto& sample : samples)
+    {
+        residentBytes.push_back(double(sample.residentBytes));
+        allocations.push_back(double(sample.driver.memoryAllocations));
+        allocatedBytes.push_back(double(sample.driver.memoryBytes));
+        objects.push_back(double(sample.driver.liveObjects));
+        descriptorSets.push_back(double(sample.driver.descriptorSets));
+        frameTimes.push_back(sample.frameNs);
+    }
+
+    vector<string> failures;
+
+    const double residentTolerance = std::max(4.0 * 1048576.0,
+        residentBytes.empty() ? 0.0 : 0.02 * *max_element(residentBytes.begin(), residentBytes.end()));
+
+    if (DetectGrowth(residentBytes, residentTolerance))
+        failures.push_back("resident memory grows");
+    if (DetectGrowth(allocations, 0.0))
+        failures.push_back("Vulkan allocation count grows");
+    if (DetectGrowth(allocatedBytes, 0.0))
+        failures.push_back("Vulkan allocated bytes grow");
+    if (DetectGrowth(objects, 0.0))
+        failures.push_back("Vulkan object count grows");
+    if (DetectGrowth(descriptorSets, 0.0))
+        failures.push_back("descriptor pool usage grows");
+
+    // Frame time drift: compare the last quarter of the run with the first quarter after warm-up.
+    if (frameTimes.size() >= 8)
+    {
+        const size_t quarter = frameTimes.size() / 4;
+        const double early = Average(frameTimes.begin() + quarter, frameTimes.begin() + 2 * quarter);
+        const double late = Average(frameTimes.end() - quarter, frameTimes.end());
+
+        if (early > 0.0 && late > early * 1.25)
+            failures.push_back("frame time drifts");
+    }
+
+    Json::Value result;
+    result["type"] = "soak_result";
+    result["simulated_hours"] = params.simulatedHours;
+    result["samples"] = Json::UInt(samples.size());
+    result["passed"] = failures.empty();
+    for (const auto& failure : failures)
+        result["failures"].append(failure);
+    WriteStats(result);
+
+    if (samples.size() < 8)
+        LOG("WARNING: the soak test collected only %d samples, growth detection needs at least 8.\n", int(samples.size()));
+
+    if (failures.empty())
+    {
+        LOG("Soak test passed.\n");
+        return true;
+    }
+
+    for (const auto& failure : failures)
+        LOG("ERROR: soak test failed: %s\n", failure.c_str());
+
+    return false;
+}
@@ -0,0 +1,453 @@
+/*
+* Copyright (c) 2022, NVIDIA CORPORATION. All rights reserved.
+*
+* Permission is hereby granted, free of charge, to any person obtaining a
+* copy of this software and associated documentation files (the "Software"),
+* to deal in the Software without restriction, including without limitation
+* the rights to use, copy, modify, merge, publish, distribute, sublicense,
+* and/or sell copies of the Software, and to permit persons to whom the
+* Software is furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+* THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+* DEALINGS IN THE SOFTWARE.
+*/
+
+
+
+#include "ShaderProj.h"
+
+#include <cmath>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+
+using namespace std;
+
+// Every thread takes tiles of this size from a shared counter, so that the expensive parts of the image
+// are spread between the threads. The tiles are made of whole 4x2 blocks.
+constexpr int c_SoftwareTileWidth = 32;
+constexpr int c_SoftwareTileHeight = 8;
+
+struct SoftwarePass
+{
+    shared_ptr<const SpirvShader> shader;
+    // One per thread, because the invocations hold the registers
+    vector<unique_ptr<SpirvInvocation>> invocations;
+    array<SoftwareChannel, c_MaxPassInputs> channels;
+    array<SoftwareTexture, c_HistoryLength> targets;
+};
+
+// The render targets are RGBA16F on the GPU, so the values are rounded in the same way
+static float RoundToHalf(float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+
+    const uint32_t sign = bits & 0x80000000u;
+    uint32_t magnitude = bits & 0x7fffffffu;
+
+    if (magnitude >= 0x7f800000u)
+        return value;
+
+    if (magnitude >= 0x477ff000u)
+    {
+        magnitude = 0x7f800000u;
+    }
+    else if (magnitude < 0x38800000u)
+    {
+        // Denormals have a fixed step of 2^-24
+        float rounded = std::nearbyint(std::fabs(value) * 16777216.f) / 16777216.f;
+        memcpy(&magnitude, &rounded, sizeof(magnitude));
+    }
+    else
+    {
+        magnitude += 0xfffu + ((magnitude >> 13) & 1u);
+        magnitude &= ~0x1fffu;
+    }
+
+    bits = sign | magnitude;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+static void ResizeSoftwareTarget(SoftwareTexture& target, int width, int height)
+{
+    target = SoftwareTexture();
+    target.width = width;
+    target.height = height;
+    target.levels.emplace_back(size_t(width) * height * 4, 0.f);
+}
+
+// Box-filters level 0 into a full mip chain, like MipGenerator does on the GPU
+static void GenerateSoftwareMips(SoftwareTexture& target)
+{
+    int levelCount = 1;
+    while ((std::max(target.width, target.height) >> levelCount) > 0)
+        ++levelCount;
+
+    target.levels.resize(levelCount);
+
+    for (int level = 1; level < levelCount; level++)
+    {
+        const int srcWidth = std::max(target.width >> (level - 1), 1);
+        const int srcHeight = std::max(target.height >> (level - 1), 1);
+        const int dstWidth = std::max(target.width >> level, 1);
+        const int dstHeight = std::max(target.height >> level, 1);
+        const vector<float>& src = target.levels[level - 1];
+        vector<float>& dst = target.levels[level];
+        dst.resize(size_t(dstWidth) * dstHeight * 4);
+
+        for (int y = 0; y < dstHeight; y++)
+        {
+            const int y0 = std::min(y * 2, srcHeight - 1);
+            const int y1 = std::min(y * 2 + 1, srcHeight - 1);
+            for (int x = 0; x < dstWidth; x++)
+            {
+                const int x0 = std::min(x * 2, srcWidth - 1);
+                const int x1 = std::min(x * 2 + 1, srcWidth - 1);
+                for (int channel = 0; channel < 4; channel++)
+                {
+                    const float sum =
+                        src[(size_t(y0) * srcWidth + x0) * 4 + channel] + src[(size_t(y0) * srcWidth + x1) * 4 + channel] +
+                        src[(size_t(y1) * srcWidth + x0) * 4 + channel] + src[(size_t(y1) * srcWidth + x1) * 4 + channel];
+                    dst[(size_t(y) * dstWidth + x) * 4 + channel] = RoundToHalf(sum * 0.25f);
+                }
+            }
+        }
+    }
+}
+
+// Creates the interpreted shaders, the inputs and the render targets of all passes of the program.
+// Returns false if any pass uses something that the interpreter doesn't support.
+static bool LoadSoftwareProgram(
+    ShProgram& program,
+    int threadCount,
+    uint32_t width,
+    uint32_t height,
+    map<string, shared_ptr<SoftwareTexture>>& textureCache,
+    vector<SoftwarePass>& passes)
+{
+    passes.clear();
+    passes.resize(program.GetPasses().size());
+
+    for (size_t index = 0; index < passes.size(); index++)
+    {
+        ShRenderpass& pass = *program.GetPasses()[index];
+        SoftwarePass& softwarePass = passes[index];
+
+        string error;
+        softwarePass.shader = LoadSpirvShader(pass.GetShaderData(0), error);
+        if (!softwarePass.shader)
+        {
+            LOG("WARNING: program '%s' can't be rendered in software, pass '%s': %s\n",
+                program.GetName().c_str(), pass.GetPassName().c_str(), error.c_str());
+            passes.clear();
+            return false;
+        }
+
+        for (int thread = 0; thread < threadCount; thread++)
+            softwarePass.invocations.push_back(make_unique<SpirvInvocation>(softwarePass.shader));
+
+        pass.LoadSoftwareInputs(textureCache, softwarePass.channels);
+
+        // The image pass is always at the output resolution, so the output doesn't need to be scaled
+        const int passWidth = std::max(int(float(width) * pass.GetScale() + 0.5f), 1);
+        const int passHeight = std::max(int(float(height) * pass.GetScale() + 0.5f), 1);
+        for (auto& target : softwarePass.targets)
+        {
+            ResizeSoftwareTarget(target, passWidth, passHeight);
+            if (pass.GeneratesMips())
+                GenerateSoftwareMips(target);
+        }
+    }
+
+    // The programs are loaded one at a time, when they start playing, so the files that were prefetched
+    // for the others would only take memory until then; they're read again when needed
+    DiscardPrefetchedFiles();
+    return true;
+}
+
+static void RenderSoftwarePass(ThreadPool& threads, SoftwarePass& pass, const SoftwareShaderInputs& inputs, SoftwareTexture& target)
+{
+    for (auto& invocation : pass.invocations)
+        invocation->SetInputs(inputs);
+
+    const int tilesX = (target.width + c_SoftwareTileWidth - 1) / c_SoftwareTileWidth;
+    const int tilesY = (target.height + c_SoftwareTileHeight - 1) / c_SoftwareTileHeight;
+    const int tileCount = tilesX * tilesY;
+    atomic<int> nextTile{ 0 };
+
+    for (auto& invocationPtr : pass.invocations)
+    {
+        SpirvInvocation* invocation = invocationPtr.get();
+        threads.AddTask([invocation, &target, &nextTile, tilesX, tileCount]()
+        {
+            vector<float>& pixels = target.levels[0];
+            float colors[c_SoftwareLanes][4];
+
+            for (int tile = nextTile++; tile < tileCount; tile = nextTile++)
+            {
+                const int tileX = (tile % tilesX) * c_SoftwareTileWidth;
+                const int tileY = (tile / tilesX) * c_SoftwareTileHeight;
+                const int endX = std::min(tileX + c_SoftwareTileWidth, target.width);
+                const int endY = std::min(tileY + c_SoftwareTileHeight, target.height);
+
+                for (int blockY = tileY; blockY < endY; blockY += c_SoftwareBlockHeight)
+                {
+                    for (int blockX = tileX; blockX < endX; blockX += c_SoftwareBlockWidth)
+                    {
+                        // The discarded pixels keep the previous contents of the target, like with the load op on the GPU
+                        const uint32_t mask = invocation->ShadeBlock(blockX, blockY, colors);
+
+                        for (int lane = 0; lane < c_SoftwareLanes; lane++)
+                        {
+                            const int x = blockX + lane % c_SoftwareBlockWidth;
+                            const int y = blockY + lane / c_SoftwareBlockWidth;
+                            if (!(mask & (1u << lane)) || x >= endX || y >= endY)
+                                continue;
+
+                            float* pixel = &pixels[(size_t(y) * target.width + x) * 4];
+                            for (int channel = 0; channel < 4; channel++)
+                                pixel[channel] = RoundToHalf(colors[lane][channel]);
+                        }
+                    }
+                }
+            }
+        });
+    }
+
+    threads.WaitForAll();
+}
+
+// Renders the passes in the same order and with the same history slots as ShaderProj::RenderPasses
+static void RenderSoftwareFrame(
+    ThreadPool& threads,
+    ShProgram& program,
+    vector<SoftwarePass>& passes,
+    const ShadertoyUniforms& uniforms,
+    int frameIndex,
+    bool trackChanges)
+{
+    const uint32_t historyIndex = frameIndex % c_HistoryLength;
+
+    program.UpdateDirtyFlags(uniforms, historyIndex, frameIndex, frameIndex == 0, trackChanges);
+
+    for (size_t index = 0; index < passes.size(); index++)
+    {
+        const ShRenderpass& pass = *program.GetPasses()[index];
+        SoftwarePass& softwarePass = passes[index];
+
+        if (!pass.IsDirty())
+        {
+            if (pass.NeedsHistoryCopy())
+                softwarePass.targets[historyIndex].levels = softwarePass.targets[!historyIndex].levels;
+            continue;
+        }
+
+        SoftwareTexture& target = softwarePass.targets[pass.IsPinnedToFirstSlot() ? 0 : historyIndex];
+
+        SoftwareShaderInputs inputs;
+        inputs.uniforms = uniforms;
+        inputs.channels = softwarePass.channels;
+        for (uint32_t channel = 0; channel < c_MaxPassInputs; channel++)
+        {
+            const int source = pass.GetChannelSource(channel);
+            if (source >= 0)
+            {
+                const ShRenderpass& producer = *program.GetPasses()[source];
+                uint32_t slot = (source == int(index)) ? !historyIndex : historyIndex;
+                if (producer.IsPinnedToFirstSlot())
+                    slot = 0;
+
+                inputs.channels[channel].texture = &passes[source].targets[slot];
+            }
+
+            if (const SoftwareTexture* texture = inputs.channels[channel].texture)
+            {
+                inputs.push.iChannelResolution[channel][0] = float(texture->width);
+                inputs.push.iChannelResolution[channel][1] = float(texture->height);
+                inputs.push.iChannelResolution[channel][2] = float(texture->depth);
+            }
+        }
+        inputs.push.iResolution[0] = float(target.width);
+        inputs.push.iResolution[1] = float(target.height);
+        inputs.push.iResolution[2] = 1.f;
+
+        RenderSoftwarePass(threads, softwarePass, inputs, target);
+
+        if (pass.GeneratesMips())
+            GenerateSoftwareMips(target);
+    }
+}
+
+bool ShaderProj::RunSoftwareRenderer(const SoftwareRendererParams& params)
+{
+    const uint32_t width = std::max(params.width, 1u);
+    const uint32_t height = std::max(params.height, 1u);
+    SetTextureSizeLimit(GetTextureSizeLimit(width, height));
+
+    const int threadCount = params.threads > 0 ? params.threads : int(std::max(thread::hardware_concurrency(), 1u));
+    ThreadPool threads(threadCount);
+
+    // Only the textures of the program that is playing are kept
+    map<string, shared_ptr<SoftwareTexture>> textureCache;
+    vector<SoftwarePass> passes;
+
+    if (params.benchmarkFrames > 0)
+    {
+        LOG("Measuring the software renderer at %ux%u with %d threads...\n", width, height, threadCount);
+
+        const double timeStep = 1.0 / 60.0;
+        for (int programIndex = 0; programIndex < int(m_Programs.size()); programIndex++)
+        {
+            ShProgram& program = *m_Programs[programIndex];
+            textureCache.clear();
+            if (IsProgramSkipped(programIndex) || !LoadSoftwareProgram(program, threadCount, width, height, textureCache, passes))
+                continue;
+
+            m_CurrentTime = 0;
+            m_CurrentTimeDelta = timeStep;
+
+            const auto startTime = chrono::steady_clock::now();
+            for (m_FrameIndex = 0; m_FrameIndex < params.benchmarkFrames; m_FrameIndex++)
+            {
+                RenderSoftwareFrame(threads, program, passes, GetUniforms(width, height), m_FrameIndex, m_DirtyTrackingEnabled);
+                m_CurrentTime += timeStep;
+            }
+            const double frameMs = chrono::duration<double, milli>(chrono::steady_clock::now() - startTime).count()
+                / double(params.benchmarkFrames);
+
+            LOG("%s: %.2f ms per frame\n", program.GetName().c_str(), frameMs);
+
+            Json::Value record;
+            record["type"] = "software_benchmark";
+            record["program"] = program.GetName();
+            record["width"] = width;
+            record["height"] = height;
+            record["threads"] = threadCount;
+            record["frames"] = params.benchmarkFrames;
+            record["frame_ms"] = frameMs;
+            WriteStats(record);
+        }
+
+        return true;
+    }
+
+    FILE* output = fopen(params.outputPath.string().c_str(), "wb");
+    if (!output)
+    {
+        LOG("ERROR: couldn't open '%s' for writing.\n", params.outputPath.generic_string().c_str());
+        return false;
+    }
+
+#ifndef _WIN32
+    // A FIFO whose reader goes away should end the output, not the process
+    signal(SIGPIPE, SIG_IGN);
+#endif
+
+    LOG("Rendering in software at %ux%u with %d threads into '%s'\n",
+        width, height, threadCount, params.outputPath.generic_string().c_str());
+
+    // The programs that the interpreter can't run are skipped like the quarantined ones
+    vector<bool> unsupported(m_Programs.size());
+    const double timeStep = 1.0 / double(std::max(params.refreshRate, 1));
+    const auto frameInterval = chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(timeStep));
+    auto nextFrameTime = chrono::steady_clock::now();
+    vector<uint8_t> pixels(size_t(width) * height * 3);
+    bool result = true;
+
+    m_ResetRequired = true;
+
+    for (;;)
+    {
+        m_CurrentTime += timeStep;
+        m_CurrentTimeDelta = timeStep;
+
+        if (m_CurrentDuration > 0 && m_CurrentTime > m_CurrentDuration)
+            NextProgram();
+
+        if (m_ResetRequired)
+        {
+            bool loaded = false;
+            for (size_t attempt = 0; attempt < m_Script.size() && !loaded; attempt++)
+            {
+                textureCache.clear();
+                if (!unsupported[m_ActiveProgram] && !IsProgramSkipped(m_ActiveProgram))
+                {
+                    loaded = LoadSoftwareProgram(*m_Programs[m_ActiveProgram], threadCount, width, height, textureCache, passes);
+                    unsupported[m_ActiveProgram] = !loaded;
+                }
+
+                if (!loaded)
+                    NextProgram();
+            }
+
+            if (!loaded)
+            {
+                LOG("ERROR: none of the programs can be rendered in software.\n");
+                result = false;
+                break;
+            }
+
+            m_FrameIndex = 0;
+            m_CurrentTime = 0;
+            m_ResetRequired = false;
+            LOG("Playing %s for %.1f seconds\n", m_Programs[m_ActiveProgram]->GetName().c_str(), m_CurrentDuration);
+        }
+
+        ShProgram& program = *m_Programs[m_ActiveProgram];
+        RenderSoftwareFrame(threads, program, passes, GetUniforms(width, height), m_FrameIndex, m_DirtyTrackingEnabled);
+
+        // The same fade as the blit on the GPU, into the UNORM format of the swap chain
+        float factor = 1.f;
+        if (m_CurrentDuration > 0)
+        {
+            const double transitionTime = 0.5;
+            factor = float(std::min(m_CurrentTime, m_CurrentDuration - m_CurrentTime) / transitionTime);
+            factor = std::max(0.f, std::min(1.f, factor));
+        }
+
+        // The final image has its bottom row first, and the output starts with the top row
+        const SoftwareTexture& image = passes[program.GetImagePassIndex()].targets[m_FrameIndex % c_HistoryLength];
+        for (uint32_t row = 0; row < height; row++)
+        {
+            const float* src = &image.levels[0][size_t(height - 1 - row) * width * 4];
+            uint8_t* dst = &pixels[size_t(row) * width * 3];
+            for (uint32_t x = 0; x < width; x++)
+            {
+                for (int channel = 0; channel < 3; channel++)
+                {
+                    const float value = std::max(0.f, std::min(1.f, src[x * 4 + channel] * factor));
+                    dst[x * 3 + channel] = uint8_t(value * 255.f + 0.5f);
+                }
+            }
+        }
+
+        if (fwrite(pixels.data(), 1, pixels.size(), output) != pixels.size() || fflush(output) != 0)
+        {
+            LOG("INFO: the output was closed, stopping.\n");
+            break;
+        }
+
+        ++m_FrameIndex;
+
+        // Frames are paced to the refresh rate, and a renderer that falls behind just continues from now
+        nextFrameTime += frameInterval;
+        const auto now = chrono::steady_clock::now();
+        if (nextFrameTime < now)
+            nextFrameTime = now;
+        else
+            this_thread::sleep_until(nextFrameTime);
+    }
+
+    fclose(output);
+    return result;
+}
@@ -0,0 +1,222 @@
+/*
+* Copyright (c) 2022, NVIDIA CORPORATION. All rights reserved.
+*
+* Permission is hereby granted, free of charge, to any person obtaining a
+* copy of this software and associated documentation files (the "Software"),
+* to deal in the Software without restriction, including without limitation
+* the rights to use, copy, modify, merge, publish, distribute, sublicense,
+* and/or sell copies of the Software, and to permit persons to whom the
+* Software is furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+* THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+* DEALINGS IN THE SOFTWARE.
+*/
+
+#pragma once
+
+#include <cstdint>
+
+// The SPIR-V constants used by the reflection of the pass shaders and by the software renderer,
+// see the SPIR-V specification. Only the values that these two need are listed.
+
+constexpr uint32_t c_SpirvMagic = 0x07230203;
+constexpr uint32_t c_SpirvHeaderWords = 5;
+
+enum SpirvOpcode : uint16_t
+{
+    c_OpNop = 0,
+    c_OpUndef = 1,
+    c_OpSourceContinued = 2,
+    c_OpSource = 3,
+    c_OpSourceExtension = 4,
+    c_OpName = 5,
+    c_OpMemberName = 6,
+    c_OpString = 7,
+    c_OpLine = 8,
+    c_OpExtension = 10,
+    c_OpExtInstImport = 11,
+    c_OpExtInst = 12,
+    c_OpMemoryModel = 14,
+    c_OpEntryPoint = 15,
+    c_OpExecutionMode = 16,
+    c_OpCapability = 17,
+    c_OpTypeVoid = 19,
+    c_OpTypeBool = 20,
+    c_OpTypeInt = 21,
+    c_OpTypeFloat = 22,
+    c_OpTypeVector = 23,
+    c_OpTypeMatrix = 24,
+    c_OpTypeImage = 25,
+    c_OpTypeSampler = 26,
+    c_OpTypeSampledImage = 27,
+    c_OpTypeArray = 28,
+    c_OpTypeStruct = 30,
+    c_OpTypePointer = 32,
+    c_OpTypeFunction = 33,
+    c_OpConstantTrue = 41,
+    c_OpConstantFalse = 42,
+    c_OpConstant = 43,
+    c_OpConstantComposite = 44,
+    c_OpConstantNull = 46,
+    c_OpSpecConstantTrue = 48,
+    c_OpSpecConstantFalse = 49,
+    c_OpSpecConstant = 50,
+    c_OpSpecConstantComposite = 51,
+    c_OpFunction = 54,
+    c_OpFunctionParameter = 55,
+    c_OpFunctionEnd = 56,
+    c_OpFunctionCall = 57,
+    c_OpVariable = 59,
+    c_OpLoad = 61,
+    c_OpStore = 62,
+    c_OpCopyMemory = 63,
+    c_OpAccessChain = 65,
+    c_OpInBoundsAccessChain = 66,
+    c_OpDecorate = 71,
+    c_OpMemberDecorate = 72,
+    c_OpVectorExtractDynamic = 77,
+    c_OpVectorInsertDynamic = 78,
+    c_OpVectorShuffle = 79,
+    c_OpCompositeConstruct = 80,
+    c_OpCompositeExtract = 81,
+    c_OpCompositeInsert = 82,
+    c_OpCopyObject = 83,
+    c_OpTranspose = 84,
+    c_OpSampledImage = 86,
+    c_OpImageSampleImplicitLod = 87,
+    c_OpImageSampleExplicitLod = 88,
+    c_OpImageSampleProjImplicitLod = 91,
+    c_OpImageSampleProjExplicitLod = 92,
+    c_OpImageFetch = 95,
+    c_OpImage = 100,
+    c_OpImageQuerySizeLod = 103,
+    c_OpImageQuerySize = 104,
+    c_OpImageQueryLevels = 106,
+    c_OpConvertFToU = 109,
+    c_OpConvertFToS = 110,
+    c_OpConvertSToF = 111,
+    c_OpConvertUToF = 112,
+    c_OpUConvert = 113,
+    c_OpSConvert = 114,
+    c_OpFConvert = 115,
+    c_OpQuantizeToF16 = 116,
+    c_OpBitcast = 124,
+    c_OpSNegate = 126,
+    c_OpFNegate = 127,
+    c_OpIAdd = 128,
+    c_OpFAdd = 129,
+    c_OpISub = 130,
+    c_OpFSub = 131,
+    c_OpIMul = 132,
+    c_OpFMul = 133,
+    c_OpUDiv = 134,
+    c_OpSDiv = 135,
+    c_OpFDiv = 136,
+    c_OpUMod = 137,
+    c_OpSRem = 138,
+    c_OpSMod = 139,
+    c_OpFRem = 140,
+    c_OpFMod = 141,
+    c_OpVectorTimesScalar = 142,
+    c_OpMatrixTimesScalar = 143,
+    c_OpVectorTimesMatrix = 144,
+    c_OpMatrixTimesVector = 145,
+    c_OpMatrixTimesMatrix = 146,
+    c_OpOuterProduct = 147,
+    c_OpDot = 148,
+    c_OpAny = 154,
+    c_OpAll = 155,
+    c_OpIsNan = 156,
+    c_OpIsInf = 157,
+    c_OpLogicalEqual = 164,
+    c_OpLogicalNotEqual = 165,
+    c_OpLogicalOr = 166,
+    c_OpLogicalAnd = 167,
+    c_OpLogicalNot = 168,
+    c_OpSelect = 169,
+    c_OpIEqual = 170,
+    c_OpINotEqual = 171,
+    c_OpUGreaterThan = 172,
+    c_OpSGreaterThan = 173,
+    c_OpUGreaterThanEqual = 174,
+    c_OpSGreaterThanEqual = 175,
+    c_OpULessThan = 176,
+    c_OpSLessThan = 177,
+    c_OpULessThanEqual = 178,
+    c_OpSLessThanEqual = 179,
+    c_OpFOrdEqual = 180,
+    c_OpFUnordEqual = 181,
+    c_OpFOrdNotEqual = 182,
+    c_OpFUnordNotEqual = 183,
+    c_OpFOrdLessThan = 184,
+    c_OpFUnordLessThan = 185,
+    c_OpFOrdGreaterThan = 186,
+    c_OpFUnordGreaterThan = 187,
+    c_OpFOrdLessThanEqual = 188,
+    c_OpFUnordLessThanEqual = 189,
+    c_OpFOrdGreaterThanEqual = 190,
+    c_OpFUnordGreaterThanEqual = 191,
+    c_OpShiftRightLogical = 194,
+    c_OpShiftRightArithmetic = 195,
+    c_OpShiftLeftLogical = 196,
+    c_OpBitwiseOr = 197,
+    c_OpBitwiseXor = 198,
+    c_OpBitwiseAnd = 199,
+    c_OpNot = 200,
+    c_OpBitFieldInsert = 201,
+    c_OpBitFieldSExtract = 202,
+    c_OpBitFieldUExtract = 203,
+    c_OpBitReverse = 204,
+    c_OpBitCount = 205,
+    c_OpDPdx = 207,
+    c_OpDPdy = 208,
+    c_OpFwidth = 209,
+    c_OpDPdxFine = 210,
+    c_OpDPdyFine = 211,
+    c_OpFwidthFine = 212,
+    c_OpDPdxCoarse = 213,
+    c_OpDPdyCoarse = 214,
+    c_OpFwidthCoarse = 215,
+    c_OpPhi = 245,
+    c_OpLoopMerge = 246,
+    c_OpSelectionMerge = 247,
+    c_OpLabel = 248,
+    c_OpBranch = 249,
+    c_OpBranchConditional = 250,
+    c_OpSwitch = 251,
+    c_OpKill = 252,
+    c_OpReturn = 253,
+    c_OpReturnValue = 254,
+    c_OpUnreachable = 255,
+    c_OpNoLine = 317,
+    c_OpModuleProcessed = 330,
+    c_OpCopyLogical = 400,
+    c_OpTerminateInvocation = 4416,
+    c_OpDemoteToHelperInvocation = 5380,
+};
+
+constexpr uint32_t c_DecorationArrayStride = 6;
+constexpr uint32_t c_DecorationBuiltIn = 11;
+constexpr uint32_t c_DecorationLocation = 30;
+constexpr uint32_t c_DecorationBinding = 33;
+constexpr uint32_t c_DecorationOffset = 35;
+constexpr uint32_t c_BuiltInFragCoord = 15;
+
+constexpr uint32_t c_StorageClassUniformConstant = 0;
+constexpr uint32_t c_StorageClassInput = 1;
+constexpr uint32_t c_StorageClassUniform = 2;
+constexpr uint32_t c_StorageClassOutput = 3;
+constexpr uint32_t c_StorageClassPrivate = 6;
+constexpr uint32_t c_StorageClassFunction = 7;
+constexpr uint32_t c_StorageClassPushConstant = 9;
+
+// Bindings of the pass descriptor set, see ShaderProj::CreateDeviceObjects
+constexpr uint32_t c_UniformBufferBinding = 4;
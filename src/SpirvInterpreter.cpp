@@ -0,0 +1,2905 @@
+/*
+* Copyright (c) 2022, NVIDIA CORPORATION. All rights reserved.
+*
+* Permission is hereby granted, free of charge, to any person obtaining a
+* copy of this software and associated documentation files (the "Software"),
+* to deal in the Software without restriction, including without limitation
+* the rights to use, copy, modify, merge, publish, distribute, sublicense,
+* and/or sell copies of the Software, and to permit persons to whom the
+* Software is furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+* THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+* DEALINGS IN THE SOFTWARE.
+*/
+
+
+
+#include "ShaderProj.h"
+#include "Spirv.h"
+
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <unordered_map>
+
+// An interpreter for the SPIR-V that glslang generates for the pass shaders, used by the software
+// renderer. Every value holds one 32-bit word per lane for each of its scalar components, and each
+// instruction is executed for all lanes at once, with plain loops over the lanes that the compiler
+// can vectorize. When the lanes take different sides of a branch, the groups run one after another
+// until the immediate post-dominator of the branch, where they continue together; this is the
+// reconvergence stack that GPUs use. There is no recursion in GLSL, so every result and variable
+// has a fixed place in the registers and the memory of the machine.
+
+static constexpr int c_Lanes = c_SoftwareLanes;
+static constexpr uint32_t c_AllLanes = (1u << c_Lanes) - 1;
+static constexpr uint32_t c_NoBlock = ~0u;      // the function exit, as a reconvergence point
+static constexpr uint32_t c_NoRegister = ~0u;
+
+// Instructions of the GLSL.std.450 extended instruction set
+enum GlslInstruction : uint32_t
+{
+    c_GlslRound = 1,
+    c_GlslRoundEven = 2,
+    c_GlslTrunc = 3,
+    c_GlslFAbs = 4,
+    c_GlslSAbs = 5,
+    c_GlslFSign = 6,
+    c_GlslSSign = 7,
+    c_GlslFloor = 8,
+    c_GlslCeil = 9,
+    c_GlslFract = 10,
+    c_GlslRadians = 11,
+    c_GlslDegrees = 12,
+    c_GlslSin = 13,
+    c_GlslCos = 14,
+    c_GlslTan = 15,
+    c_GlslAsin = 16,
+    c_GlslAcos = 17,
+    c_GlslAtan = 18,
+    c_GlslSinh = 19,
+    c_GlslCosh = 20,
+    c_GlslTanh = 21,
+    c_GlslAsinh = 22,
+    c_GlslAcosh = 23,
+    c_GlslAtanh = 24,
+    c_GlslAtan2 = 25,
+    c_GlslPow = 26,
+    c_GlslExp = 27,
+    c_GlslLog = 28,
+    c_GlslExp2 = 29,
+    c_GlslLog2 = 30,
+    c_GlslSqrt = 31,
+    c_GlslInverseSqrt = 32,
+    c_GlslDeterminant = 33,
+    c_GlslMatrixInverse = 34,
+    c_GlslModf = 35,
+    c_GlslModfStruct = 36,
+    c_GlslFMin = 37,
+    c_GlslUMin = 38,
+    c_GlslSMin = 39,
+    c_GlslFMax = 40,
+    c_GlslUMax = 41,
+    c_GlslSMax = 42,
+    c_GlslFClamp = 43,
+    c_GlslUClamp = 44,
+    c_GlslSClamp = 45,
+    c_GlslFMix = 46,
+    c_GlslStep = 48,
+    c_GlslSmoothStep = 49,
+    c_GlslFma = 50,
+    c_GlslLdexp = 53,
+    c_GlslPackSnorm4x8 = 54,
+    c_GlslPackUnorm4x8 = 55,
+    c_GlslPackSnorm2x16 = 56,
+    c_GlslPackUnorm2x16 = 57,
+    c_GlslPackHalf2x16 = 58,
+    c_GlslUnpackSnorm2x16 = 60,
+    c_GlslUnpackUnorm2x16 = 61,
+    c_GlslUnpackHalf2x16 = 62,
+    c_GlslUnpackSnorm4x8 = 63,
+    c_GlslUnpackUnorm4x8 = 64,
+    c_GlslLength = 66,
+    c_GlslDistance = 67,
+    c_GlslCross = 68,
+    c_GlslNormalize = 69,
+    c_GlslFaceForward = 70,
+    c_GlslReflect = 71,
+    c_GlslRefract = 72,
+    c_GlslFindILsb = 73,
+    c_GlslFindSMsb = 74,
+    c_GlslFindUMsb = 75,
+    c_GlslNMin = 79,
+    c_GlslNMax = 80,
+    c_GlslNClamp = 81,
+};
+
+static constexpr uint32_t c_ExecutionModelFragment = 4;
+
+static constexpr uint32_t c_DimCube = 3;
+static constexpr uint32_t c_Dim3D = 2;
+
+static constexpr uint32_t c_ImageOperandsBias = 0x1;
+static constexpr uint32_t c_ImageOperandsLod = 0x2;
+static constexpr uint32_t c_ImageOperandsGrad = 0x4;
+static constexpr uint32_t c_ImageOperandsConstOffset = 0x8;
+static constexpr uint32_t c_ImageOperandsOffset = 0x10;
+
+enum class SpirvTypeKind : uint8_t
+{
+    Void,
+    Bool,
+    Int,
+    Float,
+    Vector,
+    Matrix,
+    Array,
+    Struct,
+    Pointer,
+    Function,
+    Image,
+    Sampler,
+    SampledImage
+};
+
+struct SpirvType
+{
+    SpirvTypeKind kind = SpirvTypeKind::Void;
+    uint32_t components = 0;    // scalar components when flattened; pointers and images take one
+    uint32_t element = 0;       // of vectors, matrices (the column type) and arrays, or the pointee type
+    uint32_t count = 0;         // of vector components, matrix columns or array elements
+    uint32_t dim = 0;           // of images
+    std::vector<uint32_t> members;
+    std::vector<uint32_t> memberOffsets;    // in components
+};
+
+struct SpirvInstruction
+{
+    uint16_t opcode;
+    uint16_t wordCount;
+    uint32_t offset;            // of the first word
+};
+
+struct SpirvBlock
+{
+    uint32_t label = 0;
+    uint32_t begin = 0;         // first instruction after the label
+    uint32_t end = 0;           // one past the terminator
+    uint32_t reconverge = c_NoBlock;
+};
+
+struct SpirvFunction
+{
+    uint32_t firstBlock = 0;
+    uint32_t blockCount = 0;
+    std::vector<uint32_t> parameters;
+};
+
+class SpirvShader
+{
+public:
+    std::vector<uint32_t> words;
+    std::vector<SpirvInstruction> instructions;
+    std::vector<SpirvBlock> blocks;
+    std::vector<uint32_t> blockIndices;         // by label id
+    std::vector<SpirvFunction> functions;
+    std::vector<uint32_t> functionIndices;      // by function id
+    std::vector<SpirvType> types;               // by type id
+    std::vector<uint32_t> resultTypes;          // by result id
+    std::vector<uint32_t> registerOffsets;      // by result id, in words
+    std::vector<uint32_t> initialRegisters;     // constants and the addresses of the variables
+    std::vector<uint32_t> initialMemory;        // one word per component, the same for all lanes
+    uint32_t entryFunction = 0;
+    uint32_t glslInstructions = 0;
+    uint32_t fragCoordAddress = c_NoRegister;
+    uint32_t uvAddress = c_NoRegister;
+    uint32_t outputAddress = c_NoRegister;
+    uint32_t uniformsAddress = c_NoRegister;
+    uint32_t uniformsComponents = 0;
+    uint32_t pushConstantsAddress = c_NoRegister;
+    uint32_t pushConstantsComponents = 0;
+
+    [[nodiscard]] const uint32_t* Operands(const SpirvInstruction& instruction) const { return words.data() + instruction.offset + 1; }
+    [[nodiscard]] const SpirvType& TypeOf(uint32_t id) const { return types[resultTypes[id]]; }
+    [[nodiscard]] uint32_t ConstantValue(uint32_t id) const { return initialRegisters[registerOffsets[id]]; }
+};
+
+// True if the instruction has a result type and a result id. Only the instructions that
+// the machine can execute are listed; the others make the shader unsupported.
+static bool GetInstructionResult(uint16_t opcode, bool& hasResult)
+{
+    switch (opcode)
+    {
+    case c_OpStore:
+    case c_OpCopyMemory:
+    case c_OpLoopMerge:
+    case c_OpSelectionMerge:
+    case c_OpBranch:
+    case c_OpBranchConditional:
+    case c_OpSwitch:
+    case c_OpKill:
+    case c_OpReturn:
+    case c_OpReturnValue:
+    case c_OpUnreachable:
+    case c_OpTerminateInvocation:
+    case c_OpDemoteToHelperInvocation:
+        hasResult = false;
+        return true;
+
+    case c_OpExtInst:
+    case c_OpFunctionCall:
+    case c_OpLoad:
+    case c_OpAccessChain:
+    case c_OpInBoundsAccessChain:
+    case c_OpVectorExtractDynamic:
+    case c_OpVectorInsertDynamic:
+    case c_OpVectorShuffle:
+    case c_OpCompositeConstruct:
+    case c_OpCompositeExtract:
+    case c_OpCompositeInsert:
+    case c_OpCopyObject:
+    case c_OpCopyLogical:
+    case c_OpTranspose:
+    case c_OpSampledImage:
+    case c_OpImageSampleImplicitLod:
+    case c_OpImageSampleExplicitLod:
+    case c_OpImageSampleProjImplicitLod:
+    case c_OpImageSampleProjExplicitLod:
+    case c_OpImageFetch:
+    case c_OpImage:
+    case c_OpImageQuerySizeLod:
+    case c_OpImageQuerySize:
+    case c_OpImageQueryLevels:
+    case c_OpConvertFToU:
+    case c_OpConvertFToS:
+    case c_OpConvertSToF:
+    case c_OpConvertUToF:
+    case c_OpUConvert:
+    case c_OpSConvert:
+    case c_OpFConvert:
+    case c_OpQuantizeToF16:
+    case c_OpBitcast:
+    case c_OpSNegate:
+    case c_OpFNegate:
+    case c_OpIAdd:
+    case c_OpFAdd:
+    case c_OpISub:
+    case c_OpFSub:
+    case c_OpIMul:
+    case c_OpFMul:
+    case c_OpUDiv:
+    case c_OpSDiv:
+    case c_OpFDiv:
+    case c_OpUMod:
+    case c_OpSRem:
+    case c_OpSMod:
+    case c_OpFRem:
+    case c_OpFMod:
+    case c_OpVectorTimesScalar:
+    case c_OpMatrixTimesScalar:
+    case c_OpVectorTimesMatrix:
+    case c_OpMatrixTimesVector:
+    case c_OpMatrixTimesMatrix:
+    case c_OpOuterProduct:
+    case c_OpDot:
+    case c_OpAny:
+    case c_OpAll:
+    case c_OpIsNan:
+    case c_OpIsInf:
+    case c_OpLogicalEqual:
+    case c_OpLogicalNotEqual:
+    case c_OpLogicalOr:
+    case c_OpLogicalAnd:
+    case c_OpLogicalNot:
+    case c_OpSelect:
+    case c_OpIEqual:
+    case c_OpINotEqual:
+    case c_OpUGreaterThan:
+    case c_OpSGreaterThan:
+    case c_OpUGreaterThanEqual:
+    case c_OpSGreaterThanEqual:
+    case c_OpULessThan:
+    case c_OpSLessThan:
+    case c_OpULessThanEqual:
+    case c_OpSLessThanEqual:
+    case c_OpFOrdEqual:
+    case c_OpFUnordEqual:
+    case c_OpFOrdNotEqual:
+    case c_OpFUnordNotEqual:
+    case c_OpFOrdLessThan:
+    case c_OpFUnordLessThan:
+    case c_OpFOrdGreaterThan:
+    case c_OpFUnordGreaterThan:
+    case c_OpFOrdLessThanEqual:
+    case c_OpFUnordLessThanEqual:
+    case c_OpFOrdGreaterThanEqual:
+    case c_OpFUnordGreaterThanEqual:
+    case c_OpShiftRightLogical:
+    case c_OpShiftRightArithmetic:
+    case c_OpShiftLeftLogical:
+    case c_OpBitwiseOr:
+    case c_OpBitwiseXor:
+    case c_OpBitwiseAnd:
+    case c_OpNot:
+    case c_OpBitFieldInsert:
+    case c_OpBitFieldSExtract:
+    case c_OpBitFieldUExtract:
+    case c_OpBitReverse:
+    case c_OpBitCount:
+    case c_OpDPdx:
+    case c_OpDPdy:
+    case c_OpFwidth:
+    case c_OpDPdxFine:
+    case c_OpDPdyFine:
+    case c_OpFwidthFine:
+    case c_OpDPdxCoarse:
+    case c_OpDPdyCoarse:
+    case c_OpFwidthCoarse:
+    case c_OpPhi:
+        hasResult = true;
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+static bool IsTerminator(uint16_t opcode)
+{
+    switch (opcode)
+    {
+    case c_OpBranch:
+    case c_OpBranchConditional:
+    case c_OpSwitch:
+    case c_OpKill:
+    case c_OpReturn:
+    case c_OpReturnValue:
+    case c_OpUnreachable:
+    case c_OpTerminateInvocation:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// The GLSL.std.450 instructions that SpirvMachine::ExecuteGlsl implements: all but IMix,
+// Frexp, the double packing and the interpolation functions
+static bool IsSupportedGlslInstruction(uint32_t instruction)
+{
+    return (instruction >= c_GlslRound && instruction <= c_GlslFMix)
+        || (instruction >= c_GlslStep && instruction <= c_GlslFma)
+        || (instruction >= c_GlslLdexp && instruction <= c_GlslPackHalf2x16)
+        || (instruction >= c_GlslUnpackSnorm2x16 && instruction <= c_GlslUnpackUnorm4x8)
+        || (instruction >= c_GlslLength && instruction <= c_GlslFindUMsb)
+        || (instruction >= c_GlslNMin && instruction <= c_GlslNClamp);
+}
+
+// Finds the immediate post-dominator of every block of a function, which is where the lanes that
+// went different ways from the block meet again. This is the Cooper-Harvey-Kennedy algorithm on the
+// reversed control flow graph. Blocks whose paths only meet at the function exit, or never reach it,
+// get no reconvergence point.
+static void FindReconvergencePoints(SpirvShader& shader, const SpirvFunction& function)
+{
+    const uint32_t count = function.blockCount;
+    const uint32_t exitNode = count;
+
+    std::vector<std::vector<uint32_t>> successors(count + 1);
+    std::vector<std::vector<uint32_t>> predecessors(count + 1);
+
+    auto addEdge = [&](uint32_t from, uint32_t label)
+    {
+        const uint32_t to = shader.blockIndices[label] - function.firstBlock;
+        successors[from].push_back(to);
+        predecessors[to].push_back(from);
+    };
+
+    for (uint32_t local = 0; local < count; local++)
+    {
+        const SpirvInstruction& terminator = shader.instructions[shader.blocks[function.firstBlock + local].end - 1];
+        const uint32_t* ops = shader.Operands(terminator);
+
+        switch (terminator.opcode)
+        {
+        case c_OpBranch:
+            addEdge(local, ops[0]);
+            break;
+        case c_OpBranchConditional:
+            addEdge(local, ops[1]);
+            addEdge(local, ops[2]);
+            break;
+        case c_OpSwitch:
+            addEdge(local, ops[1]);
+            for (uint32_t operand = 3; operand + 1 < terminator.wordCount; operand += 2)
+                addEdge(local, ops[operand]);
+            break;
+        default:
+            successors[local].push_back(exitNode);
+            predecessors[exitNode].push_back(local);
+            break;
+        }
+    }
+
+    // Post-order of the reversed graph, starting from the exit
+    std::vector<uint32_t> order;
+    std::vector<uint32_t> postorderIndex(count + 1, ~0u);
+    std::vector<bool> visited(count + 1, false);
+    std::vector<std::pair<uint32_t, size_t>> path;
+    path.emplace_back(exitNode, 0);
+    visited[exitNode] = true;
+    while (!path.empty())
+    {
+        auto& [node, next] = path.back();
+        if (next < predecessors[node].size())
+        {
+            const uint32_t predecessor = predecessors[node][next++];
+            if (!visited[predecessor])
+            {
+                visited[predecessor] = true;
+                path.emplace_back(predecessor, 0);
+            }
+            continue;
+        }
+
+        postorderIndex[node] = uint32_t(order.size());
+        order.push_back(node);
+        path.pop_back();
+    }
+
+    std::vector<uint32_t> postDominators(count + 1, ~0u);
+    postDominators[exitNode] = exitNode;
+
+    auto intersect = [&](uint32_t a, uint32_t b)
+    {
+        while (a != b)
+        {
+            while (postorderIndex[a] < postorderIndex[b])
+                a = postDominators[a];
+            while (postorderIndex[b] < postorderIndex[a])
+                b = postDominators[b];
+        }
+        return a;
+    };
+
+    for (bool changed = true; changed; )
+    {
+        changed = false;
+        for (auto node = order.rbegin(); node != order.rend(); ++node)
+        {
+            if (*node == exitNode)
+                continue;
+
+            uint32_t dominator = ~0u;
+            for (uint32_t successor : successors[*node])
+            {
+                if (postDominators[successor] == ~0u)
+                    continue;
+                dominator = (dominator == ~0u) ? successor : intersect(successor, dominator);
+            }
+
+            if (dominator != postDominators[*node])
+            {
+                postDominators[*node] = dominator;
+                changed = true;
+            }
+        }
+    }
+
+    for (uint32_t local = 0; local < count; local++)
+    {
+        const uint32_t dominator = postDominators[local];
+        shader.blocks[function.firstBlock + local].reconverge =
+            (dominator == ~0u || dominator == exitNode) ? c_NoBlock : function.firstBlock + dominator;
+    }
+}
+
+std::shared_ptr<const SpirvShader> LoadSpirvShader(const blob& spirv, std::string& error)
+{
+    auto shader = std::make_shared<SpirvShader>();
+    auto& words = shader->words;
+    words.resize(spirv.size() / sizeof(uint32_t));
+    memcpy(words.data(), spirv.data(), words.size() * sizeof(uint32_t));
+
+    if (words.size() < c_SpirvHeaderWords || words[0] != c_SpirvMagic)
+    {
+        error = "not a SPIR-V module";
+        return nullptr;
+    }
+
+    const uint32_t bound = words[3];
+    shader->blockIndices.assign(bound, c_NoBlock);
+    shader->functionIndices.assign(bound, ~0u);
+    shader->types.resize(bound);
+    shader->resultTypes.assign(bound, 0);
+    shader->registerOffsets.assign(bound, c_NoRegister);
+
+    std::vector<uint32_t> builtIns(bound, ~0u);
+    std::vector<uint32_t> locations(bound, ~0u);
+    std::vector<uint32_t> bindings(bound, ~0u);
+    std::vector<uint32_t> arrayStrides(bound, 0);
+    std::unordered_map<uint32_t, std::vector<uint32_t>> memberByteOffsets;
+    uint32_t memoryComponents = 0;
+    bool inFunction = false;
+
+    auto fail = [&](const std::string& message)
+    {
+        error = message;
+        return nullptr;
+    };
+
+    auto allocateRegister = [&](uint32_t id, uint32_t typeId)
+    {
+        shader->resultTypes[id] = typeId;
+        const uint32_t components = shader->types[typeId].components;
+        if (components == 0)
+            return;
+
+        shader->registerOffsets[id] = uint32_t(shader->initialRegisters.size());
+        shader->initialRegisters.resize(shader->initialRegisters.size() + size_t(components) * c_Lanes, 0);
+    };
+
+    auto setConstant = [&](uint32_t id, uint32_t component, uint32_t value)
+    {
+        uint32_t* lanes = shader->initialRegisters.data() + shader->registerOffsets[id] + component * c_Lanes;
+        std::fill(lanes, lanes + c_Lanes, value);
+    };
+
+    auto allocateVariable = [&](uint32_t id, uint32_t pointerType)
+    {
+        allocateRegister(id, pointerType);
+        const uint32_t address = memoryComponents;
+        memoryComponents += shader->types[shader->types[pointerType].element].components;
+        setConstant(id, 0, address);
+        return address;
+    };
+
+    for (size_t pos = c_SpirvHeaderWords; pos < words.size(); )
+    {
+        const uint32_t wordCount = words[pos] >> 16;
+        const uint16_t opcode = uint16_t(words[pos] & 0xffff);
+        if (wordCount == 0 || pos + wordCount > words.size())
+            return fail("the module is truncated");
+
+        const uint32_t* ops = words.data() + pos + 1;
+        const SpirvInstruction instruction = { opcode, uint16_t(wordCount), uint32_t(pos) };
+        pos += wordCount;
+
+        // The result ids of the declarations index the tables directly
+        const bool isType = opcode >= c_OpTypeVoid && opcode <= c_OpTypeFunction;
+        const bool isValue = (opcode >= c_OpConstantTrue && opcode <= c_OpSpecConstantComposite) || opcode == c_OpUndef || opcode == c_OpVariable;
+        if ((isType && (wordCount < 2 || ops[0] >= bound)) || (isValue && (wordCount < 3 || ops[0] >= bound || ops[1] >= bound)))
+            return fail("invalid id");
+
+        switch (opcode)
+        {
+        case c_OpNop:
+        case c_OpSourceContinued:
+        case c_OpSource:
+        case c_OpSourceExtension:
+        case c_OpName:
+        case c_OpMemberName:
+        case c_OpString:
+        case c_OpLine:
+        case c_OpNoLine:
+        case c_OpExtension:
+        case c_OpMemoryModel:
+        case c_OpExecutionMode:
+        case c_OpCapability:
+        case c_OpModuleProcessed:
+            break;
+
+        case c_OpExtInstImport:
+            if (strncmp(reinterpret_cast<const char*>(ops + 1), "GLSL.std.450", (wordCount - 2) * sizeof(uint32_t)) != 0)
+                return fail("unsupported extended instruction set");
+            shader->glslInstructions = ops[0];
+            break;
+
+        case c_OpEntryPoint:
+            if (ops[0] == c_ExecutionModelFragment)
+                shader->entryFunction = ops[1];
+            break;
+
+        case c_OpDecorate:
+            if (wordCount < 4 || ops[0] >= bound)
+                break;
+            if (ops[1] == c_DecorationBuiltIn)
+                builtIns[ops[0]] = ops[2];
+            else if (ops[1] == c_DecorationLocation)
+                locations[ops[0]] = ops[2];
+            else if (ops[1] == c_DecorationBinding)
+                bindings[ops[0]] = ops[2];
+            else if (ops[1] == c_DecorationArrayStride)
+                arrayStrides[ops[0]] = ops[2];
+            break;
+
+        case c_OpMemberDecorate:
+            if (wordCount >= 5 && ops[2] == c_DecorationOffset)
+            {
+                auto& offsets = memberByteOffsets[ops[0]];
+                if (offsets.size() <= ops[1])
+                    offsets.resize(ops[1] + 1, ~0u);
+                offsets[ops[1]] = ops[3];
+            }
+            break;
+
+        case c_OpTypeVoid:
+            shader->types[ops[0]].kind = SpirvTypeKind::Void;
+            break;
+
+        case c_OpTypeBool:
+            shader->types[ops[0]].kind = SpirvTypeKind::Bool;
+            shader->types[ops[0]].components = 1;
+            break;
+
+        case c_OpTypeInt:
+        case c_OpTypeFloat:
+            if (ops[1] != 32)
+                return fail("only 32-bit numbers are supported");
+            shader->types[ops[0]].kind = opcode == c_OpTypeInt ? SpirvTypeKind::Int : SpirvTypeKind::Float;
+            shader->types[ops[0]].components = 1;
+            break;
+
+        case c_OpTypeVector:
+        case c_OpTypeMatrix:
+        {
+            SpirvType& type = shader->types[ops[0]];
+            type.kind = opcode == c_OpTypeVector ? SpirvTypeKind::Vector : SpirvTypeKind::Matrix;
+            type.element = ops[1];
+            type.count = ops[2];
+            type.components = ops[2] * shader->types[ops[1]].components;
+            break;
+        }
+
+        case c_OpTypeImage:
+        case c_OpTypeSampledImage:
+        {
+            SpirvType& type = shader->types[ops[0]];
+            type.kind = opcode == c_OpTypeImage ? SpirvTypeKind::Image : SpirvTypeKind::SampledImage;
+            type.dim = opcode == c_OpTypeImage ? ops[2] : shader->types[ops[1]].dim;
+            type.components = 1;
+            break;
+        }
+
+        case c_OpTypeSampler:
+            shader->types[ops[0]].kind = SpirvTypeKind::Sampler;
+            shader->types[ops[0]].components = 1;
+            break;
+
+        case c_OpTypeArray:
+        {
+            SpirvType& type = shader->types[ops[0]];
+            type.kind = SpirvTypeKind::Array;
+            type.element = ops[1];
+            type.count = shader->ConstantValue(ops[2]);
+            type.components = type.count * shader->types[ops[1]].components;
+
+            // Only the tightly packed layouts of the preamble blocks are supported
+            if (arrayStrides[ops[0]] && arrayStrides[ops[0]] != shader->types[ops[1]].components * sizeof(uint32_t))
+                return fail("unsupported array layout");
+            break;
+        }
+
+        case c_OpTypeStruct:
+        {
+            SpirvType& type = shader->types[ops[0]];
+            type.kind = SpirvTypeKind::Struct;
+            for (uint32_t member = 1; member < wordCount - 1; member++)
+            {
+                type.members.push_back(ops[member]);
+                type.memberOffsets.push_back(type.components);
+                type.components += shader->types[ops[member]].components;
+            }
+            break;
+        }
+
+        case c_OpTypePointer:
+            shader->types[ops[0]].kind = SpirvTypeKind::Pointer;
+            shader->types[ops[0]].element = ops[2];
+            shader->types[ops[0]].components = 1;
+            break;
+
+        case c_OpTypeFunction:
+            shader->types[ops[0]].kind = SpirvTypeKind::Function;
+            break;
+
+        case c_OpConstantTrue:
+        case c_OpConstantFalse:
+        case c_OpSpecConstantTrue:
+        case c_OpSpecConstantFalse:
+            allocateRegister(ops[1], ops[0]);
+            setConstant(ops[1], 0, (opcode == c_OpConstantTrue || opcode == c_OpSpecConstantTrue) ? 1 : 0);
+            break;
+
+        case c_OpConstant:
+        case c_OpSpecConstant:
+            if (wordCount != 4)
+                return fail("only 32-bit constants are supported");
+            allocateRegister(ops[1], ops[0]);
+            setConstant(ops[1], 0, ops[2]);
+            break;
+
+        case c_OpConstantComposite:
+        case c_OpSpecConstantComposite:
+        {
+            allocateRegister(ops[1], ops[0]);
+            uint32_t component = 0;
+            for (uint32_t operand = 2; operand < wordCount - 1; operand++)
+            {
+                const uint32_t constituent = ops[operand];
+                for (uint32_t index = 0; index < shader->TypeOf(constituent).components; index++)
+                    setConstant(ops[1], component++, shader->initialRegisters[shader->registerOffsets[constituent] + index * c_Lanes]);
+            }
+            break;
+        }
+
+        case c_OpConstantNull:
+        case c_OpUndef:
+            allocateRegister(ops[1], ops[0]);
+            break;
+
+        case c_OpVariable:
+        {
+            const uint32_t id = ops[1];
+            const uint32_t storageClass = ops[2];
+            const uint32_t address = allocateVariable(id, ops[0]);
+            const SpirvType& pointee = shader->types[shader->types[ops[0]].element];
+
+            if (inFunction)
+            {
+                if (storageClass != c_StorageClassFunction)
+                    return fail("unsupported variable");
+                shader->instructions.push_back(instruction);
+                break;
+            }
+
+            shader->initialMemory.resize(memoryComponents, 0);
+            if (wordCount > 4)
+            {
+                for (uint32_t component = 0; component < pointee.components; component++)
+                    shader->initialMemory[address + component] = shader->initialRegisters[shader->registerOffsets[ops[3]] + component * c_Lanes];
+            }
+
+            auto checkBlockLayout = [&]()
+            {
+                const auto offsets = memberByteOffsets.find(shader->types[ops[0]].element);
+                if (offsets == memberByteOffsets.end())
+                    return true;
+                for (size_t member = 0; member < offsets->second.size() && member < pointee.memberOffsets.size(); member++)
+                {
+                    if (offsets->second[member] != pointee.memberOffsets[member] * sizeof(uint32_t))
+                        return false;
+                }
+                return true;
+            };
+
+            if (storageClass == c_StorageClassInput && builtIns[id] == c_BuiltInFragCoord)
+                shader->fragCoordAddress = address;
+            else if (storageClass == c_StorageClassInput && locations[id] == 0 && builtIns[id] == ~0u)
+                shader->uvAddress = address;
+            else if (storageClass == c_StorageClassOutput && locations[id] == 0 && pointee.components == 4)
+                shader->outputAddress = address;
+            else if (storageClass == c_StorageClassUniform && bindings[id] == c_UniformBufferBinding)
+            {
+                if (!checkBlockLayout())
+                    return fail("unsupported uniform buffer layout");
+                shader->uniformsAddress = address;
+                shader->uniformsComponents = pointee.components;
+            }
+            else if (storageClass == c_StorageClassPushConstant)
+            {
+                if (!checkBlockLayout())
+                    return fail("unsupported push constant layout");
+                shader->pushConstantsAddress = address;
+                shader->pushConstantsComponents = pointee.components;
+            }
+            else if (storageClass == c_StorageClassUniformConstant && bindings[id] < c_MaxPassInputs)
+                shader->initialMemory[address] = bindings[id];
+            else if (storageClass != c_StorageClassPrivate)
+                return fail("unsupported shader interface variable");
+            break;
+        }
+
+        case c_OpFunction:
+            if (inFunction || ops[1] >= bound)
+                return fail("invalid function");
+            inFunction = true;
+            shader->functionIndices[ops[1]] = uint32_t(shader->functions.size());
+            shader->functions.emplace_back();
+            shader->functions.back().firstBlock = uint32_t(shader->blocks.size());
+            break;
+
+        case c_OpFunctionParameter:
+            if (!inFunction)
+                return fail("invalid function");
+            allocateRegister(ops[1], ops[0]);
+            shader->functions.back().parameters.push_back(ops[1]);
+            break;
+
+        case c_OpLabel:
+            if (!inFunction || ops[0] >= bound)
+                return fail("invalid block");
+            shader->blockIndices[ops[0]] = uint32_t(shader->blocks.size());
+            shader->blocks.push_back({ ops[0], uint32_t(shader->instructions.size()), 0, c_NoBlock });
+            ++shader->functions.back().blockCount;
+            break;
+
+        case c_OpFunctionEnd:
+            inFunction = false;
+            break;
+
+        default:
+        {
+            bool hasResult = false;
+            if (!inFunction || shader->blocks.empty() || !GetInstructionResult(opcode, hasResult))
+                return fail("unsupported instruction " + std::to_string(opcode));
+
+            if (hasResult)
+            {
+                if (wordCount < 3 || ops[0] >= bound || ops[1] >= bound)
+                    return fail("invalid instruction " + std::to_string(opcode));
+                allocateRegister(ops[1], ops[0]);
+            }
+
+            if (opcode == c_OpExtInst && (wordCount < 6 || ops[2] != shader->glslInstructions || !IsSupportedGlslInstruction(ops[3])))
+                return fail("unsupported extended instruction " + std::to_string(wordCount >= 5 ? ops[3] : 0));
+
+            shader->instructions.push_back(instruction);
+            if (IsTerminator(opcode))
+                shader->blocks.back().end = uint32_t(shader->instructions.size());
+            break;
+        }
+        }
+    }
+
+    if (shader->entryFunction == 0 || shader->functionIndices[shader->entryFunction] == ~0u)
+        return fail("no fragment shader entry point");
+    if (shader->outputAddress == c_NoRegister)
+        return fail("no color output");
+
+    for (const auto& block : shader->blocks)
+    {
+        if (block.end <= block.begin)
+            return fail("a block has no terminator");
+    }
+
+    for (const auto& function : shader->functions)
+    {
+        if (function.blockCount == 0)
+            return fail("a function has no blocks");
+
+        // Every branch must go to a block of the same function
+        for (uint32_t block = function.firstBlock; block < function.firstBlock + function.blockCount; block++)
+        {
+            const SpirvInstruction& terminator = shader->instructions[shader->blocks[block].end - 1];
+            const uint32_t* ops = shader->Operands(terminator);
+            std::vector<uint32_t> targets;
+            if (terminator.opcode == c_OpBranch)
+                targets = { ops[0] };
+            else if (terminator.opcode == c_OpBranchConditional)
+                targets = { ops[1], ops[2] };
+            else if (terminator.opcode == c_OpSwitch)
+            {
+                targets.push_back(ops[1]);
+                for (uint32_t operand = 3; operand + 1 < terminator.wordCount; operand += 2)
+                    targets.push_back(ops[operand]);
+            }
+
+            for (uint32_t label : targets)
+            {
+                const uint32_t target = label < bound ? shader->blockIndices[label] : c_NoBlock;
+                if (target < function.firstBlock || target >= function.firstBlock + function.blockCount)
+                    return fail("invalid branch");
+            }
+        }
+
+        FindReconvergencePoints(*shader, function);
+    }
+
+    shader->initialMemory.resize(memoryComponents, 0);
+    return shader;
+}
+
+// The shaders can loop forever, which the GPU would stop with a device reset. Here the block
+// is abandoned after this many branches and comes out black.
+static constexpr uint32_t c_MaxBranches = 1u << 22;
+
+static float AsFloat(uint32_t bits)
+{
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+static uint32_t AsBits(float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+// Writes the lanes in the mask; the other lanes keep their values from before the divergence
+static void WriteLanes(uint32_t* dst, const uint32_t* src, uint32_t components, uint32_t mask)
+{
+    if (mask == c_AllLanes)
+    {
+        memmove(dst, src, size_t(components) * c_Lanes * sizeof(uint32_t));
+        return;
+    }
+
+    for (uint32_t component = 0; component < components; component++)
+    {
+        for (int lane = 0; lane < c_Lanes; lane++)
+        {
+            if (mask & (1u << lane))
+                dst[component * c_Lanes + lane] = src[component * c_Lanes + lane];
+        }
+    }
+}
+
+static int32_t FloatToInt(float value)
+{
+    if (!(value > -2147483648.f))
+        return std::isnan(value) ? 0 : std::numeric_limits<int32_t>::min();
+    if (value >= 2147483648.f)
+        return std::numeric_limits<int32_t>::max();
+    return int32_t(value);
+}
+
+static uint32_t FloatToUint(float value)
+{
+    if (!(value > 0.f))
+        return 0;
+    if (value >= 4294967296.f)
+        return std::numeric_limits<uint32_t>::max();
+    return uint32_t(value);
+}
+
+static uint32_t FloatToHalf(float value)
+{
+    const uint32_t bits = AsBits(value);
+    const uint32_t sign = (bits >> 16) & 0x8000;
+    const float magnitude = std::fabs(value);
+    if (std::isnan(value))
+        return sign | 0x7e00;
+    if (magnitude >= 65520.f)
+        return sign | 0x7c00;
+    if (magnitude < 6.103515625e-05f)
+        return sign | uint32_t(std::nearbyint(magnitude * 16777216.f));
+    const uint32_t rounded = (bits & 0x7fffffff) + 0xfff + ((bits >> 13) & 1);
+    return sign | ((rounded - (112u << 23)) >> 13);
+}
+
+class SpirvMachine
+{
+private:
+    struct StackEntry
+    {
+        uint32_t block;
+        uint32_t instruction;
+        uint32_t reconverge;
+        uint32_t mask;
+    };
+
+    struct CallFrame
+    {
+        size_t stackBase;
+        uint32_t result;
+        uint32_t returned;
+    };
+
+    std::shared_ptr<const SpirvShader> m_ShaderPtr;
+    const SpirvShader& m_Shader;
+    std::vector<uint32_t> m_Registers;
+    std::vector<uint32_t> m_Memory;
+    std::vector<StackEntry> m_Stack;
+    std::vector<CallFrame> m_Calls;
+    uint32_t m_PreviousBlocks[c_Lanes] = {};
+    uint32_t m_Killed = 0;
+    std::array<SoftwareChannel, c_MaxPassInputs> m_Channels;
+    float m_Width = 0.f;
+    float m_Height = 0.f;
+
+    uint32_t* Reg(uint32_t id) { return m_Registers.data() + m_Shader.registerOffsets[id]; }
+    [[nodiscard]] uint32_t Components(uint32_t id) const { return m_Shader.TypeOf(id).components; }
+
+    template<typename T, typename F>
+    void Map1(uint32_t type, uint32_t result, uint32_t a, uint32_t mask, F&& f);
+    template<typename T, typename F>
+    void Map2(uint32_t type, uint32_t result, uint32_t a, uint32_t b, uint32_t mask, F&& f);
+    template<typename T, typename F>
+    void Map3(uint32_t type, uint32_t result, uint32_t a, uint32_t b, uint32_t c, uint32_t mask, F&& f);
+
+    void PopEntry();
+    void Jump(uint32_t from, uint32_t to, uint32_t mask);
+    void Diverge(uint32_t from, const uint32_t* targets, const uint32_t* masks, int count, uint32_t mask);
+    void Call(const uint32_t* ops, uint32_t mask);
+    void Switch(uint32_t from, const SpirvInstruction& instruction, const uint32_t* ops, uint32_t mask);
+    void RunBlock(uint32_t mask);
+    void Execute(const SpirvInstruction& instruction, const uint32_t* ops, uint32_t mask);
+    void ExecuteGlsl(const SpirvInstruction& instruction, const uint32_t* ops, uint32_t mask);
+    void Load(uint32_t type, uint32_t result, uint32_t pointer, uint32_t mask);
+    void Store(uint32_t pointer, uint32_t object, uint32_t mask);
+    void StoreLanes(const uint32_t* address, const uint32_t* src, uint32_t components, uint32_t mask);
+    void AccessChain(const SpirvInstruction& instruction, const uint32_t* ops, uint32_t mask);
+    void Derivative(uint16_t opcode, const uint32_t* ops, uint32_t mask);
+    void SampleImage(const SpirvInstruction& instruction, const uint32_t* ops, uint32_t mask);
+    void QueryImage(const SpirvInstruction& instruction, const uint32_t* ops, uint32_t mask);
+
+public:
+    explicit SpirvMachine(std::shared_ptr<const SpirvShader> shader);
+
+    void SetInputs(const SoftwareShaderInputs& inputs);
+    uint32_t ShadeBlock(int x, int y, float (&colors)[c_Lanes][4]);
+};
+
+SpirvMachine::SpirvMachine(std::shared_ptr<const SpirvShader> shader)
+    : m_ShaderPtr(std::move(shader))
+    , m_Shader(*m_ShaderPtr)
+    , m_Registers(m_Shader.initialRegisters)
+    , m_Memory(m_Shader.initialMemory.size() * c_Lanes)
+{
+    for (size_t address = 0; address < m_Shader.initialMemory.size(); address++)
+        std::fill_n(m_Memory.data() + address * c_Lanes, c_Lanes, m_Shader.initialMemory[address]);
+}
+
+void SpirvMachine::SetInputs(const SoftwareShaderInputs& inputs)
+{
+    m_Channels = inputs.channels;
+    m_Width = inputs.push.iResolution[0];
+    m_Height = inputs.push.iResolution[1];
+
+    auto writeBlock = [this](uint32_t address, uint32_t components, const void* data, size_t size)
+    {
+        if (address == c_NoRegister)
+            return;
+
+        uint32_t words[64] = {};
+        memcpy(words, data, std::min(size, sizeof(words)));
+        for (uint32_t component = 0; component < components && component < std::size(words); component++)
+            std::fill_n(m_Memory.data() + (address + component) * c_Lanes, c_Lanes, words[component]);
+    };
+
+    writeBlock(m_Shader.uniformsAddress, m_Shader.uniformsComponents, &inputs.uniforms, sizeof(inputs.uniforms));
+    writeBlock(m_Shader.pushConstantsAddress, m_Shader.pushConstantsComponents, &inputs.push, sizeof(inputs.push));
+}
+
+uint32_t SpirvMachine::ShadeBlock(int x, int y, float (&colors)[c_Lanes][4])
+{
+    for (int lane = 0; lane < c_Lanes; lane++)
+    {
+        const float fragX = float(x + lane % c_SoftwareBlockWidth) + 0.5f;
+        const float fragY = float(y + lane / c_SoftwareBlockWidth) + 0.5f;
+        const float fragCoord[4] = { fragX, fragY, 0.f, 1.f };
+        const float uv[2] = { fragX / m_Width, fragY / m_Height };
+
+        if (m_Shader.fragCoordAddress != c_NoRegister)
+        {
+            for (uint32_t component = 0; component < 4; component++)
+                m_Memory[(m_Shader.fragCoordAddress + component) * c_Lanes + lane] = AsBits(fragCoord[component]);
+        }
+        if (m_Shader.uvAddress != c_NoRegister)
+        {
+            for (uint32_t component = 0; component < 2; component++)
+                m_Memory[(m_Shader.uvAddress + component) * c_Lanes + lane] = AsBits(uv[component]);
+        }
+    }
+
+    const SpirvFunction& entry = m_Shader.functions[m_Shader.functionIndices[m_Shader.entryFunction]];
+    m_Killed = 0;
+    m_Stack.clear();
+    m_Calls.clear();
+    std::fill_n(m_PreviousBlocks, c_Lanes, c_NoBlock);
+    m_Calls.push_back({ 0, c_NoRegister, 0 });
+    m_Stack.push_back({ entry.firstBlock, m_Shader.blocks[entry.firstBlock].begin, c_NoBlock, c_AllLanes });
+
+    uint32_t branches = 0;
+    while (!m_Stack.empty())
+    {
+        const StackEntry& top = m_Stack.back();
+        const uint32_t mask = top.mask & ~m_Killed & ~m_Calls.back().returned;
+        if (mask == 0 || top.block == top.reconverge || top.block == c_NoBlock)
+        {
+            PopEntry();
+            continue;
+        }
+
+        if (++branches > c_MaxBranches)
+        {
+            m_Killed = c_AllLanes;
+            break;
+        }
+
+        RunBlock(mask);
+    }
+
+    for (int lane = 0; lane < c_Lanes; lane++)
+    {
+        for (uint32_t component = 0; component < 4; component++)
+            colors[lane][component] = AsFloat(m_Memory[(m_Shader.outputAddress + component) * c_Lanes + lane]);
+    }
+
+    return c_AllLanes & ~m_Killed;
+}
+
+void SpirvMachine::PopEntry()
+{
+    m_Stack.pop_back();
+    if (m_Calls.size() > 1 && m_Stack.size() == m_Calls.back().stackBase)
+        m_Calls.pop_back();
+}
+
+void SpirvMachine::Jump(uint32_t from, uint32_t to, uint32_t mask)
+{
+    for (int lane = 0; lane < c_Lanes; lane++)
+    {
+        if (mask & (1u << lane))
+            m_PreviousBlocks[lane] = from;
+    }
+
+    StackEntry& top = m_Stack.back();
+    top.block = to;
+    top.instruction = m_Shader.blocks[to].begin;
+}
+
+// The current entry waits at the reconvergence point of the block while each group of lanes
+// runs up to that point on its own entry
+void SpirvMachine::Diverge(uint32_t from, const uint32_t* targets, const uint32_t* masks, int count, uint32_t mask)
+{
+    for (int lane = 0; lane < c_Lanes; lane++)
+    {
+        if (mask & (1u << lane))
+            m_PreviousBlocks[lane] = from;
+    }
+
+    const uint32_t reconverge = m_Shader.blocks[from].reconverge;
+    StackEntry& top = m_Stack.back();
+    top.block = reconverge;
+    top.instruction = (reconverge == c_NoBlock) ? 0 : m_Shader.blocks[reconverge].begin;
+
+    for (int index = 0; index < count; index++)
+    {
+        if (targets[index] != reconverge)
+            m_Stack.push_back({ targets[index], m_Shader.blocks[targets[index]].begin, reconverge, masks[index] });
+    }
+}
+
+void SpirvMachine::Call(const uint32_t* ops, uint32_t mask)
+{
+    const SpirvFunction& function = m_Shader.functions[m_Shader.functionIndices[ops[2]]];
+    for (size_t parameter = 0; parameter < function.parameters.size(); parameter++)
+    {
+        const uint32_t id = function.parameters[parameter];
+        WriteLanes(Reg(id), Reg(ops[3 + parameter]), Components(id), mask);
+    }
+
+    m_Calls.push_back({ m_Stack.size(), Components(ops[1]) ? ops[1] : c_NoRegister, 0 });
+    m_Stack.push_back({ function.firstBlock, m_Shader.blocks[function.firstBlock].begin, c_NoBlock, mask });
+}
+
+void SpirvMachine::Switch(uint32_t from, const SpirvInstruction& instruction, const uint32_t* ops, uint32_t mask)
+{
+    const uint32_t* selector = Reg(ops[0]);
+    uint32_t targets[c_Lanes];
+    uint32_t masks[c_Lanes];
+    int count = 0;
+
+    for (int lane = 0; lane < c_Lanes; lane++)
+    {
+        if (!(mask & (1u << lane)))
+            continue;
+
+        uint32_t label = ops[1];
+        for (uint32_t operand = 2; operand + 2 < instruction.wordCount; operand += 2)
+        {
+            if (ops[operand] == selector[lane])
+            {
+                label = ops[operand + 1];
+                break;
+            }
+        }
+
+        const uint32_t target = m_Shader.blockIndices[label];
+        int index = 0;
+        while (index < count && targets[index] != target)
+            ++index;
+        if (index == count)
+        {
+            targets[count] = target;
+            masks[count++] = 0;
+        }
+        masks[index] |= 1u << lane;
+    }
+
+    if (count == 1)
+        Jump(from, targets[0], mask);
+    else
+        Diverge(from, targets, masks, count, mask);
+}
+
+// Runs the instructions of the top entry until it leaves the block
+void SpirvMachine::RunBlock(uint32_t mask)
+{
+    const uint32_t block = m_Stack.back().block;
+
+    for (uint32_t index = m_Stack.back().instruction; ; index++)
+    {
+        const SpirvInstruction& instruction = m_Shader.instructions[index];
+        const uint32_t* ops = m_Shader.Operands(instruction);
+
+        switch (instruction.opcode)
+        {
+        case c_OpBranch:
+            Jump(block, m_Shader.blockIndices[ops[0]], mask);
+            return;
+
+        case c_OpBranchConditional:
+        {
+            const uint32_t* condition = Reg(ops[0]);
+            uint32_t taken = 0;
+            for (int lane = 0; lane < c_Lanes; lane++)
+                taken |= condition[lane] ? (1u << lane) : 0;
+            taken &= mask;
+
+            const uint32_t targets[2] = { m_Shader.blockIndices[ops[2]], m_Shader.blockIndices[ops[1]] };
+            const uint32_t masks[2] = { mask & ~taken, taken };
+            if (taken == mask)
+                Jump(block, targets[1], mask);
+            else if (taken == 0)
+                Jump(block, targets[0], mask);
+            else
+                Diverge(block, targets, masks, 2, mask);
+            return;
+        }
+
+        case c_OpSwitch:
+            Switch(block, instruction, ops, mask);
+            return;
+
+        case c_OpReturnValue:
+            if (m_Calls.back().result != c_NoRegister)
+                WriteLanes(Reg(m_Calls.back().result), Reg(ops[0]), Components(ops[0]), mask);
+            [[fallthrough]];
+        case c_OpReturn:
+        case c_OpUnreachable:
+            m_Calls.back().returned |= mask;
+            PopEntry();
+            return;
+
+        case c_OpKill:
+        case c_OpTerminateInvocation:
+            m_Killed |= mask;
+            PopEntry();
+            return;
+
+        case c_OpFunctionCall:
+            m_Stack.back().instruction = index + 1;
+            Call(ops, mask);
+            return;
+
+        default:
+            Execute(instruction, ops, mask);
+            break;
+        }
+    }
+}
+
+template<typename T, typename F>
+void SpirvMachine::Map1(uint32_t type, uint32_t result, uint32_t a, uint32_t mask, F&& f)
+{
+    const uint32_t components = m_Shader.types[type].components;
+    uint32_t* dst = Reg(result);
+    const uint32_t* srcA = Reg(a);
+
+    for (uint32_t component = 0; component < components; component++)
+    {
+        T x[c_Lanes];
+        uint32_t r[c_Lanes];
+        memcpy(x, srcA + component * c_Lanes, sizeof(x));
+        for (int lane = 0; lane < c_Lanes; lane++)
+            r[lane] = f(x[lane]);
+        WriteLanes(dst + component * c_Lanes, r, 1, mask);
+    }
+}
+
+// A scalar operand is used for all components of a vector result, which is how the
+// GLSL instructions like mix(vec3, vec3, float) come out of glslang after OpCompositeConstruct
+template<typename T, typename F>
+void SpirvMachine::Map2(uint32_t type, uint32_t result, uint32_t a, uint32_t b, uint32_t mask, F&& f)
+{
+    const uint32_t components = m_Shader.types[type].components;
+    uint32_t* dst = Reg(result);
+    const uint32_t* srcA = Reg(a);
+    const uint32_t* srcB = Reg(b);
+    const uint32_t strideB = Components(b) == 1 ? 0 : c_Lanes;
+
+    for (uint32_t component = 0; component < components; component++)
+    {
+        T x[c_Lanes], y[c_Lanes];
+        uint32_t r[c_Lanes];
+        memcpy(x, srcA + component * c_Lanes, sizeof(x));
+        memcpy(y, srcB + component * strideB, sizeof(y));
+        for (int lane = 0; lane < c_Lanes; lane++)
+            r[lane] = f(x[lane], y[lane]);
+        WriteLanes(dst + component * c_Lanes, r, 1, mask);
+    }
+}
+
+template<typename T, typename F>
+void SpirvMachine::Map3(uint32_t type, uint32_t result, uint32_t a, uint32_t b, uint32_t c, uint32_t mask, F&& f)
+{
+    const uint32_t components = m_Shader.types[type].components;
+    uint32_t* dst = Reg(result);
+    const uint32_t* srcA = Reg(a);
+    const uint32_t* srcB = Reg(b);
+    const uint32_t* srcC = Reg(c);
+    const uint32_t strideA = Components(a) == 1 ? 0 : c_Lanes;
+    const uint32_t strideB = Components(b) == 1 ? 0 : c_Lanes;
+    const uint32_t strideC = Components(c) == 1 ? 0 : c_Lanes;
+
+    for (uint32_t component = 0; component < components; component++)
+    {
+        T x[c_Lanes], y[c_Lanes], z[c_Lanes];
+        uint32_t r[c_Lanes];
+        memcpy(x, srcA + component * strideA, sizeof(x));
+        memcpy(y, srcB + component * strideB, sizeof(y));
+        memcpy(z, srcC + component * strideC, sizeof(z));
+        for (int lane = 0; lane < c_Lanes; lane++)
+            r[lane] = f(x[lane], y[lane], z[lane]);
+        WriteLanes(dst + component * c_Lanes, r, 1, mask);
+    }
+}
+
+void SpirvMachine::Load(uint32_t type, uint32_t result, uint32_t pointer, uint32_t mask)
+{
+    const uint32_t components = m_Shader.types[type].components;
+    const uint32_t memoryComponents = uint32_t(m_Memory.size() / c_Lanes);
+    const uint32_t* address = Reg(pointer);
+    uint32_t* dst = Reg(result);
+
+    bool uniform = mask == c_AllLanes;
+    for (int lane = 1; lane < c_Lanes && uniform; lane++)
+        uniform = address[lane] == address[0];
+
+    if (uniform && address[0] <= memoryComponents - components)
+    {
+        memcpy(dst, m_Memory.data() + size_t(address[0]) * c_Lanes, size_t(components) * c_Lanes * sizeof(uint32_t));
+        return;
+    }
+
+    for (int lane = 0; lane < c_Lanes; lane++)
+    {
+        if (!(mask & (1u << lane)))
+            continue;
+
+        const bool valid = address[lane] <= memoryComponents - components;
+        for (uint32_t component = 0; component < components; component++)
+            dst[component * c_Lanes + lane] = valid ? m_Memory[(address[lane] + component) * c_Lanes + lane] : 0;
+    }
+}
+
+void SpirvMachine::Store(uint32_t pointer, uint32_t object, uint32_t mask)
+{
+    StoreLanes(Reg(pointer), Reg(object), Components(object), mask);
+}
+
+void SpirvMachine::StoreLanes(const uint32_t* address, const uint32_t* src, uint32_t components, uint32_t mask)
+{
+    const uint32_t memoryComponents = uint32_t(m_Memory.size() / c_Lanes);
+
+    bool uniform = true;
+    for (int lane = 1; lane < c_Lanes && uniform; lane++)
+        uniform = address[lane] == address[0];
+
+    if (uniform && address[0] <= memoryComponents - components)
+    {
+        WriteLanes(m_Memory.data() + size_t(address[0]) * c_Lanes, src, components, mask);
+        return;
+    }
+
+    for (int lane = 0; lane < c_Lanes; lane++)
+    {
+        if (!(mask & (1u << lane)) || address[lane] > memoryComponents - components)
+            continue;
+
+        for (uint32_t component = 0; component < components; component++)
+            m_Memory[(address[lane] + component) * c_Lanes + lane] = src[component * c_Lanes + lane];
+    }
+}
+
+// Pointers are component addresses in the memory. Dynamic indices are clamped to the array
+// or vector, so that a bad index reads a wrong element instead of something outside the variable.
+void SpirvMachine::AccessChain(const SpirvInstruction& instruction, const uint32_t* ops, uint32_t mask)
+{
+    uint32_t address[c_Lanes];
+    memcpy(address, Reg(ops[2]), sizeof(address));
+    uint32_t typeId = m_Shader.TypeOf(ops[2]).element;
+
+    for (uint32_t operand = 3; operand < uint32_t(instruction.wordCount - 1); operand++)
+    {
+        const SpirvType& type = m_Shader.types[typeId];
+        if (type.kind == SpirvTypeKind::Struct)
+        {
+            const uint32_t member = std::min(m_Shader.ConstantValue(ops[operand]), uint32_t(type.members.size() - 1));
+            for (uint32_t& lane : address)
+                lane += type.memberOffsets[member];
+            typeId = type.members[member];
+            continue;
+        }
+
+        const uint32_t stride = m_Shader.types[type.element].components;
+        const uint32_t* index = Reg(ops[operand]);
+        for (int lane = 0; lane < c_Lanes; lane++)
+        {
+            const int32_t value = int32_t(index[lane]);
+            address[lane] += uint32_t(std::clamp(value, 0, int32_t(type.count) - 1)) * stride;
+        }
+        typeId = type.element;
+    }
+
+    WriteLanes(Reg(ops[1]), address, 1, mask);
+}
+
+// The lanes of a block are numbered row by row, so the horizontal neighbor of a lane is lane ^ 1
+// and the vertical one is lane ^ 4. The fine derivatives are taken within each row or column
+// of the 2x2 quad, the coarse ones use the first row or column of the quad for all its pixels.
+void SpirvMachine::Derivative(uint16_t opcode, const uint32_t* ops, uint32_t mask)
+{
+    const bool coarse = opcode == c_OpDPdxCoarse || opcode == c_OpDPdyCoarse || opcode == c_OpFwidthCoarse;
+    const bool width = opcode == c_OpFwidth || opcode == c_OpFwidthFine || opcode == c_OpFwidthCoarse;
+    const bool horizontal = opcode == c_OpDPdx || opcode == c_OpDPdxFine || opcode == c_OpDPdxCoarse;
+    const uint32_t components = m_Shader.types[ops[0]].components;
+    const uint32_t* src = Reg(ops[2]);
+    uint32_t* dst = Reg(ops[1]);
+
+    for (uint32_t component = 0; component < components; component++)
+    {
+        float v[c_Lanes];
+        uint32_t r[c_Lanes];
+        memcpy(v, src + component * c_Lanes, sizeof(v));
+
+        for (int lane = 0; lane < c_Lanes; lane++)
+        {
+            const int row = coarse ? (lane & ~c_SoftwareBlockWidth) : lane;
+            const int column = coarse ? (lane & ~1) : lane;
+            const float dx = v[row | 1] - v[row & ~1];
+            const float dy = v[column | c_SoftwareBlockWidth] - v[column & ~c_SoftwareBlockWidth];
+            r[lane] = AsBits(width ? std::fabs(dx) + std::fabs(dy) : (horizontal ? dx : dy));
+        }
+        WriteLanes(dst + component * c_Lanes, r, 1, mask);
+    }
+}
+
+void SpirvMachine::Execute(const SpirvInstruction& instruction, const uint32_t* ops, uint32_t mask)
+{
+    const uint16_t opcode = instruction.opcode;
+
+    switch (opcode)
+    {
+    case c_OpLoopMerge:
+    case c_OpSelectionMerge:
+        break;
+
+    case c_OpVariable:
+        if (instruction.wordCount > 4)
+            Store(ops[1], ops[3], mask);
+        break;
+
+    case c_OpLoad:
+        Load(ops[0], ops[1], ops[2], mask);
+        break;
+
+    case c_OpStore:
+        Store(ops[0], ops[1], mask);
+        break;
+
+    case c_OpCopyMemory:
+    {
+        // Goes through a temporary register, the pointee type is read from the source pointer
+        const uint32_t components = m_Shader.types[m_Shader.TypeOf(ops[1]).element].components;
+        const uint32_t memoryComponents = uint32_t(m_Memory.size() / c_Lanes);
+        const uint32_t* dstAddress = Reg(ops[0]);
+        const uint32_t* srcAddress = Reg(ops[1]);
+        for (int lane = 0; lane < c_Lanes; lane++)
+        {
+            if (!(mask & (1u << lane)) || dstAddress[lane] > memoryComponents - components || srcAddress[lane] > memoryComponents - components)
+                continue;
+            for (uint32_t component = 0; component < components; component++)
+                m_Memory[(dstAddress[lane] + component) * c_Lanes + lane] = m_Memory[(srcAddress[lane] + component) * c_Lanes + lane];
+        }
+        break;
+    }
+
+    case c_OpAccessChain:
+    case c_OpInBoundsAccessChain:
+        AccessChain(instruction, ops, mask);
+        break;
+
+    case c_OpPhi:
+    {
+        uint32_t* dst = Reg(ops[1]);
+        const uint32_t components = m_Shader.types[ops[0]].components;
+        for (uint32_t operand = 2; operand + 2 < instruction.wordCount; operand += 2)
+        {
+            uint32_t lanes = 0;
+            for (int lane = 0; lane < c_Lanes; lane++)
+                lanes |= (m_PreviousBlocks[lane] == m_Shader.blockIndices[ops[operand + 1]]) ? (1u << lane) : 0;
+            if (lanes & mask)
+                WriteLanes(dst, Reg(ops[operand]), components, lanes & mask);
+        }
+        break;
+    }
+
+    case c_OpCopyObject:
+    case c_OpCopyLogical:
+    case c_OpSampledImage:
+    case c_OpImage:
+    case c_OpUConvert:
+    case c_OpSConvert:
+    case c_OpFConvert:
+    case c_OpBitcast:
+        WriteLanes(Reg(ops[1]), Reg(ops[2]), m_Shader.types[ops[0]].components, mask);
+        break;
+
+    case c_OpQuantizeToF16:
+        Map1<float>(ops[0], ops[1], ops[2], mask, [](float x) { return AsBits(HalfToFloat(uint16_t(FloatToHalf(x)))); });
+        break;
+
+    case c_OpCompositeConstruct:
+    {
+        uint32_t* dst = Reg(ops[1]);
+        uint32_t offset = 0;
+        for (uint32_t operand = 2; operand < uint32_t(instruction.wordCount - 1); operand++)
+        {
+            const uint32_t components = Components(ops[operand]);
+            WriteLanes(dst + offset * c_Lanes, Reg(ops[operand]), components, mask);
+            offset += components;
+        }
+        break;
+    }
+
+    case c_OpCompositeExtract:
+    case c_OpCompositeInsert:
+    {
+        const bool insert = opcode == c_OpCompositeInsert;
+        const uint32_t composite = insert ? ops[3] : ops[2];
+        uint32_t typeId = m_Shader.resultTypes[composite];
+        uint32_t offset = 0;
+        for (uint32_t operand = insert ? 4 : 3; operand < uint32_t(instruction.wordCount - 1); operand++)
+        {
+            const SpirvType& type = m_Shader.types[typeId];
+            const uint32_t index = ops[operand];
+            if (type.kind == SpirvTypeKind::Struct)
+            {
+                offset += type.memberOffsets[index];
+                typeId = type.members[index];
+            }
+            else
+            {
+                offset += index * m_Shader.types[type.element].components;
+                typeId = type.element;
+            }
+        }
+
+        if (insert)
+        {
+            WriteLanes(Reg(ops[1]), Reg(composite), Components(composite), mask);
+            WriteLanes(Reg(ops[1]) + offset * c_Lanes, Reg(ops[2]), Components(ops[2]), mask);
+        }
+        else
+            WriteLanes(Reg(ops[1]), Reg(composite) + offset * c_Lanes, m_Shader.types[ops[0]].components, mask);
+        break;
+    }
+
+    case c_OpVectorShuffle:
+    {
+        const uint32_t firstComponents = Components(ops[2]);
+        uint32_t result[4 * c_Lanes] = {};
+        const uint32_t components = std::min(uint32_t(instruction.wordCount - 5), 4u);
+        for (uint32_t component = 0; component < components; component++)
+        {
+            const uint32_t select = ops[4 + component];
+            if (select == ~0u)
+                continue;
+            const uint32_t* src = (select < firstComponents) ? Reg(ops[2]) + select * c_Lanes : Reg(ops[3]) + (select - firstComponents) * c_Lanes;
+            memcpy(result + component * c_Lanes, src, c_Lanes * sizeof(uint32_t));
+        }
+        WriteLanes(Reg(ops[1]), result, components, mask);
+        break;
+    }
+
+    case c_OpVectorExtractDynamic:
+    {
+        const uint32_t components = Components(ops[2]);
+        const uint32_t* vector = Reg(ops[2]);
+        const uint32_t* index = Reg(ops[3]);
+        uint32_t result[c_Lanes];
+        for (int lane = 0; lane < c_Lanes; lane++)
+        {
+            const uint32_t component = std::min(index[lane], components - 1);
+            result[lane] = vector[component * c_Lanes + lane];
+        }
+        WriteLanes(Reg(ops[1]), result, 1, mask);
+        break;
+    }
+
+    case c_OpVectorInsertDynamic:
+    {
+        const uint32_t components = Components(ops[2]);
+        uint32_t result[4 * c_Lanes];
+        memcpy(result, Reg(ops[2]), size_t(components) * c_Lanes * sizeof(uint32_t));
+        const uint32_t* value = Reg(ops[3]);
+        const uint32_t* index = Reg(ops[4]);
+        for (int lane = 0; lane < c_Lanes; lane++)
+        {
+            if (index[lane] < components)
+                result[index[lane] * c_Lanes + lane] = value[lane];
+        }
+        WriteLanes(Reg(ops[1]), result, components, mask);
+        break;
+    }
+
+    case c_OpTranspose:
+    {
+        const SpirvType& resultType = m_Shader.types[ops[0]];
+        const uint32_t columns = resultType.count;
+        const uint32_t rows = m_Shader.types[resultType.element].count;
+        const uint32_t* src = Reg(ops[2]);
+        uint32_t result[16 * c_Lanes];
+        for (uint32_t column = 0; column < columns; column++)
+        {
+            for (uint32_t row = 0; row < rows; row++)
+                memcpy(result + (column * rows + row) * c_Lanes, src + (row * columns + column) * c_Lanes, c_Lanes * sizeof(uint32_t));
+        }
+        WriteLanes(Reg(ops[1]), result, columns * rows, mask);
+        break;
+    }
+
+    case c_OpConvertFToU:
+        Map1<float>(ops[0], ops[1], ops[2], mask, [](float x) { return FloatToUint(x); });
+        break;
+    case c_OpConvertFToS:
+        Map1<float>(ops[0], ops[1], ops[2], mask, [](float x) { return uint32_t(FloatToInt(x)); });
+        break;
+    case c_OpConvertSToF:
+        Map1<int32_t>(ops[0], ops[1], ops[2], mask, [](int32_t x) { return AsBits(float(x)); });
+        break;
+    case c_OpConvertUToF:
+        Map1<uint32_t>(ops[0], ops[1], ops[2], mask, [](uint32_t x) { return AsBits(float(x)); });
+        break;
+
+    case c_OpSNegate:
+        Map1<uint32_t>(ops[0], ops[1], ops[2], mask, [](uint32_t x) { return 0u - x; });
+        break;
+    case c_OpFNegate:
+        Map1<float>(ops[0], ops[1], ops[2], mask, [](float x) { return AsBits(-x); });
+        break;
+    case c_OpNot:
+        Map1<uint32_t>(ops[0], ops[1], ops[2], mask, [](uint32_t x) { return ~x; });
+        break;
+    case c_OpLogicalNot:
+        Map1<uint32_t>(ops[0], ops[1], ops[2], mask, [](uint32_t x) { return uint32_t(!x); });
+        break;
+    case c_OpIsNan:
+        Map1<float>(ops[0], ops[1], ops[2], mask, [](float x) { return uint32_t(std::isnan(x)); });
+        break;
+    case c_OpIsInf:
+        Map1<float>(ops[0], ops[1], ops[2], mask, [](float x) { return uint32_t(std::isinf(x)); });
+        break;
+    case c_OpBitReverse:
+        Map1<uint32_t>(ops[0], ops[1], ops[2], mask, [](uint32_t x)
+        {
+            uint32_t r = 0;
+            for (int bit = 0; bit < 32; bit++)
+                r |= ((x >> bit) & 1) << (31 - bit);
+            return r;
+        });
+        break;
+    case c_OpBitCount:
+        Map1<uint32_t>(ops[0], ops[1], ops[2], mask, [](uint32_t x)
+        {
+            uint32_t count = 0;
+            for (; x; x &= x - 1)
+                ++count;
+            return count;
+        });
+        break;
+
+    case c_OpIAdd:
+        Map2<uint32_t>(ops[0], ops[1], ops[2], ops[3], mask, [](uint32_t x, uint32_t y) { return x + y; });
+        break;
+    case c_OpISub:
+        Map2<uint32_t>(ops[0], ops[1], ops[2], ops[3], mask, [](uint32_t x, uint32_t y) { return x - y; });
+        break;
+    case c_OpIMul:
+        Map2<uint32_t>(ops[0], ops[1], ops[2], ops[3], mask, [](uint32_t x, uint32_t y) { return x * y; });
+        break;
+    case c_OpUDiv:
+        Map2<uint32_t>(ops[0], ops[1], ops[2], ops[3], mask, [](uint32_t x, uint32_t y) { return y ? x / y : ~0u; });
+        break;
+    case c_OpSDiv:
+        Map2<int32_t>(ops[0], ops[1], ops[2], ops[3], mask, [](int32_t x, int32_t y)
+        {
+            if (y == 0)
+                return ~0u;
+            if (y == -1)
+                return 0u - uint32_t(x);
+            return uint32_t(x / y);
+        });
+        break;
+    case c_OpUMod:
+        Map2<uint32_t>(ops[0], ops[1], ops[2], ops[3], mask, [](uint32_t x, uint32_t y) { return y ? x % y : 0u; });
+        break;
+    case c_OpSRem:
+    case c_OpSMod:
+        Map2<int32_t>(ops[0], ops[1], ops[2], ops[3], mask, [opcode](int32_t x, int32_t y)
+        {
+            if (y == 0 || y == -1)
+                return 0u;
+            int32_t r = x % y;
+            if (opcode == c_OpSMod && r != 0 && ((r < 0) != (y < 0)))
+                r += y;
+            return uint32_t(r);
+        });
+        break;
+    case c_OpFAdd:
+        Map2<float>(ops[0], ops[1], ops[2], ops[3], mask, [](float x, float y) { return AsBits(x + y); });
+        break;
+    case c_OpFSub:
+        Map2<float>(ops[0], ops[1], ops[2], ops[3], mask, [](float x, float y) { return AsBits(x - y); });
+        break;
+    case c_OpFMul:
+    case c_OpVectorTimesScalar:
+    case c_OpMatrixTimesScalar:
+        Map2<float>(ops[0], ops[1], ops[2], ops[3], mask, [](float x, float y) { return AsBits(x * y); });
+        break;
+    case c_OpFDiv:
+        Map2<float>(ops[0], ops[1], ops[2], ops[3], mask, [](float x, float y) { return AsBits(x / y); });
+        break;
+    case c_OpFRem:
+        Map2<float>(ops[0], ops[1], ops[2], ops[3], mask, [](float x, float y) { return AsBits(std::fmod(x, y)); });
+        break;
+    case c_OpFMod:
+        Map2<float>(ops[0], ops[1], ops[2], ops[3], mask, [](float x, float y) { return AsBits(x - y * std::floor(x / y)); });
+        break;
+
+    case c_OpShiftRightLogical:
+        Map2<uint32_t>(ops[0], ops[1], ops[2], ops[3], mask, [](uint32_t x, uint32_t y) { return x >> (y & 31); });
+        break;
+    case c_OpShiftRightArithmetic:
+        Map2<int32_t>(ops[0], ops[1], ops[2], ops[3], mask, [](int32_t x, int32_t y) { return uint32_t(x >> (y & 31)); });
+        break;
+    case c_OpShiftLeftLogical:
+        Map2<uint32_t>(ops[0], ops[1], ops[2], ops[3], mask, [](uint32_t x, uint32_t y) { return x << (y & 31); });
+        break;
+    case c_OpBitwiseOr:
+    case c_OpLogicalOr:
+        Map2<uint32_t>(ops[0], ops[1], ops[2], ops[3], mask, [](uint32_t x, uint32_t y) { return x | y; });
+        break;
+    case c_OpBitwiseXor:
+        Map2<uint32_t>(ops[0], ops[1], ops[2], ops[3], mask, [](uint32_t x, uint32_t y) { return x ^ y; });
+        break;
+    case c_OpBitwiseAnd:
+    case c_OpLogicalAnd:
+        Map2<uint32_t>(ops[0], ops[1], ops[2], ops[3], mask, [](uint32_t x, uint32_t y) { return x & y; });
+        break;
+
+    case c_OpIEqual:
+    case c_OpLogicalEqual:
+        Map2<uint32_t>(ops[0], ops[1], ops[2], ops[3], mask, [](uint32_t x, uint32_t y) { return uint32_t(x == y); });
+        break;
+    case c_OpINotEqual:
+    case c_OpLogicalNotEqual:
+        Map2<uint32_t>(ops[0], ops[1], ops[2], ops[3], mask, [](uint32_t x, uint32_t y) { return uint32_t(x != y); });
+        break;
+    case c_OpUGreaterThan:
+        Map2<uint32_t>(ops[0], ops[1], ops[2], ops[3], mask, [](uint32_t x, uint32_t y) { return uint32_t(x > y); });
+        break;
+    case c_OpSGreaterThan:
+        Map2<int32_t>(ops[0], ops[1], ops[2], ops[3], mask, [](int32_t x, int32_t y) { return uint32_t(x > y); });
+        break;
+    case c_OpUGreaterThanEqual:
+        Map2<uint32_t>(ops[0], ops[1], ops[2], ops[3], mask, [](uint32_t x, uint32_t y) { return uint32_t(x >= y); });
+        break;
+    case c_OpSGreaterThanEqual:
+        Map2<int32_t>(ops[0], ops[1], ops[2], ops[3], mask, [](int32_t x, int32_t y) { return uint32_t(x >= y); });
+        break;
+    case c_OpULessThan:
+        Map2<uint32_t>(ops[0], ops[1], ops[2], ops[3], mask, [](uint32_t x, uint32_t y) { return uint32_t(x < y); });
+        break;
+    case c_OpSLessThan:
+        Map2<int32_t>(ops[0], ops[1], ops[2], ops[3], mask, [](int32_t x, int32_t y) { return uint32_t(x < y); });
+        break;
+    case c_OpULessThanEqual:
+        Map2<uint32_t>(ops[0], ops[1], ops[2], ops[3], mask, [](uint32_t x, uint32_t y) { return uint32_t(x <= y); });
+        break;
+    case c_OpSLessThanEqual:
+        Map2<int32_t>(ops[0], ops[1], ops[2], ops[3], mask, [](int32_t x, int32_t y) { return uint32_t(x <= y); });
+        break;
+    case c_OpFOrdEqual:
+        Map2<float>(ops[0], ops[1], ops[2], ops[3], mask, [](float x, float y) { return uint32_t(x == y); });
+        break;
+    case c_OpFUnordEqual:
+        Map2<float>(ops[0], ops[1], ops[2], ops[3], mask, [](float x, float y) { return uint32_t(!(x < y) && !(x > y)); });
+        break;
+    case c_OpFOrdNotEqual:
+        Map2<float>(ops[0], ops[1], ops[2], ops[3], mask, [](float x, float y) { return uint32_t(x < y || x > y); });
+        break;
+    case c_OpFUnordNotEqual:
+        Map2<float>(ops[0], ops[1], ops[2], ops[3], mask, [](float x, float y) { return uint32_t(x != y); });
+        break;
+    case c_OpFOrdLessThan:
+        Map2<float>(ops[0], ops[1], ops[2], ops[3], mask, [](float x, float y) { return uint32_t(x < y); });
+        break;
+    case c_OpFUnordLessThan:
+        Map2<float>(ops[0], ops[1], ops[2], ops[3], mask, [](float x, float y) { return uint32_t(!(x >= y)); });
+        break;
+    case c_OpFOrdGreaterThan:
+        Map2<float>(ops[0], ops[1], ops[2], ops[3], mask, [](float x, float y) { return uint32_t(x > y); });
+        break;
+    case c_OpFUnordGreaterThan:
+        Map2<float>(ops[0], ops[1], ops[2], ops[3], mask, [](float x, float y) { return uint32_t(!(x <= y)); });
+        break;
+    case c_OpFOrdLessThanEqual:
+        Map2<float>(ops[0], ops[1], ops[2], ops[3], mask, [](float x, float y) { return uint32_t(x <= y); });
+        break;
+    case c_OpFUnordLessThanEqual:
+        Map2<float>(ops[0], ops[1], ops[2], ops[3], mask, [](float x, float y) { return uint32_t(!(x > y)); });
+        break;
+    case c_OpFOrdGreaterThanEqual:
+        Map2<float>(ops[0], ops[1], ops[2], ops[3], mask, [](float x, float y) { return uint32_t(x >= y); });
+        break;
+    case c_OpFUnordGreaterThanEqual:
+        Map2<float>(ops[0], ops[1], ops[2], ops[3], mask, [](float x, float y) { return uint32_t(!(x < y)); });
+        break;
+
+    case c_OpSelect:
+        Map3<uint32_t>(ops[0], ops[1], ops[2], ops[3], ops[4], mask, [](uint32_t condition, uint32_t x, uint32_t y) { return condition ? x : y; });
+        break;
+
+    case c_OpBitFieldInsert:
+    {
+        // The offset and count are scalars for all components
+        uint32_t offsets[c_Lanes], counts[c_Lanes];
+        memcpy(offsets, Reg(ops[4]), sizeof(offsets));
+        memcpy(counts, Reg(ops[5]), sizeof(counts));
+        const uint32_t components = m_Shader.types[ops[0]].components;
+        for (uint32_t component = 0; component < components; component++)
+        {
+            const uint32_t* base = Reg(ops[2]) + component * c_Lanes;
+            const uint32_t* insert = Reg(ops[3]) + component * c_Lanes;
+            uint32_t result[c_Lanes];
+            for (int lane = 0; lane < c_Lanes; lane++)
+            {
+                const uint32_t offset = std::min(offsets[lane], 32u);
+                const uint32_t count = std::min(counts[lane], 32u - offset);
+                const uint32_t bits = (count == 32) ? ~0u : (((1u << count) - 1) << offset);
+                result[lane] = (base[lane] & ~bits) | ((insert[lane] << (offset & 31)) & bits);
+            }
+            WriteLanes(Reg(ops[1]) + component * c_Lanes, result, 1, mask);
+        }
+        break;
+    }
+
+    case c_OpBitFieldSExtract:
+    case c_OpBitFieldUExtract:
+    {
+        const bool sign = opcode == c_OpBitFieldSExtract;
+        uint32_t offsets[c_Lanes], counts[c_Lanes];
+        memcpy(offsets, Reg(ops[3]), sizeof(offsets));
+        memcpy(counts, Reg(ops[4]), sizeof(counts));
+        const uint32_t components = m_Shader.types[ops[0]].components;
+        for (uint32_t component = 0; component < components; component++)
+        {
+            const uint32_t* base = Reg(ops[2]) + component * c_Lanes;
+            uint32_t result[c_Lanes];
+            for (int lane = 0; lane < c_Lanes; lane++)
+            {
+                const uint32_t offset = std::min(offsets[lane], 32u);
+                const uint32_t count = std::min(counts[lane], 32u - offset);
+                if (count == 0)
+                {
+                    result[lane] = 0;
+                    continue;
+                }
+                const uint64_t field = (uint64_t(base[lane]) >> offset) & ((uint64_t(1) << count) - 1);
+                const bool negative = sign && (field >> (count - 1)) & 1;
+                result[lane] = uint32_t(negative ? (field | ~((uint64_t(1) << count) - 1)) : field);
+            }
+            WriteLanes(Reg(ops[1]) + component * c_Lanes, result, 1, mask);
+        }
+        break;
+    }
+
+    case c_OpDot:
+    {
+        const uint32_t components = Components(ops[2]);
+        const uint32_t* a = Reg(ops[2]);
+        const uint32_t* b = Reg(ops[3]);
+        float sum[c_Lanes] = {};
+        for (uint32_t component = 0; component < components; component++)
+        {
+            float x[c_Lanes], y[c_Lanes];
+            memcpy(x, a + component * c_Lanes, sizeof(x));
+            memcpy(y, b + component * c_Lanes, sizeof(y));
+            for (int lane = 0; lane < c_Lanes; lane++)
+                sum[lane] += x[lane] * y[lane];
+        }
+        uint32_t result[c_Lanes];
+        memcpy(result, sum, sizeof(result));
+        WriteLanes(Reg(ops[1]), result, 1, mask);
+        break;
+    }
+
+    case c_OpAny:
+    case c_OpAll:
+    {
+        const uint32_t components = Components(ops[2]);
+        const uint32_t* src = Reg(ops[2]);
+        uint32_t result[c_Lanes];
+        for (int lane = 0; lane < c_Lanes; lane++)
+        {
+            bool any = false, all = true;
+            for (uint32_t component = 0; component < components; component++)
+            {
+                any = any || src[component * c_Lanes + lane];
+                all = all && src[component * c_Lanes + lane];
+            }
+            result[lane] = (opcode == c_OpAny) ? any : all;
+        }
+        WriteLanes(Reg(ops[1]), result, 1, mask);
+        break;
+    }
+
+    case c_OpMatrixTimesVector:
+    case c_OpVectorTimesMatrix:
+    case c_OpMatrixTimesMatrix:
+    case c_OpOuterProduct:
+    {
+        // All of these are sums of products of column-major matrices: result[c][r] = sum over k of A[k][r] * B[c][k],
+        // where a vector is a matrix of one column on the right side and of one row on the left.
+        const SpirvType& resultType = m_Shader.types[ops[0]];
+        const bool resultIsMatrix = resultType.kind == SpirvTypeKind::Matrix;
+        const uint32_t resultColumns = resultIsMatrix ? resultType.count : 1;
+        const uint32_t resultRows = resultType.components / resultColumns;
+        const uint32_t inner = (opcode == c_OpOuterProduct) ? 1 : Components(ops[2]) / resultRows;
+        const uint32_t* a = Reg(ops[2]);
+        const uint32_t* b = Reg(ops[3]);
+
+        // For vector * matrix, the vector is the left operand as a row
+        const bool rowVector = opcode == c_OpVectorTimesMatrix;
+        const uint32_t rows = rowVector ? 1 : resultRows;
+        const uint32_t columns = rowVector ? resultType.components : resultColumns;
+        const uint32_t k = rowVector ? Components(ops[2]) : inner;
+
+        uint32_t result[16 * c_Lanes];
+        for (uint32_t column = 0; column < columns; column++)
+        {
+            for (uint32_t row = 0; row < rows; row++)
+            {
+                float sum[c_Lanes] = {};
+                for (uint32_t index = 0; index < k; index++)
+                {
+                    float x[c_Lanes], y[c_Lanes];
+                    memcpy(x, a + (index * rows + row) * c_Lanes, sizeof(x));
+                    memcpy(y, b + (column * k + index) * c_Lanes, sizeof(y));
+                    for (int lane = 0; lane < c_Lanes; lane++)
+                        sum[lane] += x[lane] * y[lane];
+                }
+                memcpy(result + (column * rows + row) * c_Lanes, sum, sizeof(sum));
+            }
+        }
+        WriteLanes(Reg(ops[1]), result, resultType.components, mask);
+        break;
+    }
+
+    case c_OpDPdx:
+    case c_OpDPdy:
+    case c_OpFwidth:
+    case c_OpDPdxFine:
+    case c_OpDPdyFine:
+    case c_OpFwidthFine:
+    case c_OpDPdxCoarse:
+    case c_OpDPdyCoarse:
+    case c_OpFwidthCoarse:
+        Derivative(opcode, ops, mask);
+        break;
+
+    case c_OpImageSampleImplicitLod:
+    case c_OpImageSampleExplicitLod:
+    case c_OpImageSampleProjImplicitLod:
+    case c_OpImageSampleProjExplicitLod:
+    case c_OpImageFetch:
+        SampleImage(instruction, ops, mask);
+        break;
+
+    case c_OpImageQuerySizeLod:
+    case c_OpImageQuerySize:
+    case c_OpImageQueryLevels:
+        QueryImage(instruction, ops, mask);
+        break;
+
+    case c_OpExtInst:
+        ExecuteGlsl(instruction, ops, mask);
+        break;
+
+    case c_OpDemoteToHelperInvocation:
+        // Same as a discard, except that the lanes finish the block
+        m_Killed |= mask;
+        break;
+
+    default:
+        break;
+    }
+}
+
+static float Determinant(const float* m, int n)
+{
+    // Column-major, m[column * n + row]
+    if (n == 2)
+        return m[0] * m[3] - m[2] * m[1];
+    if (n == 3)
+        return m[0] * (m[4] * m[8] - m[7] * m[5])
+             - m[3] * (m[1] * m[8] - m[7] * m[2])
+             + m[6] * (m[1] * m[5] - m[4] * m[2]);
+
+    float result = 0.f;
+    for (int column = 0; column < 4; column++)
+    {
+        float minor[9];
+        int index = 0;
+        for (int c = 0; c < 4; c++)
+        {
+            if (c == column)
+                continue;
+            for (int row = 1; row < 4; row++)
+                minor[index++] = m[c * 4 + row];
+        }
+        const float cofactor = m[column * 4] * Determinant(minor, 3);
+        result += (column & 1) ? -cofactor : cofactor;
+    }
+    return result;
+}
+
+// Gauss-Jordan elimination with partial pivoting; a singular matrix gives infinities like on the GPU
+static void Invert(const float* m, float* result, int n)
+{
+    float a[4][8] = {};
+    for (int row = 0; row < n; row++)
+    {
+        for (int column = 0; column < n; column++)
+            a[row][column] = m[column * n + row];
+        a[row][n + row] = 1.f;
+    }
+
+    for (int column = 0; column < n; column++)
+    {
+        int pivot = column;
+        for (int row = column + 1; row < n; row++)
+        {
+            if (std::fabs(a[row][column]) > std::fabs(a[pivot][column]))
+                pivot = row;
+        }
+        std::swap(a[column], a[pivot]);
+
+        const float scale = 1.f / a[column][column];
+        for (int k = 0; k < 2 * n; k++)
+            a[column][k] *= scale;
+
+        for (int row = 0; row < n; row++)
+        {
+            if (row == column)
+                continue;
+            const float factor = a[row][column];
+            for (int k = 0; k < 2 * n; k++)
+                a[row][k] -= factor * a[column][k];
+        }
+    }
+
+    for (int row = 0; row < n; row++)
+    {
+        for (int column = 0; column < n; column++)
+            result[column * n + row] = a[row][n + column];
+    }
+}
+
+static uint32_t FindMsb(uint32_t value)
+{
+    if (value == 0)
+        return ~0u;
+    uint32_t bit = 31;
+    while (!(value >> bit))
+        --bit;
+    return bit;
+}
+
+void SpirvMachine::ExecuteGlsl(const SpirvInstruction& instruction, const uint32_t* ops, uint32_t mask)
+{
+    const uint32_t type = ops[0];
+    const uint32_t result = ops[1];
+    const uint32_t* args = ops + 4;
+    const uint32_t argCount = instruction.wordCount - 5;
+    auto arg = [&](uint32_t index) { return index < argCount ? args[index] : args[0]; };
+
+    switch (ops[3])
+    {
+    case c_GlslRound:
+        Map1<float>(type, result, arg(0), mask, [](float x) { return AsBits(std::round(x)); });
+        break;
+    case c_GlslRoundEven:
+        Map1<float>(type, result, arg(0), mask, [](float x) { return AsBits(std::nearbyint(x)); });
+        break;
+    case c_GlslTrunc:
+        Map1<float>(type, result, arg(0), mask, [](float x) { return AsBits(std::trunc(x)); });
+        break;
+    case c_GlslFAbs:
+        Map1<float>(type, result, arg(0), mask, [](float x) { return AsBits(std::fabs(x)); });
+        break;
+    case c_GlslSAbs:
+        Map1<int32_t>(type, result, arg(0), mask, [](int32_t x) { return x < 0 ? 0u - uint32_t(x) : uint32_t(x); });
+        break;
+    case c_GlslFSign:
+        Map1<float>(type, result, arg(0), mask, [](float x) { return AsBits(x > 0.f ? 1.f : (x < 0.f ? -1.f : 0.f)); });
+        break;
+    case c_GlslSSign:
+        Map1<int32_t>(type, result, arg(0), mask, [](int32_t x) { return uint32_t(x > 0 ? 1 : (x < 0 ? -1 : 0)); });
+        break;
+    case c_GlslFloor:
+        Map1<float>(type, result, arg(0), mask, [](float x) { return AsBits(std::floor(x)); });
+        break;
+    case c_GlslCeil:
+        Map1<float>(type, result, arg(0), mask, [](float x) { return AsBits(std::ceil(x)); });
+        break;
+    case c_GlslFract:
+        Map1<float>(type, result, arg(0), mask, [](float x) { return AsBits(x - std::floor(x)); });
+        break;
+    case c_GlslRadians:
+        Map1<float>(type, result, arg(0), mask, [](float x) { return AsBits(x * 0.017453292519943295f); });
+        break;
+    case c_GlslDegrees:
+        Map1<float>(type, result, arg(0), mask, [](float x) { return AsBits(x * 57.29577951308232f); });
+        break;
+    case c_GlslSin:
+        Map1<float>(type, result, arg(0), mask, [](float x) { return AsBits(std::sin(x)); });
+        break;
+    case c_GlslCos:
+        Map1<float>(type, result, arg(0), mask, [](float x) { return AsBits(std::cos(x)); });
+        break;
+    case c_GlslTan:
+        Map1<float>(type, result, arg(0), mask, [](float x) { return AsBits(std::tan(x)); });
+        break;
+    case c_GlslAsin:
+        Map1<float>(type, result, arg(0), mask, [](float x) { return AsBits(std::asin(x)); });
+        break;
+    case c_GlslAcos:
+        Map1<float>(type, result, arg(0), mask, [](float x) { return AsBits(std::acos(x)); });
+        break;
+    case c_GlslAtan:
+        Map1<float>(type, result, arg(0), mask, [](float x) { return AsBits(std::atan(x)); });
+        break;
+    case c_GlslSinh:
+        Map1<float>(type, result, arg(0), mask, [](float x) { return AsBits(std::sinh(x)); });
+        break;
+    case c_GlslCosh:
+        Map1<float>(type, result, arg(0), mask, [](float x) { return AsBits(std::cosh(x)); });
+        break;
+    case c_GlslTanh:
+        Map1<float>(type, result, arg(0), mask, [](float x) { return AsBits(std::tanh(x)); });
+        break;
+    case c_GlslAsinh:
+        Map1<float>(type, result, arg(0), mask, [](float x) { return AsBits(std::asinh(x)); });
+        break;
+    case c_GlslAcosh:
+        Map1<float>(type, result, arg(0), mask, [](float x) { return AsBits(std::acosh(x)); });
+        break;
+    case c_GlslAtanh:
+        Map1<float>(type, result, arg(0), mask, [](float x) { return AsBits(std::atanh(x)); });
+        break;
+    case c_GlslExp:
+        Map1<float>(type, result, arg(0), mask, [](float x) { return AsBits(std::exp(x)); });
+        break;
+    case c_GlslLog:
+        Map1<float>(type, result, arg(0), mask, [](float x) { return AsBits(std::log(x)); });
+        break;
+    case c_GlslExp2:
+        Map1<float>(type, result, arg(0), mask, [](float x) { return AsBits(std::exp2(x)); });
+        break;
+    case c_GlslLog2:
+        Map1<float>(type, result, arg(0), mask, [](float x) { return AsBits(std::log2(x)); });
+        break;
+    case c_GlslSqrt:
+        Map1<float>(type, result, arg(0), mask, [](float x) { return AsBits(std::sqrt(x)); });
+        break;
+    case c_GlslInverseSqrt:
+        Map1<float>(type, result, arg(0), mask, [](float x) { return AsBits(1.f / std::sqrt(x)); });
+        break;
+    case c_GlslFindILsb:
+        Map1<uint32_t>(type, result, arg(0), mask, [](uint32_t x)
+        {
+            if (x == 0)
+                return ~0u;
+            uint32_t bit = 0;
+            while (!((x >> bit) & 1))
+                ++bit;
+            return bit;
+        });
+        break;
+    case c_GlslFindSMsb:
+        Map1<int32_t>(type, result, arg(0), mask, [](int32_t x) { return FindMsb(x < 0 ? ~uint32_t(x) : uint32_t(x)); });
+        break;
+    case c_GlslFindUMsb:
+        Map1<uint32_t>(type, result, arg(0), mask, [](uint32_t x) { return FindMsb(x); });
+        break;
+
+    case c_GlslAtan2:
+        Map2<float>(type, result, arg(0), arg(1), mask, [](float y, float x) { return AsBits(std::atan2(y, x)); });
+        break;
+    case c_GlslPow:
+        Map2<float>(type, result, arg(0), arg(1), mask, [](float x, float y) { return AsBits(std::pow(x, y)); });
+        break;
+    case c_GlslFMin:
+        Map2<float>(type, result, arg(0), arg(1), mask, [](float x, float y) { return AsBits(y < x ? y : x); });
+        break;
+    case c_GlslFMax:
+        Map2<float>(type, result, arg(0), arg(1), mask, [](float x, float y) { return AsBits(x < y ? y : x); });
+        break;
+    case c_GlslNMin:
+        Map2<float>(type, result, arg(0), arg(1), mask, [](float x, float y) { return AsBits(std::fmin(x, y)); });
+        break;
+    case c_GlslNMax:
+        Map2<float>(type, result, arg(0), arg(1), mask, [](float x, float y) { return AsBits(std::fmax(x, y)); });
+        break;
+    case c_GlslUMin:
+        Map2<uint32_t>(type, result, arg(0), arg(1), mask, [](uint32_t x, uint32_t y) { return std::min(x, y); });
+        break;
+    case c_GlslUMax:
+        Map2<uint32_t>(type, result, arg(0), arg(1), mask, [](uint32_t x, uint32_t y) { return std::max(x, y); });
+        break;
+    case c_GlslSMin:
+        Map2<int32_t>(type, result, arg(0), arg(1), mask, [](int32_t x, int32_t y) { return uint32_t(std::min(x, y)); });
+        break;
+    case c_GlslSMax:
+        Map2<int32_t>(type, result, arg(0), arg(1), mask, [](int32_t x, int32_t y) { return uint32_t(std::max(x, y)); });
+        break;
+    case c_GlslStep:
+        Map2<float>(type, result, arg(0), arg(1), mask, [](float edge, float x) { return AsBits(x < edge ? 0.f : 1.f); });
+        break;
+    case c_GlslLdexp:
+    {
+        const uint32_t components = m_Shader.types[type].components;
+        const uint32_t* x = Reg(arg(0));
+        const uint32_t* exponent = Reg(arg(1));
+        const uint32_t exponentStride = Components(arg(1)) == 1 ? 0 : c_Lanes;
+        uint32_t values[4 * c_Lanes];
+        for (uint32_t component = 0; component < components; component++)
+        {
+            for (int lane = 0; lane < c_Lanes; lane++)
+            {
+                const int e = std::clamp(int32_t(exponent[component * exponentStride + lane]), -300, 300);
+                values[component * c_Lanes + lane] = AsBits(std::ldexp(AsFloat(x[component * c_Lanes + lane]), e));
+            }
+        }
+        WriteLanes(Reg(result), values, components, mask);
+        break;
+    }
+
+    case c_GlslFClamp:
+        Map3<float>(type, result, arg(0), arg(1), arg(2), mask, [](float x, float lo, float hi) { return AsBits(std::min(std::max(x, lo), hi)); });
+        break;
+    case c_GlslNClamp:
+        Map3<float>(type, result, arg(0), arg(1), arg(2), mask, [](float x, float lo, float hi) { return AsBits(std::fmin(std::fmax(x, lo), hi)); });
+        break;
+    case c_GlslUClamp:
+        Map3<uint32_t>(type, result, arg(0), arg(1), arg(2), mask, [](uint32_t x, uint32_t lo, uint32_t hi) { return std::min(std::max(x, lo), hi); });
+        break;
+    case c_GlslSClamp:
+        Map3<int32_t>(type, result, arg(0), arg(1), arg(2), mask, [](int32_t x, int32_t lo, int32_t hi) { return uint32_t(std::min(std::max(x, lo), hi)); });
+        break;
+    case c_GlslFMix:
+        Map3<float>(type, result, arg(0), arg(1), arg(2), mask, [](float x, float y, float a) { return AsBits(x + (y - x) * a); });
+        break;
+    case c_GlslSmoothStep:
+        Map3<float>(type, result, arg(0), arg(1), arg(2), mask, [](float edge0, float edge1, float x)
+        {
+            const float t = std::min(std::max((x - edge0) / (edge1 - edge0), 0.f), 1.f);
+            return AsBits(t * t * (3.f - 2.f * t));
+        });
+        break;
+    case c_GlslFma:
+        Map3<float>(type, result, arg(0), arg(1), arg(2), mask, [](float a, float b, float c) { return AsBits(a * b + c); });
+        break;
+
+    case c_GlslModf:
+    case c_GlslModfStruct:
+    {
+        const uint32_t components = Components(arg(0));
+        const uint32_t* x = Reg(arg(0));
+        uint32_t fraction[4 * c_Lanes], whole[4 * c_Lanes];
+        for (uint32_t index = 0; index < components * c_Lanes; index++)
+        {
+            const float value = AsFloat(x[index]);
+            const float integer = std::trunc(value);
+            whole[index] = AsBits(integer);
+            fraction[index] = AsBits(value - integer);
+        }
+        WriteLanes(Reg(result), fraction, components, mask);
+        if (ops[3] == c_GlslModfStruct)
+            WriteLanes(Reg(result) + components * c_Lanes, whole, components, mask);
+        else
+            StoreLanes(Reg(arg(1)), whole, components, mask);
+        break;
+    }
+
+    case c_GlslLength:
+    case c_GlslDistance:
+    case c_GlslNormalize:
+    case c_GlslCross:
+    case c_GlslFaceForward:
+    case c_GlslReflect:
+    case c_GlslRefract:
+    {
+        // Per-lane vector math on up to 3 arguments of up to 4 components
+        const uint32_t components = Components(arg(0));
+        float v[3][4][c_Lanes] = {};
+        for (uint32_t index = 0; index < std::min(argCount, 3u); index++)
+        {
+            const uint32_t count = std::min(Components(args[index]), 4u);
+            memcpy(v[index], Reg(args[index]), size_t(count) * c_Lanes * sizeof(float));
+        }
+
+        float out[4][c_Lanes] = {};
+        for (int lane = 0; lane < c_Lanes; lane++)
+        {
+            auto dot = [&](int a, int b)
+            {
+                float sum = 0.f;
+                for (uint32_t component = 0; component < components; component++)
+                    sum += v[a][component][lane] * v[b][component][lane];
+                return sum;
+            };
+
+            switch (ops[3])
+            {
+            case c_GlslLength:
+                out[0][lane] = std::sqrt(dot(0, 0));
+                break;
+            case c_GlslDistance:
+            {
+                float sum = 0.f;
+                for (uint32_t component = 0; component < components; component++)
+                {
+                    const float d = v[0][component][lane] - v[1][component][lane];
+                    sum += d * d;
+                }
+                out[0][lane] = std::sqrt(sum);
+                break;
+            }
+            case c_GlslNormalize:
+            {
+                const float scale = 1.f / std::sqrt(dot(0, 0));
+                for (uint32_t component = 0; component < components; component++)
+                    out[component][lane] = v[0][component][lane] * scale;
+                break;
+            }
+            case c_GlslCross:
+                out[0][lane] = v[0][1][lane] * v[1][2][lane] - v[1][1][lane] * v[0][2][lane];
+                out[1][lane] = v[0][2][lane] * v[1][0][lane] - v[1][2][lane] * v[0][0][lane];
+                out[2][lane] = v[0][0][lane] * v[1][1][lane] - v[1][0][lane] * v[0][1][lane];
+                break;
+            case c_GlslFaceForward:
+            {
+                const float sign = dot(2, 1) < 0.f ? 1.f : -1.f;
+                for (uint32_t component = 0; component < components; component++)
+                    out[component][lane] = v[0][component][lane] * sign;
+                break;
+            }
+            case c_GlslReflect:
+            {
+                const float d = 2.f * dot(1, 0);
+                for (uint32_t component = 0; component < components; component++)
+                    out[component][lane] = v[0][component][lane] - d * v[1][component][lane];
+                break;
+            }
+            case c_GlslRefract:
+            {
+                const float eta = v[2][0][lane];
+                const float d = dot(1, 0);
+                const float k = 1.f - eta * eta * (1.f - d * d);
+                for (uint32_t component = 0; component < components; component++)
+                    out[component][lane] = (k < 0.f) ? 0.f : eta * v[0][component][lane] - (eta * d + std::sqrt(k)) * v[1][component][lane];
+                break;
+            }
+            }
+        }
+
+        uint32_t values[4 * c_Lanes];
+        memcpy(values, out, sizeof(values));
+        WriteLanes(Reg(result), values, m_Shader.types[type].components, mask);
+        break;
+    }
+
+    case c_GlslDeterminant:
+    case c_GlslMatrixInverse:
+    {
+        const int n = int(m_Shader.TypeOf(arg(0)).count);
+        const uint32_t* src = Reg(arg(0));
+        uint32_t values[16 * c_Lanes];
+        for (int lane = 0; lane < c_Lanes; lane++)
+        {
+            float m[16], inverse[16];
+            for (int index = 0; index < n * n; index++)
+                m[index] = AsFloat(src[index * c_Lanes + lane]);
+
+            if (ops[3] == c_GlslDeterminant)
+            {
+                values[lane] = AsBits(Determinant(m, n));
+                continue;
+            }
+
+            Invert(m, inverse, n);
+            for (int index = 0; index < n * n; index++)
+                values[index * c_Lanes + lane] = AsBits(inverse[index]);
+        }
+        WriteLanes(Reg(result), values, m_Shader.types[type].components, mask);
+        break;
+    }
+
+    case c_GlslPackUnorm4x8:
+    case c_GlslPackSnorm4x8:
+    case c_GlslPackUnorm2x16:
+    case c_GlslPackSnorm2x16:
+    case c_GlslPackHalf2x16:
+    {
+        const uint32_t* src = Reg(arg(0));
+        const uint32_t count = Components(arg(0));
+        const uint32_t bits = 32 / count;
+        uint32_t values[c_Lanes];
+        for (int lane = 0; lane < c_Lanes; lane++)
+        {
+            uint32_t packed = 0;
+            for (uint32_t component = 0; component < count; component++)
+            {
+                const float x = AsFloat(src[component * c_Lanes + lane]);
+                const float scale = float((1u << (bits - ((ops[3] == c_GlslPackSnorm4x8 || ops[3] == c_GlslPackSnorm2x16) ? 1 : 0))) - 1);
+                uint32_t field;
+                if (ops[3] == c_GlslPackHalf2x16)
+                    field = FloatToHalf(x);
+                else if (ops[3] == c_GlslPackUnorm4x8 || ops[3] == c_GlslPackUnorm2x16)
+                    field = uint32_t(std::nearbyint(std::min(std::max(x, 0.f), 1.f) * scale));
+                else
+                    field = uint32_t(int32_t(std::nearbyint(std::min(std::max(x, -1.f), 1.f) * scale)));
+                packed |= (field & ((1u << bits) - 1)) << (component * bits);
+            }
+            values[lane] = packed;
+        }
+        WriteLanes(Reg(result), values, 1, mask);
+        break;
+    }
+
+    case c_GlslUnpackUnorm4x8:
+    case c_GlslUnpackSnorm4x8:
+    case c_GlslUnpackUnorm2x16:
+    case c_GlslUnpackSnorm2x16:
+    case c_GlslUnpackHalf2x16:
+    {
+        const uint32_t* src = Reg(arg(0));
+        const uint32_t count = m_Shader.types[type].components;
+        const uint32_t bits = 32 / count;
+        const bool snorm = ops[3] == c_GlslUnpackSnorm4x8 || ops[3] == c_GlslUnpackSnorm2x16;
+        uint32_t values[4 * c_Lanes];
+        for (int lane = 0; lane < c_Lanes; lane++)
+        {
+            for (uint32_t component = 0; component < count; component++)
+            {
+                const uint32_t field = (src[lane] >> (component * bits)) & ((1u << bits) - 1);
+                float x;
+                if (ops[3] == c_GlslUnpackHalf2x16)
+                    x = HalfToFloat(uint16_t(field));
+                else if (snorm)
+                {
+                    const int32_t value = int32_t(field << (32 - bits)) >> (32 - bits);
+                    x = std::max(float(value) / float((1u << (bits - 1)) - 1), -1.f);
+                }
+                else
+                    x = float(field) / float((1u << bits) - 1);
+                values[component * c_Lanes + lane] = AsBits(x);
+            }
+        }
+        WriteLanes(Reg(result), values, count, mask);
+        break;
+    }
+
+    default:
+        break;
+    }
+}
+
+static int WrapTexel(int coordinate, int size, bool repeat)
+{
+    if (repeat)
+    {
+        coordinate %= size;
+        return coordinate < 0 ? coordinate + size : coordinate;
+    }
+    return std::clamp(coordinate, 0, size - 1);
+}
+
+// Brings a normalized coordinate into [0, 1] before it's scaled to texels, which also keeps
+// the infinities and NaNs that shaders produce from overflowing the conversion to int
+static float WrapCoordinate(float coordinate, bool repeat)
+{
+    if (!std::isfinite(coordinate))
+        return 0.f;
+    if (repeat)
+        return coordinate - std::floor(coordinate);
+    return std::min(std::max(coordinate, 0.f), 1.f);
+}
+
+static void SampleLevel2D(const SoftwareTexture& texture, const SoftwareChannel& channel, int level, int face,
+    float u, float v, const int (&offset)[3], float (&color)[4])
+{
+    const int width = std::max(texture.width >> level, 1);
+    const int height = std::max(texture.height >> level, 1);
+    const float* texels = texture.levels[level].data() + size_t(face) * width * height * 4;
+    u = WrapCoordinate(u, channel.repeat) * float(width);
+    v = WrapCoordinate(v, channel.repeat) * float(height);
+
+    if (!channel.linear)
+    {
+        const int x = WrapTexel(int(u) + offset[0], width, channel.repeat);
+        const int y = WrapTexel(int(v) + offset[1], height, channel.repeat);
+        memcpy(color, texels + (size_t(y) * width + x) * 4, sizeof(color));
+        return;
+    }
+
+    const float x = u - 0.5f;
+    const float y = v - 0.5f;
+    const float left = std::floor(x);
+    const float top = std::floor(y);
+    const float fx = x - left;
+    const float fy = y - top;
+    const int x0 = WrapTexel(int(left) + offset[0], width, channel.repeat);
+    const int x1 = WrapTexel(int(left) + offset[0] + 1, width, channel.repeat);
+    const int y0 = WrapTexel(int(top) + offset[1], height, channel.repeat);
+    const int y1 = WrapTexel(int(top) + offset[1] + 1, height, channel.repeat);
+    const float* t00 = texels + (size_t(y0) * width + x0) * 4;
+    const float* t10 = texels + (size_t(y0) * width + x1) * 4;
+    const float* t01 = texels + (size_t(y1) * width + x0) * 4;
+    const float* t11 = texels + (size_t(y1) * width + x1) * 4;
+
+    for (int component = 0; component < 4; component++)
+    {
+        const float a = t00[component] + (t10[component] - t00[component]) * fx;
+        const float b = t01[component] + (t11[component] - t01[component]) * fx;
+        color[component] = a + (b - a) * fy;
+    }
+}
+
+// Volumes are sampled from the first level only
+static void SampleVolume(const SoftwareTexture& texture, const SoftwareChannel& channel,
+    const float (&coords)[3], const int (&offset)[3], float (&color)[4])
+{
+    const int size[3] = { texture.width, texture.height, texture.depth };
+    const float* texels = texture.levels[0].data();
+    int lo[3], hi[3];
+    float f[3];
+
+    for (int axis = 0; axis < 3; axis++)
+    {
+        const float position = WrapCoordinate(coords[axis], channel.repeat) * float(size[axis]);
+        if (!channel.linear)
+        {
+            lo[axis] = hi[axis] = WrapTexel(int(position) + offset[axis], size[axis], channel.repeat);
+            f[axis] = 0.f;
+            continue;
+        }
+
+        const float base = std::floor(position - 0.5f);
+        f[axis] = position - 0.5f - base;
+        lo[axis] = WrapTexel(int(base) + offset[axis], size[axis], channel.repeat);
+        hi[axis] = WrapTexel(int(base) + offset[axis] + 1, size[axis], channel.repeat);
+    }
+
+    std::fill_n(color, 4, 0.f);
+    for (int corner = 0; corner < 8; corner++)
+    {
+        const int x = (corner & 1) ? hi[0] : lo[0];
+        const int y = (corner & 2) ? hi[1] : lo[1];
+        const int z = (corner & 4) ? hi[2] : lo[2];
+        const float weight = ((corner & 1) ? f[0] : 1.f - f[0]) * ((corner & 2) ? f[1] : 1.f - f[1]) * ((corner & 4) ? f[2] : 1.f - f[2]);
+        const float* texel = texels + ((size_t(z) * size[1] + y) * size[0] + x) * 4;
+        for (int component = 0; component < 4; component++)
+            color[component] += texel[component] * weight;
+    }
+}
+
+// Picks the cube face like the Vulkan spec does, and the coordinates on it in [0, 1]
+static int SelectCubeFace(const float (&direction)[3], float& u, float& v)
+{
+    const float ax = std::fabs(direction[0]);
+    const float ay = std::fabs(direction[1]);
+    const float az = std::fabs(direction[2]);
+    int face;
+    float sc, tc, ma;
+
+    if (ax >= ay && ax >= az)
+    {
+        face = direction[0] >= 0.f ? 0 : 1;
+        sc = direction[0] >= 0.f ? -direction[2] : direction[2];
+        tc = -direction[1];
+        ma = ax;
+    }
+    else if (ay >= az)
+    {
+        face = direction[1] >= 0.f ? 2 : 3;
+        sc = direction[0];
+        tc = direction[1] >= 0.f ? direction[2] : -direction[2];
+        ma = ay;
+    }
+    else
+    {
+        face = direction[2] >= 0.f ? 4 : 5;
+        sc = direction[2] >= 0.f ? direction[0] : -direction[0];
+        tc = -direction[1];
+        ma = az;
+    }
+
+    u = (ma > 0.f) ? 0.5f * (sc / ma + 1.f) : 0.5f;
+    v = (ma > 0.f) ? 0.5f * (tc / ma + 1.f) : 0.5f;
+    return face;
+}
+
+static void SampleTexture(const SoftwareTexture& texture, const SoftwareChannel& channel,
+    const float (&coords)[3], float level, const int (&offset)[3], float (&color)[4])
+{
+    if (texture.type == SoftwareTextureType::Volume)
+    {
+        SampleVolume(texture, channel, coords, offset, color);
+        return;
+    }
+
+    int face = 0;
+    float u = coords[0];
+    float v = coords[1];
+    SoftwareChannel faceChannel = channel;
+    if (texture.type == SoftwareTextureType::Cube)
+    {
+        face = SelectCubeFace(coords, u, v);
+        faceChannel.repeat = false;
+    }
+
+    const int levels = int(texture.levels.size());
+    level = (level > 0.f) ? std::min(level, float(levels - 1)) : 0.f;
+
+    if (!channel.mipmap || levels == 1)
+    {
+        SampleLevel2D(texture, faceChannel, int(level + 0.5f), face, u, v, offset, color);
+        return;
+    }
+
+    const int first = int(level);
+    const float t = level - float(first);
+    SampleLevel2D(texture, faceChannel, first, face, u, v, offset, color);
+    if (t > 0.f && first + 1 < levels)
+    {
+        float next[4];
+        SampleLevel2D(texture, faceChannel, first + 1, face, u, v, offset, next);
+        for (int component = 0; component < 4; component++)
+            color[component] += (next[component] - color[component]) * t;
+    }
+}
+
+// The derivatives are in normalized coordinates; for cubemaps, in coordinates divided by the major axis
+static float LevelOfDetail(const SoftwareTexture& texture, const float (&dx)[3], const float (&dy)[3])
+{
+    const bool cube = texture.type == SoftwareTextureType::Cube;
+    const float scale[3] = {
+        float(texture.width) * (cube ? 0.5f : 1.f),
+        float(cube ? texture.width : texture.height) * (cube ? 0.5f : 1.f),
+        cube ? float(texture.width) * 0.5f : 0.f };
+
+    float x2 = 0.f, y2 = 0.f;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        x2 += (dx[axis] * scale[axis]) * (dx[axis] * scale[axis]);
+        y2 += (dy[axis] * scale[axis]) * (dy[axis] * scale[axis]);
+    }
+
+    const float rho2 = std::max(x2, y2);
+    return (rho2 > 0.f) ? 0.5f * std::log2(rho2) : 0.f;
+}
+
+static void FetchTexel(const SoftwareTexture& texture, int level, const int (&coords)[3], float (&color)[4])
+{
+    std::fill_n(color, 4, 0.f);
+    if (level < 0 || level >= int(texture.levels.size()))
+        return;
+
+    const int width = std::max(texture.width >> level, 1);
+    const int height = std::max(texture.height >> level, 1);
+    const int depth = (texture.type == SoftwareTextureType::Volume) ? std::max(texture.depth >> level, 1) : 1;
+    const int z = (texture.type == SoftwareTextureType::Volume) ? coords[2] : 0;
+    if (coords[0] < 0 || coords[0] >= width || coords[1] < 0 || coords[1] >= height || z < 0 || z >= depth)
+        return;
+
+    memcpy(color, texture.levels[level].data() + ((size_t(z) * height + coords[1]) * width + coords[0]) * 4, sizeof(color));
+}
+
+void SpirvMachine::SampleImage(const SpirvInstruction& instruction, const uint32_t* ops, uint32_t mask)
+{
+    const uint16_t opcode = instruction.opcode;
+    const bool fetch = opcode == c_OpImageFetch;
+    const bool projective = opcode == c_OpImageSampleProjImplicitLod || opcode == c_OpImageSampleProjExplicitLod;
+    const bool implicitLod = opcode == c_OpImageSampleImplicitLod || opcode == c_OpImageSampleProjImplicitLod;
+    const bool cube = m_Shader.TypeOf(ops[2]).dim == c_DimCube;
+    const uint32_t* handle = Reg(ops[2]);
+    const uint32_t* coordinate = Reg(ops[3]);
+    const uint32_t coordinateComponents = Components(ops[3]);
+
+    const uint32_t* bias = nullptr;
+    const uint32_t* lod = nullptr;
+    const uint32_t* gradX = nullptr;
+    const uint32_t* gradY = nullptr;
+    const uint32_t* offset = nullptr;
+    uint32_t gradComponents = 0;
+    uint32_t offsetComponents = 0;
+    if (instruction.wordCount > 5)
+    {
+        const uint32_t operands = ops[4];
+        uint32_t next = 5;
+        if (operands & c_ImageOperandsBias)
+            bias = Reg(ops[next++]);
+        if (operands & c_ImageOperandsLod)
+            lod = Reg(ops[next++]);
+        if (operands & c_ImageOperandsGrad)
+        {
+            gradComponents = std::min(Components(ops[next]), 3u);
+            gradX = Reg(ops[next++]);
+            gradY = Reg(ops[next++]);
+        }
+        if (operands & (c_ImageOperandsConstOffset | c_ImageOperandsOffset))
+        {
+            offsetComponents = std::min(Components(ops[next]), 3u);
+            offset = Reg(ops[next++]);
+        }
+    }
+
+    // The coordinates of all lanes are needed for the implicit level of detail
+    const uint32_t used = std::min(coordinateComponents - (projective ? 1 : 0), 3u);
+    float coords[3][c_Lanes] = {};
+    for (uint32_t component = 0; component < used; component++)
+    {
+        for (int lane = 0; lane < c_Lanes; lane++)
+        {
+            const uint32_t bits = coordinate[component * c_Lanes + lane];
+            coords[component][lane] = fetch ? float(int32_t(bits)) : AsFloat(bits);
+            if (projective)
+                coords[component][lane] /= AsFloat(coordinate[(coordinateComponents - 1) * c_Lanes + lane]);
+        }
+    }
+
+    float derivatives[3][c_Lanes];
+    memcpy(derivatives, coords, sizeof(derivatives));
+    if (cube)
+    {
+        for (int lane = 0; lane < c_Lanes; lane++)
+        {
+            const float major = std::max({ std::fabs(coords[0][lane]), std::fabs(coords[1][lane]), std::fabs(coords[2][lane]) });
+            for (uint32_t component = 0; component < 3; component++)
+                derivatives[component][lane] = (major > 0.f) ? coords[component][lane] / major : 0.f;
+        }
+    }
+
+    const uint32_t resultComponents = std::min(m_Shader.types[ops[0]].components, 4u);
+    uint32_t values[4 * c_Lanes] = {};
+
+    for (int lane = 0; lane < c_Lanes; lane++)
+    {
+        if (!(mask & (1u << lane)))
+            continue;
+
+        const SoftwareChannel& channel = m_Channels[handle[lane] % c_MaxPassInputs];
+        if (!channel.texture || channel.texture->levels.empty())
+            continue;
+
+        const SoftwareTexture& texture = *channel.texture;
+        int texelOffset[3] = {};
+        for (uint32_t component = 0; component < offsetComponents; component++)
+            texelOffset[component] = int32_t(offset[component * c_Lanes + lane]);
+
+        float color[4];
+        if (fetch)
+        {
+            const int texel[3] = {
+                int(coords[0][lane]) + texelOffset[0],
+                int(coords[1][lane]) + texelOffset[1],
+                int(coords[2][lane]) + texelOffset[2] };
+            FetchTexel(texture, lod ? int32_t(lod[lane]) : 0, texel, color);
+        }
+        else
+        {
+            float level = 0.f;
+            if (lod)
+                level = AsFloat(lod[lane]);
+            else if (gradX || implicitLod)
+            {
+                float dx[3] = {}, dy[3] = {};
+                for (uint32_t component = 0; component < 3; component++)
+                {
+                    if (gradX)
+                    {
+                        dx[component] = component < gradComponents ? AsFloat(gradX[component * c_Lanes + lane]) : 0.f;
+                        dy[component] = component < gradComponents ? AsFloat(gradY[component * c_Lanes + lane]) : 0.f;
+                    }
+                    else
+                    {
+                        const float* values = derivatives[component];
+                        dx[component] = values[lane | 1] - values[lane & ~1];
+                        dy[component] = values[lane | c_SoftwareBlockWidth] - values[lane & ~c_SoftwareBlockWidth];
+                    }
+                }
+                level = LevelOfDetail(texture, dx, dy);
+            }
+            if (bias)
+                level += AsFloat(bias[lane]);
+
+            const float position[3] = { coords[0][lane], coords[1][lane], coords[2][lane] };
+            SampleTexture(texture, channel, position, level, texelOffset, color);
+        }
+
+        for (uint32_t component = 0; component < resultComponents; component++)
+            values[component * c_Lanes + lane] = AsBits(color[component]);
+    }
+
+    WriteLanes(Reg(ops[1]), values, resultComponents, mask);
+}
+
+void SpirvMachine::QueryImage(const SpirvInstruction& instruction, const uint32_t* ops, uint32_t mask)
+{
+    const uint32_t* handle = Reg(ops[2]);
+    const uint32_t* lod = (instruction.opcode == c_OpImageQuerySizeLod) ? Reg(ops[3]) : nullptr;
+    const uint32_t resultComponents = std::min(m_Shader.types[ops[0]].components, 3u);
+    uint32_t values[3 * c_Lanes] = {};
+
+    for (int lane = 0; lane < c_Lanes; lane++)
+    {
+        const SoftwareTexture* texture = m_Channels[handle[lane] % c_MaxPassInputs].texture;
+        if (!texture || texture->levels.empty())
+            continue;
+
+        if (instruction.opcode == c_OpImageQueryLevels)
+        {
+            values[lane] = uint32_t(texture->levels.size());
+            continue;
+        }
+
+        const uint32_t level = lod ? std::min(lod[lane], 31u) : 0;
+        const int size[3] = { texture->width, texture->type == SoftwareTextureType::Cube ? texture->width : texture->height, texture->depth };
+        for (uint32_t component = 0; component < resultComponents; component++)
+            values[component * c_Lanes + lane] = uint32_t(std::max(size[component] >> level, 1));
+    }
+
+    WriteLanes(Reg(ops[1]), values, resultComponents, mask);
+}
+
+SpirvInvocation::SpirvInvocation(std::shared_ptr<const SpirvShader> shader)
+    : m_Machine(std::make_unique<SpirvMachine>(std::move(shader)))
+{
+}
+
+SpirvInvocation::~SpirvInvocation() = default;
+
+void SpirvInvocation::SetInputs(const SoftwareShaderInputs& inputs)
+{
+    m_Machine->SetInputs(inputs);
+}
+
+uint32_t SpirvInvocation::ShadeBlock(int x, int y, float (&colors)[c_SoftwareLanes][4])
+{
+    return m_Machine->ShadeBlock(x, y, colors);
+}
@@ -0,0 +1,75 @@
+/*
+* Copyright (c) 2022, NVIDIA CORPORATION. All rights reserved.
+*
+* Permission is hereby granted, free of charge, to any person obtaining a
+* copy of this software and associated documentation files (the "Software"),
+* to deal in the Software without restriction, including without limitation
+* the rights to use, copy, modify, merge, publish, distribute, sublicense,
+* and/or sell copies of the Software, and to permit persons to whom the
+* Software is furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+* THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+* DEALINGS IN THE SOFTWARE.
+*/
+
+
+#include "ShaderProj.h"
+
+#include <chrono>
+#include <fstream>
+#include <mutex>
+#include <json/writer.h>
+
+static std::ofstream* g_StatsFile = nullptr;
+static std::mutex g_StatsMutex;
+
+bool InitStats(const fs::path& fileName)
+{
+    g_StatsFile = new std::ofstream(fileName.generic_string(), std::ios::app);
+
+    if (!g_StatsFile->is_open())
+    {
+        LOG("ERROR: Cannot open the stats file '%s'\n", fileName.generic_string().c_str());
+        ShutdownStats();
+        return false;
+    }
+
+    return true;
+}
+
+void ShutdownStats()
+{
+    delete g_StatsFile;
+    g_StatsFile = nullptr;
+}
+
+bool IsStatsEnabled()
+{
+    return g_StatsFile != nullptr;
+}
+
+void WriteStats(const Json::Value& record)
+{
+    if (!g_StatsFile)
+        return;
+
+    // One JSON object per line, so that the file can be appended to by multiple runs
+    // and consumed by line-oriented tools.
+    Json::Value line = record;
+    line["timestamp"] = Json::Int64(std::chrono::duration_cast<std::chrono::seconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count());
+
+    Json::StreamWriterBuilder builder;
+    builder["indentation"] = "";
+
+    std::lock_guard<std::mutex> lock(g_StatsMutex);
+    *g_StatsFile << Json::writeString(builder, line) << std::endl;
+}
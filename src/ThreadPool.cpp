@@ -0,0 +1,91 @@
+/*
+* Copyright (c) 2022, NVIDIA CORPORATION. All rights reserved.
+*
+* Permission is hereby granted, free of charge, to any person obtaining a
+* copy of this software and associated documentation files (the "Software"),
+* to deal in the Software without restriction, including without limitation
+* the rights to use, copy, modify, merge, publish, distribute, sublicense,
+* and/or sell copies of the Software, and to permit persons to whom the
+* Software is furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+* THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+* DEALINGS IN THE SOFTWARE.
+*/
+
+
+#include "ShaderProj.h"
+
+ThreadPool::ThreadPool(int threadCount)
+{
+    threadCount = std::max(threadCount, 1);
+
+    for (int index = 0; index < threadCount; index++)
+    {
+        m_Threads.emplace_back([this]() { ThreadProc(); });
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Terminate = true;
+    }
+    m_TaskAvailable.notify_all();
+
+    for (auto& thread : m_Threads)
+    {
+        thread.join();
+    }
+}
+
+void ThreadPool::AddTask(std::function<void()> task)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Tasks.push_back(std::move(task));
+        ++m_PendingTasks;
+    }
+    m_TaskAvailable.notify_one();
+}
+
+void ThreadPool::WaitForAll()
+{
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    m_AllTasksDone.wait(lock, [this]() { return m_PendingTasks == 0; });
+}
+
+void ThreadPool::ThreadProc()
+{
+    while (true)
+    {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(m_Mutex);
+            m_TaskAvailable.wait(lock, [this]() { return m_Terminate || !m_Tasks.empty(); });
+
+            if (m_Tasks.empty())
+                return;
+
+            task = std::move(m_Tasks.front());
+            m_Tasks.pop_front();
+        }
+
+        task();
+
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            --m_PendingTasks;
+            if (m_PendingTasks == 0)
+                m_AllTasksDone.notify_all();
+        }
+    }
+}
@@ -22,8 +22,16 @@
 
 #include "ShaderProj.h"
 
+#include <cstring>
 #include <fstream>
 
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <unistd.h>
+#endif
+
 bool ReadFile(const fs::path& name, std::vector<char>& result)
 {
     std::ifstream file(name, std::ios::binary);
@@ -45,3 +53,82 @@ bool ReadFile(const fs::path& name, std::vector<char>& result)
 
 	return true;
 }
+
+bool WriteFile(const fs::path& name, const std::vector<char>& data)
+{
+    // Written under a temporary name first, so that a reader never sees a partial file
+    fs::path tempName = name;
+    tempName += ".tmp";
+
+    {
+        std::ofstream file(tempName, std::ios::binary | std::ios::trunc);
+        if (!file.is_open())
+            return false;
+
+        file.write(data.data(), data.size());
+        if (!file.good())
+            return false;
+    }
+
+    std::error_code error;
+    fs::rename(tempName, name, error);
+    if (error)
+    {
+        fs::remove(tempName, error);
+        return false;
+    }
+
+    return true;
+}
+
+uint64_t GetProcessResidentBytes()
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters = {};
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+        return 0;
+
+    return counters.WorkingSetSize;
+#else
+    // The second field of statm is the resident set size in pages.
+    std::ifstream statm("/proc/self/statm");
+    uint64_t totalPages = 0;
+    uint64_t residentPages = 0;
+    if (!(statm >> totalPages >> residentPages))
+        return 0;
+
+    return residentPages * uint64_t(sysconf(_SC_PAGESIZE));
+#endif
+}
+
+float HalfToFloat(uint16_t value)
+{
+    const uint32_t sign = uint32_t(value >> 15) << 31;
+    const uint32_t exponent = (value >> 10) & 0x1f;
+    const uint32_t mantissa = value & 0x3ff;
+
+    uint32_t bits;
+    if (exponent == 0x1f)
+    {
+        // Inf or NaN
+        bits = sign | 0x7f800000 | (mantissa << 13);
+    }
+    else if (exponent != 0)
+    {
+        bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+    }
+    else if (mantissa != 0)
+    {
+        // Denormal: the value is mantissa * 2^-24
+        const float result = float(mantissa) * (1.f / 16777216.f);
+        return sign ? -result : result;
+    }
+    else
+    {
+        bits = sign;
+    }
+
+    float result;
+    memcpy(&result, &bits, sizeof(result));
+    return result;
+}
@@ -153,6 +153,49 @@ bool VulkanApp::InitVulkan(const VulkanAppParameters& params, const char *window
     return true;
 }
 
+bool VulkanApp::InitNullDevice(const VulkanAppParameters& params)
+{
+    // Headless initialization on top of the no-op driver, see NullDriver.cpp.
+    // The window dimensions are taken from the parameters as-is and never change.
+    m_DeviceParams = params;
+    m_RequestedVSync = params.enableVsync;
+    m_WindowVisible = true;
+
+    InitNullDriver();
+
+    m_VulkanPhysicalDevice = GetNullPhysicalDevice();
+    m_GraphicsQueueFamily = 0;
+    m_PresentQueueFamily = 0;
+
+    m_VulkanDevice = m_VulkanPhysicalDevice.createDevice(vk::DeviceCreateInfo());
+    m_VulkanDevice.getQueue(m_GraphicsQueueFamily, 0, &m_GraphicsQueue);
+    m_PresentQueue = m_GraphicsQueue;
+
+    m_RendererString = std::string(m_VulkanPhysicalDevice.getProperties().deviceName.data());
+
+    if (!createSwapChain())
+        return false;
+
+    m_PresentSemaphore = m_VulkanDevice.createSemaphore(vk::SemaphoreCreateInfo());
+
+    for (uint32_t frame = 0; frame < m_DeviceParams.maxFramesInFlight + 1; frame++)
+    {
+        m_Fences.push_back(m_VulkanDevice.createFence(vk::FenceCreateInfo()));
+        m_FencesSignaled.push_back(false);
+    }
+
+    m_CommandPool = m_VulkanDevice.createCommandPool(vk::CommandPoolCreateInfo());
+
+    m_CommandBuffers = m_VulkanDevice.allocateCommandBuffers(vk::CommandBufferAllocateInfo()
+        .setLevel(vk::CommandBufferLevel::ePrimary)
+        .setCommandPool(m_CommandPool)
+        .setCommandBufferCount(m_DeviceParams.maxFramesInFlight + 1));
+
+    LOG("Created Vulkan device: %s\n", m_RendererString.c_str());
+
+    return true;
+}
+
 void VulkanApp::RunMessageLoop()
 {
     m_PreviousFrameTimestamp = glfwGetTime();
@@ -168,10 +211,26 @@ void VulkanApp::RunMessageLoop()
 
         if (m_WindowVisible)
         {
-            Animate(elapsedTime);
-            BeginFrame();
-            Render();
-            Present();
+            // The device can be lost in any call, but only some of them report it with a result code
+            try
+            {
+                Animate(elapsedTime);
+                if (BeginFrame())
+                {
+                    Render();
+                    Present();
+                }
+            }
+            catch (const vk::DeviceLostError&)
+            {
+                m_DeviceLost = true;
+            }
+
+            if (m_DeviceLost && !RecoverFromDeviceLoss())
+            {
+                LOG("ERROR: failed to recover from the device loss.\n");
+                break;
+            }
         }
 
         std::this_thread::sleep_for(std::chrono::milliseconds(0));
@@ -179,7 +238,8 @@ void VulkanApp::RunMessageLoop()
         m_PreviousFrameTimestamp = curTime;
     }
 
-    GetDevice().waitIdle();
+    if (!m_DeviceLost)
+        GetDevice().waitIdle();
 }
 
 void VulkanApp::GetWindowDimensions(uint32_t& width, uint32_t& height)
@@ -214,17 +274,22 @@ void VulkanApp::UpdateWindowSize()
     {
         // window is not minimized, and the size has changed
 
-        BackBufferResizing();
+        SetBackBufferSize(uint32_t(width), uint32_t(height));
+    }
 
-        m_DeviceParams.windowWidth = width;
-        m_DeviceParams.windowHeight = height;
-        m_DeviceParams.enableVsync = m_RequestedVSync;
+    m_DeviceParams.enableVsync = m_RequestedVSync;
+}
 
-        ResizeSwapChain();
-        BackBufferResized();
-    }
+void VulkanApp::SetBackBufferSize(uint32_t width, uint32_t height)
+{
+    BackBufferResizing();
 
+    m_DeviceParams.windowWidth = width;
+    m_DeviceParams.windowHeight = height;
     m_DeviceParams.enableVsync = m_RequestedVSync;
+
+    ResizeSwapChain();
+    BackBufferResized();
 }
 
 void VulkanApp::Shutdown()
@@ -619,6 +684,29 @@ bool VulkanApp::createDevice()
         }
     }
 
+    void* featureChain = nullptr;
+
+#ifdef VK_EXT_graphics_pipeline_library
+    // The extension is only useful if the feature is supported as well
+    auto pipelineLibraryFeatures = vk::PhysicalDeviceGraphicsPipelineLibraryFeaturesEXT();
+    if (enabledExtensions.device.count(VK_EXT_GRAPHICS_PIPELINE_LIBRARY_EXTENSION_NAME))
+    {
+        auto features2 = vk::PhysicalDeviceFeatures2().setPNext(&pipelineLibraryFeatures);
+        m_VulkanPhysicalDevice.getFeatures2(&features2);
+        pipelineLibraryFeatures.setPNext(nullptr);
+
+        if (pipelineLibraryFeatures.graphicsPipelineLibrary)
+        {
+            featureChain = &pipelineLibraryFeatures;
+            m_PipelineLibrarySupported = true;
+        }
+        else
+        {
+            enabledExtensions.device.erase(VK_EXT_GRAPHICS_PIPELINE_LIBRARY_EXTENSION_NAME);
+        }
+    }
+#endif
+
     LOG("Enabled Vulkan device extensions:\n");
     for (const auto& ext : enabledExtensions.device)
     {
@@ -645,6 +733,7 @@ bool VulkanApp::createDevice()
     auto extVec = stringSetToVector(enabledExtensions.device);
 
     auto deviceDesc = vk::DeviceCreateInfo()
+        .setPNext(featureChain)
         .setPQueueCreateInfos(queueDesc.data())
         .setQueueCreateInfoCount(uint32_t(queueDesc.size()))
         .setPEnabledFeatures(&deviceFeatures)
@@ -688,7 +777,7 @@ bool VulkanApp::createWindowSurface()
 
 void VulkanApp::destroySwapChain()
 {
-    if (m_VulkanDevice)
+    if (m_VulkanDevice && !m_DeviceLost)
     {
         m_VulkanDevice.waitIdle();
     }
@@ -796,8 +885,20 @@ bool VulkanApp::CreateDeviceAndSwapChain()
     CHECK(createWindowSurface())
     CHECK(pickPhysicalDevice())
     CHECK(findQueueFamilies(m_VulkanPhysicalDevice))
-    CHECK(createDevice())
-    CHECK(createSwapChain())
+    CHECK(createDeviceObjects())
+
+#undef CHECK
+
+    return true;
+}
+
+bool VulkanApp::createDeviceObjects()
+{
+    if (!createDevice())
+        return false;
+
+    if (!createSwapChain())
+        return false;
 
     m_PresentSemaphore = m_VulkanDevice.createSemaphore(vk::SemaphoreCreateInfo());
 
@@ -822,13 +923,12 @@ bool VulkanApp::CreateDeviceAndSwapChain()
         .setCommandBufferCount(m_DeviceParams.maxFramesInFlight + 1);
 
     m_CommandBuffers = m_VulkanDevice.allocateCommandBuffers(allocInfo);
-
-#undef CHECK
+    m_LoopingFrameIndex = 0;
 
     return true;
 }
 
-void VulkanApp::DestroyDeviceAndSwapChain()
+void VulkanApp::destroyDeviceObjects()
 {
     destroySwapChain();
 
@@ -839,22 +939,30 @@ void VulkanApp::DestroyDeviceAndSwapChain()
     {
         m_VulkanDevice.destroyFence(fence);
     }
+    m_Fences.clear();
+    m_FencesSignaled.clear();
 
     m_VulkanDevice.destroyCommandPool(m_CommandPool);
     m_CommandPool = nullptr;
+    m_CommandBuffers.clear();
 
     m_RendererString.clear();
 
-    if (m_DebugReportCallback)
-    {
-        m_VulkanInstance.destroyDebugReportCallbackEXT(m_DebugReportCallback);
-    }
-
     if (m_VulkanDevice)
     {
         m_VulkanDevice.destroy();
         m_VulkanDevice = nullptr;
     }
+}
+
+void VulkanApp::DestroyDeviceAndSwapChain()
+{
+    destroyDeviceObjects();
+
+    if (m_DebugReportCallback)
+    {
+        m_VulkanInstance.destroyDebugReportCallbackEXT(m_DebugReportCallback);
+    }
 
     if (m_WindowSurface)
     {
@@ -870,7 +978,24 @@ void VulkanApp::DestroyDeviceAndSwapChain()
     }
 }
 
-void VulkanApp::BeginFrame()
+bool VulkanApp::RecoverFromDeviceLoss()
+{
+    // The instance and the window surface survive a device loss, everything else is re-created.
+    // The objects that belong to the lost device can still be destroyed, but not waited on.
+    LOG("ERROR: the Vulkan device was lost, re-creating it.\n");
+
+    DeviceLost();
+    destroyDeviceObjects();
+
+    if (!createDeviceObjects())
+        return false;
+
+    m_DeviceLost = false;
+
+    return DeviceRecreated();
+}
+
+bool VulkanApp::BeginFrame()
 {
     vk::Result res;
 
@@ -882,6 +1007,12 @@ void VulkanApp::BeginFrame()
             vk::Fence(),
             &m_SwapChainIndex);
 
+        if (res == vk::Result::eErrorDeviceLost)
+        {
+            m_DeviceLost = true;
+            return false;
+        }
+
         if (res == vk::Result::eErrorOutOfDateKHR)
         {
             LOG("Swap chain lost, re-creating.\n");
@@ -903,6 +1034,8 @@ void VulkanApp::BeginFrame()
 
     auto cmdBuf = GetCurrentCmdBuf();
     cmdBuf.begin(vk::CommandBufferBeginInfo().setFlags(vk::CommandBufferUsageFlagBits::eOneTimeSubmit));
+
+    return true;
 }
 
 void VulkanApp::Present()
@@ -924,6 +1057,11 @@ void VulkanApp::Present()
         .setPSignalSemaphores(&m_PresentSemaphore);
 
     auto res = m_GraphicsQueue.submit(1, &submitInfo, m_Fences[m_LoopingFrameIndex]);
+    if (res == vk::Result::eErrorDeviceLost)
+    {
+        m_DeviceLost = true;
+        return;
+    }
     assert(res == vk::Result::eSuccess);
 
     m_FencesSignaled[m_LoopingFrameIndex] = true;
@@ -938,6 +1076,11 @@ void VulkanApp::Present()
         .setPImageIndices(&m_SwapChainIndex);
 
     res = m_PresentQueue.presentKHR(&info);
+    if (res == vk::Result::eErrorDeviceLost)
+    {
+        m_DeviceLost = true;
+        return;
+    }
     assert(res == vk::Result::eSuccess || res == vk::Result::eErrorOutOfDateKHR);
 
     // Advance the frame index
@@ -949,6 +1092,11 @@ void VulkanApp::Present()
     if (m_FencesSignaled[m_LoopingFrameIndex])
     {
         res = m_VulkanDevice.waitForFences(1, &m_Fences[m_LoopingFrameIndex], true, ~0ull);
+        if (res == vk::Result::eErrorDeviceLost)
+        {
+            m_DeviceLost = true;
+            return;
+        }
         assert(res == vk::Result::eSuccess);
 
         res = m_VulkanDevice.resetFences(1, &m_Fences[m_LoopingFrameIndex]);
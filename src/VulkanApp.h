@@ -51,6 +51,7 @@ class VulkanApp
 {
 public:
     bool InitVulkan(const VulkanAppParameters& params, const char *windowTitle);
+    bool InitNullDevice(const VulkanAppParameters& params);
     
     void RunMessageLoop();
 
@@ -61,6 +62,9 @@ public:
     virtual void Render() { }
     virtual void BackBufferResizing() { }
     virtual void BackBufferResized() { }
+    // Called when the device is lost, before it's destroyed, and after a new device is created
+    virtual void DeviceLost() { }
+    virtual bool DeviceRecreated() { return true; }
 
     virtual void KeyboardUpdate(int key, int scancode, int action, int mods) { }
     virtual void KeyboardCharInput(unsigned int unicode, int mods) { }
@@ -73,11 +77,15 @@ protected:
     VulkanApp() = default;
 
     void UpdateWindowSize();
+    void SetBackBufferSize(uint32_t width, uint32_t height);
 
     bool CreateDeviceAndSwapChain();
     void DestroyDeviceAndSwapChain();
+    bool RecoverFromDeviceLoss();
+    // For the rendering outside of the message loop, which can't recover
+    void SetDeviceLost() { m_DeviceLost = true; }
     void ResizeSwapChain();
-    void BeginFrame();
+    bool BeginFrame();
     void Present();
 
 public:
@@ -89,9 +97,15 @@ public:
     uint32_t GetCurrentSwapChainIndex();
     uint32_t GetSwapChainImageCount();
     vk::CommandBuffer GetCurrentCmdBuf();
+    // The command buffer slots are reused in order, and the GPU has finished with the current slot
+    [[nodiscard]] uint32_t GetFrameSlot() const { return m_LoopingFrameIndex; }
+    [[nodiscard]] uint32_t GetFrameSlotCount() const { return m_DeviceParams.maxFramesInFlight + 1; }
 
     const VulkanAppParameters& GetVulkanParams();
+    [[nodiscard]] bool IsDeviceExtensionEnabled(const char* name) const { return enabledExtensions.device.count(name) != 0; }
+    [[nodiscard]] bool IsPipelineLibrarySupported() const { return m_PipelineLibrarySupported; }
     [[nodiscard]] bool IsVsyncEnabled() const { return m_DeviceParams.enableVsync; }
+    [[nodiscard]] bool IsDeviceLost() const { return m_DeviceLost; }
     virtual void SetVsync(bool enabled) { m_RequestedVSync = enabled; /* will be processed later */ }
     
     [[nodiscard]] GLFWwindow* GetWindow() const { return m_Window; }
@@ -109,7 +123,9 @@ private:
     std::string m_RendererString;
 
     bool m_WindowVisible = false;
+    bool m_DeviceLost = false;
     bool m_RequestedVSync = false;
+    bool m_PipelineLibrarySupported = false;
     
     vk::Instance m_VulkanInstance;
     vk::DebugReportCallbackEXT m_DebugReportCallback;
@@ -170,7 +186,12 @@ private:
         { },
         // device
         {
-            VK_EXT_DEBUG_MARKER_EXTENSION_NAME
+            VK_EXT_DEBUG_MARKER_EXTENSION_NAME,
+            VK_EXT_PIPELINE_CREATION_FEEDBACK_EXTENSION_NAME,
+#ifdef VK_EXT_graphics_pipeline_library
+            VK_KHR_PIPELINE_LIBRARY_EXTENSION_NAME,
+            VK_EXT_GRAPHICS_PIPELINE_LIBRARY_EXTENSION_NAME
+#endif
         },
     };
 
@@ -179,11 +200,25 @@ private:
     bool pickPhysicalDevice();
     bool findQueueFamilies(vk::PhysicalDevice physicalDevice);
     bool createDevice();
+    bool createDeviceObjects();
+    void destroyDeviceObjects();
     bool createWindowSurface();
     void destroySwapChain();
     bool createSwapChain();
 
 };
 
+struct NullDriverStats
+{
+    uint64_t memoryAllocations = 0;
+    uint64_t memoryBytes = 0;
+    uint64_t liveObjects = 0;
+    uint64_t descriptorSets = 0;
+};
+
+void InitNullDriver();
+NullDriverStats GetNullDriverStats();
+vk::PhysicalDevice GetNullPhysicalDevice();
+
 const char* VulkanResultToString(VkResult result);
 const char* VulkanResultToString(vk::Result result);
@@ -22,6 +22,12 @@
 
 #include "ShaderProj.h"
 
+#include <thread>
+
+#ifndef _WIN32
+#include <csignal>
+#endif
+
 using namespace std;
 
 enum ExitCodes
@@ -31,7 +37,8 @@ enum ExitCodes
     E_NoScript = 2,
     E_NoPrograms = 3,
     E_ShaderError = 4,
-    E_VulkanError = 5
+    E_VulkanError = 5,
+    E_SoakTestFailed = 6
 };
 
 int main(int argc, char** argv)
@@ -44,6 +51,16 @@ int main(int argc, char** argv)
         return ExitCodes::E_CommandLineError;
     }
 
+    LogParams logParams;
+    logParams.level = options.logLevel;
+    logParams.json = options.logJson;
+    InitLog(logParams);
+
+#ifndef _WIN32
+    // For the installations without a keyboard, like the L key
+    signal(SIGUSR1, [](int) { CycleLogLevel(); });
+#endif
+
     auto projectPath = options.projectPath.empty()
         ? fs::current_path()
         : fs::path(options.projectPath);
@@ -52,6 +69,30 @@ int main(int argc, char** argv)
         ? projectPath / "script.json"
         : fs::path(options.scriptFile);
 
+    auto quarantinePath = options.quarantineFile.empty()
+        ? projectPath / "quarantine.json"
+        : fs::path(options.quarantineFile);
+
+    Quarantine quarantine;
+    quarantine.Load(quarantinePath);
+
+    if (options.listQuarantine)
+    {
+        for (const auto& programName : quarantine.GetEntries().getMemberNames())
+        {
+            const auto& entry = quarantine.GetEntries()[programName];
+            LOG("%s: %s\n", programName.c_str(), entry["reason"].asString().c_str());
+        }
+        LOG("%d program(s) in quarantine.\n", int(quarantine.GetEntries().size()));
+        return ExitCodes::E_OK;
+    }
+
+    if (options.clearQuarantine)
+    {
+        quarantine.Clear();
+        return quarantine.Save() ? ExitCodes::E_OK : ExitCodes::E_CommandLineError;
+    }
+
     vector<ScriptEntry> script;
     if (options.shader.empty())
     {
@@ -71,15 +112,44 @@ int main(int argc, char** argv)
         programNames.insert(entry.programName);
     }
     
+    if (!options.statsFile.empty() && !InitStats(options.statsFile))
+        return ExitCodes::E_CommandLineError;
+
+    // All the descriptions are read at once and parsed as they arrive. Each loaded program
+    // then starts reading its shaders and textures while the next descriptions are parsed.
+    InitFilePrefetch(options.ioUring);
+
+    vector<PrefetchFile> descriptionFiles;
+    for (const auto& shaderName : programNames)
+    {
+        if (!quarantine.Contains(shaderName))
+            descriptionFiles.push_back({ projectPath / shaderName / "description.json", true });
+    }
+    PrefetchFiles(descriptionFiles);
+
     vector<shared_ptr<ShProgram>> programs;
     for (const auto& shaderName : programNames)
     {
+        if (quarantine.Contains(shaderName))
+        {
+            LOG("Skipping program '%s' because it's in quarantine.\n", shaderName.c_str());
+            continue;
+        }
+
         fs::path descriptionFile = projectPath / shaderName / "description.json";
 
         shared_ptr<ShProgram> program = make_shared<ShProgram>(shaderName);
 
-        if (program->Load(descriptionFile, projectPath))
-            programs.push_back(program);
+        if (!program->Load(descriptionFile, projectPath))
+            continue;
+
+        vector<PrefetchFile> programFiles;
+        program->GetPrefetchFiles(programFiles);
+        PrefetchFiles(programFiles);
+
+        ApplyScriptSettings(*program, script);
+
+        programs.push_back(program);
     }
 
     if (programs.empty())
@@ -87,16 +157,62 @@ int main(int argc, char** argv)
         LOG("ERROR: No programs loaded.\n");
         return ExitCodes::E_NoPrograms;
     }
-    
+
     InitImageCache();
     InitCompiler();
     
     unique_ptr<ShaderProj> application = make_unique<ShaderProj>(programs);
+
+    CompileWorkerParams compileParams;
+#ifndef _WIN32
+    compileParams.workerCount = options.compileWorkers >= 0
+        ? options.compileWorkers
+        : int(std::max(std::thread::hardware_concurrency(), 1u));
+#endif
+    compileParams.timeoutSeconds = options.compileTimeout;
+    compileParams.memoryLimitBytes = uint64_t(std::max(options.compileMemoryLimit, 0)) << 20;
+    application->SetCompileWorkerParams(compileParams);
+    application->SetPipelineLibraryEnabled(options.pipelineLibrary);
+    application->SetDirtyTrackingEnabled(options.dirtyTracking);
+    application->SetTextureImportLimits(options.maxTextureSize, !options.fullResTextures);
+    application->SetQuarantine(quarantine);
+
     if (!application->LoadShaders())
         return ExitCodes::E_ShaderError;
 
     application->SetScript(script, options.interval);
 
+    const bool softwareRenderer = !options.softwareOutput.empty() || options.softwareBenchmarkFrames > 0;
+
+    // The benchmarks and reports work with the programs that were loaded at the start
+    if (options.shader.empty() && options.cpuBenchmarkFrames == 0 && options.soakHours <= 0 && !options.precisionReport &&
+        !options.memoryReport && !options.selectPassScales && !softwareRenderer)
+        application->EnableScriptReload(scriptPath, projectPath);
+
+    // The software renderer runs the compiled SPIR-V on the CPU and doesn't need a Vulkan device at all
+    if (softwareRenderer)
+    {
+        SoftwareRendererParams softwareParams;
+        softwareParams.outputPath = options.softwareOutput;
+        softwareParams.width = uint32_t(std::max(options.width, 1));
+        softwareParams.height = uint32_t(std::max(options.height, 1));
+        softwareParams.refreshRate = options.refreshRate;
+        softwareParams.threads = options.softwareThreads;
+        softwareParams.benchmarkFrames = options.softwareBenchmarkFrames;
+
+        const bool softwareResult = application->RunSoftwareRenderer(softwareParams);
+
+        application.reset();
+        programs.clear();
+
+        ShutdownCompiler();
+        ShutdownFilePrefetch();
+        ShutdownStats();
+        ShutdownLog();
+
+        return softwareResult ? ExitCodes::E_OK : ExitCodes::E_ShaderError;
+    }
+
     VulkanAppParameters appParams;
     appParams.windowWidth = options.width;
     appParams.windowHeight = options.height;
@@ -106,12 +222,108 @@ int main(int argc, char** argv)
     appParams.monitorIndex = options.monitor;
     appParams.enableVsync = true;
 
-    if (!application->InitVulkan(appParams, "ShaderProj"))
+    const bool cpuBenchmark = options.cpuBenchmarkFrames > 0;
+    const bool soakTest = options.soakHours > 0;
+
+    const bool vulkanInitialized = (cpuBenchmark || soakTest)
+        ? application->InitNullDevice(appParams)
+        : application->InitVulkan(appParams, "ShaderProj");
+
+    if (!vulkanInitialized)
         return ExitCodes::E_VulkanError;
 
+    // The budget only applies to the real device, not the no-op one
+    FrameBudgetParams budgetParams;
+    budgetParams.budget = (cpuBenchmark || soakTest) ? 0 : options.frameBudget;
+    budgetParams.frames = std::max(options.budgetFrames, 1);
+    application->SetFrameBudget(budgetParams);
+
+    if (options.governor)
+    {
+        GovernorParams governorParams;
+        if (!options.sysfsRoot.empty())
+            governorParams.sysfsRoot = options.sysfsRoot;
+        governorParams.maxTemperature = options.maxTemperature;
+        governorParams.maxPower = options.maxPower;
+
+        if (!application->EnableGovernor(governorParams))
+            return ExitCodes::E_CommandLineError;
+    }
+
+    // Only the interactive playback is synchronized, not the benchmarks and reports
+    if ((options.syncLeader || !options.syncLeaderAddress.empty()) && !cpuBenchmark && !soakTest &&
+        !options.precisionReport && !options.memoryReport && !options.selectPassScales)
+    {
+        SyncParams syncParams;
+        syncParams.leader = options.syncLeader;
+        syncParams.leaderAddress = options.syncLeaderAddress;
+        syncParams.port = uint16_t(options.syncPort);
+        syncParams.swapBarrier = options.syncSwapBarrier;
+
+        if (!application->EnablePlaybackSync(syncParams))
+            return ExitCodes::E_CommandLineError;
+    }
+
+    if (options.energy && !application->EnableEnergyAccounting(
+        options.sysfsRoot.empty() ? fs::path("/sys") : fs::path(options.sysfsRoot)))
+        return ExitCodes::E_CommandLineError;
+
     application->Init();
 
-    application->RunMessageLoop();
+    // The textures are loaded now, anything left was prefetched for programs that failed to compile
+    DiscardPrefetchedFiles();
+
+    int exitCode = ExitCodes::E_OK;
+
+    if (cpuBenchmark)
+    {
+        CpuBenchmarkParams benchmarkParams;
+        benchmarkParams.projectPath = projectPath;
+        benchmarkParams.scriptPath = options.shader.empty() ? scriptPath : fs::path();
+        benchmarkParams.frames = options.cpuBenchmarkFrames;
+
+        application->RunCpuBenchmark(benchmarkParams);
+    }
+    else if (options.precisionReport)
+    {
+        application->RunPrecisionReport(PrecisionReportParams());
+    }
+    else if (options.memoryReport)
+    {
+        application->WaitForPipelines();
+        application->WriteMemoryReport(true);
+    }
+    else if (options.selectPassScales)
+    {
+        PassScaleParams passScaleParams;
+        passScaleParams.outputFile = GetPassScalesFile(scriptPath);
+
+        if (!application->RunPassScaleSelection(passScaleParams))
+            exitCode = ExitCodes::E_ShaderError;
+    }
+    else if (soakTest)
+    {
+        SoakParams soakParams;
+        soakParams.simulatedHours = options.soakHours;
+
+        if (!application->RunSoakTest(soakParams))
+            exitCode = ExitCodes::E_SoakTestFailed;
+    }
+    else
+    {
+        // Only the messages of the playback are limited, not the reports
+        SetLogRateLimit(true);
+        application->RunMessageLoop();
+        SetLogRateLimit(false);
+
+        application->WriteEnergyReport(true);
+        application->WriteMemoryReport(false);
+    }
+
+    // Nothing can be cleaned up properly without a device
+    if (application->IsDeviceLost())
+        return ExitCodes::E_VulkanError;
+
     application->GetDevice().waitIdle();
 
     programs.clear();
@@ -120,6 +332,9 @@ int main(int argc, char** argv)
     application->Shutdown();
     
     ShutdownCompiler();
+    ShutdownFilePrefetch();
+    ShutdownStats();
+    ShutdownLog();
 
-    return ExitCodes::E_OK;
+    return exitCode;
 }
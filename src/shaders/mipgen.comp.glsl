@@ -0,0 +1,168 @@
+/*
+* Copyright (c) 2022, NVIDIA CORPORATION. All rights reserved.
+*
+* Permission is hereby granted, free of charge, to any person obtaining a
+* copy of this software and associated documentation files (the "Software"),
+* to deal in the Software without restriction, including without limitation
+* the rights to use, copy, modify, merge, publish, distribute, sublicense,
+* and/or sell copies of the Software, and to permit persons to whom the
+* Software is furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+* THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+* DEALINGS IN THE SOFTWARE.
+*/
+
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+
+// Generates the mip chain of a render target in a single dispatch, in the style of AMD FidelityFX SPD.
+// Every workgroup reduces a 64x64 tile of level 0 into levels 1-6 through shared memory, and the last
+// workgroup to finish reduces level 6 into levels 7-12. That covers images up to 4096x4096.
+
+layout(local_size_x = 256) in;
+
+// Level 0, sampled between 4 texels so that one bilinear fetch returns their average
+layout(set = 0, binding = 0) uniform sampler2D sourceTexture;
+
+// Levels 1-12, the descriptors of the levels that the image doesn't have repeat the last level
+layout(set = 0, binding = 1, rgba16f) uniform coherent image2D mips[12];
+
+layout(set = 0, binding = 2) coherent buffer Counter
+{
+	uint workgroupsDone;
+};
+
+layout(push_constant) uniform PushConstants
+{
+	ivec2 sourceSize;
+	int mipCount;       // number of levels to generate, not including level 0
+	int workgroupCount;
+};
+
+shared vec4 tile[16][16];
+shared bool isLastWorkgroup;
+
+// The image array is only indexed with constants, which doesn't need shaderStorageImageArrayDynamicIndexing
+#define STORE_MIP(index) case index + 1: if (all(lessThan(pos, imageSize(mips[index])))) imageStore(mips[index], pos, value); break;
+
+void
+storeMip(int level, ivec2 pos, vec4 value)
+{
+	if (level > mipCount)
+		return;
+
+	switch (level)
+	{
+	STORE_MIP(0) STORE_MIP(1) STORE_MIP(2) STORE_MIP(3) STORE_MIP(4) STORE_MIP(5)
+	STORE_MIP(6) STORE_MIP(7) STORE_MIP(8) STORE_MIP(9) STORE_MIP(10) STORE_MIP(11)
+	}
+}
+
+vec4
+loadMip6(ivec2 pos)
+{
+	return imageLoad(mips[5], min(pos, imageSize(mips[5]) - 1));
+}
+
+// Reduces the 16x16 values in the tile into the next 4 levels, starting with 'level' at 'origin'
+void
+reduceTile(ivec2 thread, int level, ivec2 origin)
+{
+	for (int size = 8; size >= 1; size >>= 1)
+	{
+		vec4 value = vec4(0);
+		bool active = all(lessThan(thread, ivec2(size)));
+		if (active)
+		{
+			value = (tile[thread.y * 2][thread.x * 2] + tile[thread.y * 2][thread.x * 2 + 1] +
+				tile[thread.y * 2 + 1][thread.x * 2] + tile[thread.y * 2 + 1][thread.x * 2 + 1]) * 0.25;
+			storeMip(level, origin + thread, value);
+		}
+
+		barrier();
+
+		if (active)
+			tile[thread.y][thread.x] = value;
+
+		barrier();
+
+		++level;
+		origin >>= 1;
+	}
+}
+
+void
+main()
+{
+	ivec2 thread = ivec2(gl_LocalInvocationIndex % 16, gl_LocalInvocationIndex / 16);
+	ivec2 workgroup = ivec2(gl_WorkGroupID.xy);
+	vec2 invSourceSize = 1.0 / vec2(sourceSize);
+
+	// Levels 1 and 2: every thread produces 2x2 texels of level 1 and one texel of level 2
+	vec4 sum = vec4(0);
+	for (int j = 0; j < 2; j++)
+	{
+		for (int i = 0; i < 2; i++)
+		{
+			ivec2 pos = workgroup * 32 + thread * 2 + ivec2(i, j);
+			vec4 value = textureLod(sourceTexture, vec2(pos * 2 + 1) * invSourceSize, 0);
+			storeMip(1, pos, value);
+			sum += value;
+		}
+	}
+
+	storeMip(2, workgroup * 16 + thread, sum * 0.25);
+	tile[thread.y][thread.x] = sum * 0.25;
+	barrier();
+
+	// Levels 3-6
+	reduceTile(thread, 3, workgroup * 8);
+
+	if (mipCount <= 6)
+		return;
+
+	// The last workgroup continues from level 6, which must be complete and visible by then
+	if (gl_LocalInvocationIndex == 0)
+	{
+		memoryBarrierImage();
+		isLastWorkgroup = atomicAdd(workgroupsDone, 1) == uint(workgroupCount - 1);
+	}
+
+	barrier();
+
+	if (!isLastWorkgroup)
+		return;
+
+	// Levels 7 and 8, in the same way as levels 1 and 2
+	sum = vec4(0);
+	for (int j = 0; j < 2; j++)
+	{
+		for (int i = 0; i < 2; i++)
+		{
+			ivec2 pos = thread * 2 + ivec2(i, j);
+			vec4 value = (loadMip6(pos * 2) + loadMip6(pos * 2 + ivec2(1, 0)) +
+				loadMip6(pos * 2 + ivec2(0, 1)) + loadMip6(pos * 2 + ivec2(1, 1))) * 0.25;
+			storeMip(7, pos, value);
+			sum += value;
+		}
+	}
+
+	storeMip(8, thread, sum * 0.25);
+	tile[thread.y][thread.x] = sum * 0.25;
+	barrier();
+
+	// Levels 9-12
+	reduceTile(thread, 9, ivec2(0));
+
+	// Ready for the next dispatch on this image
+	if (gl_LocalInvocationIndex == 0)
+		workgroupsDone = 0;
+}
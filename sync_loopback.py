@@ -0,0 +1,103 @@
+#!/usr/bin/python
+#
+# Copyright (c) 2022, NVIDIA CORPORATION. All rights reserved.
+#
+# Permission is hereby granted, free of charge, to any person obtaining a
+# copy of this software and associated documentation files (the "Software"),
+# to deal in the Software without restriction, including without limitation
+# the rights to use, copy, modify, merge, publish, distribute, sublicense,
+# and/or sell copies of the Software, and to permit persons to whom the
+# Software is furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in
+# all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+# THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+# FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+# DEALINGS IN THE SOFTWARE.
+
+
+
+# Runs a sync leader and a follower on loopback and checks that they play in sync,
+# that the follower plays on its own when the leader is killed, and that it follows
+# the restarted leader. Usage: sync_loopback.py <shaderproj> <project> [port]
+
+import sys
+import os
+import json
+import signal
+import subprocess
+import tempfile
+import time
+
+if len(sys.argv) < 3:
+	print("Usage: sync_loopback.py <shaderproj> <project> [port]")
+	sys.exit(1)
+
+executable = sys.argv[1]
+projectPath = sys.argv[2]
+port = sys.argv[3] if len(sys.argv) > 3 else "47000"
+workPath = tempfile.mkdtemp(prefix = "sync_loopback_")
+
+def start(name, args):
+	output = open(os.path.join(workPath, name + ".log"), "w")
+	command = [executable, "-p", projectPath, "-W", "640", "-H", "360",
+		"--stats", os.path.join(workPath, name + ".jsonl")] + args
+	return subprocess.Popen(command, stdout = output, stderr = subprocess.STDOUT)
+
+def readLog(name):
+	with open(os.path.join(workPath, name + ".log")) as f:
+		return f.read()
+
+def readSkew(name):
+	records = []
+	with open(os.path.join(workPath, name + ".jsonl")) as f:
+		for line in f:
+			record = json.loads(line)
+			if record["type"] == "sync_skew":
+				records.append(record)
+	return records
+
+failures = []
+
+def check(condition, message):
+	print(("ok: " if condition else "FAILED: ") + message)
+	if not condition:
+		failures.append(message)
+
+# The leader reports the skew every 10 seconds
+leader = start("leader1", ["--sync-leader", port])
+follower = start("follower", ["--sync-follower", "127.0.0.1:" + port])
+time.sleep(25)
+
+leader.send_signal(signal.SIGKILL)
+leader.wait()
+time.sleep(6)
+
+check(follower.poll() is None, "the follower keeps running without the leader")
+check("hasn't answered" in readLog("follower"), "the follower plays on its own without the leader")
+
+leader = start("leader2", ["--sync-leader", port])
+time.sleep(25)
+
+log = readLog("follower")
+check("has restarted" in log, "the follower notices the restarted leader")
+check(log.count("Synchronized with the sync leader") >= 2, "the follower synchronizes with the restarted leader")
+
+for process in [leader, follower]:
+	process.send_signal(signal.SIGTERM)
+	process.wait()
+
+for name in ["leader1", "leader2"]:
+	records = readSkew(name)
+	check(len(records) > 0, name + " reports the skew of the follower")
+	for record in records:
+		check(record["max_skew_ms"] <= record["frame_period_ms"],
+			"%s: skew %.2f ms, frame %.2f ms" % (name, record["max_skew_ms"], record["frame_period_ms"]))
+
+print("The logs and stats are in " + workPath)
+sys.exit(1 if failures else 0)